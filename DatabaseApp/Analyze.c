@@ -0,0 +1,273 @@
+#include "Analyze.h"
+#include <stdlib.h>
+#include <string.h>
+
+//What the file pass keeps about each page, then which tree it turned out to be in and how far below that tree's root
+typedef struct {
+	NodeType type;
+	uint32_t parent;
+	uint32_t num_cells;
+	uint32_t next_leaf;
+	//index into the trees being analyzed, -1 for the header and pages nothing leads to
+	int32_t tree;
+	uint32_t level;
+} PageSummary;
+
+//Further up than this and it's a loop of parent pointers, not a tree
+#define ANALYZE_MAX_PARENT_HOPS 64
+
+//Text keys sort byte by byte, and a string sorts before anything longer that starts with it
+static int analyze_compare(bool text, const AnalyzedKey* a, const Value* b) {
+	if (!text) {
+		return a->integer < b->integer ? -1 : a->integer > b->integer;
+	}
+	uint32_t shorter = a->length < b->length ? a->length : b->length;
+	int compared = memcmp(a->text, b->text, shorter);
+	if (compared != 0) {
+		return compared;
+	}
+	return a->length < b->length ? -1 : a->length > b->length;
+}
+
+static void analyze_set_key(AnalyzedKey* to, const Value* key) {
+	to->integer = key->integer;
+	to->length = key->length > SCHEMA_MAX_KEY_LENGTH ? SCHEMA_MAX_KEY_LENGTH : key->length;
+	if (key->text != NULL) {
+		memcpy(to->text, key->text, to->length);
+	}
+}
+
+//Widens the level's key range to take in keys from smallest to biggest
+static void analyze_add_keys(LevelAnalysis* level, bool text, const Value* smallest, const Value* biggest) {
+	if (!level->has_keys || analyze_compare(text, &level->min_key, smallest) > 0) {
+		analyze_set_key(&level->min_key, smallest);
+	}
+	if (!level->has_keys || analyze_compare(text, &level->max_key, biggest) < 0) {
+		analyze_set_key(&level->max_key, biggest);
+	}
+	level->has_keys = true;
+}
+
+static Value analyze_internal_key(const InternalNodeContents* contents, uint32_t key_num) {
+	Value key = { contents->text ? VALUE_TEXT : VALUE_INTEGER, 0, 0, NULL, 0 };
+	if (contents->text) {
+		key.text = contents->text_keys[key_num];
+		key.length = contents->text_key_lengths[key_num];
+	}
+	else {
+		key.integer = (int64_t)contents->keys[key_num];
+	}
+	return key;
+}
+
+//Adds one page (already known to be in table's tree) to its analysis
+static void analyze_page(Table* table, Snapshot* snapshot, uint32_t page_num, const PageSummary* page, TableAnalysis* analysis) {
+	uint32_t level_num = page->level < ANALYZE_MAX_LEVELS ? page->level : ANALYZE_MAX_LEVELS - 1;
+	LevelAnalysis* level = &analysis->levels[level_num];
+	if (level_num + 1 > analysis->depth) {
+		analysis->depth = level_num + 1;
+	}
+	analysis->pages++;
+	level->pages++;
+	//it came through the cache on the file pass, so this is a hit
+	void* node = get_page_at(table->pager, page_num, snapshot);
+	if (page->type == NODE_LEAF) {
+		uint32_t cell_size = is_node_packed(node) ? table->leaf_cell_size : table->leaf_cell_size + LEAF_NODE_KEY_SIZE;
+		analysis->leaf_pages++;
+		analysis->rows += page->num_cells;
+		level->entries += page->num_cells;
+		uint32_t space = LEAF_NODE_SPACE_FOR_CELLS(table->pager->page_size);
+		if (page->num_cells * cell_size < space) {
+			analysis->free_bytes += space - page->num_cells * cell_size;
+		}
+		if (page->num_cells > 0) {
+			Value smallest = table_row_key(table, leaf_node_value(table, node, 0));
+			Value biggest = table_row_key(table, leaf_node_value(table, node, page->num_cells - 1));
+			analyze_add_keys(level, table->text_keys, &smallest, &biggest);
+		}
+		if (page->next_leaf != 0) {
+			analysis->leaf_hops++;
+			if (page->next_leaf != page_num + 1) {
+				analysis->out_of_order_hops++;
+			}
+		}
+		return;
+	}
+	InternalNodeContents* contents = malloc(sizeof(InternalNodeContents));
+	internal_node_decode(table, node, contents);
+	level->entries += contents->num_keys;
+	if (contents->num_keys > 0) {
+		Value smallest = analyze_internal_key(contents, 0);
+		Value biggest = analyze_internal_key(contents, contents->num_keys - 1);
+		analyze_add_keys(level, table->text_keys, &smallest, &biggest);
+	}
+	internal_node_contents_free(contents);
+	free(contents);
+}
+
+void database_analyze(Database* database, FileAnalysis* file) {
+	Pager* pager = database->pager;
+	Snapshot snapshot;
+	pager_snapshot_begin(pager, &snapshot);
+
+	//Every table the snapshot can see, and the catalog last since it's a tree too
+	Table* trees[DATABASE_MAX_TABLES + 1];
+	uint32_t num_trees = 0;
+	//Pages a transaction we're inside of added aren't committed yet, so they aren't ours to read
+	uint32_t num_pages = snapshot.num_pages;
+	pthread_mutex_lock(&pager->latch);
+	for (uint32_t i = 0; i < database->num_tables; i++) {
+		if (database->tables[i]->created_at <= snapshot.commit_seq) {
+			trees[num_trees++] = database->tables[i];
+		}
+	}
+	uint32_t num_tables = num_trees;
+	if (database->catalog != NULL) {
+		trees[num_trees++] = database->catalog;
+	}
+	pthread_mutex_unlock(&pager->latch);
+
+	PageSummary* pages = calloc(num_pages > 0 ? num_pages : 1, sizeof(PageSummary));
+	int32_t* root_of = malloc((num_pages > 0 ? num_pages : 1) * sizeof(int32_t));
+	for (uint32_t i = 0; i < num_pages; i++) {
+		root_of[i] = -1;
+	}
+	for (uint32_t i = 0; i < num_trees; i++) {
+		uint32_t root_page_num = table_root_at(trees[i], &snapshot);
+		if (root_page_num < num_pages) {
+			root_of[root_page_num] = (int32_t)i;
+		}
+	}
+
+	//The file pass: every page in order, with a window of reads kept going ahead of us
+	for (uint32_t i = 0; i < num_pages; i++) {
+		if (i % LEAF_READAHEAD_PAGES == 0) {
+			uint32_t count = num_pages - i < LEAF_READAHEAD_PAGES ? num_pages - i : LEAF_READAHEAD_PAGES;
+			pager_prefetch_range(pager, i, count);
+		}
+		pages[i].tree = -1;
+		//Page 0 is the header unless it's an old single table file's root
+		if (i == 0 && root_of[0] == -1) {
+			continue;
+		}
+		void* node = get_page_at(pager, i, &snapshot);
+		pages[i].type = get_node_type(node);
+		pages[i].parent = *node_parent(node);
+		if (pages[i].type == NODE_LEAF) {
+			pages[i].num_cells = *leaf_node_num_cells(node);
+			pages[i].next_leaf = *leaf_node_next_leaf(node);
+		}
+	}
+
+	//Up the parent pointers (in memory now) to a root, which says whose page it is and how deep
+	for (uint32_t i = 0; i < num_pages; i++) {
+		if (i == 0 && root_of[0] == -1) {
+			continue;
+		}
+		uint32_t page_num = i;
+		uint32_t hops = 0;
+		while (root_of[page_num] == -1 && hops < ANALYZE_MAX_PARENT_HOPS) {
+			page_num = pages[page_num].parent;
+			if (page_num >= num_pages) {
+				break;
+			}
+			hops++;
+		}
+		if (page_num < num_pages && root_of[page_num] != -1) {
+			pages[i].tree = root_of[page_num];
+			pages[i].level = hops;
+		}
+	}
+
+	memset(file, 0, sizeof(FileAnalysis));
+	file->pages = num_pages;
+	TableAnalysis** analyses = malloc((num_tables > 0 ? num_tables : 1) * sizeof(TableAnalysis*));
+	for (uint32_t i = 0; i < num_tables; i++) {
+		analyses[i] = calloc(1, sizeof(TableAnalysis));
+		analyses[i]->commit_seq = snapshot.commit_seq;
+	}
+	for (uint32_t i = 0; i < num_pages; i++) {
+		int32_t tree = pages[i].tree;
+		if (tree == -1) {
+			if (i == 0 && root_of[0] == -1) {
+				file->header_pages++;
+			}
+			else {
+				file->unreachable_pages++;
+			}
+		}
+		else if ((uint32_t)tree == num_tables) {
+			file->catalog_pages++;
+		}
+		else {
+			file->table_pages++;
+			analyze_page(trees[tree], &snapshot, i, &pages[i], analyses[tree]);
+		}
+	}
+	pager_snapshot_end(pager, &snapshot);
+
+	for (uint32_t i = 0; i < num_tables; i++) {
+		TableAnalysis* analysis = analyses[i];
+		Table* table = trees[i];
+		if (analysis->leaf_pages > 0) {
+			analysis->leaf_fill = (double)analysis->rows / ((double)analysis->leaf_pages * table->leaf_max_cells);
+		}
+		if (analysis->leaf_hops > 0) {
+			analysis->fragmentation = (double)analysis->out_of_order_hops / analysis->leaf_hops;
+		}
+		analysis->packed_leaf_pages = analysis->rows == 0 ? 1
+			: (uint32_t)((analysis->rows + table->leaf_max_cells - 1) / table->leaf_max_cells);
+		pthread_mutex_lock(&pager->latch);
+		TableAnalysis* old = table->analysis;
+		table->analysis = analysis;
+		pthread_mutex_unlock(&pager->latch);
+		free(old);
+	}
+	free(analyses);
+	free(root_of);
+	free(pages);
+}
+
+static void print_key(FILE* out, bool text, const AnalyzedKey* key) {
+	if (text) {
+		fprintf(out, "'%.*s'", (int)key->length, key->text);
+	}
+	else {
+		fprintf(out, "%lld", (long long)key->integer);
+	}
+}
+
+void print_analysis(FILE* out, Database* database, const FileAnalysis* file) {
+	for (uint32_t i = 0; i < database->num_tables; i++) {
+		Table* table = database->tables[i];
+		//Only ever replaced by the thread that runs .analyze, which is us
+		TableAnalysis* analysis = table->analysis;
+		if (analysis == NULL) {
+			continue;
+		}
+		fprintf(out, "%s: %u levels, %u pages, %llu rows\n", table->schema.table_name, analysis->depth, analysis->pages,
+			(unsigned long long)analysis->rows);
+		for (uint32_t j = 0; j < analysis->depth; j++) {
+			const LevelAnalysis* level = &analysis->levels[j];
+			bool leaves = j + 1 == analysis->depth;
+			fprintf(out, "  level %u%s: %u pages, %llu %s", j, leaves ? " (leaves)" : j == 0 ? " (root)" : "",
+				level->pages, (unsigned long long)level->entries, leaves ? "rows" : "keys");
+			if (level->has_keys) {
+				fprintf(out, ", keys ");
+				print_key(out, table->text_keys, &level->min_key);
+				fprintf(out, " to ");
+				print_key(out, table->text_keys, &level->max_key);
+			}
+			fprintf(out, "\n");
+		}
+		fprintf(out, "  leaves %.1f%% full, %llu bytes free, %u of %u leaf hops out of page order (%.1f%% fragmented)\n",
+			100.0 * analysis->leaf_fill, (unsigned long long)analysis->free_bytes, analysis->out_of_order_hops,
+			analysis->leaf_hops, 100.0 * analysis->fragmentation);
+		if (analysis->packed_leaf_pages < analysis->leaf_pages) {
+			fprintf(out, "  a vacuum would pack the rows into %u leaves instead of %u\n", analysis->packed_leaf_pages,
+				analysis->leaf_pages);
+		}
+	}
+	fprintf(out, "File: %u pages, %u header, %u catalog, %u in tables, %u unreachable\n", file->pages, file->header_pages,
+		file->catalog_pages, file->table_pages, file->unreachable_pages);
+}
@@ -0,0 +1,80 @@
+#ifndef ANALYZE_H
+#define ANALYZE_H
+#include <stdio.h>
+#include "table.h"
+
+//.analyze: what shape every table's tree is in, without printing it. .btree walks the tree from the root and prints
+//every key on the way, which on anything but a toy table is a wall of text that takes ages. This reads the file
+//instead: every page once, in page order (so the read-ahead gets to stream it), noting each page's type, parent,
+//cell count and next leaf. Which table a page belongs to and how deep it sits both come from following parent
+//pointers in that array afterwards, so nothing gets pointer chased on disk.
+//
+//The results stay on each Table (table->analysis) until the next .analyze or a vacuum. Scans use them to start
+//reading ahead straight away on a table whose leaves are already in order, and .analyze itself says how many pages
+//a vacuum would save.
+
+//Deepest tree .analyze keeps per level numbers for, anything past it gets counted on the last level
+#ifndef ANALYZE_MAX_LEVELS
+#define ANALYZE_MAX_LEVELS 16
+#endif
+//A leaf chain with at most this fraction of its hops out of page order counts as in order for read-ahead
+#ifndef ANALYZE_IN_ORDER_FRAGMENTATION
+#define ANALYZE_IN_ORDER_FRAGMENTATION 0.1
+#endif
+
+//Smallest or biggest key on a level: integer for integer keys, text (not terminated) for varchar keys
+typedef struct {
+	int64_t integer;
+	char text[SCHEMA_MAX_KEY_LENGTH];
+	uint32_t length;
+} AnalyzedKey;
+
+typedef struct {
+	uint32_t pages;
+	//rows on the leaf level, separator keys on the levels above it
+	uint64_t entries;
+	//false while the level has no keys at all (an empty root leaf, or internal nodes with only a right child)
+	bool has_keys;
+	AnalyzedKey min_key;
+	AnalyzedKey max_key;
+} LevelAnalysis;
+
+struct TableAnalysis {
+	//the commit the pages were read at
+	uint64_t commit_seq;
+	//levels[0] is the root, levels[depth - 1] the leaves
+	uint32_t depth;
+	LevelAnalysis levels[ANALYZE_MAX_LEVELS];
+	uint32_t pages;
+	uint64_t rows;
+	uint32_t leaf_pages;
+	//rows / how many the leaves could hold
+	double leaf_fill;
+	//bytes of the leaves' cell space that aren't holding a row
+	uint64_t free_bytes;
+	//hops along the leaf chain, and how many of them don't go to the very next page
+	uint32_t leaf_hops;
+	uint32_t out_of_order_hops;
+	//out_of_order_hops / leaf_hops, 0 for a single leaf
+	double fragmentation;
+	//leaves the rows would take packed full, like a vacuum packs them
+	uint32_t packed_leaf_pages;
+};
+
+//What the pages of the file as a whole are used for
+typedef struct {
+	uint32_t pages;
+	uint32_t header_pages;
+	uint32_t catalog_pages;
+	uint32_t table_pages;
+	//pages no table's tree leads to
+	uint32_t unreachable_pages;
+} FileAnalysis;
+
+//Reads every page once, stores a fresh analysis on every table and fills in file. Runs on a snapshot, so writes
+//can carry on while it does.
+void database_analyze(Database* database, FileAnalysis* file);
+//Prints every table's analysis (tables that haven't got one are skipped) and then the file's
+void print_analysis(FILE* out, Database* database, const FileAnalysis* file);
+
+#endif
@@ -0,0 +1,435 @@
+#include "AsyncIO.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#define ASYNC_IO_THREADS 4
+
+struct AsyncIO {
+	IOBackend backend;
+	int fd;
+	//requests queued but not yet handed to the backend
+	IORequest* staged_head;
+	IORequest* staged_tail;
+	uint32_t num_staged;
+	//requests handed to the backend that haven't been waited on yet
+	uint32_t num_submitted;
+	//finished requests waiting to be picked up by async_io_wait (threads/sync backends)
+	IORequest* completed_head;
+	IORequest* completed_tail;
+#ifdef __linux__
+	//io_uring state, the rings are shared memory between us and the kernel
+	int ring_fd;
+	void* sq_ring;
+	void* cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+#endif
+#ifndef _WIN32
+	//thread pool state
+	pthread_t threads[ASYNC_IO_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready;
+	pthread_cond_t work_done;
+	IORequest* pending_head;
+	IORequest* pending_tail;
+	bool shutting_down;
+#endif
+};
+
+//Moves what's left of a request after the first done bytes with positioned I/O. pread and pwrite (and io_uring) are
+//allowed to stop short, so keep going until the whole page is through. Only a read can end early, at end of file.
+//Returns the bytes transferred in all, or -errno.
+static ssize_t transfer_rest(int fd, IORequest* request, size_t done) {
+	while (done < request->length) {
+		char* at = (char*)request->buffer + done;
+		ssize_t result;
+		if (request->kind == IO_READ) {
+			result = pread(fd, at, request->length - done, request->offset + (off_t)done);
+		}
+		else {
+			result = pwrite(fd, at, request->length - done, request->offset + (off_t)done);
+		}
+		if (result == -1) {
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		if (result == 0) {
+			//a write that makes no progress would spin forever
+			if (request->kind == IO_WRITE) {
+				return -EIO;
+			}
+			break;
+		}
+		done += (size_t)result;
+	}
+	return (ssize_t)done;
+}
+
+//Runs a single request right here, used by the thread pool and the sync backend
+static void run_request(int fd, IORequest* request) {
+	request->result = transfer_rest(fd, request, 0);
+}
+
+//Tiny linked list helpers, requests chain through their next pointer
+static void list_push(IORequest** head, IORequest** tail, IORequest* request) {
+	request->next = NULL;
+	if (*tail) {
+		(*tail)->next = request;
+	}
+	else {
+		*head = request;
+	}
+	*tail = request;
+}
+static IORequest* list_pop(IORequest** head, IORequest** tail) {
+	IORequest* request = *head;
+	if (request) {
+		*head = request->next;
+		if (*head == NULL) {
+			*tail = NULL;
+		}
+		request->next = NULL;
+	}
+	return request;
+}
+
+#ifdef __linux__
+//There's no liburing on the machines we deploy to, so talk to the kernel directly.
+//This follows the layout from the io_uring man pages: mmap the submission ring, completion ring and sqe array.
+static bool uring_setup(AsyncIO* io) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int ring_fd = (int)syscall(__NR_io_uring_setup, ASYNC_IO_QUEUE_DEPTH, &params);
+	if (ring_fd < 0) {
+		return false;
+	}
+	//We use the plain read/write opcodes, which showed up in 5.6 along with this feature bit.
+	//Anything older gets the thread pool instead.
+	if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+		close(ring_fd);
+		return false;
+	}
+	io->ring_fd = ring_fd;
+	io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap) {
+		//newer kernels let both rings share one mapping, it just has to be big enough for either
+		if (io->cq_ring_size > io->sq_ring_size) {
+			io->sq_ring_size = io->cq_ring_size;
+		}
+		io->cq_ring_size = io->sq_ring_size;
+	}
+	io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (io->sq_ring == MAP_FAILED) {
+		close(ring_fd);
+		return false;
+	}
+	if (single_mmap) {
+		io->cq_ring = io->sq_ring;
+	}
+	else {
+		io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (io->cq_ring == MAP_FAILED) {
+			munmap(io->sq_ring, io->sq_ring_size);
+			close(ring_fd);
+			return false;
+		}
+	}
+	io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (io->sqes == MAP_FAILED) {
+		if (!single_mmap) munmap(io->cq_ring, io->cq_ring_size);
+		munmap(io->sq_ring, io->sq_ring_size);
+		close(ring_fd);
+		return false;
+	}
+	char* sq = io->sq_ring;
+	char* cq = io->cq_ring;
+	io->sq_head = (unsigned*)(sq + params.sq_off.head);
+	io->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	io->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	io->sq_array = (unsigned*)(sq + params.sq_off.array);
+	io->cq_head = (unsigned*)(cq + params.cq_off.head);
+	io->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	io->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	io->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	return true;
+}
+
+static void uring_teardown(AsyncIO* io) {
+	munmap(io->sqes, io->sqes_size);
+	if (io->cq_ring != io->sq_ring) {
+		munmap(io->cq_ring, io->cq_ring_size);
+	}
+	munmap(io->sq_ring, io->sq_ring_size);
+	close(io->ring_fd);
+}
+
+//Moves every staged request into submission queue entries, then one io_uring_enter submits them all
+static void uring_submit(AsyncIO* io) {
+	unsigned tail = *io->sq_tail;
+	unsigned mask = *io->sq_mask;
+	uint32_t to_submit = 0;
+	IORequest* request;
+	while ((request = list_pop(&io->staged_head, &io->staged_tail)) != NULL) {
+		unsigned index = tail & mask;
+		struct io_uring_sqe* sqe = &io->sqes[index];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = (request->kind == IO_READ) ? IORING_OP_READ : IORING_OP_WRITE;
+		sqe->fd = io->fd;
+		sqe->off = (uint64_t)request->offset;
+		sqe->addr = (uint64_t)(uintptr_t)request->buffer;
+		sqe->len = (uint32_t)request->length;
+		sqe->user_data = (uint64_t)(uintptr_t)request;
+		io->sq_array[index] = index;
+		tail++;
+		to_submit++;
+	}
+	io->num_staged = 0;
+	if (to_submit == 0) {
+		return;
+	}
+	//The kernel must see the filled entries before it sees the new tail
+	__atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+	while (to_submit > 0) {
+		int submitted = (int)syscall(__NR_io_uring_enter, io->ring_fd, to_submit, 0, 0, NULL, 0);
+		if (submitted < 0) {
+			if (errno == EINTR || errno == EAGAIN) continue;
+			printf("Error submitting I/O: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+		to_submit -= (uint32_t)submitted;
+	}
+}
+
+static IORequest* uring_wait(AsyncIO* io) {
+	while (true) {
+		unsigned head = *io->cq_head;
+		unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+		if (head != tail) {
+			struct io_uring_cqe* cqe = &io->cqes[head & *io->cq_mask];
+			IORequest* request = (IORequest*)(uintptr_t)cqe->user_data;
+			request->result = cqe->res;
+			if (cqe->res >= 0 && (size_t)cqe->res < request->length) {
+				//the ring only did part of it, finish the page off ourselves
+				request->result = transfer_rest(io->fd, request, (size_t)cqe->res);
+			}
+			__atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+			return request;
+		}
+		int result = (int)syscall(__NR_io_uring_enter, io->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (result < 0 && errno != EINTR) {
+			printf("Error waiting for I/O: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+#endif
+
+#ifndef _WIN32
+//Each worker pulls a request off the pending list, does the pread/pwrite and drops it on the completed list
+static void* io_worker(void* arg) {
+	AsyncIO* io = arg;
+	pthread_mutex_lock(&io->lock);
+	while (true) {
+		while (io->pending_head == NULL && !io->shutting_down) {
+			pthread_cond_wait(&io->work_ready, &io->lock);
+		}
+		if (io->pending_head == NULL && io->shutting_down) {
+			break;
+		}
+		IORequest* request = list_pop(&io->pending_head, &io->pending_tail);
+		pthread_mutex_unlock(&io->lock);
+		run_request(io->fd, request);
+		pthread_mutex_lock(&io->lock);
+		list_push(&io->completed_head, &io->completed_tail, request);
+		pthread_cond_signal(&io->work_done);
+	}
+	pthread_mutex_unlock(&io->lock);
+	return NULL;
+}
+
+static bool threads_setup(AsyncIO* io) {
+	pthread_mutex_init(&io->lock, NULL);
+	pthread_cond_init(&io->work_ready, NULL);
+	pthread_cond_init(&io->work_done, NULL);
+	io->pending_head = NULL;
+	io->pending_tail = NULL;
+	io->shutting_down = false;
+	for (int i = 0; i < ASYNC_IO_THREADS; i++) {
+		if (pthread_create(&io->threads[i], NULL, io_worker, io) != 0) {
+			printf("Unable to start I/O thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return true;
+}
+
+static void threads_teardown(AsyncIO* io) {
+	pthread_mutex_lock(&io->lock);
+	io->shutting_down = true;
+	pthread_cond_broadcast(&io->work_ready);
+	pthread_mutex_unlock(&io->lock);
+	for (int i = 0; i < ASYNC_IO_THREADS; i++) {
+		pthread_join(io->threads[i], NULL);
+	}
+	pthread_cond_destroy(&io->work_done);
+	pthread_cond_destroy(&io->work_ready);
+	pthread_mutex_destroy(&io->lock);
+}
+#endif
+
+AsyncIO* async_io_open(int fd) {
+	AsyncIO* io = malloc(sizeof(AsyncIO));
+	memset(io, 0, sizeof(AsyncIO));
+	io->fd = fd;
+	io->backend = IO_BACKEND_SYNC;
+
+	const char* forced = getenv("DB_IO_BACKEND");
+	bool want_uring = forced == NULL || strcmp(forced, "io_uring") == 0;
+	bool want_threads = forced == NULL || strcmp(forced, "sync") != 0;
+#ifdef __linux__
+	if (want_uring && uring_setup(io)) {
+		io->backend = IO_BACKEND_IO_URING;
+		return io;
+	}
+#endif
+#ifndef _WIN32
+	if (want_threads && threads_setup(io)) {
+		io->backend = IO_BACKEND_THREADS;
+		return io;
+	}
+#endif
+	(void)want_uring;
+	(void)want_threads;
+	return io;
+}
+
+void async_io_close(AsyncIO* io) {
+	//Nobody should leave I/O hanging at close, but finish it anyway so no worker writes into freed memory
+	async_io_submit(io);
+	while (async_io_in_flight(io) > 0) {
+		async_io_wait(io);
+	}
+	switch (io->backend) {
+#ifdef __linux__
+	case IO_BACKEND_IO_URING:
+		uring_teardown(io);
+		break;
+#endif
+#ifndef _WIN32
+	case IO_BACKEND_THREADS:
+		threads_teardown(io);
+		break;
+#endif
+	default:
+		break;
+	}
+	free(io);
+}
+
+bool async_io_queue(AsyncIO* io, IORequest* request) {
+	if (io->num_staged + io->num_submitted >= ASYNC_IO_QUEUE_DEPTH) {
+		return false;
+	}
+	list_push(&io->staged_head, &io->staged_tail, request);
+	io->num_staged++;
+	return true;
+}
+
+void async_io_submit(AsyncIO* io) {
+	if (io->num_staged == 0) {
+		return;
+	}
+	uint32_t count = io->num_staged;
+	switch (io->backend) {
+#ifdef __linux__
+	case IO_BACKEND_IO_URING:
+		uring_submit(io);
+		break;
+#endif
+#ifndef _WIN32
+	case IO_BACKEND_THREADS:
+		pthread_mutex_lock(&io->lock);
+		while (io->staged_head) {
+			list_push(&io->pending_head, &io->pending_tail, list_pop(&io->staged_head, &io->staged_tail));
+		}
+		pthread_cond_broadcast(&io->work_ready);
+		pthread_mutex_unlock(&io->lock);
+		break;
+#endif
+	default: {
+		IORequest* request;
+		while ((request = list_pop(&io->staged_head, &io->staged_tail)) != NULL) {
+			run_request(io->fd, request);
+			list_push(&io->completed_head, &io->completed_tail, request);
+		}
+		break;
+	}
+	}
+	io->num_staged = 0;
+	io->num_submitted += count;
+}
+
+IORequest* async_io_wait(AsyncIO* io) {
+	if (io->num_submitted == 0) {
+		//don't deadlock waiting on something that was only staged
+		if (io->num_staged == 0) {
+			return NULL;
+		}
+		async_io_submit(io);
+	}
+	IORequest* request = NULL;
+	switch (io->backend) {
+#ifdef __linux__
+	case IO_BACKEND_IO_URING:
+		request = uring_wait(io);
+		break;
+#endif
+#ifndef _WIN32
+	case IO_BACKEND_THREADS:
+		pthread_mutex_lock(&io->lock);
+		while (io->completed_head == NULL) {
+			pthread_cond_wait(&io->work_done, &io->lock);
+		}
+		request = list_pop(&io->completed_head, &io->completed_tail);
+		pthread_mutex_unlock(&io->lock);
+		break;
+#endif
+	default:
+		request = list_pop(&io->completed_head, &io->completed_tail);
+		break;
+	}
+	io->num_submitted--;
+	return request;
+}
+
+uint32_t async_io_in_flight(AsyncIO* io) {
+	return io->num_staged + io->num_submitted;
+}
+
+IOBackend async_io_backend(AsyncIO* io) {
+	return io->backend;
+}
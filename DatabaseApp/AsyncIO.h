@@ -0,0 +1,51 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "posix_comp.h"
+
+//The pager used to do one blocking read/write at a time, this lets it hand the disk a whole batch of page I/O at once.
+//Three backends live behind the same calls:
+//io_uring = linux, the kernel works through the whole queue for us
+//threads = a small pool of workers doing pread/pwrite, for kernels without io_uring (or where it's blocked)
+//sync = windows, each request just runs as it's queued
+typedef enum { IO_BACKEND_IO_URING, IO_BACKEND_THREADS, IO_BACKEND_SYNC } IOBackend;
+
+typedef enum { IO_READ, IO_WRITE } IOKind;
+
+//One page worth of I/O. The caller owns the request (and its buffer) until async_io_wait hands it back.
+typedef struct IORequest {
+	IOKind kind;
+	void* buffer;
+	size_t length;
+	off_t offset;
+	//Which page this is for, the I/O layer doesn't care but the pager needs it back on completion
+	uint32_t page_num;
+	//bytes transferred, or -errno if the request failed. Always all of length unless a read ran into end of file.
+	ssize_t result;
+	//used internally to chain requests in the submission/completion lists
+	struct IORequest* next;
+} IORequest;
+
+typedef struct AsyncIO AsyncIO;
+
+//Max number of requests the queue will hold in flight at once
+#define ASYNC_IO_QUEUE_DEPTH 64
+
+//Sets up the I/O layer for a file, picking the best backend this machine supports.
+//Setting DB_IO_BACKEND=threads or DB_IO_BACKEND=sync in the environment forces a fallback.
+AsyncIO* async_io_open(int fd);
+//Waits for anything still in flight, then tears the backend down
+void async_io_close(AsyncIO* io);
+//Stages a request, returns false if the queue is already full (wait for something to complete first)
+bool async_io_queue(AsyncIO* io, IORequest* request);
+//Hands everything staged by async_io_queue to the disk in one go
+void async_io_submit(AsyncIO* io);
+//Blocks until a submitted request finishes and returns it, NULL if nothing is in flight
+IORequest* async_io_wait(AsyncIO* io);
+//Number of requests queued or submitted that haven't come back out of async_io_wait yet
+uint32_t async_io_in_flight(AsyncIO* io);
+//Which backend we ended up with
+IOBackend async_io_backend(AsyncIO* io);
+
+#endif
@@ -0,0 +1,292 @@
+#ifdef __linux__
+//copy_file_range
+#define _GNU_SOURCE
+#endif
+#include "Backup.h"
+#include "Journal.h"
+#include "ChangeLog.h"
+#include "Shard.h"
+#include "posix_comp.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+//Most pages a single copy_file_range gets asked for
+#define BACKUP_RUN_PAGES 64
+
+typedef struct {
+	Pager* pager;
+	Snapshot snapshot;
+	//Our own handle on the database file. A vacuum that swaps the file out closes the pager's, this one keeps the
+	//file the snapshot's pages are in open until we're done.
+	int source;
+	int dest;
+	uint32_t page_size;
+	uint32_t num_pages;
+	//With a change log, the copy's header says how far into it the copy goes, so a follower can start from it
+	bool has_change_seq;
+	uint64_t change_seq;
+} Backup;
+
+//The snapshot's copy of a page: out of the file when the file has it, otherwise from memory. A commit can replace
+//the page while we read it, so the file only counts if it still had the snapshot's copy once the read was done.
+static void backup_read_page(Backup* backup, uint32_t page_num, void* buffer) {
+	Pager* pager = backup->pager;
+	bool from_file = pager_page_on_disk(pager, page_num, &backup->snapshot)
+		&& pread(backup->source, buffer, backup->page_size, (off_t)page_num * backup->page_size) == (ssize_t)backup->page_size
+		&& pager_page_on_disk(pager, page_num, &backup->snapshot);
+	if (!from_file) {
+		//the snapshot keeps this copy around until we end it
+		memcpy(buffer, get_page_at(pager, page_num, &backup->snapshot), backup->page_size);
+	}
+	//The copy gets closed cleanly with its own page count, whatever the live file's header says right now
+	if (page_num == 0 && memcmp(buffer, HEADER_MAGIC, HEADER_MAGIC_SIZE) == 0) {
+		header_mark_clean(buffer, backup->page_size, backup->num_pages);
+		if (backup->has_change_seq) {
+			memcpy((char*)buffer + HEADER_CHANGE_SEQ_OFFSET, &backup->change_seq, sizeof(uint64_t));
+		}
+	}
+}
+
+static bool backup_write_page(Backup* backup, uint32_t page_num, void* buffer) {
+	backup_read_page(backup, page_num, buffer);
+	return pwrite(backup->dest, buffer, backup->page_size, (off_t)page_num * backup->page_size) == (ssize_t)backup->page_size;
+}
+
+//Copies count pages starting at first from the database file to dest without them coming through us.
+//Returns how many whole pages made it, 0 on a platform or filesystem that can't do it.
+static uint32_t backup_copy_run(Backup* backup, uint32_t first, uint32_t count) {
+#ifdef __linux__
+	loff_t from = (loff_t)first * backup->page_size;
+	loff_t to = from;
+	size_t remaining = (size_t)count * backup->page_size;
+	while (remaining > 0) {
+		ssize_t copied = copy_file_range(backup->source, &from, backup->dest, &to, remaining, 0);
+		if (copied <= 0) {
+			//EXDEV, EOPNOTSUPP and friends, or the file got shorter: what's left goes the slow way
+			break;
+		}
+		remaining -= (size_t)copied;
+	}
+	return (uint32_t)(((size_t)count * backup->page_size - remaining) / backup->page_size);
+#else
+	(void)backup;
+	(void)first;
+	(void)count;
+	return 0;
+#endif
+}
+
+//Writes every changed page but page 0, going file to file for runs of pages dest doesn't have yet
+static bool backup_write_pages(Backup* backup, const bool* changed, uint32_t dest_pages, BackupStats* stats, void* buffer) {
+	uint32_t page_num = 1;
+	while (page_num < backup->num_pages) {
+		if (!changed[page_num]) {
+			page_num++;
+			continue;
+		}
+		//Pages past the end of dest have nothing there to compare with or journal, so they can go as a run
+		uint32_t run = 0;
+		while (page_num >= dest_pages && page_num + run < backup->num_pages && run < BACKUP_RUN_PAGES
+			&& pager_page_on_disk(backup->pager, page_num + run, &backup->snapshot)) {
+			run++;
+		}
+		uint32_t copied = run > 0 ? backup_copy_run(backup, page_num, run) : 0;
+		for (uint32_t i = page_num; i < page_num + copied; i++) {
+			//A commit that replaced the page mid copy means the file had moved on, redo it from the snapshot
+			if (pager_page_on_disk(backup->pager, i, &backup->snapshot)) {
+				stats->pages_zero_copy++;
+			}
+			else if (!backup_write_page(backup, i, buffer)) {
+				return false;
+			}
+			stats->pages_written++;
+		}
+		if (copied == 0) {
+			if (!backup_write_page(backup, page_num, buffer)) {
+				return false;
+			}
+			stats->pages_written++;
+			copied = 1;
+		}
+		page_num += copied;
+	}
+	return true;
+}
+
+//Both handles on the same file: writing the backup would wreck the database
+static bool backup_same_file(int source, int dest) {
+#ifndef _WIN32
+	struct stat source_stat;
+	struct stat dest_stat;
+	return fstat(source, &source_stat) == 0 && fstat(dest, &dest_stat) == 0
+		&& source_stat.st_dev == dest_stat.st_dev && source_stat.st_ino == dest_stat.st_ino;
+#else
+	(void)source;
+	(void)dest;
+	return false;
+#endif
+}
+
+//Compares the snapshot against what dest already has and writes what's different. Dest's journal makes it all or
+//nothing: the old copies of every page we touch are saved first, and deleting the journal at the end commits it.
+static BackupResult backup_to(Backup* backup, const char* path, BackupStats* stats) {
+	uint32_t page_size = backup->page_size;
+	struct stat dest_stat;
+	if (fstat(backup->dest, &dest_stat) == -1) {
+		printf("Error reading backup file: %d\n", errno);
+		return BACKUP_FAILED;
+	}
+	uint32_t dest_length = (uint32_t)dest_stat.st_size;
+	uint32_t dest_pages = (dest_length + page_size - 1) / page_size;
+	uint8_t dest_header[HEADER_SIZE];
+	bool dest_has_header = pread(backup->dest, dest_header, HEADER_SIZE, 0) == HEADER_SIZE
+		&& memcmp(dest_header, HEADER_MAGIC, HEADER_MAGIC_SIZE) == 0;
+	uint32_t dest_version = 0;
+	uint32_t dest_page_size = PAGE_SIZE;
+	if (dest_has_header) {
+		memcpy(&dest_version, dest_header + HEADER_VERSION_OFFSET, sizeof(uint32_t));
+		if (dest_version >= 1) {
+			memcpy(&dest_page_size, dest_header + HEADER_PAGE_SIZE_OFFSET, sizeof(uint32_t));
+		}
+	}
+	//Opening dest plays its journal back in dest's page size, so a rollback needs the two to match
+	if (dest_length > 0 && dest_page_size != page_size) {
+		printf("Backup file %s has %u byte pages, the database has %u.\n", path, dest_page_size, page_size);
+		return BACKUP_FAILED;
+	}
+	//A clean close of dest means its next open skips the journal, so it can't stay that way while we write
+	bool dest_clean = dest_has_header && dest_version >= 1 && dest_header[HEADER_CLEAN_OFFSET] == 1;
+
+	uint32_t max_pages = backup->num_pages > dest_pages ? backup->num_pages : dest_pages;
+	bool* changed = calloc(max_pages > 0 ? max_pages : 1, sizeof(bool));
+	uint8_t* page = malloc(page_size);
+	uint8_t* old = malloc(page_size);
+	uint32_t* journaled = malloc((max_pages > 0 ? max_pages : 1) * sizeof(uint32_t));
+	uint32_t num_journaled = 0;
+	uint32_t num_changed = 0;
+	for (uint32_t i = 0; i < backup->num_pages; i++) {
+		if (i >= dest_pages) {
+			changed[i] = true;
+		}
+		else {
+			backup_read_page(backup, i, page);
+			changed[i] = pread(backup->dest, old, page_size, (off_t)i * page_size) != (ssize_t)page_size
+				|| memcmp(page, old, page_size) != 0;
+		}
+		num_changed += changed[i];
+	}
+	BackupResult result = BACKUP_SUCCESS;
+	if (num_changed > 0 || dest_pages > backup->num_pages) {
+		//the header goes last, and has to be rewritten if we're about to clear dest's clean flag
+		changed[0] = changed[0] || dest_clean;
+		for (uint32_t i = 0; i < dest_pages; i++) {
+			if (i >= backup->num_pages || changed[i]) {
+				journaled[num_journaled++] = i;
+			}
+		}
+		char* journal_path = journal_path_for(path);
+		journal_write(journal_path, backup->dest, dest_length, journaled, num_journaled, page_size);
+		uint8_t not_clean = 0;
+		bool written = !dest_clean || (pwrite(backup->dest, &not_clean, 1, HEADER_CLEAN_OFFSET) == 1 && fsync(backup->dest) == 0);
+		written = written && backup_write_pages(backup, changed, dest_pages, stats, page);
+		written = written && ftruncate(backup->dest, (off_t)backup->num_pages * page_size) == 0 && fsync(backup->dest) == 0;
+		if (written && backup->num_pages > 0 && changed[0]) {
+			written = backup_write_page(backup, 0, page) && fsync(backup->dest) == 0;
+			stats->pages_written++;
+		}
+		if (written) {
+			//also syncs the directory, which is what makes a brand new dest stick
+			journal_delete(journal_path);
+		}
+		else {
+			//the journal stays, the next open of dest puts it back
+			printf("Error writing backup: %d\n", errno);
+			result = BACKUP_FAILED;
+		}
+		free(journal_path);
+	}
+	stats->pages_unchanged = backup->num_pages - stats->pages_written;
+	free(journaled);
+	free(old);
+	free(page);
+	free(changed);
+	return result;
+}
+
+//Backs up one file, the database's own or one of its shards
+static BackupResult backup_file(Database* database, const char* path, BackupStats* stats) {
+	memset(stats, 0, sizeof(BackupStats));
+	Pager* pager = database->pager;
+	int dest = open(path, O_RDWR | O_CREAT | O_BINARY, S_IWUSR | S_IRUSR);
+	if (dest == -1) {
+		printf("Unable to open backup file %s\n", path);
+		return BACKUP_FAILED;
+	}
+	Backup backup;
+	backup.pager = pager;
+	backup.dest = dest;
+	backup.page_size = pager->page_size;
+	//Read before the snapshot, so the copy has at least every change up to here. A follower applying one twice
+	//that was in the copy already just skips it.
+	backup.has_change_seq = database->changes != NULL;
+	backup.change_seq = backup.has_change_seq ? change_log_last_seq(database->changes) : 0;
+	pager_snapshot_begin(pager, &backup.snapshot);
+	backup.num_pages = backup.snapshot.num_pages;
+	pthread_mutex_lock(&pager->latch);
+	backup.source = dup(pager->file_descriptor);
+	pthread_mutex_unlock(&pager->latch);
+	stats->pages = backup.num_pages;
+
+	BackupResult result;
+	if (backup.source == -1) {
+		printf("Error reading database file: %d\n", errno);
+		result = BACKUP_FAILED;
+	}
+	else if (backup_same_file(backup.source, dest)) {
+		result = BACKUP_SAME_FILE;
+	}
+	else {
+		result = backup_to(&backup, path, stats);
+	}
+	pager_snapshot_end(pager, &backup.snapshot);
+	if (backup.source != -1) {
+		close(backup.source);
+	}
+	close(dest);
+	return result;
+}
+
+BackupResult database_backup(Database* database, const char* path, BackupStats* stats) {
+	BackupResult result = backup_file(database, path, stats);
+	ShardSet* shards = database->shards;
+	//Shard i goes to <path>-shardi, which is where opening the copy looks for it (its header has the shard count).
+	//Every shard gets its own snapshot, taken after the database's, so the copy has at least every change up to the
+	//change log position in its header.
+	for (uint32_t i = 0; shards != NULL && i < shards->num_shards && result == BACKUP_SUCCESS; i++) {
+		char* shard_path = shard_path_for(path, i);
+		BackupStats shard_stats;
+		result = backup_file(shards->shards[i], shard_path, &shard_stats);
+		free(shard_path);
+		stats->pages += shard_stats.pages;
+		stats->pages_written += shard_stats.pages_written;
+		stats->pages_zero_copy += shard_stats.pages_zero_copy;
+		stats->pages_unchanged += shard_stats.pages_unchanged;
+	}
+	return result;
+}
+
+void print_backup_result(FILE* out, BackupResult result, const BackupStats* stats) {
+	switch (result) {
+	case(BACKUP_SUCCESS):
+		fprintf(out, "Backed up: %u pages, %u written (%u file to file), %u already up to date.\n", stats->pages,
+			stats->pages_written, stats->pages_zero_copy, stats->pages_unchanged);
+		break;
+	case(BACKUP_SAME_FILE):
+		fprintf(out, "Error: Can't back a database up onto itself.\n");
+		break;
+	case(BACKUP_FAILED):
+		fprintf(out, "Error: Backup failed.\n");
+		break;
+	}
+}
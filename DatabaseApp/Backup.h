@@ -0,0 +1,39 @@
+#ifndef BACKUP_H
+#define BACKUP_H
+#include <stdio.h>
+#include "table.h"
+
+//.backup dest.db: writes a copy of the database as of one commit into dest while the database stays open.
+//Committed pages can sit in memory for a long time before a checkpoint writes them (autocommit inserts only reach
+//the file at close), so copying the file from outside misses them. The backup works off a snapshot instead: pages
+//the file already holds the snapshot's copy of get copied file to file (copy_file_range on Linux, so they never
+//pass through us), everything else comes out of memory. Writes carry on the whole time, and if a commit replaces
+//a page while it's being copied, the copy gets redone from the old version the snapshot keeps around.
+//
+//It's incremental: if dest already has an older backup in it, only pages that changed get written. The pages dest
+//has are saved to dest's own journal first, so a backup that dies partway through leaves dest the way it was
+//(the next open of dest rolls it back, same as for a database). The copy is closed cleanly, with its own page count.
+//A sharded database's shards go to dest-shard0, dest-shard1..., each from its own snapshot, so they're each whole
+//but not necessarily as of the same moment.
+
+typedef enum {
+	BACKUP_SUCCESS,
+	//dest is the database file itself
+	BACKUP_SAME_FILE,
+	//couldn't open or write dest, it's left as it was
+	BACKUP_FAILED
+} BackupResult;
+
+typedef struct {
+	uint32_t pages;
+	//pages that had to be written to dest, and how many of those went file to file without a copy through memory
+	uint32_t pages_written;
+	uint32_t pages_zero_copy;
+	//pages dest already had right
+	uint32_t pages_unchanged;
+} BackupStats;
+
+BackupResult database_backup(Database* database, const char* path, BackupStats* stats);
+void print_backup_result(FILE* out, BackupResult result, const BackupStats* stats);
+
+#endif
@@ -0,0 +1,170 @@
+#include "Statement.h"
+#include "Journal.h"
+#include "Stats.h"
+#include "posix_comp.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+//dbbench [rows] [lookups] [scans]: loads the same users table into a fresh file at every page size a file can have
+//(PAGE_SIZE_VARIANTS) and times point lookups and full scans on each, through the same statements the REPL runs.
+//"warm" runs with every page already in the pager's cache, "cold" right after reopening the file, so the pages
+//come from the OS (which probably still has them cached, this isn't timing the disk).
+//The files go in the current directory as dbbench-<page size>.db and get deleted afterwards.
+
+//Rows default to what fits in TABLE_MAX_PAGES of the smallest pages, page sizes too small for the rows get skipped
+#define BENCH_DEFAULT_ROWS 1000
+#define BENCH_DEFAULT_LOOKUPS 20000
+#define BENCH_DEFAULT_SCANS 50
+//Lookups timed right after a reopen, before the cache has everything
+#define BENCH_COLD_LOOKUPS 200
+//Warm numbers are the fastest of this many rounds, so a hiccup from something else on the machine doesn't count
+#define BENCH_ROUNDS 10
+
+//Selects hand us their rows to count instead of printing them
+typedef struct {
+	Session session;
+	uint64_t rows;
+} BenchSession;
+
+static void bench_count_row(Session* session, const Schema* layout, const void* row) {
+	(void)layout;
+	(void)row;
+	((BenchSession*)session)->rows++;
+}
+
+//Same thing the REPL does with a line, minus the printing. Anything but success ends the run.
+static void bench_run(BenchSession* bench, const char* line) {
+	char text[128];
+	snprintf(text, sizeof(text), "%s", line);
+	size_t length = strlen(text);
+	InputBuffer input_buffer = { text, length + 1, (ssize_t)length };
+	Statement statement;
+	PrepareResult prepare_result = prepare_statement(&input_buffer, &statement);
+	if (prepare_result != PREPARE_SUCCESS) {
+		print_prepare_result(stdout, prepare_result, &input_buffer);
+		exit(EXIT_FAILURE);
+	}
+	ExecuteResult result = execute_statement(&statement, &bench->session);
+	if (result != EXECUTE_SUCCESS) {
+		printf("'%s' failed: ", line);
+		print_execute_result(stdout, result);
+		exit(EXIT_FAILURE);
+	}
+}
+
+//xorshift, so every page size looks up the same keys in the same order
+static uint32_t bench_random(uint32_t* state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+//Nanoseconds per lookup of count random keys, split into rounds, in the fastest round
+static double bench_lookups(BenchSession* bench, uint32_t rows, uint32_t count, uint32_t rounds) {
+	uint32_t state = 2463534242u;
+	char line[64];
+	uint32_t per_round = count / rounds > 0 ? count / rounds : 1;
+	double best = 0;
+	for (uint32_t round = 0; round < rounds; round++) {
+		uint64_t start = stats_clock();
+		for (uint32_t i = 0; i < per_round; i++) {
+			snprintf(line, sizeof(line), "select %u", bench_random(&state) % rows + 1);
+			bench_run(bench, line);
+		}
+		double average = (double)(stats_clock() - start) / per_round;
+		best = round == 0 || average < best ? average : best;
+	}
+	return best;
+}
+
+//Microseconds per full scan in the fastest round
+static double bench_scans(BenchSession* bench, uint32_t rows, uint32_t count, uint32_t rounds) {
+	uint32_t per_round = count / rounds > 0 ? count / rounds : 1;
+	double best = 0;
+	for (uint32_t round = 0; round < rounds; round++) {
+		uint64_t start = stats_clock();
+		for (uint32_t i = 0; i < per_round; i++) {
+			bench->rows = 0;
+			bench_run(bench, "select");
+			if (bench->rows != rows) {
+				printf("Scan found %llu rows, expected %u\n", (unsigned long long)bench->rows, rows);
+				exit(EXIT_FAILURE);
+			}
+		}
+		double average = (double)(stats_clock() - start) / per_round / 1000;
+		best = round == 0 || average < best ? average : best;
+	}
+	return best;
+}
+
+static void bench_remove(const char* path) {
+	char* journal_path = journal_path_for(path);
+	unlink(path);
+	unlink(journal_path);
+	free(journal_path);
+}
+
+static void bench_page_size(uint32_t page_size, uint32_t rows, uint32_t lookups, uint32_t scans) {
+	char path[64];
+	snprintf(path, sizeof(path), "dbbench-%u.db", page_size);
+	bench_remove(path);
+	BenchSession bench = { { NULL, stdout, false, bench_count_row }, 0 };
+	bench.session.database = db_open_page_size(path, page_size);
+	//The pager stops at TABLE_MAX_PAGES, so check the rows fit: full leaves, a few parents, the header and catalog
+	uint32_t leaves = (rows + bench.session.database->tables[0]->leaf_max_cells - 1)
+		/ bench.session.database->tables[0]->leaf_max_cells;
+	if (leaves + leaves / 256 + 4 > TABLE_MAX_PAGES) {
+		printf("%9u  %u rows take more than TABLE_MAX_PAGES (%d) pages\n", page_size, rows, TABLE_MAX_PAGES);
+		db_close(bench.session.database);
+		bench_remove(path);
+		return;
+	}
+
+	//One transaction for the whole load, ids in order so the leaves come out packed and in page order
+	char line[128];
+	bench_run(&bench, "begin");
+	for (uint32_t i = 1; i <= rows; i++) {
+		snprintf(line, sizeof(line), "insert %u user%u person%u@example.com", i, i, i);
+		bench_run(&bench, line);
+	}
+	bench_run(&bench, "commit");
+	Table* table = bench.session.database->tables[0];
+	uint32_t height = table_height(table, NULL);
+	uint32_t pages = bench.session.database->pager->num_pages;
+	db_close(bench.session.database);
+
+	bench.session.database = db_open_page_size(path, page_size);
+	double cold_scan = bench_scans(&bench, rows, 1, 1);
+	double warm_scan = bench_scans(&bench, rows, scans, BENCH_ROUNDS);
+	db_close(bench.session.database);
+
+	bench.session.database = db_open_page_size(path, page_size);
+	double cold_lookup = bench_lookups(&bench, rows, BENCH_COLD_LOOKUPS, 1);
+	double warm_lookup = bench_lookups(&bench, rows, lookups, BENCH_ROUNDS);
+	db_close(bench.session.database);
+	bench_remove(path);
+
+	printf("%9u %6u %6u %12.0f %12.0f %12.1f %12.1f\n", page_size, pages, height, warm_lookup, cold_lookup, warm_scan,
+		cold_scan);
+}
+
+#define BENCH_PAGE_SIZE(size) bench_page_size(size, rows, lookups, scans);
+
+int main(int argc, char* argv[]) {
+	uint32_t rows = argc >= 2 ? (uint32_t)atoi(argv[1]) : BENCH_DEFAULT_ROWS;
+	uint32_t lookups = argc >= 3 ? (uint32_t)atoi(argv[2]) : BENCH_DEFAULT_LOOKUPS;
+	uint32_t scans = argc >= 4 ? (uint32_t)atoi(argv[3]) : BENCH_DEFAULT_SCANS;
+	if (rows == 0 || lookups == 0 || scans == 0) {
+		printf("usage: dbbench [rows] [lookups] [scans]\n");
+		return EXIT_FAILURE;
+	}
+	printf("%u rows, %u lookups, %u scans\n", rows, lookups, scans);
+	printf("%9s %6s %6s %12s %12s %12s %12s\n", "page size", "pages", "height", "lookup ns", "cold lookup",
+		"scan us", "cold scan");
+	PAGE_SIZE_VARIANTS(BENCH_PAGE_SIZE)
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,360 @@
+#include "ChangeLog.h"
+#include "Journal.h"
+#include "posix_comp.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+struct ChangeLog {
+	int fd;
+	bool writable;
+	//Bytes at the start of the file that are the magic and whole records. Past that is either nothing, a record
+	//that's still being written, or (in a writer's file after a crash) one that never will be.
+	uint64_t length;
+	//offsets[i] is where the record with sequence number i + 1 starts
+	uint64_t* offsets;
+	uint64_t num_records;
+	uint64_t capacity;
+	//Records waiting for the commit, sequence numbers and checksums still blank
+	uint8_t* pending;
+	size_t pending_length;
+	size_t pending_capacity;
+	//The writer appends while server workers read for followers
+	pthread_mutex_t lock;
+	//The database file the log covers, until its header has been told it isn't clean any more
+	Pager* unmarked;
+};
+
+char* change_log_path_for(const char* db_filename) {
+	const char* suffix = "-changes";
+	size_t length = strlen(db_filename) + strlen(suffix) + 1;
+	char* path = malloc(length);
+	snprintf(path, length, "%s%s", db_filename, suffix);
+	return path;
+}
+
+size_t change_decode(const uint8_t* data, size_t length, Change* change) {
+	if (length < CHANGE_RECORD_HEADER_SIZE) {
+		return 0;
+	}
+	uint32_t record_length;
+	uint32_t checksum;
+	memcpy(&record_length, data, sizeof(uint32_t));
+	memcpy(&checksum, data + sizeof(uint32_t), sizeof(uint32_t));
+	if (record_length < CHANGE_RECORD_FIXED_SIZE || record_length > CHANGE_RECORD_MAX_SIZE - CHANGE_RECORD_HEADER_SIZE
+		|| length - CHANGE_RECORD_HEADER_SIZE < record_length) {
+		return 0;
+	}
+	const uint8_t* record = data + CHANGE_RECORD_HEADER_SIZE;
+	if (journal_checksum(record, record_length) != checksum) {
+		return 0;
+	}
+	uint8_t kind = record[sizeof(uint64_t)];
+	uint8_t name_length = record[sizeof(uint64_t) + 1];
+	if ((kind != CHANGE_CREATE_TABLE && kind != CHANGE_INSERT) || name_length > SCHEMA_NAME_SIZE
+		|| name_length > record_length - CHANGE_RECORD_FIXED_SIZE) {
+		return 0;
+	}
+	memcpy(&change->seq, record, sizeof(uint64_t));
+	change->kind = (ChangeKind)kind;
+	memcpy(change->table_name, record + CHANGE_RECORD_FIXED_SIZE, name_length);
+	change->table_name[name_length] = '\0';
+	change->body = record + CHANGE_RECORD_FIXED_SIZE + name_length;
+	change->body_length = record_length - CHANGE_RECORD_FIXED_SIZE - name_length;
+	return CHANGE_RECORD_HEADER_SIZE + record_length;
+}
+
+static void change_log_index(ChangeLog* log, uint64_t offset) {
+	if (log->num_records == log->capacity) {
+		log->capacity = log->capacity == 0 ? 1024 : log->capacity * 2;
+		log->offsets = realloc(log->offsets, log->capacity * sizeof(uint64_t));
+	}
+	log->offsets[log->num_records++] = offset;
+}
+
+//Indexes whatever whole records have been added to the file past log->length. Caller holds the lock.
+//Stops at the first record that isn't whole, intact, and numbered one after the last.
+static void change_log_catch_up(ChangeLog* log) {
+	uint8_t* buffer = malloc(CHANGE_LOG_BATCH_SIZE);
+	while (true) {
+		ssize_t bytes_read = pread(log->fd, buffer, CHANGE_LOG_BATCH_SIZE, (off_t)log->length);
+		if (bytes_read <= 0) {
+			break;
+		}
+		size_t used = 0;
+		Change change;
+		size_t record_size;
+		while ((record_size = change_decode(buffer + used, (size_t)bytes_read - used, &change)) > 0
+			&& change.seq == log->num_records + 1) {
+			change_log_index(log, log->length + used);
+			used += record_size;
+		}
+		log->length += used;
+		//either the end of what's there, or a record we can't take (yet)
+		if (used == 0 || (size_t)bytes_read < CHANGE_LOG_BATCH_SIZE) {
+			break;
+		}
+	}
+	free(buffer);
+}
+
+ChangeLog* change_log_open(const char* path, bool writable) {
+	int fd = writable ? open(path, O_RDWR | O_CREAT | O_BINARY, S_IWUSR | S_IRUSR) : open(path, O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		return NULL;
+	}
+	char magic[CHANGE_LOG_MAGIC_SIZE];
+	ssize_t bytes_read = pread(fd, magic, CHANGE_LOG_MAGIC_SIZE, 0);
+	if (bytes_read == 0 && writable) {
+		//brand new, or a crash before the magic made it (there can't be records behind a missing magic)
+		if (pwrite(fd, CHANGE_LOG_MAGIC, CHANGE_LOG_MAGIC_SIZE, 0) != CHANGE_LOG_MAGIC_SIZE || fsync(fd) == -1) {
+			close(fd);
+			return NULL;
+		}
+	}
+	else if (bytes_read != CHANGE_LOG_MAGIC_SIZE || memcmp(magic, CHANGE_LOG_MAGIC, CHANGE_LOG_MAGIC_SIZE) != 0) {
+		close(fd);
+		return NULL;
+	}
+	ChangeLog* log = calloc(1, sizeof(ChangeLog));
+	log->fd = fd;
+	log->writable = writable;
+	log->length = CHANGE_LOG_MAGIC_SIZE;
+	pthread_mutex_init(&log->lock, NULL);
+	change_log_catch_up(log);
+	if (writable) {
+		//A record that was cut off by a crash never committed anything, and new ones go where it started
+		struct stat log_stat;
+		if (fstat(fd, &log_stat) == 0 && (uint64_t)log_stat.st_size > log->length
+			&& (ftruncate(fd, (off_t)log->length) == -1 || fsync(fd) == -1)) {
+			printf("Error trimming change log: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+	}
+	return log;
+}
+
+void change_log_attach(ChangeLog* log, Pager* pager) {
+	log->unmarked = pager;
+}
+
+void change_log_close(ChangeLog* log) {
+	if (log == NULL) {
+		return;
+	}
+	if (log->writable && fsync(log->fd) == -1) {
+		printf("Error syncing change log: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	close(log->fd);
+	pthread_mutex_destroy(&log->lock);
+	free(log->pending);
+	free(log->offsets);
+	free(log);
+}
+
+//Queues a record with everything but its sequence number and checksum filled in. A sharded database's inserts queue
+//from several threads at once (see Shard.h), so the queue is under the lock too.
+static void change_log_queue(ChangeLog* log, ChangeKind kind, const char* table_name, const void* body, uint32_t body_length) {
+	uint8_t name_length = (uint8_t)strlen(table_name);
+	uint32_t record_length = (uint32_t)CHANGE_RECORD_FIXED_SIZE + name_length + body_length;
+	size_t size = CHANGE_RECORD_HEADER_SIZE + record_length;
+	pthread_mutex_lock(&log->lock);
+	if (log->pending_length + size > log->pending_capacity) {
+		log->pending_capacity = log->pending_capacity == 0 ? CHANGE_LOG_BATCH_SIZE : log->pending_capacity * 2;
+		if (log->pending_capacity < log->pending_length + size) {
+			log->pending_capacity = log->pending_length + size;
+		}
+		log->pending = realloc(log->pending, log->pending_capacity);
+	}
+	uint8_t* record = log->pending + log->pending_length;
+	memset(record, 0, CHANGE_RECORD_HEADER_SIZE + CHANGE_RECORD_FIXED_SIZE);
+	memcpy(record, &record_length, sizeof(uint32_t));
+	record += CHANGE_RECORD_HEADER_SIZE;
+	record[sizeof(uint64_t)] = (uint8_t)kind;
+	record[sizeof(uint64_t) + 1] = name_length;
+	memcpy(record + CHANGE_RECORD_FIXED_SIZE, table_name, name_length);
+	memcpy(record + CHANGE_RECORD_FIXED_SIZE + name_length, body, body_length);
+	log->pending_length += size;
+	pthread_mutex_unlock(&log->lock);
+}
+
+void change_log_insert(ChangeLog* log, Table* table, const void* row) {
+	if (log != NULL) {
+		change_log_queue(log, CHANGE_INSERT, table->schema.table_name, row, table->schema.row_size);
+	}
+}
+
+void change_log_create(ChangeLog* log, const Schema* schema) {
+	if (log != NULL) {
+		uint8_t encoded[SCHEMA_ENCODED_SIZE];
+		schema_encode(schema, encoded);
+		change_log_queue(log, CHANGE_CREATE_TABLE, schema->table_name, encoded, SCHEMA_ENCODED_SIZE);
+	}
+}
+
+void change_log_commit(ChangeLog* log, bool durable) {
+	if (log == NULL) {
+		return;
+	}
+	//Whatever's queued goes, including inserts other threads queued since. A commit that finds the queue empty
+	//had its changes taken by one of those, and waited on the lock for them to be written.
+	pthread_mutex_lock(&log->lock);
+	if (log->pending_length == 0) {
+		pthread_mutex_unlock(&log->lock);
+		return;
+	}
+	//Autocommit pages only reach the file at close, so a file that opened clean would still say so after a crash and
+	//the next open wouldn't look at the log. Its header hears about it before the first record goes in.
+	if (log->unmarked != NULL) {
+		pager_mark_dirty(log->unmarked);
+		log->unmarked = NULL;
+	}
+	size_t offset = 0;
+	while (offset < log->pending_length) {
+		uint8_t* record = log->pending + offset;
+		uint32_t record_length;
+		memcpy(&record_length, record, sizeof(uint32_t));
+		uint64_t seq = log->num_records + 1;
+		memcpy(record + CHANGE_RECORD_HEADER_SIZE, &seq, sizeof(uint64_t));
+		uint32_t checksum = journal_checksum(record + CHANGE_RECORD_HEADER_SIZE, record_length);
+		memcpy(record + sizeof(uint32_t), &checksum, sizeof(uint32_t));
+		change_log_index(log, log->length + offset);
+		offset += CHANGE_RECORD_HEADER_SIZE + record_length;
+	}
+	//the whole commit goes out in one write, a follower reading along either sees all of it or waits
+	if (pwrite(log->fd, log->pending, log->pending_length, (off_t)log->length) != (ssize_t)log->pending_length
+		|| (durable && fsync(log->fd) == -1)) {
+		printf("Error writing change log: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	log->length += log->pending_length;
+	log->pending_length = 0;
+	pthread_mutex_unlock(&log->lock);
+}
+
+void change_log_rollback(ChangeLog* log) {
+	if (log != NULL) {
+		pthread_mutex_lock(&log->lock);
+		log->pending_length = 0;
+		pthread_mutex_unlock(&log->lock);
+	}
+}
+
+uint64_t change_log_last_seq(ChangeLog* log) {
+	pthread_mutex_lock(&log->lock);
+	if (!log->writable) {
+		change_log_catch_up(log);
+	}
+	uint64_t last_seq = log->num_records;
+	pthread_mutex_unlock(&log->lock);
+	return last_seq;
+}
+
+size_t change_log_read(ChangeLog* log, uint64_t after_seq, uint8_t* buffer, size_t capacity) {
+	pthread_mutex_lock(&log->lock);
+	if (!log->writable) {
+		change_log_catch_up(log);
+	}
+	if (after_seq >= log->num_records) {
+		pthread_mutex_unlock(&log->lock);
+		return 0;
+	}
+	uint64_t start = log->offsets[after_seq];
+	uint64_t end = start;
+	//records only ever get added after these, so the bytes can be read once we let go of the lock
+	for (uint64_t i = after_seq + 1; i <= log->num_records; i++) {
+		uint64_t next = i < log->num_records ? log->offsets[i] : log->length;
+		if (next - start > capacity) {
+			break;
+		}
+		end = next;
+	}
+	pthread_mutex_unlock(&log->lock);
+	size_t length = (size_t)(end - start);
+	if (length > 0 && pread(log->fd, buffer, length, (off_t)start) != (ssize_t)length) {
+		printf("Error reading change log: %d\n", errno);
+		return 0;
+	}
+	return length;
+}
+
+//begin or commit, the same way the statements do it (so the change log gets its say)
+static ExecuteResult change_transaction(Session* session, StatementType type) {
+	Statement statement;
+	statement.type = type;
+	return execute_transaction(&statement, session);
+}
+
+ExecuteResult change_apply(Session* session, const Change* change) {
+	if (change->kind == CHANGE_CREATE_TABLE) {
+		Statement statement;
+		statement.type = STATEMENT_CREATE;
+		if (change->body_length != SCHEMA_ENCODED_SIZE || !schema_decode(&statement.schema, change->body)) {
+			return EXECUTE_TYPE_MISMATCH;
+		}
+		bool in_transaction = session->in_transaction;
+		if (in_transaction) {
+			change_transaction(session, STATEMENT_COMMIT);
+		}
+		ExecuteResult result = execute_create(&statement, session);
+		if (in_transaction) {
+			change_transaction(session, STATEMENT_BEGIN);
+		}
+		return result;
+	}
+	Table* table = database_find_table(session->database, change->table_name);
+	if (table == NULL) {
+		return EXECUTE_NO_SUCH_TABLE;
+	}
+	if (change->body_length != table->schema.row_size) {
+		return EXECUTE_TYPE_MISMATCH;
+	}
+	return execute_insert_row(session, table, change->body);
+}
+
+ExecuteResult change_apply_batch(Session* session, const uint8_t* records, size_t length, bool record_position,
+	uint64_t* last_seq, uint64_t* applied) {
+	change_transaction(session, STATEMENT_BEGIN);
+	size_t used = 0;
+	Change change;
+	size_t record_size;
+	uint64_t seq = *last_seq;
+	while ((record_size = change_decode(records + used, length - used, &change)) > 0) {
+		ExecuteResult result = change_apply(session, &change);
+		if (result == EXECUTE_SUCCESS) {
+			(*applied)++;
+		}
+		else if (result != EXECUTE_DUPLICATE_KEY && result != EXECUTE_TABLE_EXISTS) {
+			change_transaction(session, STATEMENT_ROLLBACK);
+			*last_seq = change.seq;
+			return result;
+		}
+		seq = change.seq;
+		used += record_size;
+	}
+	if (record_position) {
+		database_set_change_seq(session->database, seq);
+	}
+	change_transaction(session, STATEMENT_COMMIT);
+	*last_seq = seq;
+	return EXECUTE_SUCCESS;
+}
+
+uint64_t change_log_replay(ChangeLog* log, Database* database) {
+	Session session = { database, stdout, false, NULL };
+	uint8_t* buffer = malloc(CHANGE_LOG_BATCH_SIZE);
+	uint64_t applied = 0;
+	uint64_t last_seq = 0;
+	size_t length;
+	while ((length = change_log_read(log, last_seq, buffer, CHANGE_LOG_BATCH_SIZE)) > 0) {
+		ExecuteResult result = change_apply_batch(&session, buffer, length, false, &last_seq, &applied);
+		if (result != EXECUTE_SUCCESS) {
+			printf("Change %llu in the change log doesn't fit the database: ", (unsigned long long)last_seq);
+			print_execute_result(stdout, result);
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(buffer);
+	return applied;
+}
@@ -0,0 +1,96 @@
+#ifndef CHANGE_LOG_H
+#define CHANGE_LOG_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "Statement.h"
+
+//The change log: every insert and create table a database commits, in commit order, as rows rather than pages.
+//With DB_CHANGE_LOG=1 set, a database keeps one next to its file (<db>-changes). Followers read it (straight out of
+//the file, or from a server over the socket, see Follower.h) and apply the same changes to their own copy, which is
+//a lot cheaper than copying the whole file across every time and only as far behind as the follower's polling.
+//
+//A transaction's changes wait in memory and go into the log when it commits, before its pages do. So if the
+//application dies between the two the log has a commit the file doesn't, and the next open of the database plays
+//the log back into it (an insert that's already there is skipped, so that's safe to do with the whole log).
+//Autocommit inserts only reach the file at close, the log is what keeps them through a crash.
+//Nothing deletes or updates rows yet, so inserts and create tables are every change there is.
+//
+//Leave it on once it's on: changes made while DB_CHANGE_LOG wasn't set never make it to a follower.
+
+/*Change log layout
+bytes 0-7: magic "DBCHNG01"
+then records back to back:
+0-3: length of the rest of the record, counted from the sequence number
+4-7: checksum of the rest of the record (a record that didn't finish writing fails this and ends the log)
+8-15: sequence number, 1 for the first change the log ever took and one more for every change after it
+16: kind (CHANGE_CREATE_TABLE or CHANGE_INSERT)
+17: length of the table's name, then the name (no terminator)
+then the row exactly as the table stores it, or for create table the schema as schema_encode writes it*/
+#define CHANGE_LOG_MAGIC "DBCHNG01"
+#define CHANGE_LOG_MAGIC_SIZE 8
+#define CHANGE_RECORD_HEADER_SIZE (2 * sizeof(uint32_t))
+#define CHANGE_RECORD_FIXED_SIZE (sizeof(uint64_t) + 2 * sizeof(uint8_t))
+//Biggest record there can be, any read buffer at least this big always gets at least one record
+#define CHANGE_RECORD_MAX_SIZE (CHANGE_RECORD_HEADER_SIZE + CHANGE_RECORD_FIXED_SIZE + SCHEMA_NAME_SIZE \
+	+ (SCHEMA_MAX_ROW_SIZE > SCHEMA_ENCODED_SIZE ? SCHEMA_MAX_ROW_SIZE : SCHEMA_ENCODED_SIZE))
+//How much of the log a follower asks for at a time, it applies each batch as one transaction
+#ifndef CHANGE_LOG_BATCH_SIZE
+#define CHANGE_LOG_BATCH_SIZE (64 * 1024)
+#endif
+
+typedef enum { CHANGE_CREATE_TABLE = 1, CHANGE_INSERT = 2 } ChangeKind;
+
+//One record, decoded. body points into whatever the record was decoded from.
+typedef struct {
+	uint64_t seq;
+	ChangeKind kind;
+	char table_name[SCHEMA_NAME_SIZE + 1];
+	const uint8_t* body;
+	uint32_t body_length;
+} Change;
+
+//Builds the change log path for a database file, caller frees it
+char* change_log_path_for(const char* db_filename);
+//Opens (creating it if it isn't there and writable is set) a change log and indexes every whole record in it.
+//The writer cuts off a record a crash left half written. A reader leaves the file alone and picks up records
+//the writer adds as it goes. Returns NULL if the file can't be opened or isn't a change log.
+ChangeLog* change_log_open(const char* path, bool writable);
+//The database file the writer's log goes with. Its clean shutdown flag gets cleared before the first commit.
+void change_log_attach(ChangeLog* log, Pager* pager);
+//Syncs and closes the log. Changes still waiting on a commit are dropped.
+void change_log_close(ChangeLog* log);
+
+//The writer's side. These all do nothing with a NULL log, so callers don't have to check whether there is one.
+//Queue a change up for the next commit:
+void change_log_insert(ChangeLog* log, Table* table, const void* row);
+void change_log_create(ChangeLog* log, const Schema* schema);
+//Numbers the queued changes and appends them in one write, synced if durable is set
+void change_log_commit(ChangeLog* log, bool durable);
+//Forgets the queued changes
+void change_log_rollback(ChangeLog* log);
+
+//Sequence number of the last change in the log, 0 while it's empty. A reader's catches up with the file first.
+uint64_t change_log_last_seq(ChangeLog* log);
+//Copies whole records, starting with the one after after_seq, into buffer until the next one wouldn't fit.
+//Returns the bytes copied, 0 when there's nothing new. A reader's catches up with the file first.
+size_t change_log_read(ChangeLog* log, uint64_t after_seq, uint8_t* buffer, size_t capacity);
+
+//Decodes the record at the start of data. Returns its size, or 0 if data doesn't start with a whole, intact record.
+size_t change_decode(const uint8_t* data, size_t length, Change* change);
+//Applies one change to the session's database, inside the session's transaction if it has one (a create table
+//commits it and starts a new one, tables can't be created mid transaction). An insert whose key is already there
+//comes back EXECUTE_DUPLICATE_KEY and a table that already exists EXECUTE_TABLE_EXISTS, without anything changing,
+//so applying changes a second time does no harm.
+ExecuteResult change_apply(Session* session, const Change* change);
+//Applies a batch of records (back to back, the way change_log_read hands them out) as one transaction. last_seq goes
+//in as the change before the batch and comes out as its last one, applied counts the changes that weren't there yet.
+//With record_position set the database's header keeps last_seq (database_set_change_seq) in the same transaction.
+//If a change doesn't fit the database the batch is rolled back, last_seq comes out as that change and what went wrong
+//with it comes back. (A create table in the batch has been committed by then, which is fine, applying it again is too.)
+ExecuteResult change_apply_batch(Session* session, const uint8_t* records, size_t length, bool record_position,
+	uint64_t* last_seq, uint64_t* applied);
+//Applies every change in the log to the database (see the top of this file), returns how many weren't in it yet
+uint64_t change_log_replay(ChangeLog* log, Database* database);
+
+#endif
@@ -0,0 +1,241 @@
+#include "Client.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct DBClient {
+	int fd;
+	//one frame at a time, grown to fit the biggest one we've seen
+	uint8_t* frame;
+	size_t frame_capacity;
+	//outgoing frame being built
+	uint8_t* request;
+	size_t request_capacity;
+};
+
+static bool send_all(int fd, const uint8_t* data, size_t length) {
+	while (length > 0) {
+		ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		data += sent;
+		length -= (size_t)sent;
+	}
+	return true;
+}
+
+static bool recv_all(int fd, uint8_t* data, size_t length) {
+	while (length > 0) {
+		ssize_t received = recv(fd, data, length, 0);
+		if (received == -1 && errno == EINTR) {
+			continue;
+		}
+		if (received <= 0) {
+			return false;
+		}
+		data += received;
+		length -= (size_t)received;
+	}
+	return true;
+}
+
+//Reads the next frame, returns its type (payload is left in client->frame + 1), or 0 if the connection broke
+static uint8_t read_frame(DBClient* client, size_t* payload_length) {
+	uint8_t length_bytes[sizeof(uint32_t)];
+	if (!recv_all(client->fd, length_bytes, sizeof(length_bytes))) {
+		return 0;
+	}
+	uint32_t length = wire_get_u32(length_bytes);
+	if (length == 0) {
+		return 0;
+	}
+	if (length > client->frame_capacity) {
+		client->frame = realloc(client->frame, length);
+		client->frame_capacity = length;
+	}
+	if (!recv_all(client->fd, client->frame, length)) {
+		return 0;
+	}
+	*payload_length = length - 1;
+	return client->frame[0];
+}
+
+//Makes room for a request frame of the given payload size and fills in its header
+static uint8_t* begin_request(DBClient* client, uint8_t type, size_t payload_length) {
+	size_t total = WIRE_HEADER_SIZE + payload_length;
+	if (total > client->request_capacity) {
+		client->request = realloc(client->request, total);
+		client->request_capacity = total;
+	}
+	wire_put_u32(client->request, (uint32_t)(payload_length + 1));
+	client->request[4] = type;
+	return client->request + WIRE_HEADER_SIZE;
+}
+
+static bool send_request(DBClient* client, size_t payload_length) {
+	return send_all(client->fd, client->request, WIRE_HEADER_SIZE + payload_length);
+}
+
+DBClient* db_client_connect(const char* socket_path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(address.sun_path)) {
+		return NULL;
+	}
+	strcpy(address.sun_path, socket_path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return NULL;
+	}
+	if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1
+		|| !send_all(fd, (const uint8_t*)WIRE_MAGIC, WIRE_MAGIC_SIZE)) {
+		close(fd);
+		return NULL;
+	}
+	DBClient* client = calloc(1, sizeof(DBClient));
+	client->fd = fd;
+	return client;
+}
+
+void db_client_close(DBClient* client) {
+	close(client->fd);
+	free(client->frame);
+	free(client->request);
+	free(client);
+}
+
+int db_client_prepare(DBClient* client, const char* sql, uint32_t* statement_id) {
+	size_t length = strlen(sql);
+	uint8_t* payload = begin_request(client, WIRE_PREPARE, length);
+	memcpy(payload, sql, length);
+	if (!send_request(client, length)) {
+		return DB_CLIENT_IO_ERROR;
+	}
+	size_t payload_length;
+	uint8_t type = read_frame(client, &payload_length);
+	if (type == WIRE_PREPARED && payload_length >= sizeof(uint32_t)) {
+		*statement_id = wire_get_u32(client->frame + 1);
+		return PREPARE_SUCCESS;
+	}
+	if (type == WIRE_PREPARE_ERROR && payload_length >= 1) {
+		return client->frame[1];
+	}
+	return DB_CLIENT_IO_ERROR;
+}
+
+int db_client_execute(DBClient* client, uint32_t statement_id, const DBParam* params, uint8_t num_params,
+	DBRowCallback on_row, void* context, ExecuteResult* result) {
+	size_t length = sizeof(uint32_t) + sizeof(uint8_t);
+	for (uint8_t i = 0; i < num_params; i++) {
+		switch (params[i].type) {
+		case(WIRE_PARAM_INT):
+			length += 1 + sizeof(uint32_t);
+			break;
+		case(WIRE_PARAM_TEXT): {
+			//the length goes out as 2 bytes, anything longer would throw the frame out of step with the server
+			size_t text_length = strlen(params[i].text);
+			if (text_length > UINT16_MAX) {
+				return PREPARE_STRING_TOO_LONG;
+			}
+			length += 1 + sizeof(uint16_t) + text_length;
+			break;
+		}
+		default:
+			length += 1 + sizeof(uint64_t);
+			break;
+		}
+	}
+	uint8_t* payload = begin_request(client, WIRE_EXECUTE, length);
+	wire_put_u32(payload, statement_id);
+	payload[4] = num_params;
+	uint8_t* at = payload + 5;
+	for (uint8_t i = 0; i < num_params; i++) {
+		*at++ = (uint8_t)params[i].type;
+		switch (params[i].type) {
+		case(WIRE_PARAM_INT):
+			wire_put_u32(at, (uint32_t)params[i].integer);
+			at += sizeof(uint32_t);
+			break;
+		case(WIRE_PARAM_INT64):
+			wire_put_u64(at, (uint64_t)params[i].integer);
+			at += sizeof(uint64_t);
+			break;
+		case(WIRE_PARAM_DOUBLE): {
+			uint64_t bits;
+			memcpy(&bits, &params[i].real, sizeof(bits));
+			wire_put_u64(at, bits);
+			at += sizeof(uint64_t);
+			break;
+		}
+		case(WIRE_PARAM_TEXT): {
+			size_t text_length = strlen(params[i].text);
+			wire_put_u16(at, (uint16_t)text_length);
+			memcpy(at + sizeof(uint16_t), params[i].text, text_length);
+			at += sizeof(uint16_t) + text_length;
+			break;
+		}
+		}
+	}
+	if (!send_request(client, length)) {
+		return DB_CLIENT_IO_ERROR;
+	}
+	while (true) {
+		size_t payload_length;
+		uint8_t type = read_frame(client, &payload_length);
+		switch (type) {
+		case(WIRE_ROW):
+			if (on_row != NULL) {
+				on_row(context, client->frame + 1);
+			}
+			break;
+		case(WIRE_DONE):
+			*result = (ExecuteResult)client->frame[1];
+			return PREPARE_SUCCESS;
+		case(WIRE_PREPARE_ERROR):
+			return client->frame[1];
+		default:
+			return DB_CLIENT_IO_ERROR;
+		}
+	}
+}
+
+int db_client_finalize(DBClient* client, uint32_t statement_id) {
+	uint8_t* payload = begin_request(client, WIRE_FINALIZE, sizeof(uint32_t));
+	wire_put_u32(payload, statement_id);
+	return send_request(client, sizeof(uint32_t)) ? PREPARE_SUCCESS : DB_CLIENT_IO_ERROR;
+}
+
+int db_client_changes(DBClient* client, uint64_t after_seq, const uint8_t** records, size_t* length, uint64_t* last_seq) {
+	uint8_t* payload = begin_request(client, WIRE_CHANGES, sizeof(uint64_t));
+	wire_put_u64(payload, after_seq);
+	if (!send_request(client, sizeof(uint64_t))) {
+		return DB_CLIENT_IO_ERROR;
+	}
+	size_t payload_length;
+	uint8_t type = read_frame(client, &payload_length);
+	if (type != WIRE_CHANGE_BATCH || payload_length < 1) {
+		return DB_CLIENT_IO_ERROR;
+	}
+	if (client->frame[1] == 0) {
+		return DB_CLIENT_NO_CHANGE_LOG;
+	}
+	if (payload_length < 1 + sizeof(uint64_t)) {
+		return DB_CLIENT_IO_ERROR;
+	}
+	*last_seq = wire_get_u64(client->frame + 2);
+	*records = client->frame + 2 + sizeof(uint64_t);
+	*length = payload_length - 1 - sizeof(uint64_t);
+	return PREPARE_SUCCESS;
+}
+
+void db_client_decode_row(const void* row, Row* destination) {
+	memcpy(&(destination->id), (const char*)row + ID_OFFSET, ID_SIZE);
+	memcpy(&(destination->username), (const char*)row + USERNAME_OFFSET, USERNAME_SIZE);
+	memcpy(&(destination->email), (const char*)row + EMAIL_OFFSET, EMAIL_SIZE);
+}
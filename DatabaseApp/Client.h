@@ -0,0 +1,77 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "Statement.h"
+#include "WireProtocol.h"
+
+//A small client for server mode's binary protocol. Prepare a statement once, then run it with new parameters
+//as often as you like: nothing on either side gets parsed or printf'd per execute, rows come back as raw cells.
+//
+//	DBClient* client = db_client_connect("/tmp/db.sock");
+//	uint32_t lookup;
+//	db_client_prepare(client, "select ?", &lookup);
+//	DBParam id = db_param_int(42);
+//	ExecuteResult result;
+//	db_client_execute(client, lookup, &id, 1, on_row, NULL, &result);
+//
+//Not thread safe, give each thread its own client (they're just a socket).
+
+//Returned in place of a PrepareResult when the connection itself failed
+#define DB_CLIENT_IO_ERROR -1
+//db_client_changes only: the server's database doesn't keep a change log
+#define DB_CLIENT_NO_CHANGE_LOG -2
+
+typedef struct DBClient DBClient;
+
+typedef struct {
+	WireParamType type;
+	//WIRE_PARAM_INT and WIRE_PARAM_INT64
+	int64_t integer;
+	//WIRE_PARAM_DOUBLE
+	double real;
+	//WIRE_PARAM_TEXT only, doesn't have to outlive the execute call
+	const char* text;
+} DBParam;
+
+static inline DBParam db_param_int(int32_t value) {
+	DBParam param = { WIRE_PARAM_INT, value, 0, NULL };
+	return param;
+}
+static inline DBParam db_param_int64(int64_t value) {
+	DBParam param = { WIRE_PARAM_INT64, value, 0, NULL };
+	return param;
+}
+static inline DBParam db_param_double(double value) {
+	DBParam param = { WIRE_PARAM_DOUBLE, 0, value, NULL };
+	return param;
+}
+static inline DBParam db_param_text(const char* value) {
+	DBParam param = { WIRE_PARAM_TEXT, 0, 0, value };
+	return param;
+}
+
+//Gets each selected row as the server stored it (the table's row_size bytes), only valid until the callback returns
+typedef void (*DBRowCallback)(void* context, const void* row);
+
+//NULL if nothing's listening on socket_path
+DBClient* db_client_connect(const char* socket_path);
+void db_client_close(DBClient* client);
+//Parses sql (with '?' for parameters) on the server. Returns PREPARE_SUCCESS and the statement's id,
+//the PrepareResult the server complained with, or DB_CLIENT_IO_ERROR.
+int db_client_prepare(DBClient* client, const char* sql, uint32_t* statement_id);
+//Runs a prepared statement. Returns PREPARE_SUCCESS once it has run (its own outcome lands in *result),
+//a PrepareResult if the parameters didn't fit, or DB_CLIENT_IO_ERROR. Text parameters longer than UINT16_MAX bytes
+//don't fit the protocol and get PREPARE_STRING_TOO_LONG without anything being sent.
+int db_client_execute(DBClient* client, uint32_t statement_id, const DBParam* params, uint8_t num_params,
+	DBRowCallback on_row, void* context, ExecuteResult* result);
+//Tells the server it can forget a prepared statement
+int db_client_finalize(DBClient* client, uint32_t statement_id);
+//Asks for the server's change log records after after_seq (see ChangeLog.h). Returns PREPARE_SUCCESS with the records
+//in *records (length bytes of them, none if there's nothing new, good until the next call) and the log's last sequence
+//number in *last_seq, or DB_CLIENT_NO_CHANGE_LOG, or DB_CLIENT_IO_ERROR.
+int db_client_changes(DBClient* client, uint64_t after_seq, const uint8_t** records, size_t* length, uint64_t* last_seq);
+//Unpacks a raw row from DBRowCallback, for the default users table only (other tables follow their own Schema)
+void db_client_decode_row(const void* row, Row* destination);
+
+#endif
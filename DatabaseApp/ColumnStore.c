@@ -0,0 +1,106 @@
+#include "ColumnStore.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void column_store_free(ColumnStore* store) {
+	for (uint32_t i = 0; i < store->num_blocks; i++) {
+		for (uint32_t column = 0; column < SCHEMA_MAX_COLUMNS; column++) {
+			free(store->blocks[i].columns[column]);
+		}
+	}
+	free(store->blocks);
+	free(store);
+}
+
+//Fills in a block's zones once its rows are in
+static void column_block_finish(const Schema* schema, ColumnBlock* block) {
+	for (uint32_t column = 0; column < schema->num_columns; column++) {
+		const Column* described = &schema->columns[column];
+		filter_zone(described, block->columns[column], described->size, block->num_rows, &block->zones[column]);
+	}
+}
+
+//One pass over the leaves, each row's columns get scattered into the current block
+static ColumnStore* column_store_build(Table* table, Snapshot* snapshot) {
+	const Schema* schema = &table->schema;
+	ColumnStore* store = calloc(1, sizeof(ColumnStore));
+	store->commit_seq = snapshot->commit_seq;
+	uint32_t capacity = 0;
+	ColumnBlock* block = NULL;
+
+	Cursor cursor;
+	table_seek_start(table, snapshot, &cursor);
+	while (!cursor.end_of_table) {
+		if (block == NULL || block->num_rows == COLUMN_BLOCK_ROWS) {
+			if (block != NULL) {
+				column_block_finish(schema, block);
+			}
+			if (store->num_blocks == capacity) {
+				capacity = capacity == 0 ? 4 : capacity * 2;
+				store->blocks = realloc(store->blocks, capacity * sizeof(ColumnBlock));
+			}
+			block = &store->blocks[store->num_blocks++];
+			memset(block, 0, sizeof(ColumnBlock));
+			for (uint32_t column = 0; column < schema->num_columns; column++) {
+				block->columns[column] = malloc((size_t)COLUMN_BLOCK_ROWS * schema->columns[column].size);
+			}
+		}
+		const uint8_t* row = cursor_value(&cursor);
+		for (uint32_t column = 0; column < schema->num_columns; column++) {
+			const Column* described = &schema->columns[column];
+			memcpy(block->columns[column] + (size_t)block->num_rows * described->size, row + described->offset, described->size);
+		}
+		block->num_rows++;
+		store->num_rows++;
+		cursor_advance(&cursor);
+	}
+	if (block != NULL) {
+		column_block_finish(schema, block);
+	}
+	return store;
+}
+
+ColumnStore* column_store_acquire(Table* table, Snapshot* snapshot) {
+	Pager* pager = table->pager;
+	pthread_mutex_lock(&pager->latch);
+	ColumnStore* store = table->column_store;
+	//Good for any snapshot that sees the same rows it was copied from: both of them after the table last changed
+	if (store != NULL && store->commit_seq >= table->modified_at && snapshot->commit_seq >= table->modified_at) {
+		store->references++;
+		pthread_mutex_unlock(&pager->latch);
+		return store;
+	}
+	pthread_mutex_unlock(&pager->latch);
+
+	//Building reads pages, which takes the latch, so it happens outside of it. Two scans might both build one,
+	//the table keeps whichever copy is newer.
+	ColumnStore* built = column_store_build(table, snapshot);
+	built->references = 1;
+	pthread_mutex_lock(&pager->latch);
+	ColumnStore* cached = table->column_store;
+	if (cached == NULL || cached->commit_seq <= built->commit_seq) {
+		table->column_store = built;
+		built->references++;
+		if (cached != NULL && --cached->references == 0) {
+			column_store_free(cached);
+		}
+	}
+	pthread_mutex_unlock(&pager->latch);
+	return built;
+}
+
+void column_store_release(Table* table, ColumnStore* store) {
+	pthread_mutex_lock(&table->pager->latch);
+	bool last = --store->references == 0;
+	pthread_mutex_unlock(&table->pager->latch);
+	if (last) {
+		column_store_free(store);
+	}
+}
+
+void column_store_drop(Table* table) {
+	if (table->column_store != NULL) {
+		column_store_release(table, table->column_store);
+		table->column_store = NULL;
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef COLUMN_STORE_H
+#define COLUMN_STORE_H
+#include <stdint.h>
+#include "table.h"
+#include "Filter.h"
+
+//A column at a time copy of a table for analytic scans (select a, b from t where ...). Rows get copied out of the
+//leaves into blocks of COLUMN_BLOCK_ROWS, and inside a block each column's values sit back to back, so a scan that
+//only wants id reads 4 bytes a row instead of dragging every 293 byte users row through the cache, and a where clause
+//runs over a plain array of one type.
+//
+//It's built from a snapshot the first time a scan asks for it, and reused by every scan that sees the same rows.
+//Once an insert into the table gets committed the next scan builds a fresh one (commits to other tables don't count,
+//see Table.modified_at), so it's for reporting style reads, not a table that changes between every query.
+
+//one block is one filter batch
+#define COLUMN_BLOCK_ROWS FILTER_MAX_BATCH
+
+typedef struct {
+	uint32_t num_rows;
+	//column i's values back to back, Column.size bytes each, in the same format as inside a row
+	uint8_t* columns[SCHEMA_MAX_COLUMNS];
+	//min and max of every number column in the block, so a where clause can skip the block without reading it
+	ColumnZone zones[SCHEMA_MAX_COLUMNS];
+} ColumnBlock;
+
+struct ColumnStore {
+	//the commit the copy was taken at
+	uint64_t commit_seq;
+	//scans reading it right now, plus one while it's the table's cached copy. Guarded by the pager latch.
+	uint32_t references;
+	uint32_t num_rows;
+	uint32_t num_blocks;
+	ColumnBlock* blocks;
+};
+
+//A column store showing the table as the snapshot sees it, builds one if the cached one is from another commit.
+//Hand it back with column_store_release when the scan is done.
+ColumnStore* column_store_acquire(Table* table, Snapshot* snapshot);
+void column_store_release(Table* table, ColumnStore* store);
+//Drops the table's cached copy, for db_close
+void column_store_drop(Table* table);
+
+#endif
@@ -0,0 +1,379 @@
+//memmem
+#define _GNU_SOURCE
+#include "Filter.h"
+#include <string.h>
+//Same deal as the B-tree's key search: compare four int32s a time when the compiler gives us SSE2
+#if defined(__SSE2__) || defined(_M_X64)
+#define FILTER_SSE2
+#include <emmintrin.h>
+#endif
+
+bool filter_parse_op(const char* token, CompareOp* op) {
+	if (strcmp(token, "=") == 0 || strcmp(token, "==") == 0) {
+		*op = COMPARE_EQ;
+	}
+	else if (strcmp(token, "!=") == 0 || strcmp(token, "<>") == 0) {
+		*op = COMPARE_NE;
+	}
+	else if (strcmp(token, "<") == 0) {
+		*op = COMPARE_LT;
+	}
+	else if (strcmp(token, "<=") == 0) {
+		*op = COMPARE_LE;
+	}
+	else if (strcmp(token, ">") == 0) {
+		*op = COMPARE_GT;
+	}
+	else if (strcmp(token, ">=") == 0) {
+		*op = COMPARE_GE;
+	}
+	else if (strcmp(token, "contains") == 0) {
+		*op = COMPARE_CONTAINS;
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+SchemaResult filter_bind(const Schema* schema, const Predicate* predicate, BoundPredicate* bound) {
+	int32_t index = schema_find_column(schema, predicate->column_name);
+	if (index < 0) {
+		return SCHEMA_NO_SUCH_COLUMN;
+	}
+	const Value* value = &predicate->value;
+	bound->column = &schema->columns[index];
+	bound->column_index = (uint32_t)index;
+	bound->op = predicate->op;
+	bound->integer = 0;
+	bound->real = 0;
+	bound->text = NULL;
+	bound->length = 0;
+	//only strings can contain things
+	if (bound->op == COMPARE_CONTAINS && bound->column->type != COLUMN_VARCHAR) {
+		return SCHEMA_TYPE_MISMATCH;
+	}
+	switch (bound->column->type) {
+	case(COLUMN_INT32):
+	case(COLUMN_INT64):
+		if (value->type != VALUE_INTEGER) {
+			return SCHEMA_TYPE_MISMATCH;
+		}
+		bound->integer = value->integer;
+		break;
+	case(COLUMN_DOUBLE):
+		if (value->type == VALUE_TEXT) {
+			return SCHEMA_TYPE_MISMATCH;
+		}
+		bound->real = value->type == VALUE_REAL ? value->real : (double)value->integer;
+		break;
+	case(COLUMN_VARCHAR):
+		//parsed values keep their text, so where name = 42 still works on a varchar
+		if (value->text == NULL) {
+			return SCHEMA_TYPE_MISMATCH;
+		}
+		bound->text = value->text;
+		bound->length = value->length;
+		break;
+	}
+	return SCHEMA_OK;
+}
+
+SchemaResult filter_bind_all(const Schema* schema, const Filter* filter, BoundFilter* bound) {
+	bound->num_terms = filter->num_terms;
+	for (uint32_t i = 0; i < filter->num_terms; i++) {
+		SchemaResult result = filter_bind(schema, &filter->terms[i], &bound->terms[i]);
+		if (result != SCHEMA_OK) {
+			return result;
+		}
+		bound->starts_group[i] = filter->starts_group[i];
+	}
+	return SCHEMA_OK;
+}
+
+//One loop per operator: load the value at position i into v, and every position gets written to the selection
+//but only counted when it passes, so there's no branch to mispredict in the middle of the loop.
+//Narrowing a selection reads input[k] before anything gets written at k or before, so it works in place.
+#define FILTER_LOOP(load, test) \
+	if (input == NULL) { \
+		for (uint32_t i = 0; i < count; i++) { \
+			load; \
+			selection[selected] = (uint16_t)i; \
+			selected += (test); \
+		} \
+	} \
+	else { \
+		for (uint32_t k = 0; k < count; k++) { \
+			uint32_t i = input[k]; \
+			load; \
+			selection[selected] = (uint16_t)i; \
+			selected += (test); \
+		} \
+	}
+
+#define FILTER_BY_OP(load, less, equal, greater) \
+	switch (predicate->op) { \
+	case(COMPARE_EQ): FILTER_LOOP(load, (equal)) break; \
+	case(COMPARE_NE): FILTER_LOOP(load, !(equal)) break; \
+	case(COMPARE_LT): FILTER_LOOP(load, (less)) break; \
+	case(COMPARE_LE): FILTER_LOOP(load, (less) || (equal)) break; \
+	case(COMPARE_GT): FILTER_LOOP(load, (greater)) break; \
+	case(COMPARE_GE): FILTER_LOOP(load, (greater) || (equal)) break; \
+	default: break; \
+	}
+
+//Orders a varchar slot against a string: null terminated unless the string fills the slot, and byte by byte like text keys
+static int filter_compare_text(const char* slot, uint32_t slot_size, const char* text, uint32_t length) {
+	uint32_t slot_length = (uint32_t)strnlen(slot, slot_size);
+	int compared = memcmp(slot, text, slot_length < length ? slot_length : length);
+	if (compared != 0) {
+		return compared;
+	}
+	return slot_length < length ? -1 : (slot_length > length ? 1 : 0);
+}
+
+//Whether text shows up anywhere in a varchar slot. glibc's memmem is a proper substring search, windows doesn't have
+//one, so there it's memchr for the first byte and memcmp for the rest.
+static bool filter_contains(const char* slot, uint32_t slot_size, const char* text, uint32_t length) {
+	size_t slot_length = strnlen(slot, slot_size);
+#ifdef _WIN32
+	if (length == 0) {
+		return true;
+	}
+	const char* end = slot + slot_length;
+	for (const char* at = slot; (size_t)(end - at) >= length; at++) {
+		at = memchr(at, text[0], (size_t)(end - at) - length + 1);
+		if (at == NULL) {
+			return false;
+		}
+		if (memcmp(at, text, length) == 0) {
+			return true;
+		}
+	}
+	return false;
+#else
+	return memmem(slot, slot_length, text, length) != NULL;
+#endif
+}
+
+#ifdef FILTER_SSE2
+//Contiguous int32s (a column block's worth) compared against a constant four at a time
+static uint32_t filter_int32_sse2(CompareOp op, const int32_t* values, uint32_t count, int32_t constant, uint16_t* selection) {
+	__m128i probe = _mm_set1_epi32(constant);
+	uint32_t selected = 0;
+	uint32_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(values + i));
+		__m128i passed;
+		switch (op) {
+		case(COMPARE_EQ): passed = _mm_cmpeq_epi32(block, probe); break;
+		case(COMPARE_NE): passed = _mm_xor_si128(_mm_cmpeq_epi32(block, probe), _mm_set1_epi32(-1)); break;
+		case(COMPARE_LT): passed = _mm_cmplt_epi32(block, probe); break;
+		case(COMPARE_LE): passed = _mm_xor_si128(_mm_cmpgt_epi32(block, probe), _mm_set1_epi32(-1)); break;
+		case(COMPARE_GT): passed = _mm_cmpgt_epi32(block, probe); break;
+		default: passed = _mm_xor_si128(_mm_cmplt_epi32(block, probe), _mm_set1_epi32(-1)); break;
+		}
+		//one bit per lane
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(passed));
+		for (uint32_t lane = 0; lane < 4; lane++) {
+			selection[selected] = (uint16_t)(i + lane);
+			selected += (mask >> lane) & 1;
+		}
+	}
+	for (; i < count; i++) {
+		int32_t v = values[i];
+		bool pass;
+		switch (op) {
+		case(COMPARE_EQ): pass = v == constant; break;
+		case(COMPARE_NE): pass = v != constant; break;
+		case(COMPARE_LT): pass = v < constant; break;
+		case(COMPARE_LE): pass = v <= constant; break;
+		case(COMPARE_GT): pass = v > constant; break;
+		default: pass = v >= constant; break;
+		}
+		selection[selected] = (uint16_t)i;
+		selected += pass;
+	}
+	return selected;
+}
+#endif
+
+uint32_t filter_select(const BoundPredicate* predicate, const uint8_t* values, uint32_t stride, uint32_t count,
+	const uint16_t* input, uint16_t* selection) {
+	uint32_t selected = 0;
+	switch (predicate->column->type) {
+	case(COLUMN_INT32): {
+		//kept 64 bit, so a constant past int32's range still compares right
+		int64_t constant = predicate->integer;
+#ifdef FILTER_SSE2
+		if (input == NULL && stride == sizeof(int32_t) && constant >= INT32_MIN && constant <= INT32_MAX) {
+			return filter_int32_sse2(predicate->op, (const int32_t*)values, count, (int32_t)constant, selection);
+		}
+#endif
+		int32_t v;
+		FILTER_BY_OP(memcpy(&v, values + (size_t)i * stride, sizeof(v)), v < constant, v == constant, v > constant)
+		break;
+	}
+	case(COLUMN_INT64): {
+		int64_t constant = predicate->integer;
+		int64_t v;
+		FILTER_BY_OP(memcpy(&v, values + (size_t)i * stride, sizeof(v)), v < constant, v == constant, v > constant)
+		break;
+	}
+	case(COLUMN_DOUBLE): {
+		double constant = predicate->real;
+		double v;
+		FILTER_BY_OP(memcpy(&v, values + (size_t)i * stride, sizeof(v)), v < constant, v == constant, v > constant)
+		break;
+	}
+	case(COLUMN_VARCHAR): {
+		//slots are null terminated unless the string fills them, and sort byte by byte like text keys
+		const char* constant = predicate->text;
+		uint32_t constant_length = predicate->length;
+		uint32_t slot_size = predicate->column->size;
+		if (predicate->op == COMPARE_CONTAINS) {
+			FILTER_LOOP(const char* v = (const char*)values + (size_t)i * stride, filter_contains(v, slot_size, constant, constant_length))
+			break;
+		}
+		if (predicate->op == COMPARE_EQ || predicate->op == COMPARE_NE) {
+			//equality doesn't need an order, just a length check and one memcmp
+			bool want = predicate->op == COMPARE_EQ;
+			FILTER_LOOP(const char* v = (const char*)values + (size_t)i * stride,
+				((strnlen(v, slot_size) == constant_length && memcmp(v, constant, constant_length) == 0) == want))
+			break;
+		}
+		FILTER_BY_OP(int compared = filter_compare_text((const char*)values + (size_t)i * stride, slot_size, constant, constant_length),
+			compared < 0, compared == 0, compared > 0)
+		break;
+	}
+	}
+	return selected;
+}
+
+//Both lists are sorted positions, so or-ing them is a merge
+static uint32_t filter_union(const uint16_t* a, uint32_t a_count, const uint16_t* b, uint32_t b_count, uint16_t* merged) {
+	uint32_t i = 0;
+	uint32_t j = 0;
+	uint32_t count = 0;
+	while (i < a_count && j < b_count) {
+		uint16_t next = a[i] < b[j] ? a[i] : b[j];
+		i += a[i] == next;
+		j += b[j] == next;
+		merged[count++] = next;
+	}
+	while (i < a_count) {
+		merged[count++] = a[i++];
+	}
+	while (j < b_count) {
+		merged[count++] = b[j++];
+	}
+	return count;
+}
+
+uint32_t filter_run(const BoundFilter* filter, const uint8_t* const* columns, const uint32_t* strides, uint32_t count,
+	uint16_t* selection) {
+	uint16_t group[FILTER_MAX_BATCH];
+	uint16_t merged[FILTER_MAX_BATCH];
+	uint32_t selected = 0;
+	uint32_t term = 0;
+	while (term < filter->num_terms) {
+		//the first term of a group checks every row, the rest only narrow down what's still in
+		const BoundPredicate* predicate = &filter->terms[term];
+		uint32_t passed = filter_select(predicate, columns[predicate->column_index], strides[predicate->column_index],
+			count, NULL, group);
+		for (term++; term < filter->num_terms && !filter->starts_group[term]; term++) {
+			predicate = &filter->terms[term];
+			if (passed > 0) {
+				passed = filter_select(predicate, columns[predicate->column_index], strides[predicate->column_index],
+					passed, group, group);
+			}
+		}
+		selected = filter_union(selection, selected, group, passed, merged);
+		memcpy(selection, merged, selected * sizeof(uint16_t));
+		//every row made it, later groups can't add any
+		if (selected == count) {
+			break;
+		}
+	}
+	return selected;
+}
+
+void filter_zone(const Column* column, const uint8_t* values, uint32_t stride, uint32_t count, ColumnZone* zone) {
+	zone->min_integer = INT64_MAX;
+	zone->max_integer = INT64_MIN;
+	zone->min_real = 0;
+	zone->max_real = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		const uint8_t* at = values + (size_t)i * stride;
+		switch (column->type) {
+		case(COLUMN_INT32): {
+			int32_t v;
+			memcpy(&v, at, sizeof(v));
+			zone->min_integer = v < zone->min_integer ? v : zone->min_integer;
+			zone->max_integer = v > zone->max_integer ? v : zone->max_integer;
+			break;
+		}
+		case(COLUMN_INT64): {
+			int64_t v;
+			memcpy(&v, at, sizeof(v));
+			zone->min_integer = v < zone->min_integer ? v : zone->min_integer;
+			zone->max_integer = v > zone->max_integer ? v : zone->max_integer;
+			break;
+		}
+		case(COLUMN_DOUBLE): {
+			double v;
+			memcpy(&v, at, sizeof(v));
+			zone->min_real = i == 0 || v < zone->min_real ? v : zone->min_real;
+			zone->max_real = i == 0 || v > zone->max_real ? v : zone->max_real;
+			break;
+		}
+		case(COLUMN_VARCHAR):
+			return;
+		}
+	}
+}
+
+//Could anything in [min, max] pass "x op constant"?
+#define ZONE_MAY_MATCH(min, max, constant) \
+	switch (predicate->op) { \
+	case(COMPARE_EQ): return (min) <= (constant) && (constant) <= (max); \
+	case(COMPARE_NE): return !((min) == (constant) && (max) == (constant)); \
+	case(COMPARE_LT): return (min) < (constant); \
+	case(COMPARE_LE): return (min) <= (constant); \
+	case(COMPARE_GT): return (max) > (constant); \
+	case(COMPARE_GE): return (max) >= (constant); \
+	default: break; \
+	}
+
+bool filter_zone_may_match(const BoundPredicate* predicate, const ColumnZone* zone) {
+	switch (predicate->column->type) {
+	case(COLUMN_INT32):
+	case(COLUMN_INT64):
+		ZONE_MAY_MATCH(zone->min_integer, zone->max_integer, predicate->integer)
+		break;
+	case(COLUMN_DOUBLE):
+		ZONE_MAY_MATCH(zone->min_real, zone->max_real, predicate->real)
+		break;
+	default:
+		break;
+	}
+	return true;
+}
+
+bool filter_zones_may_match(const BoundFilter* filter, const ColumnZone* zones) {
+	uint32_t term = 0;
+	while (term < filter->num_terms) {
+		//a group is out as soon as one of its terms is, the zone is worth reading if any group isn't
+		bool group_may_match = true;
+		do {
+			const BoundPredicate* predicate = &filter->terms[term];
+			group_may_match = group_may_match && filter_zone_may_match(predicate, &zones[predicate->column_index]);
+			term++;
+		} while (term < filter->num_terms && !filter->starts_group[term]);
+		if (group_may_match) {
+			return true;
+		}
+	}
+	//no where clause at all lets everything through
+	return filter->num_terms == 0;
+}
@@ -0,0 +1,83 @@
+#ifndef FILTER_H
+#define FILTER_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "Schema.h"
+
+//Where clauses. A predicate compares one column against one value, and the kernels below check it against a whole
+//run of values in one go (a column block, or every row of a leaf) with one tight loop per column type and operator,
+//instead of deserializing each row and switching on its types as we go.
+
+//contains is for varchars: the value shows up anywhere in the string
+typedef enum { COMPARE_EQ, COMPARE_NE, COMPARE_LT, COMPARE_LE, COMPARE_GT, COMPARE_GE, COMPARE_CONTAINS } CompareOp;
+
+//Most rows one filter call looks at, a column block or a leaf's worth
+#define FILTER_MAX_BATCH 1024
+//Most predicates one where clause can have
+#define FILTER_MAX_TERMS 8
+
+//col op value, as written. The column gets looked up by name when the statement runs, prepare doesn't know the table yet.
+typedef struct {
+	char column_name[SCHEMA_NAME_SIZE + 1];
+	CompareOp op;
+	Value value;
+} Predicate;
+
+//A predicate checked against a schema: the column it reads and the value already converted to that column's type
+typedef struct {
+	const Column* column;
+	uint32_t column_index;
+	CompareOp op;
+	int64_t integer;
+	double real;
+	const char* text;
+	uint32_t length;
+} BoundPredicate;
+
+//Smallest and biggest value in a run of a number column, lets a filter skip the whole run
+typedef struct {
+	int64_t min_integer;
+	int64_t max_integer;
+	double min_real;
+	double max_real;
+} ColumnZone;
+
+//A whole where clause: a and b or c and d. and binds tighter than or like in SQL, so it's a list of groups that
+//each need all of their terms to pass, and a row passes if any group does. No parentheses.
+typedef struct {
+	uint32_t num_terms;
+	Predicate terms[FILTER_MAX_TERMS];
+	//terms[i] comes right after an or, so it starts a new group (terms[0] always does)
+	bool starts_group[FILTER_MAX_TERMS];
+} Filter;
+
+typedef struct {
+	uint32_t num_terms;
+	BoundPredicate terms[FILTER_MAX_TERMS];
+	bool starts_group[FILTER_MAX_TERMS];
+} BoundFilter;
+
+//=, !=, <>, <, <=, >, >=, contains. False if token isn't one of them.
+bool filter_parse_op(const char* token, CompareOp* op);
+//SCHEMA_NO_SUCH_COLUMN, or SCHEMA_TYPE_MISMATCH if the value can't be compared with the column
+SchemaResult filter_bind(const Schema* schema, const Predicate* predicate, BoundPredicate* bound);
+//filter_bind for every term of a where clause
+SchemaResult filter_bind_all(const Schema* schema, const Filter* filter, BoundFilter* bound);
+//Checks values of the predicate's column: value i is at values + i * stride (stride is the column's own size in a
+//column block, the cell size when walking a leaf's rows). With input NULL that's positions 0 to count - 1, otherwise
+//it's the count positions listed in input, which lets a selection be narrowed down in place (input == selection).
+//Writes the positions that pass to selection, in order, and returns how many did.
+uint32_t filter_select(const BoundPredicate* predicate, const uint8_t* values, uint32_t stride, uint32_t count,
+	const uint16_t* input, uint16_t* selection);
+//Runs a whole where clause over count rows (at most FILTER_MAX_BATCH). Column c's value for row i is at
+//columns[c] + i * strides[c]. Writes the rows that pass to selection, in order, and returns how many did.
+uint32_t filter_run(const BoundFilter* filter, const uint8_t* const* columns, const uint32_t* strides, uint32_t count,
+	uint16_t* selection);
+//Works out the zone of count values of a number column, laid out like filter_select's
+void filter_zone(const Column* column, const uint8_t* values, uint32_t stride, uint32_t count, ColumnZone* zone);
+//False if nothing in the zone can pass (number columns only, varchars always say true)
+bool filter_zone_may_match(const BoundPredicate* predicate, const ColumnZone* zone);
+//Same for a where clause, zones is indexed by column
+bool filter_zones_may_match(const BoundFilter* filter, const ColumnZone* zones);
+
+#endif
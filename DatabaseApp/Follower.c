@@ -0,0 +1,140 @@
+#ifdef __linux__
+#include "Follower.h"
+#include "ChangeLog.h"
+#include "Client.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+
+struct Follower {
+	Session session;
+	const char* source;
+	//exactly one of these, depending on what source turned out to be
+	DBClient* client;
+	ChangeLog* log;
+	uint8_t* buffer;
+	//the last change this database has, what's in its header
+	uint64_t applied;
+};
+
+Follower* follower_open(Database* database, const char* source) {
+	//the header is where the follower keeps its place
+	if (!database->pager->has_header) {
+		printf("A follower's database needs a file with a catalog, this one is from before them.\n");
+		return NULL;
+	}
+	Follower* follower = calloc(1, sizeof(Follower));
+	Session session = { database, stdout, false, NULL };
+	follower->session = session;
+	follower->source = source;
+	struct stat source_stat;
+	if (stat(source, &source_stat) == 0 && S_ISSOCK(source_stat.st_mode)) {
+		follower->client = db_client_connect(source);
+	}
+	else {
+		follower->log = change_log_open(source, false);
+		follower->buffer = malloc(CHANGE_LOG_BATCH_SIZE);
+	}
+	if (follower->client == NULL && follower->log == NULL) {
+		printf("Unable to follow %s, it's neither a server's socket nor a change log.\n", source);
+		follower_close(follower);
+		return NULL;
+	}
+	follower->applied = database_change_seq(database);
+	printf("Following %s from change %llu\n", source, (unsigned long long)follower->applied);
+	fflush(stdout);
+	return follower;
+}
+
+void follower_close(Follower* follower) {
+	if (follower->client != NULL) {
+		db_client_close(follower->client);
+	}
+	if (follower->log != NULL) {
+		change_log_close(follower->log);
+	}
+	free(follower->buffer);
+	free(follower);
+}
+
+int64_t follower_poll(Follower* follower, pthread_mutex_t* write_lock) {
+	const uint8_t* records = follower->buffer;
+	size_t length;
+	uint64_t last_seq;
+	if (follower->client != NULL) {
+		int result = db_client_changes(follower->client, follower->applied, &records, &length, &last_seq);
+		if (result == DB_CLIENT_NO_CHANGE_LOG) {
+			printf("%s doesn't keep a change log, start it with DB_CHANGE_LOG=1.\n", follower->source);
+			return -1;
+		}
+		if (result != PREPARE_SUCCESS) {
+			printf("Lost the connection to %s.\n", follower->source);
+			return -1;
+		}
+	}
+	else {
+		length = change_log_read(follower->log, follower->applied, follower->buffer, CHANGE_LOG_BATCH_SIZE);
+		last_seq = change_log_last_seq(follower->log);
+	}
+	//A log that ends before our place can't be the one we got here from
+	if (last_seq < follower->applied) {
+		printf("This database has change %llu, but %s only goes up to %llu.\n", (unsigned long long)follower->applied,
+			follower->source, (unsigned long long)last_seq);
+		return -1;
+	}
+	if (length == 0) {
+		return 0;
+	}
+	uint64_t seq = follower->applied;
+	uint64_t applied = 0;
+	if (write_lock != NULL) {
+		pthread_mutex_lock(write_lock);
+	}
+	ExecuteResult result = change_apply_batch(&follower->session, records, length, true, &seq, &applied);
+	if (write_lock != NULL) {
+		pthread_mutex_unlock(write_lock);
+	}
+	if (result != EXECUTE_SUCCESS) {
+		printf("Change %llu from %s doesn't fit this database: ", (unsigned long long)seq, follower->source);
+		print_execute_result(stdout, result);
+		return -1;
+	}
+	int64_t count = (int64_t)(seq - follower->applied);
+	follower->applied = seq;
+	return count;
+}
+
+int follower_run(Database* database, const char* source) {
+	//Ctrl-C/kill get picked up between batches, so the database always closes on a whole one
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	Follower* follower = follower_open(database, source);
+	if (follower == NULL) {
+		return EXIT_FAILURE;
+	}
+	int exit_code = EXIT_SUCCESS;
+	while (true) {
+		int64_t count = follower_poll(follower, NULL);
+		if (count < 0) {
+			exit_code = EXIT_FAILURE;
+			break;
+		}
+		//Caught up: wait a bit before asking again (or straight away if there's more). Either way a signal ends it.
+		long wait_ms = count == 0 ? FOLLOWER_POLL_MS : 0;
+		struct timespec wait = { wait_ms / 1000, (wait_ms % 1000) * 1000000L };
+		if (sigtimedwait(&signals, NULL, &wait) > 0) {
+			break;
+		}
+	}
+	printf("Stopped following at change %llu.\n", (unsigned long long)follower->applied);
+	follower_close(follower);
+	return exit_code;
+}
+#endif
@@ -0,0 +1,37 @@
+#ifndef FOLLOWER_H
+#define FOLLOWER_H
+#include <stdint.h>
+#include <pthread.h>
+#include "table.h"
+
+//A follower keeps its own database file in step with another database's change log (see ChangeLog.h), so reads
+//can spread over as many copies as you like without copying files around. It asks for whatever came after the last
+//change it has, applies each batch as one transaction, and keeps its place in its file's header alongside the
+//changes, so a follower that stops (or crashes) picks up where it was.
+//
+//The source is either a server's socket (the leader runs --serve with DB_CHANGE_LOG=1, and the follower asks over
+//the binary protocol) or the change log file itself on the same machine. A follower's database starts out as a fresh
+//file, which then gets the whole log, or as a .backup of the leader, which already has everything up to the point
+//its header says.
+//
+//DatabaseApp --follow source follower.db runs one in the foreground, with a socket path after that it also serves
+//reads on it (writes get EXECUTE_READ_ONLY). Linux only, like server mode.
+
+//How long a follower that's caught up waits before asking again
+#ifndef FOLLOWER_POLL_MS
+#define FOLLOWER_POLL_MS 100
+#endif
+
+typedef struct Follower Follower;
+
+//Connects to source for database, NULL (after printing why) if it can't
+Follower* follower_open(Database* database, const char* source);
+//Fetches the next batch of changes and applies it, holding write_lock (if there is one) while it applies.
+//Returns how many changes the batch had, 0 when there was nothing new, -1 (after printing why) if following can't
+//go on: the source went away, doesn't keep a change log, or has changes that don't fit this database.
+int64_t follower_poll(Follower* follower, pthread_mutex_t* write_lock);
+void follower_close(Follower* follower);
+//Follows source until SIGINT/SIGTERM. Returns the process exit code.
+int follower_run(Database* database, const char* source);
+
+#endif
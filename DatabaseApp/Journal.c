@@ -0,0 +1,164 @@
+#include "Journal.h"
+#include "table.h"
+#include "posix_comp.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+char* journal_path_for(const char* db_filename) {
+	const char* suffix = "-journal";
+	size_t length = strlen(db_filename) + strlen(suffix) + 1;
+	char* path = malloc(length);
+	snprintf(path, length, "%s%s", db_filename, suffix);
+	return path;
+}
+
+uint32_t journal_checksum(const uint8_t* data, size_t length) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+//Creating or deleting a file is only durable once the directory holding it has been fsync'd too
+static void sync_parent_directory(const char* path) {
+#ifndef _WIN32
+	char* dir = malloc(strlen(path) + 2);
+	strcpy(dir, path);
+	char* slash = strrchr(dir, '/');
+	if (slash == NULL) {
+		strcpy(dir, ".");
+	}
+	else if (slash == dir) {
+		dir[1] = '\0';
+	}
+	else {
+		*slash = '\0';
+	}
+	int fd = open(dir, O_RDONLY);
+	if (fd != -1) {
+		fsync(fd);
+		close(fd);
+	}
+	free(dir);
+#else
+	(void)path;
+#endif
+}
+
+void journal_write(const char* journal_path, int db_fd, uint32_t file_length, const uint32_t* page_nums, uint32_t count,
+	uint32_t page_size) {
+	uint32_t file_pages = file_length / page_size;
+	if (file_length % page_size) {
+		file_pages += 1;
+	}
+	const size_t record_size = sizeof(uint32_t) + page_size;
+	//Pages past the end of the file have nothing to save, truncating back to file_length undoes them
+	uint32_t num_records = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		if (page_nums[i] < file_pages) {
+			num_records++;
+		}
+	}
+	size_t journal_size = JOURNAL_HEADER_SIZE + num_records * record_size;
+	uint8_t* journal = calloc(1, journal_size);
+	uint8_t* record = journal + JOURNAL_HEADER_SIZE;
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t page_num = page_nums[i];
+		if (page_num >= file_pages) {
+			continue;
+		}
+		memcpy(record, &page_num, sizeof(uint32_t));
+		//a short read on the last partial page just leaves zeroes behind it
+		ssize_t bytes_read = pread(db_fd, record + sizeof(uint32_t), page_size, (off_t)page_num * page_size);
+		if (bytes_read == -1) {
+			printf("Error reading page %d for journal: %d\n", page_num, errno);
+			exit(EXIT_FAILURE);
+		}
+		record += record_size;
+	}
+	memcpy(journal, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE);
+	memcpy(journal + 8, &file_length, sizeof(uint32_t));
+	memcpy(journal + 12, &num_records, sizeof(uint32_t));
+	uint32_t checksum = journal_checksum(journal + JOURNAL_HEADER_SIZE, journal_size - JOURNAL_HEADER_SIZE);
+	memcpy(journal + 16, &checksum, sizeof(uint32_t));
+
+	int fd = open(journal_path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, S_IWUSR | S_IRUSR);
+	if (fd == -1) {
+		printf("Unable to create journal %s\n", journal_path);
+		exit(EXIT_FAILURE);
+	}
+	//the whole journal goes out in one write
+	if (pwrite(fd, journal, journal_size, 0) != (ssize_t)journal_size || fsync(fd) == -1) {
+		printf("Error writing journal: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	sync_parent_directory(journal_path);
+	free(journal);
+}
+
+void journal_delete(const char* journal_path) {
+	if (unlink(journal_path) == -1 && errno != ENOENT) {
+		printf("Error removing journal: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	sync_parent_directory(journal_path);
+}
+
+bool journal_recover(const char* journal_path, int db_fd, uint32_t page_size) {
+	int fd = open(journal_path, O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		//no journal, nothing to recover
+		return false;
+	}
+	struct stat journal_stat;
+	if (fstat(fd, &journal_stat) == -1 || journal_stat.st_size < JOURNAL_HEADER_SIZE) {
+		//never got as far as a full header, so the database was never touched
+		close(fd);
+		journal_delete(journal_path);
+		return false;
+	}
+	size_t journal_size = (size_t)journal_stat.st_size;
+	uint8_t* journal = malloc(journal_size);
+	ssize_t bytes_read = pread(fd, journal, journal_size, 0);
+	close(fd);
+
+	const size_t record_size = sizeof(uint32_t) + page_size;
+	uint32_t file_length, num_records, checksum;
+	memcpy(&file_length, journal + 8, sizeof(uint32_t));
+	memcpy(&num_records, journal + 12, sizeof(uint32_t));
+	memcpy(&checksum, journal + 16, sizeof(uint32_t));
+	bool valid = bytes_read == (ssize_t)journal_size
+		&& memcmp(journal, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) == 0
+		&& journal_size == JOURNAL_HEADER_SIZE + num_records * record_size
+		&& journal_checksum(journal + JOURNAL_HEADER_SIZE, journal_size - JOURNAL_HEADER_SIZE) == checksum;
+	if (!valid) {
+		//a torn journal means we crashed before writing any database pages, so there's nothing to undo
+		free(journal);
+		journal_delete(journal_path);
+		return false;
+	}
+
+	uint8_t* record = journal + JOURNAL_HEADER_SIZE;
+	for (uint32_t i = 0; i < num_records; i++) {
+		uint32_t page_num;
+		memcpy(&page_num, record, sizeof(uint32_t));
+		if (pwrite(db_fd, record + sizeof(uint32_t), page_size, (off_t)page_num * page_size) != (ssize_t)page_size) {
+			printf("Error restoring page %d from journal: %d\n", page_num, errno);
+			exit(EXIT_FAILURE);
+		}
+		record += record_size;
+	}
+	//drop anything the interrupted batch appended
+	if (ftruncate(db_fd, file_length) == -1 || fsync(db_fd) == -1) {
+		printf("Error restoring database from journal: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	free(journal);
+	journal_delete(journal_path);
+	return true;
+}
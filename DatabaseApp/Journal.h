@@ -0,0 +1,34 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+//The rollback journal is what makes writing a batch of pages atomic.
+//Before we overwrite any page in the database file, we copy what's on disk right now into <db>-journal and fsync it.
+//If we crash halfway through writing the pages, the next open finds the journal and copies the old pages back.
+//Once every page is written (and fsync'd), deleting the journal is the moment the batch becomes committed.
+
+/*Journal layout
+bytes 0-7: magic "DBJRNL01"
+8-11: length of the database file before the batch
+12-15: number of page records
+16-19: checksum of the page records (a torn journal fails this and is ignored)
+then for each record: 4 byte page number followed by the page as it was on disk (the database's page size worth of bytes)*/
+#define JOURNAL_MAGIC "DBJRNL01"
+#define JOURNAL_MAGIC_SIZE 8
+#define JOURNAL_HEADER_SIZE 20
+
+//Builds the journal path for a database file, caller frees it
+char* journal_path_for(const char* db_filename);
+//Saves the on-disk copies of the given pages (only the ones that exist in the file) to the journal and fsyncs it.
+void journal_write(const char* journal_path, int db_fd, uint32_t file_length, const uint32_t* page_nums, uint32_t count,
+	uint32_t page_size);
+//Removes the journal, committing the batch
+void journal_delete(const char* journal_path);
+//Plays back a journal left behind by a crash, returns true if it had to roll anything back
+bool journal_recover(const char* journal_path, int db_fd, uint32_t page_size);
+//FNV-1a, nothing fancy, we only need to notice a journal (or a change log record) that didn't finish writing
+uint32_t journal_checksum(const uint8_t* data, size_t length);
+
+#endif
@@ -1,48 +1,129 @@
 #include "MetaCommand.h"
+#include "Vacuum.h"
+#include "Stats.h"
+#include "Analyze.h"
+#include "Backup.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+//.btree and .constants take an optional table name, without one they show the default table.
+//Prints why and returns NULL if there's nothing to show.
+static Table* meta_command_table(InputBuffer* input_buffer, size_t command_length, Database* database) {
+	if (database == NULL) {
+		printf("No database file currently open.\n");
+		return NULL;
+	}
+	const char* name = input_buffer->buffer + command_length;
+	while (*name == ' ') {
+		name++;
+	}
+	Table* table = database_find_table(database, name);
+	if (table == NULL) {
+		printf("No such table '%s'.\n", name);
+	}
+	return table;
+}
+
 //Function for handling meta commands, right now this simple string comparison will work since we only have one command
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table) {
+MetaCommandResult do_meta_command(InputBuffer* input_buffer, Database* database) {
 	//In C, switching only works on stuff like int, enum, and chars, not strings, so we have to keep this as if else
 	if (strcmp(input_buffer->buffer, ".exit") == 0) {
 		//we're exiting, so free the buffer
 		close_input_buffer(input_buffer);
-		if (table != NULL) {
-			db_close(table);
+		if (database != NULL) {
+			db_close(database);
 		}
 		//You might want to make this a successful meta command
 		//Don't, because then the program will keep running
 		exit(EXIT_SUCCESS);
 	}
 	else if (strncmp(input_buffer->buffer, ".open ", 6) == 0) {
-		if (table != NULL) {
+		if (database != NULL) {
 			printf("Closing currently open database file...\n");
-			db_close(table);
-			table = NULL;
+			db_close(database);
+			database = NULL;
 		}
 		//HAve to handle opening in main 
 		return META_COMMAND_OPEN_SUCCESS;
 	}
 	else if (strcmp(input_buffer->buffer, ".close") == 0) {
-		if (table == NULL) {
+		if (database == NULL) {
 			printf("No database file currently open.\n");
 		}
 		else {
-			db_close(table);
-			table = NULL;
+			db_close(database);
+			database = NULL;
 			printf("Closed database.\n");
 		}
 		return META_COMMAND_CLOSE_SUCCESS;
 	}
-	else if (strcmp(input_buffer->buffer, ".constants") == 0) {
+	else if (strcmp(input_buffer->buffer, ".tables") == 0) {
+		if (database == NULL) {
+			printf("No database file currently open.\n");
+			return META_COMMAND_SUCCESS;
+		}
+		//The first one listed is the one statements use when they don't name a table
+		for (uint32_t i = 0; i < database->num_tables; i++) {
+			Schema* schema = &database->tables[i]->schema;
+			printf("%s (", schema->table_name);
+			for (uint32_t j = 0; j < schema->num_columns; j++) {
+				printf("%s%s", j > 0 ? ", " : "", schema->columns[j].name);
+			}
+			printf(")\n");
+		}
+		return META_COMMAND_SUCCESS;
+	}
+	else if (strncmp(input_buffer->buffer, ".constants", 10) == 0
+		&& (input_buffer->buffer[10] == '\0' || input_buffer->buffer[10] == ' ')) {
+		Table* table = meta_command_table(input_buffer, 10, database);
+		if (table == NULL) {
+			return META_COMMAND_SUCCESS;
+		}
 		printf("Constants:\n");
-		print_constants();
+		print_constants(table);
 		return META_COMMAND_SUCCESS;
 	}
-	else if (strcmp(input_buffer->buffer, ".btree") == 0) {
+	else if (strncmp(input_buffer->buffer, ".btree", 6) == 0
+		&& (input_buffer->buffer[6] == '\0' || input_buffer->buffer[6] == ' ')) {
+		Table* table = meta_command_table(input_buffer, 6, database);
+		if (table == NULL) {
+			return META_COMMAND_SUCCESS;
+		}
 		printf("Tree:\n");
-		print_tree(table->pager, 0, 0);
+		print_tree(table, table->root_page_num, 0);
+		return META_COMMAND_SUCCESS;
+	}
+	else if (strcmp(input_buffer->buffer, ".vacuum") == 0) {
+		if (database == NULL) {
+			printf("No database file currently open.\n");
+			return META_COMMAND_SUCCESS;
+		}
+		VacuumStats stats;
+		print_vacuum_result(stdout, database_vacuum(database, &stats), &stats);
+		return META_COMMAND_SUCCESS;
+	}
+	else if (strncmp(input_buffer->buffer, ".backup ", 8) == 0) {
+		if (database == NULL) {
+			printf("No database file currently open.\n");
+			return META_COMMAND_SUCCESS;
+		}
+		BackupStats stats;
+		print_backup_result(stdout, database_backup(database, input_buffer->buffer + 8, &stats), &stats);
+		return META_COMMAND_SUCCESS;
+	}
+	else if (strcmp(input_buffer->buffer, ".analyze") == 0) {
+		if (database == NULL) {
+			printf("No database file currently open.\n");
+			return META_COMMAND_SUCCESS;
+		}
+		FileAnalysis file;
+		database_analyze(database, &file);
+		print_analysis(stdout, database, &file);
+		return META_COMMAND_SUCCESS;
+	}
+	//.stats for people, .stats json for scripts. Works with no database open too, the counts are for the whole process.
+	else if (strcmp(input_buffer->buffer, ".stats") == 0 || strcmp(input_buffer->buffer, ".stats json") == 0) {
+		stats_print(stdout, database, input_buffer->buffer[6] != '\0');
 		return META_COMMAND_SUCCESS;
 	}
 	else {
@@ -9,6 +9,6 @@ typedef enum {
 	META_COMMAND_OPEN_SUCCESS
 } MetaCommandResult;
 
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table);
+MetaCommandResult do_meta_command(InputBuffer* input_buffer, Database* database);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,319 @@
+#include "ResultCache.h"
+#include "Journal.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct CacheEntry {
+	char* key;
+	uint32_t hash;
+	const Table* table;
+	uint64_t first;
+	uint64_t last;
+	char* output;
+	size_t length;
+	//what it counts against the budget
+	size_t size;
+	struct CacheEntry* bucket_next;
+	//the range index: level is entry_level's, chained in ranges[range_slot]
+	uint32_t level;
+	uint32_t range_slot;
+	struct CacheEntry* range_next;
+	//the LRU list, newest first
+	struct CacheEntry* newer;
+	struct CacheEntry* older;
+} CacheEntry;
+
+struct ResultCache {
+	//Selects on every server worker look things up at once, so everything's under this
+	pthread_mutex_t lock;
+	size_t budget;
+	size_t bytes;
+	uint64_t epoch;
+	CacheEntry* buckets[RESULT_CACHE_BUCKETS];
+	//Every entry again, hashed by its table and where its range starts (see entry_level), so an insert only looks at
+	//entries that could have its key
+	CacheEntry* ranges[RESULT_CACHE_BUCKETS];
+	//entries at each level, an insert skips the empty ones
+	uint32_t level_entries[RESULT_CACHE_LEVELS];
+	CacheEntry* newest;
+	CacheEntry* oldest;
+};
+
+ResultCache* result_cache_new(size_t budget) {
+#ifdef _WIN32
+	//no open_memstream to catch a select's output with
+	(void)budget;
+	return NULL;
+#else
+	if (budget == 0) {
+		return NULL;
+	}
+	ResultCache* cache = calloc(1, sizeof(ResultCache));
+	cache->budget = budget;
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+#endif
+}
+
+static void cache_entry_free(CacheEntry* entry) {
+	free(entry->key);
+	free(entry->output);
+	free(entry);
+}
+
+void result_cache_free(ResultCache* cache) {
+	if (cache == NULL) {
+		return;
+	}
+	CacheEntry* entry = cache->newest;
+	while (entry != NULL) {
+		CacheEntry* older = entry->older;
+		cache_entry_free(entry);
+		entry = older;
+	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+bool result_cache_key(const Statement* statement, const Table* table, char* key, uint64_t* first, uint64_t* last) {
+	if (table->text_keys || statement->where.num_terms > 0 || statement->select_kind == SELECT_ALL) {
+		return false;
+	}
+	int64_t from = statement->select_from;
+	int64_t to = statement->select_kind == SELECT_ONE ? from : statement->select_to;
+	//Errors and empty ranges cost nothing to work out again
+	if (from < 0 || to < from) {
+		return false;
+	}
+	int written = snprintf(key, RESULT_CACHE_KEY_SIZE, "%s %lld-%lld", table->schema.table_name, (long long)from, (long long)to);
+	for (uint32_t i = 0; i < statement->num_projected; i++) {
+		written += snprintf(key + written, RESULT_CACHE_KEY_SIZE - written, "%s%s", i == 0 ? " columns " : ",", statement->projected[i]);
+	}
+	if (statement->order_column[0] != '\0') {
+		written += snprintf(key + written, RESULT_CACHE_KEY_SIZE - written, " order %s%s", statement->order_column,
+			statement->order_descending ? " desc" : "");
+	}
+	snprintf(key + written, RESULT_CACHE_KEY_SIZE - written, " limit %llu", (unsigned long long)statement->limit);
+	*first = (uint64_t)from;
+	*last = (uint64_t)to;
+	return true;
+}
+
+static uint32_t cache_hash(const char* key) {
+	return journal_checksum((const uint8_t*)key, strlen(key));
+}
+
+//Level l cuts the ids up into blocks of 2^level_shift(l). The last one has a single block, ids never go past 2^63.
+static uint32_t level_shift(uint32_t level) {
+	return level + 1 < RESULT_CACHE_LEVELS ? level * RESULT_CACHE_LEVEL_BITS : 63;
+}
+
+//An entry goes in the lowest level where its range starts and ends in the same block or the next one. So one that
+//has key k started in block k's, or the one before it, and nowhere else at that level. Point selects are all level 0.
+static uint32_t entry_level(uint64_t first, uint64_t last) {
+	uint32_t level = 0;
+	while ((last >> level_shift(level)) - (first >> level_shift(level)) > 1) {
+		level++;
+	}
+	return level;
+}
+
+static uint32_t range_slot(const Table* table, uint32_t level, uint64_t block) {
+	//splitmix64's finalizer again, neighbouring blocks land in different slots
+	uint64_t hash = (uint64_t)(uintptr_t)table ^ ((uint64_t)level << 58) ^ block;
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+	hash ^= hash >> 31;
+	return (uint32_t)(hash % RESULT_CACHE_BUCKETS);
+}
+
+//Takes an entry out of the LRU list
+static void cache_unlink(ResultCache* cache, CacheEntry* entry) {
+	if (entry->newer != NULL) {
+		entry->newer->older = entry->older;
+	}
+	else {
+		cache->newest = entry->older;
+	}
+	if (entry->older != NULL) {
+		entry->older->newer = entry->newer;
+	}
+	else {
+		cache->oldest = entry->newer;
+	}
+}
+
+static void cache_push_newest(ResultCache* cache, CacheEntry* entry) {
+	entry->newer = NULL;
+	entry->older = cache->newest;
+	if (cache->newest != NULL) {
+		cache->newest->newer = entry;
+	}
+	else {
+		cache->oldest = entry;
+	}
+	cache->newest = entry;
+}
+
+//Drops an entry for good, from its bucket and the LRU list
+static void cache_remove(ResultCache* cache, CacheEntry* entry) {
+	CacheEntry** link = &cache->buckets[entry->hash % RESULT_CACHE_BUCKETS];
+	while (*link != entry) {
+		link = &(*link)->bucket_next;
+	}
+	*link = entry->bucket_next;
+	link = &cache->ranges[entry->range_slot];
+	while (*link != entry) {
+		link = &(*link)->range_next;
+	}
+	*link = entry->range_next;
+	cache->level_entries[entry->level]--;
+	cache_unlink(cache, entry);
+	cache->bytes -= entry->size;
+	cache_entry_free(entry);
+}
+
+static CacheEntry* cache_find(ResultCache* cache, const char* key, uint32_t hash) {
+	for (CacheEntry* entry = cache->buckets[hash % RESULT_CACHE_BUCKETS]; entry != NULL; entry = entry->bucket_next) {
+		if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+bool result_cache_lookup(ResultCache* cache, const char* key, FILE* out) {
+	uint32_t hash = cache_hash(key);
+	pthread_mutex_lock(&cache->lock);
+	CacheEntry* entry = cache_find(cache, key, hash);
+	if (entry != NULL) {
+		cache_unlink(cache, entry);
+		cache_push_newest(cache, entry);
+		//written while we still hold the lock, nothing can free it underneath us
+		fwrite(entry->output, 1, entry->length, out);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return entry != NULL;
+}
+
+uint64_t result_cache_epoch(ResultCache* cache) {
+	pthread_mutex_lock(&cache->lock);
+	uint64_t epoch = cache->epoch;
+	pthread_mutex_unlock(&cache->lock);
+	return epoch;
+}
+
+void result_cache_store(ResultCache* cache, const char* key, const Table* table, uint64_t first, uint64_t last,
+	const ResultCapture* capture, uint64_t epoch) {
+	size_t key_length = strlen(key);
+	size_t size = sizeof(CacheEntry) + key_length + 1 + capture->length;
+	if (capture->output == NULL || size > cache->budget) {
+		return;
+	}
+	uint32_t hash = cache_hash(key);
+	pthread_mutex_lock(&cache->lock);
+	//A write committed since the select started might be missing from its answer. Someone else asking the same
+	//thing at the same time might have stored it already.
+	if (cache->epoch != epoch || cache_find(cache, key, hash) != NULL) {
+		pthread_mutex_unlock(&cache->lock);
+		return;
+	}
+	while (cache->bytes + size > cache->budget) {
+		cache_remove(cache, cache->oldest);
+	}
+	CacheEntry* entry = malloc(sizeof(CacheEntry));
+	entry->key = malloc(key_length + 1);
+	memcpy(entry->key, key, key_length + 1);
+	entry->hash = hash;
+	entry->table = table;
+	entry->first = first;
+	entry->last = last;
+	entry->output = malloc(capture->length > 0 ? capture->length : 1);
+	memcpy(entry->output, capture->output, capture->length);
+	entry->length = capture->length;
+	entry->size = size;
+	CacheEntry** bucket = &cache->buckets[hash % RESULT_CACHE_BUCKETS];
+	entry->bucket_next = *bucket;
+	*bucket = entry;
+	entry->level = entry_level(first, last);
+	entry->range_slot = range_slot(table, entry->level, first >> level_shift(entry->level));
+	entry->range_next = cache->ranges[entry->range_slot];
+	cache->ranges[entry->range_slot] = entry;
+	cache->level_entries[entry->level]++;
+	cache_push_newest(cache, entry);
+	cache->bytes += size;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+//Drops table's entries in one slot of the range index whose range has k
+static void cache_invalidate_slot(ResultCache* cache, uint32_t slot, const Table* table, uint64_t k) {
+	CacheEntry* entry = cache->ranges[slot];
+	while (entry != NULL) {
+		CacheEntry* next = entry->range_next;
+		if (entry->table == table && entry->first <= k && k <= entry->last) {
+			cache_remove(cache, entry);
+		}
+		entry = next;
+	}
+}
+
+void result_cache_invalidate(ResultCache* cache, const Table* table, const Value* key) {
+	if (cache == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&cache->lock);
+	cache->epoch++;
+	//a varchar keyed table never has entries to drop
+	if (key->type != VALUE_TEXT) {
+		uint64_t k = (uint64_t)key->integer;
+		for (uint32_t level = 0; level < RESULT_CACHE_LEVELS; level++) {
+			if (cache->level_entries[level] == 0) {
+				continue;
+			}
+			uint64_t block = k >> level_shift(level);
+			cache_invalidate_slot(cache, range_slot(table, level, block), table, k);
+			if (block > 0) {
+				cache_invalidate_slot(cache, range_slot(table, level, block - 1), table, k);
+			}
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void result_cache_clear(ResultCache* cache) {
+	if (cache == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&cache->lock);
+	cache->epoch++;
+	while (cache->oldest != NULL) {
+		cache_remove(cache, cache->oldest);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void result_capture_begin(ResultCapture* capture) {
+	capture->output = NULL;
+	capture->length = 0;
+#ifndef _WIN32
+	capture->stream = open_memstream(&capture->output, &capture->length);
+#else
+	capture->stream = NULL;
+#endif
+}
+
+void result_capture_end(ResultCapture* capture, FILE* out) {
+	if (capture->stream == NULL) {
+		return;
+	}
+	fclose(capture->stream);
+	capture->stream = NULL;
+	if (capture->output != NULL) {
+		fwrite(capture->output, 1, capture->length, out);
+	}
+}
+
+void result_capture_free(ResultCapture* capture) {
+	free(capture->output);
+	capture->output = NULL;
+}
@@ -0,0 +1,68 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "Statement.h"
+
+//The result cache: what select id and select id-id printed, kept per database so asking the same thing again writes
+//the same bytes straight back out, without a page read or a row formatted. Statements are keyed the same way however
+//they were typed: the table by its name (so select 5 and select from users 5 are the same one), the ids, and the
+//column list, order by and limit, which only ever pick from the rows in the range.
+//
+//Every entry remembers the range of keys it covers. An insert outside of a transaction drops the entries whose range
+//has its key once it's committed, and a commit drops everything (a transaction can insert anywhere, and keeping
+//track of where isn't worth it for something this cheap to fill back up). A select that was already running when
+//something got dropped doesn't get to store its answer, it might be from before the write.
+//The least recently used entries go first once the cache is over its budget.
+//
+//Only text output gets cached: not the binary protocol, whose rows never get formatted in the first place, not
+//selects with a where clause or on a varchar key, and not inside a transaction, which has to see its own inserts.
+
+//Bytes the cache holds before it starts throwing entries out, DB_RESULT_CACHE=bytes at open changes it (0 turns it off)
+#ifndef RESULT_CACHE_BYTES
+#define RESULT_CACHE_BYTES (4 * 1024 * 1024)
+#endif
+//Buckets in the hash table over the keys
+#ifndef RESULT_CACHE_BUCKETS
+#define RESULT_CACHE_BUCKETS 4096
+#endif
+//Entries are also indexed by the range of ids they cover, so an insert finds the ones with its key without looking at
+//the rest. Level l of that index groups ranges by blocks of 2^(l * RESULT_CACHE_LEVEL_BITS) ids.
+#define RESULT_CACHE_LEVEL_BITS 4
+#define RESULT_CACHE_LEVELS 17
+//Longest key a statement can have: the table's name, every column's, the order by column's and the numbers
+#define RESULT_CACHE_KEY_SIZE ((SCHEMA_MAX_COLUMNS + 2) * (SCHEMA_NAME_SIZE + 1) + 96)
+
+//Catches what a select prints, so it can be stored and still go out to whoever asked
+typedef struct {
+	FILE* stream;
+	char* output;
+	size_t length;
+} ResultCapture;
+
+//NULL with a budget of 0 (or where there's no open_memstream to catch output with)
+ResultCache* result_cache_new(size_t budget);
+void result_cache_free(ResultCache* cache);
+//Writes the statement's key into key (RESULT_CACHE_KEY_SIZE bytes) and the range of ids it reads into first and last.
+//False if it's not a statement the cache takes.
+bool result_cache_key(const Statement* statement, const Table* table, char* key, uint64_t* first, uint64_t* last);
+//Writes the cached answer to out, false if there isn't one
+bool result_cache_lookup(ResultCache* cache, const char* key, FILE* out);
+//How far writes have got, read before the select starts, a store only goes in if it hasn't moved since
+uint64_t result_cache_epoch(ResultCache* cache);
+void result_cache_store(ResultCache* cache, const char* key, const Table* table, uint64_t first, uint64_t last,
+	const ResultCapture* capture, uint64_t epoch);
+//A committed insert of key into table. These two do nothing with a NULL cache.
+void result_cache_invalidate(ResultCache* cache, const Table* table, const Value* key);
+//A commit
+void result_cache_clear(ResultCache* cache);
+
+//Starts catching output into capture->stream
+void result_capture_begin(ResultCapture* capture);
+//Stops, and copies what was caught to out. What's caught stays for storing until result_capture_free.
+void result_capture_end(ResultCapture* capture, FILE* out);
+void result_capture_free(ResultCapture* capture);
+
+#endif
@@ -0,0 +1,403 @@
+#include "Schema.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+void schema_init(Schema* schema, const char* table_name) {
+	memset(schema, 0, sizeof(Schema));
+	strncpy(schema->table_name, table_name, SCHEMA_NAME_SIZE);
+}
+
+SchemaResult schema_add_column(Schema* schema, const char* name, ColumnType type, uint32_t max_length) {
+	if (schema->num_columns >= SCHEMA_MAX_COLUMNS) {
+		return SCHEMA_TOO_MANY_COLUMNS;
+	}
+	for (uint32_t i = 0; i < schema->num_columns; i++) {
+		if (strcmp(schema->columns[i].name, name) == 0) {
+			return SCHEMA_DUPLICATE_COLUMN;
+		}
+	}
+	Column* column = &schema->columns[schema->num_columns++];
+	memset(column, 0, sizeof(Column));
+	strncpy(column->name, name, SCHEMA_NAME_SIZE);
+	column->type = type;
+	column->max_length = type == COLUMN_VARCHAR ? max_length : 0;
+	return SCHEMA_OK;
+}
+
+static bool value_fits_int32(const Value* value) {
+	return value->type == VALUE_INTEGER && value->integer >= INT32_MIN && value->integer <= INT32_MAX;
+}
+
+//The general case, one switch per column
+static SchemaResult serialize_generic(const Schema* schema, const Value* values, void* destination) {
+	for (uint32_t i = 0; i < schema->num_columns; i++) {
+		const Column* column = &schema->columns[i];
+		const Value* value = &values[i];
+		char* slot = (char*)destination + column->offset;
+		switch (column->type) {
+		case(COLUMN_INT32): {
+			if (!value_fits_int32(value)) {
+				return SCHEMA_TYPE_MISMATCH;
+			}
+			int32_t number = (int32_t)value->integer;
+			memcpy(slot, &number, sizeof(number));
+			break;
+		}
+		case(COLUMN_INT64):
+			if (value->type != VALUE_INTEGER) {
+				return SCHEMA_TYPE_MISMATCH;
+			}
+			memcpy(slot, &value->integer, sizeof(int64_t));
+			break;
+		case(COLUMN_DOUBLE): {
+			if (value->type == VALUE_TEXT) {
+				return SCHEMA_TYPE_MISMATCH;
+			}
+			double number = value->type == VALUE_REAL ? value->real : (double)value->integer;
+			memcpy(slot, &number, sizeof(number));
+			break;
+		}
+		case(COLUMN_VARCHAR):
+			if (value->text == NULL) {
+				return SCHEMA_TYPE_MISMATCH;
+			}
+			if (value->length > column->max_length) {
+				return SCHEMA_STRING_TOO_LONG;
+			}
+			memcpy(slot, value->text, value->length);
+			//zero the rest of the slot so nothing stale ends up in the file
+			memset(slot + value->length, 0, column->size - value->length);
+			break;
+		}
+	}
+	return SCHEMA_OK;
+}
+
+static void deserialize_generic(const Schema* schema, const void* source, Value* destination) {
+	for (uint32_t i = 0; i < schema->num_columns; i++) {
+		const Column* column = &schema->columns[i];
+		const char* slot = (const char*)source + column->offset;
+		Value* value = &destination[i];
+		value->text = NULL;
+		value->length = 0;
+		switch (column->type) {
+		case(COLUMN_INT32): {
+			int32_t number;
+			memcpy(&number, slot, sizeof(number));
+			value->type = VALUE_INTEGER;
+			value->integer = number;
+			break;
+		}
+		case(COLUMN_INT64):
+			value->type = VALUE_INTEGER;
+			memcpy(&value->integer, slot, sizeof(int64_t));
+			break;
+		case(COLUMN_DOUBLE):
+			value->type = VALUE_REAL;
+			memcpy(&value->real, slot, sizeof(double));
+			break;
+		case(COLUMN_VARCHAR):
+			value->type = VALUE_TEXT;
+			value->text = slot;
+			value->length = (uint32_t)strnlen(slot, column->size);
+			break;
+		}
+	}
+}
+
+//Fixed width fast path. Every column is a number at a known offset, so instead of switching on each column
+//we run through the int32s, then the int64s, then the doubles, each loop just a check and a copy.
+static SchemaResult serialize_fixed(const Schema* schema, const Value* values, void* destination) {
+	char* row = destination;
+	for (uint32_t i = 0; i < schema->num_int32; i++) {
+		const Column* column = &schema->columns[schema->int32_columns[i]];
+		const Value* value = &values[schema->int32_columns[i]];
+		if (!value_fits_int32(value)) {
+			return SCHEMA_TYPE_MISMATCH;
+		}
+		int32_t number = (int32_t)value->integer;
+		memcpy(row + column->offset, &number, sizeof(number));
+	}
+	for (uint32_t i = 0; i < schema->num_int64; i++) {
+		const Value* value = &values[schema->int64_columns[i]];
+		if (value->type != VALUE_INTEGER) {
+			return SCHEMA_TYPE_MISMATCH;
+		}
+		memcpy(row + schema->columns[schema->int64_columns[i]].offset, &value->integer, sizeof(int64_t));
+	}
+	for (uint32_t i = 0; i < schema->num_double; i++) {
+		const Value* value = &values[schema->double_columns[i]];
+		if (value->type == VALUE_TEXT) {
+			return SCHEMA_TYPE_MISMATCH;
+		}
+		double number = value->type == VALUE_REAL ? value->real : (double)value->integer;
+		memcpy(row + schema->columns[schema->double_columns[i]].offset, &number, sizeof(number));
+	}
+	return SCHEMA_OK;
+}
+
+static void deserialize_fixed(const Schema* schema, const void* source, Value* destination) {
+	const char* row = source;
+	for (uint32_t i = 0; i < schema->num_int32; i++) {
+		Value* value = &destination[schema->int32_columns[i]];
+		int32_t number;
+		memcpy(&number, row + schema->columns[schema->int32_columns[i]].offset, sizeof(number));
+		value->type = VALUE_INTEGER;
+		value->integer = number;
+		value->text = NULL;
+	}
+	for (uint32_t i = 0; i < schema->num_int64; i++) {
+		Value* value = &destination[schema->int64_columns[i]];
+		memcpy(&value->integer, row + schema->columns[schema->int64_columns[i]].offset, sizeof(int64_t));
+		value->type = VALUE_INTEGER;
+		value->text = NULL;
+	}
+	for (uint32_t i = 0; i < schema->num_double; i++) {
+		Value* value = &destination[schema->double_columns[i]];
+		memcpy(&value->real, row + schema->columns[schema->double_columns[i]].offset, sizeof(double));
+		value->type = VALUE_REAL;
+		value->text = NULL;
+	}
+}
+
+//Offsets, row size and the serialize/deserialize routines, everything compile does besides checking the key
+static SchemaResult schema_layout(Schema* schema) {
+	uint32_t offset = 0;
+	schema->fixed_width = true;
+	schema->num_int32 = 0;
+	schema->num_int64 = 0;
+	schema->num_double = 0;
+	for (uint32_t i = 0; i < schema->num_columns; i++) {
+		Column* column = &schema->columns[i];
+		column->offset = offset;
+		switch (column->type) {
+		case(COLUMN_INT32):
+			column->size = sizeof(int32_t);
+			schema->int32_columns[schema->num_int32++] = (uint8_t)i;
+			break;
+		case(COLUMN_INT64):
+			column->size = sizeof(int64_t);
+			schema->int64_columns[schema->num_int64++] = (uint8_t)i;
+			break;
+		case(COLUMN_DOUBLE):
+			column->size = sizeof(double);
+			schema->double_columns[schema->num_double++] = (uint8_t)i;
+			break;
+		case(COLUMN_VARCHAR):
+			column->size = column->max_length + 1;
+			schema->fixed_width = false;
+			break;
+		}
+		offset += column->size;
+		if (offset > SCHEMA_MAX_ROW_SIZE) {
+			return SCHEMA_ROW_TOO_BIG;
+		}
+	}
+	schema->row_size = offset;
+	schema->serialize = schema->fixed_width ? serialize_fixed : serialize_generic;
+	schema->deserialize = schema->fixed_width ? deserialize_fixed : deserialize_generic;
+	return SCHEMA_OK;
+}
+
+SchemaResult schema_compile(Schema* schema) {
+	//the first column is the B-tree key: a 32 or 64 bit integer, or a string short enough for internal nodes to hold
+	if (schema->num_columns == 0 || schema->columns[0].type == COLUMN_DOUBLE
+		|| (schema->columns[0].type == COLUMN_VARCHAR && schema->columns[0].max_length > SCHEMA_MAX_KEY_LENGTH)) {
+		return SCHEMA_BAD_KEY_COLUMN;
+	}
+	return schema_layout(schema);
+}
+
+int32_t schema_find_column(const Schema* schema, const char* name) {
+	for (uint32_t i = 0; i < schema->num_columns; i++) {
+		if (strcmp(schema->columns[i].name, name) == 0) {
+			return (int32_t)i;
+		}
+	}
+	return -1;
+}
+
+void schema_project(const Schema* from, const uint8_t* columns, uint32_t num_columns, Schema* to) {
+	schema_init(to, from->table_name);
+	for (uint32_t i = 0; i < num_columns; i++) {
+		to->columns[i] = from->columns[columns[i]];
+	}
+	to->num_columns = num_columns;
+	//can't be bigger than the row it came from, so this always fits
+	schema_layout(to);
+}
+
+void schema_project_row(const Schema* from, const Schema* to, const uint8_t* columns, const void* row, void* destination) {
+	for (uint32_t i = 0; i < to->num_columns; i++) {
+		const Column* column = &from->columns[columns[i]];
+		memcpy((char*)destination + to->columns[i].offset, (const char*)row + column->offset, column->size);
+	}
+}
+
+void schema_default(Schema* schema) {
+	schema_init(schema, "users");
+	schema_add_column(schema, "id", COLUMN_INT32, 0);
+	schema_add_column(schema, "username", COLUMN_VARCHAR, 32);
+	schema_add_column(schema, "email", COLUMN_VARCHAR, 255);
+	schema_compile(schema);
+}
+
+SchemaResult schema_serialize(const Schema* schema, const Value* values, uint32_t num_values, void* destination) {
+	if (num_values != schema->num_columns) {
+		return SCHEMA_WRONG_VALUE_COUNT;
+	}
+	if (schema->columns[0].type != COLUMN_VARCHAR && values[0].type == VALUE_INTEGER && values[0].integer < 0) {
+		return SCHEMA_NEGATIVE_KEY;
+	}
+	return schema->serialize(schema, values, destination);
+}
+
+int schema_compare_values(ColumnType type, uint32_t size, const void* a, const void* b) {
+	switch (type) {
+	case(COLUMN_INT32): {
+		int32_t x, y;
+		memcpy(&x, a, sizeof(x));
+		memcpy(&y, b, sizeof(y));
+		return (x > y) - (x < y);
+	}
+	case(COLUMN_INT64): {
+		int64_t x, y;
+		memcpy(&x, a, sizeof(x));
+		memcpy(&y, b, sizeof(y));
+		return (x > y) - (x < y);
+	}
+	case(COLUMN_DOUBLE): {
+		double x, y;
+		memcpy(&x, a, sizeof(x));
+		memcpy(&y, b, sizeof(y));
+		return (x > y) - (x < y);
+	}
+	case(COLUMN_VARCHAR): {
+		size_t x_length = strnlen((const char*)a, size);
+		size_t y_length = strnlen((const char*)b, size);
+		int compared = memcmp(a, b, x_length < y_length ? x_length : y_length);
+		return compared != 0 ? compared : (x_length > y_length) - (x_length < y_length);
+	}
+	}
+	return 0;
+}
+
+void schema_print_row(FILE* out, const Schema* schema, const void* row) {
+	Value values[SCHEMA_MAX_COLUMNS];
+	schema->deserialize(schema, row, values);
+	fputc('(', out);
+	for (uint32_t i = 0; i < schema->num_columns; i++) {
+		if (i > 0) {
+			fputs(", ", out);
+		}
+		switch (values[i].type) {
+		case(VALUE_INTEGER):
+			fprintf(out, "%lld", (long long)values[i].integer);
+			break;
+		case(VALUE_REAL):
+			fprintf(out, "%g", values[i].real);
+			break;
+		case(VALUE_TEXT):
+			fprintf(out, "%.*s", (int)values[i].length, values[i].text);
+			break;
+		}
+	}
+	fputs(")\n", out);
+}
+
+bool schema_parse_type(const char* text, ColumnType* type, uint32_t* max_length) {
+	*max_length = 0;
+	if (strcmp(text, "int32") == 0 || strcmp(text, "int") == 0) {
+		*type = COLUMN_INT32;
+		return true;
+	}
+	if (strcmp(text, "int64") == 0 || strcmp(text, "bigint") == 0) {
+		*type = COLUMN_INT64;
+		return true;
+	}
+	if (strcmp(text, "double") == 0) {
+		*type = COLUMN_DOUBLE;
+		return true;
+	}
+	if (strncmp(text, "varchar(", 8) == 0) {
+		char* end;
+		long length = strtol(text + 8, &end, 10);
+		if (end == text + 8 || strcmp(end, ")") != 0 || length <= 0 || length >= SCHEMA_MAX_ROW_SIZE) {
+			return false;
+		}
+		*type = COLUMN_VARCHAR;
+		*max_length = (uint32_t)length;
+		return true;
+	}
+	return false;
+}
+
+Value value_parse(const char* token) {
+	Value value;
+	value.text = token;
+	value.length = (uint32_t)strlen(token);
+	value.integer = 0;
+	value.real = 0;
+	char* end;
+	errno = 0;
+	long long integer = strtoll(token, &end, 10);
+	if (value.length > 0 && *end == '\0' && errno == 0) {
+		value.type = VALUE_INTEGER;
+		value.integer = integer;
+		value.real = (double)integer;
+		return value;
+	}
+	double real = strtod(token, &end);
+	if (value.length > 0 && *end == '\0') {
+		value.type = VALUE_REAL;
+		value.real = real;
+		return value;
+	}
+	value.type = VALUE_TEXT;
+	return value;
+}
+
+//Encoded layout: table name, column count, then every column slot (used or not) as name, type, max_length
+#define ENCODED_COLUMN_SIZE (SCHEMA_NAME_SIZE + 1 + sizeof(uint8_t) + sizeof(uint32_t))
+#define ENCODED_COLUMNS_OFFSET (SCHEMA_NAME_SIZE + 1 + sizeof(uint32_t))
+
+void schema_encode(const Schema* schema, void* destination) {
+	char* out = destination;
+	memset(out, 0, SCHEMA_ENCODED_SIZE);
+	memcpy(out, schema->table_name, SCHEMA_NAME_SIZE + 1);
+	memcpy(out + SCHEMA_NAME_SIZE + 1, &schema->num_columns, sizeof(uint32_t));
+	for (uint32_t i = 0; i < schema->num_columns; i++) {
+		char* slot = out + ENCODED_COLUMNS_OFFSET + i * ENCODED_COLUMN_SIZE;
+		uint8_t type = (uint8_t)schema->columns[i].type;
+		memcpy(slot, schema->columns[i].name, SCHEMA_NAME_SIZE + 1);
+		memcpy(slot + SCHEMA_NAME_SIZE + 1, &type, sizeof(uint8_t));
+		memcpy(slot + SCHEMA_NAME_SIZE + 2, &schema->columns[i].max_length, sizeof(uint32_t));
+	}
+}
+
+bool schema_decode(Schema* schema, const void* source) {
+	const char* in = source;
+	char name[SCHEMA_NAME_SIZE + 1];
+	memcpy(name, in, SCHEMA_NAME_SIZE + 1);
+	name[SCHEMA_NAME_SIZE] = '\0';
+	schema_init(schema, name);
+	uint32_t num_columns;
+	memcpy(&num_columns, in + SCHEMA_NAME_SIZE + 1, sizeof(uint32_t));
+	if (num_columns == 0 || num_columns > SCHEMA_MAX_COLUMNS) {
+		return false;
+	}
+	for (uint32_t i = 0; i < num_columns; i++) {
+		const char* slot = in + ENCODED_COLUMNS_OFFSET + i * ENCODED_COLUMN_SIZE;
+		uint8_t type;
+		uint32_t max_length;
+		memcpy(name, slot, SCHEMA_NAME_SIZE + 1);
+		name[SCHEMA_NAME_SIZE] = '\0';
+		memcpy(&type, slot + SCHEMA_NAME_SIZE + 1, sizeof(uint8_t));
+		memcpy(&max_length, slot + SCHEMA_NAME_SIZE + 2, sizeof(uint32_t));
+		if (type > COLUMN_VARCHAR || schema_add_column(schema, name, (ColumnType)type, max_length) != SCHEMA_OK) {
+			return false;
+		}
+	}
+	return schema_compile(schema) == SCHEMA_OK;
+}
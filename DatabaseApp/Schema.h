@@ -0,0 +1,124 @@
+#ifndef SCHEMA_H
+#define SCHEMA_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+//A table's column layout. Used to be the hard coded Row struct, now create table builds one of these and
+//the serialize/deserialize routines get picked to suit it.
+//
+//Rows are still fixed size (leaf cells are), so a varchar(N) takes a N+1 byte null terminated slot no matter
+//what's in it. The first column doubles as the B-tree key: an int32, an int64, or a varchar of up to
+//SCHEMA_MAX_KEY_LENGTH characters.
+
+#define SCHEMA_MAX_COLUMNS 32
+#define SCHEMA_NAME_SIZE 32
+//A leaf has to hold at least two rows or splitting stops making sense
+#define SCHEMA_MAX_ROW_SIZE 2000
+//Longest varchar that can be a key. Internal nodes hold whole keys, this keeps at least a dozen of them to a page.
+#define SCHEMA_MAX_KEY_LENGTH 255
+
+typedef enum { COLUMN_INT32, COLUMN_INT64, COLUMN_DOUBLE, COLUMN_VARCHAR } ColumnType;
+
+typedef struct {
+	//include +1 for null character
+	char name[SCHEMA_NAME_SIZE + 1];
+	ColumnType type;
+	//varchar only, longest string the column takes
+	uint32_t max_length;
+	//where the column sits in a serialized row and how many bytes it takes, filled in by schema_compile
+	uint32_t offset;
+	uint32_t size;
+} Column;
+
+typedef enum { VALUE_INTEGER, VALUE_REAL, VALUE_TEXT } ValueType;
+
+//One column's worth of data outside of a row. Statements parse into these and rows deserialize into them.
+//Values parsed from a statement always keep their text, so "42" can still go into a varchar column.
+//Deserialized varchars point straight into the row.
+typedef struct {
+	ValueType type;
+	int64_t integer;
+	double real;
+	const char* text;
+	uint32_t length;
+} Value;
+
+typedef enum {
+	SCHEMA_OK,
+	SCHEMA_WRONG_VALUE_COUNT,
+	SCHEMA_TYPE_MISMATCH,
+	SCHEMA_STRING_TOO_LONG,
+	SCHEMA_NEGATIVE_KEY,
+	//a where clause or column list named a column the table doesn't have
+	SCHEMA_NO_SUCH_COLUMN,
+	//the rest are for building schemas
+	SCHEMA_TOO_MANY_COLUMNS,
+	SCHEMA_DUPLICATE_COLUMN,
+	SCHEMA_BAD_KEY_COLUMN,
+	SCHEMA_ROW_TOO_BIG
+} SchemaResult;
+
+typedef struct Schema Schema;
+//values must have one entry per column, and the row must have row_size bytes of room
+typedef SchemaResult (*RowSerializer)(const Schema* schema, const Value* values, void* destination);
+typedef void (*RowDeserializer)(const Schema* schema, const void* source, Value* destination);
+
+struct Schema {
+	char table_name[SCHEMA_NAME_SIZE + 1];
+	uint32_t num_columns;
+	Column columns[SCHEMA_MAX_COLUMNS];
+	uint32_t row_size;
+	//No varchars, every column is a number at a fixed offset
+	bool fixed_width;
+	//Chosen by schema_compile, fixed width schemas get the fast versions
+	RowSerializer serialize;
+	RowDeserializer deserialize;
+	//Fast path bookkeeping: column indexes grouped by type, so the fixed width routines run one tight loop
+	//per type instead of switching on every column
+	uint32_t num_int32;
+	uint32_t num_int64;
+	uint32_t num_double;
+	uint8_t int32_columns[SCHEMA_MAX_COLUMNS];
+	uint8_t int64_columns[SCHEMA_MAX_COLUMNS];
+	uint8_t double_columns[SCHEMA_MAX_COLUMNS];
+};
+
+//Bytes schema_encode writes (and schema_decode reads)
+#define SCHEMA_ENCODED_SIZE (SCHEMA_NAME_SIZE + 1 + sizeof(uint32_t) + SCHEMA_MAX_COLUMNS * (SCHEMA_NAME_SIZE + 1 + sizeof(uint8_t) + sizeof(uint32_t)))
+
+//Starts an empty schema for table_name
+void schema_init(Schema* schema, const char* table_name);
+//Adds a column to the end. max_length only matters for varchar.
+SchemaResult schema_add_column(Schema* schema, const char* name, ColumnType type, uint32_t max_length);
+//Works out offsets and the row size, and picks the serialize/deserialize routines. Call after the last add_column.
+SchemaResult schema_compile(Schema* schema);
+//The table every database had before create table existed: users (id int32, username varchar(32), email varchar(255)).
+//Lays rows out exactly like the old Row struct did, so old files open unchanged.
+void schema_default(Schema* schema);
+
+//Index of the column called name, -1 if there isn't one
+int32_t schema_find_column(const Schema* schema, const char* name);
+//Lays out a row made of just some of from's columns (select a, b), in the order given. No key rules, it's never stored.
+void schema_project(const Schema* from, const uint8_t* columns, uint32_t num_columns, Schema* to);
+//Copies the projected columns out of a whole row of from into a row laid out by to
+void schema_project_row(const Schema* from, const Schema* to, const uint8_t* columns, const void* row, void* destination);
+
+//Checks values against the columns and packs them into a row
+SchemaResult schema_serialize(const Schema* schema, const Value* values, uint32_t num_values, void* destination);
+//Orders two values of a column's type (its size bytes, the same format as inside a row) like the B-tree orders keys,
+//varchars byte by byte. Negative, 0 or positive like memcmp.
+int schema_compare_values(ColumnType type, uint32_t size, const void* a, const void* b);
+//Prints a row the way the REPL always has: (1, name, email)
+void schema_print_row(FILE* out, const Schema* schema, const void* row);
+//Parses a column type as written in create table (int32, int64, double, varchar(N)), false if it isn't one
+bool schema_parse_type(const char* text, ColumnType* type, uint32_t* max_length);
+//Reads one token from a statement as a value. Numbers come back as numbers, anything else as text.
+Value value_parse(const char* token);
+
+//Schemas are saved in the database file in this fixed size form
+void schema_encode(const Schema* schema, void* destination);
+//Returns false if what's there doesn't make a valid schema
+bool schema_decode(Schema* schema, const void* source);
+
+#endif
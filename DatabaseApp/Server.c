@@ -0,0 +1,1037 @@
+#ifdef __linux__
+//open_memstream and accept4
+#define _GNU_SOURCE
+#include "Server.h"
+#include "Statement.h"
+#include "Vacuum.h"
+#include "Backup.h"
+#include "ChangeLog.h"
+#include "Shard.h"
+#include "Follower.h"
+#include "Stats.h"
+#include "WireProtocol.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SERVER_MAX_EVENTS 64
+
+//One line (or binary frame) from a client, waiting its turn to run
+typedef struct Line {
+	char* text;
+	size_t length;
+	struct Line* next;
+} Line;
+
+//A connection speaks text until it opens with WIRE_MAGIC
+typedef enum { CONNECTION_UNDECIDED, CONNECTION_TEXT, CONNECTION_BINARY } ConnectionMode;
+
+//Where a '?' goes: an insert value (its column index, 0 and up), one end of a select's range, its limit, or the value
+//of a where clause's term (PARAM_WHERE_VALUE for the first term, one less for each one after it)
+#define PARAM_SELECT_FROM -1
+#define PARAM_SELECT_TO -2
+#define PARAM_LIMIT -3
+#define PARAM_WHERE_VALUE -4
+
+//A statement parsed once with its parameters left blank, executed as many times as the client likes
+typedef struct {
+	bool in_use;
+	Statement statement;
+	//the statement's own text, its insert values point into this
+	char* text;
+	uint8_t num_params;
+	int16_t slots[WIRE_MAX_PARAMS];
+} PreparedStatement;
+
+typedef struct Connection {
+	int fd;
+	Session session;
+	//bytes read that don't make a full line yet
+	char* in;
+	size_t in_length;
+	size_t in_capacity;
+	//lines that have arrived but haven't been handed to a worker
+	Line* queued_head;
+	Line* queued_tail;
+	//responses waiting to go back out the socket
+	char* out;
+	size_t out_length;
+	size_t out_sent;
+	//a worker is running this connection's lines right now, only one at a time so answers stay in order
+	bool busy;
+	//the client hung up (or misbehaved), free it once the worker is done with it
+	bool closing;
+	//we asked epoll to tell us when the socket can take more output
+	bool want_write;
+	ConnectionMode mode;
+	//binary mode only, indexed by statement id. Only the worker running this connection's job touches these.
+	PreparedStatement* prepared;
+	uint32_t num_prepared;
+	uint32_t rows_sent;
+} Connection;
+
+//A batch of lines from one connection for a worker to run back to back
+typedef struct Job {
+	Connection* connection;
+	Line* lines;
+	char* output;
+	size_t output_length;
+	struct Job* next;
+} Job;
+
+typedef struct {
+	Database* database;
+	int epoll_fd;
+	int listen_fd;
+	//workers poke this eventfd when they've finished a job
+	int wake_fd;
+	int signal_fd;
+	pthread_t* workers;
+	uint32_t num_workers;
+	//guards the job and done queues
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready;
+	Job* jobs_head;
+	Job* jobs_tail;
+	Job* done_head;
+	Job* done_tail;
+	bool stopping;
+	//Only one statement that writes runs at a time. A connection that says begin keeps the write side
+	//to itself until it commits or rolls back, everyone else's writes get told the database is busy.
+	//Reads never take this, they run off snapshots.
+	pthread_mutex_t write_lock;
+	Connection* transaction_owner;
+	//A sharded database's inserts outside of a transaction only hold the write lock long enough to be counted here,
+	//then run side by side (each shard has its own lock). Anything else that writes waits for the count to drain.
+	uint32_t shard_writers;
+	pthread_cond_t shard_writers_done;
+	//Following another database (--follow): the follower thread is the only writer, clients just read.
+	//It waits on follow_wake (under lock) between polls so stopping doesn't have to wait out the poll interval.
+	Follower* follower;
+	pthread_t follow_thread;
+	pthread_cond_t follow_wake;
+} Server;
+
+static void job_push(Job** head, Job** tail, Job* job) {
+	job->next = NULL;
+	if (*tail) {
+		(*tail)->next = job;
+	}
+	else {
+		*head = job;
+	}
+	*tail = job;
+}
+static Job* job_pop(Job** head, Job** tail) {
+	Job* job = *head;
+	if (job) {
+		*head = job->next;
+		if (*head == NULL) {
+			*tail = NULL;
+		}
+	}
+	return job;
+}
+
+static void free_lines(Line* line) {
+	while (line) {
+		Line* next = line->next;
+		free(line->text);
+		free(line);
+		line = next;
+	}
+}
+
+//Takes the write lock for a write that needs the whole database to itself, once any sharded inserts have finished
+static void server_lock_writes(Server* server) {
+	pthread_mutex_lock(&server->write_lock);
+	while (server->shard_writers > 0) {
+		pthread_cond_wait(&server->shard_writers_done, &server->write_lock);
+	}
+}
+
+//An insert outside of a transaction on a sharded database: it only needs its shard, so it doesn't keep the write lock
+static ExecuteResult server_execute_shard_insert(Server* server, Connection* connection, Statement* statement) {
+	pthread_mutex_lock(&server->write_lock);
+	bool busy = server->transaction_owner != NULL;
+	server->shard_writers += !busy;
+	pthread_mutex_unlock(&server->write_lock);
+	if (busy) {
+		return EXECUTE_BUSY;
+	}
+	ExecuteResult result = execute_statement(statement, &connection->session);
+	pthread_mutex_lock(&server->write_lock);
+	if (--server->shard_writers == 0) {
+		pthread_cond_broadcast(&server->shard_writers_done);
+	}
+	pthread_mutex_unlock(&server->write_lock);
+	return result;
+}
+
+//Runs a prepared statement for a connection. Reads go straight through on their own snapshot,
+//writes queue up on the write lock and bounce off anyone else's open transaction.
+static ExecuteResult server_execute(Server* server, Connection* connection, Statement* statement) {
+	Session* session = &connection->session;
+	if (statement->type == STATEMENT_SELECT) {
+		return execute_statement(statement, session);
+	}
+	//A write here would be one the database we follow doesn't have
+	if (server->follower != NULL) {
+		return EXECUTE_READ_ONLY;
+	}
+	if (statement->type == STATEMENT_INSERT && session->database->shards != NULL && !session->in_transaction) {
+		return server_execute_shard_insert(server, connection, statement);
+	}
+	ExecuteResult result;
+	server_lock_writes(server);
+	if (server->transaction_owner != NULL && server->transaction_owner != connection) {
+		result = EXECUTE_BUSY;
+	}
+	else {
+		result = execute_statement(statement, session);
+		server->transaction_owner = session->in_transaction ? connection : NULL;
+	}
+	pthread_mutex_unlock(&server->write_lock);
+	return result;
+}
+
+//.vacuum is the one meta command a connection gets. It's a write as far as everyone else is concerned,
+//reads keep going on their snapshots while the new file gets built.
+static void server_vacuum(Server* server, Connection* connection) {
+	Session* session = &connection->session;
+	VacuumStats stats;
+	server_lock_writes(server);
+	VacuumResult result = server->transaction_owner != NULL ? (server->transaction_owner == connection
+		? VACUUM_IN_TRANSACTION : VACUUM_BUSY) : database_vacuum(session->database, &stats);
+	pthread_mutex_unlock(&server->write_lock);
+	print_vacuum_result(session->out, result, &stats);
+}
+
+//Runs one line exactly like the REPL would, with the output going to the connection's stream
+static void server_run_line(Server* server, Connection* connection, char* text) {
+	Session* session = &connection->session;
+	size_t length = strlen(text);
+	InputBuffer input_buffer = { text, length + 1, (ssize_t)length };
+	if (strcmp(text, ".vacuum") == 0) {
+		server_vacuum(server, connection);
+		return;
+	}
+	//Reading the counters doesn't get in anyone's way, so no lock for this one. The REPL has nothing after them,
+	//but over the socket every answer ends in a status line.
+	if (strcmp(text, ".stats") == 0 || strcmp(text, ".stats json") == 0) {
+		stats_print(session->out, session->database, text[6] != '\0');
+		fprintf(session->out, "Executed.\n");
+		return;
+	}
+	//A backup reads from a snapshot like a select does, so writes keep going while it copies
+	if (strncmp(text, ".backup ", 8) == 0) {
+		BackupStats stats;
+		print_backup_result(session->out, database_backup(session->database, text + 8, &stats), &stats);
+		return;
+	}
+	if (text[0] == '.') {
+		fprintf(session->out, "Unrecognized command '%s' .\n", text);
+		return;
+	}
+	Statement statement;
+	PrepareResult prepare_result = prepare_statement(&input_buffer, &statement);
+	if (prepare_result != PREPARE_SUCCESS) {
+		print_prepare_result(session->out, prepare_result, &input_buffer);
+		return;
+	}
+	print_execute_result(session->out, server_execute(server, connection, &statement));
+}
+
+static void server_send_frame(FILE* out, uint8_t type, const void* payload, uint32_t length) {
+	uint8_t header[WIRE_HEADER_SIZE];
+	wire_put_u32(header, length + 1);
+	header[4] = type;
+	fwrite(header, 1, sizeof(header), out);
+	if (length > 0) {
+		fwrite(payload, 1, length, out);
+	}
+}
+
+static void server_send_prepare_error(FILE* out, PrepareResult result) {
+	uint8_t code = (uint8_t)result;
+	server_send_frame(out, WIRE_PREPARE_ERROR, &code, 1);
+}
+
+//Session.emit_row for binary connections: the cell goes out byte for byte, no deserialize, no printf
+static void server_emit_row(Session* session, const Schema* layout, const void* row) {
+	Connection* connection = (Connection*)((char*)session - offsetof(Connection, session));
+	server_send_frame(session->out, WIRE_ROW, row, layout->row_size);
+	connection->rows_sent++;
+}
+
+//Parses a statement with '?' placeholders. Each '?' is swapped for a stand-in the normal parser accepts,
+//and we remember which value it landed on so execute can drop the real one straight in.
+static PrepareResult server_prepare_template(const char* text, size_t length, PreparedStatement* prepared) {
+	free(prepared->text);
+	prepared->text = malloc(length + 1);
+	char* copy = prepared->text;
+	memcpy(copy, text, length);
+	copy[length] = '\0';
+	bool is_insert = strncmp(copy, "insert", 6) == 0;
+	//"insert into name" and "select from name" push the values two tokens further along, and the name itself
+	//can't be a parameter
+	uint32_t first_value_token = strncmp(copy, "insert into ", 12) == 0 || strncmp(copy, "select from ", 12) == 0 ? 4 : 2;
+	prepared->num_params = 0;
+	uint32_t token = 0;
+	bool in_token = false;
+	bool after_dash = false;
+	bool after_where = false;
+	bool after_limit = false;
+	uint32_t where_term = 0;
+	for (char* c = copy; *c != '\0'; c++) {
+		if (*c == ' ') {
+			in_token = false;
+			continue;
+		}
+		if (!in_token) {
+			in_token = true;
+			token++;
+			//everything after "where" in a select is the clause, its '?' can only be a term's value,
+			//and every and/or starts the next term
+			if (!is_insert && strncmp(c, "where ", 6) == 0) {
+				after_where = true;
+			}
+			else if (after_where && (strncmp(c, "and ", 4) == 0 || strncmp(c, "or ", 3) == 0)) {
+				where_term++;
+			}
+			//limit is the last thing a select can have
+			if (!is_insert && strncmp(c, "limit ", 6) == 0) {
+				after_limit = true;
+			}
+		}
+		if (*c == '-') {
+			after_dash = true;
+		}
+		if (*c != '?') {
+			continue;
+		}
+		if (prepared->num_params == WIRE_MAX_PARAMS || token < first_value_token) {
+			return PREPARE_SYNTAX_ERROR;
+		}
+		if (is_insert) {
+			//insert value value value..., the first value is column 0
+			prepared->slots[prepared->num_params++] = (int16_t)(token - first_value_token);
+		}
+		else if (after_limit) {
+			prepared->slots[prepared->num_params++] = PARAM_LIMIT;
+		}
+		else if (after_where) {
+			prepared->slots[prepared->num_params++] = (int16_t)(PARAM_WHERE_VALUE - (int32_t)where_term);
+		}
+		else {
+			prepared->slots[prepared->num_params++] = after_dash ? PARAM_SELECT_TO : PARAM_SELECT_FROM;
+		}
+		*c = '0';
+	}
+	InputBuffer input_buffer = { copy, length + 1, (ssize_t)length };
+	return prepare_statement(&input_buffer, &prepared->statement);
+}
+
+//Copies an execute frame's parameters into a fresh copy of the prepared statement.
+//Text parameters point into the frame, which outlives the execute.
+static PrepareResult server_bind(Database* database, PreparedStatement* prepared, const uint8_t* params, size_t length,
+	Statement* statement) {
+	//Statements are a few KB (mostly create table's schema), only copy the parts this one uses
+	const Statement* template = &prepared->statement;
+	statement->type = template->type;
+	statement->num_values = template->num_values;
+	memcpy(statement->values, template->values, sizeof(Value) * template->num_values);
+	statement->select_kind = template->select_kind;
+	statement->select_from = template->select_from;
+	statement->select_to = template->select_to;
+	memcpy(statement->select_key, template->select_key, sizeof(statement->select_key));
+	memcpy(statement->table_name, template->table_name, sizeof(statement->table_name));
+	statement->num_projected = template->num_projected;
+	memcpy(statement->projected, template->projected, sizeof(statement->projected[0]) * template->num_projected);
+	statement->where = template->where;
+	memcpy(statement->order_column, template->order_column, sizeof(statement->order_column));
+	statement->order_descending = template->order_descending;
+	statement->limit = template->limit;
+	if (template->type == STATEMENT_CREATE) {
+		statement->schema = template->schema;
+	}
+	if (length < 1 || params[0] != prepared->num_params) {
+		return PREPARE_SYNTAX_ERROR;
+	}
+	size_t at = 1;
+	for (uint8_t i = 0; i < prepared->num_params; i++) {
+		int16_t slot = prepared->slots[i];
+		if (at >= length) {
+			return PREPARE_SYNTAX_ERROR;
+		}
+		uint8_t type = params[at++];
+		Value value;
+		value.text = NULL;
+		value.length = 0;
+		value.real = 0;
+		value.integer = 0;
+		if (type == WIRE_PARAM_INT && length - at >= sizeof(uint32_t)) {
+			value.type = VALUE_INTEGER;
+			value.integer = (int32_t)wire_get_u32(params + at);
+			at += sizeof(uint32_t);
+		}
+		else if ((type == WIRE_PARAM_INT64 || type == WIRE_PARAM_DOUBLE) && length - at >= sizeof(uint64_t)) {
+			uint64_t bits = wire_get_u64(params + at);
+			at += sizeof(uint64_t);
+			if (type == WIRE_PARAM_INT64) {
+				value.type = VALUE_INTEGER;
+				value.integer = (int64_t)bits;
+			}
+			else {
+				value.type = VALUE_REAL;
+				memcpy(&value.real, &bits, sizeof(double));
+			}
+		}
+		else if (type == WIRE_PARAM_TEXT && length - at >= sizeof(uint16_t)) {
+			uint16_t text_length = wire_get_u16(params + at);
+			at += sizeof(uint16_t);
+			if (length - at < text_length) {
+				return PREPARE_SYNTAX_ERROR;
+			}
+			value.type = VALUE_TEXT;
+			value.text = (const char*)params + at;
+			value.length = text_length;
+			at += text_length;
+		}
+		else {
+			return PREPARE_SYNTAX_ERROR;
+		}
+
+		if (slot >= 0) {
+			if ((uint32_t)slot >= statement->num_values) {
+				return PREPARE_SYNTAX_ERROR;
+			}
+			statement->values[slot] = value;
+			continue;
+		}
+		if (slot <= PARAM_WHERE_VALUE) {
+			uint32_t term = (uint32_t)(PARAM_WHERE_VALUE - slot);
+			if (term >= statement->where.num_terms) {
+				return PREPARE_SYNTAX_ERROR;
+			}
+			statement->where.terms[term].value = value;
+			continue;
+		}
+		//Tables keyed by a varchar look up a text parameter (or an integer, spelled out) as is. An integer keyed table
+		//takes text that spells out an id, like select 5 typed in. No such table gets the key as is, execute says so.
+		if (slot == PARAM_SELECT_FROM && value.type == VALUE_TEXT) {
+			if (value.length > SCHEMA_MAX_KEY_LENGTH) {
+				return PREPARE_STRING_TOO_LONG;
+			}
+			memcpy(statement->select_key, value.text, value.length);
+			statement->select_key[value.length] = '\0';
+			Table* table = database_find_table(database, statement->table_name);
+			if (table == NULL || table->text_keys) {
+				continue;
+			}
+			char* end;
+			errno = 0;
+			value.type = VALUE_INTEGER;
+			value.integer = strtoll(statement->select_key, &end, 10);
+			if (value.length == 0 || *end != '\0' || errno != 0) {
+				return PREPARE_SYNTAX_ERROR;
+			}
+		}
+		//otherwise select ids have to be plain integers
+		if (value.type != VALUE_INTEGER) {
+			return PREPARE_SYNTAX_ERROR;
+		}
+		if (slot == PARAM_LIMIT) {
+			if (value.integer < 0) {
+				return PREPARE_SYNTAX_ERROR;
+			}
+			statement->limit = (uint64_t)value.integer;
+		}
+		else if (slot == PARAM_SELECT_FROM) {
+			statement->select_from = value.integer;
+			snprintf(statement->select_key, sizeof(statement->select_key), "%lld", (long long)value.integer);
+		}
+		else {
+			statement->select_to = value.integer;
+		}
+	}
+	return at == length ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+
+//A follower asking for the change log past after_seq. The log has its own lock, so this doesn't hold up writes.
+static void server_send_changes(Server* server, FILE* out, uint64_t after_seq) {
+	ChangeLog* changes = server->database->changes;
+	if (changes == NULL) {
+		uint8_t no_log = 0;
+		server_send_frame(out, WIRE_CHANGE_BATCH, &no_log, sizeof(no_log));
+		return;
+	}
+	size_t header_size = sizeof(uint8_t) + sizeof(uint64_t);
+	uint8_t* reply = malloc(header_size + CHANGE_LOG_BATCH_SIZE);
+	reply[0] = 1;
+	size_t length = change_log_read(changes, after_seq, reply + header_size, CHANGE_LOG_BATCH_SIZE);
+	//read after the records, so it's never behind the ones that come with it
+	wire_put_u64(reply + 1, change_log_last_seq(changes));
+	server_send_frame(out, WIRE_CHANGE_BATCH, reply, (uint32_t)(header_size + length));
+	free(reply);
+}
+
+//Runs one binary frame, the reply frames go to the connection's stream
+static void server_run_frame(Server* server, Connection* connection, const uint8_t* frame, size_t length) {
+	FILE* out = connection->session.out;
+	uint8_t type = frame[0];
+	const uint8_t* payload = frame + 1;
+	size_t payload_length = length - 1;
+	if (type == WIRE_PREPARE) {
+		//reuse the first free slot so a client that prepares and finalizes in a loop doesn't grow us forever
+		uint32_t id = 0;
+		while (id < connection->num_prepared && connection->prepared[id].in_use) {
+			id++;
+		}
+		if (id == connection->num_prepared) {
+			connection->num_prepared++;
+			connection->prepared = realloc(connection->prepared, sizeof(PreparedStatement) * connection->num_prepared);
+			connection->prepared[id].text = NULL;
+		}
+		PreparedStatement* prepared = &connection->prepared[id];
+		PrepareResult result = server_prepare_template((const char*)payload, payload_length, prepared);
+		if (result != PREPARE_SUCCESS) {
+			prepared->in_use = false;
+			server_send_prepare_error(out, result);
+			return;
+		}
+		prepared->in_use = true;
+		uint8_t reply[sizeof(uint32_t) + sizeof(uint8_t)];
+		wire_put_u32(reply, id);
+		reply[4] = prepared->num_params;
+		server_send_frame(out, WIRE_PREPARED, reply, sizeof(reply));
+		return;
+	}
+	if (type == WIRE_CHANGES && payload_length == sizeof(uint64_t)) {
+		server_send_changes(server, out, wire_get_u64(payload));
+		return;
+	}
+	if (payload_length < sizeof(uint32_t) || (type != WIRE_EXECUTE && type != WIRE_FINALIZE)) {
+		server_send_prepare_error(out, PREPARE_UNRECOGNIZED_STATEMENT);
+		return;
+	}
+	uint32_t id = wire_get_u32(payload);
+	bool known = id < connection->num_prepared && connection->prepared[id].in_use;
+	if (type == WIRE_FINALIZE) {
+		if (known) {
+			connection->prepared[id].in_use = false;
+			free(connection->prepared[id].text);
+			connection->prepared[id].text = NULL;
+		}
+		return;
+	}
+	if (!known) {
+		server_send_prepare_error(out, PREPARE_UNRECOGNIZED_STATEMENT);
+		return;
+	}
+	Statement statement;
+	PrepareResult bind_result = server_bind(server->database, &connection->prepared[id], payload + sizeof(uint32_t),
+		payload_length - sizeof(uint32_t), &statement);
+	if (bind_result != PREPARE_SUCCESS) {
+		server_send_prepare_error(out, bind_result);
+		return;
+	}
+	connection->rows_sent = 0;
+	ExecuteResult result = server_execute(server, connection, &statement);
+	uint8_t reply[sizeof(uint8_t) + sizeof(uint32_t)];
+	reply[0] = (uint8_t)result;
+	wire_put_u32(reply + 1, connection->rows_sent);
+	server_send_frame(out, WIRE_DONE, reply, sizeof(reply));
+}
+
+static void* server_worker(void* arg) {
+	Server* server = arg;
+	while (true) {
+		pthread_mutex_lock(&server->lock);
+		while (server->jobs_head == NULL && !server->stopping) {
+			pthread_cond_wait(&server->work_ready, &server->lock);
+		}
+		Job* job = job_pop(&server->jobs_head, &server->jobs_tail);
+		pthread_mutex_unlock(&server->lock);
+		if (job == NULL) {
+			//stopping and nothing left to do
+			return NULL;
+		}
+
+		//Everything the statements print lands in a memory buffer instead of stdout
+		FILE* out = open_memstream(&job->output, &job->output_length);
+		job->connection->session.out = out;
+		for (Line* line = job->lines; line != NULL; line = line->next) {
+			if (job->connection->mode == CONNECTION_BINARY) {
+				server_run_frame(server, job->connection, (const uint8_t*)line->text, line->length);
+			}
+			else {
+				server_run_line(server, job->connection, line->text);
+			}
+		}
+		fclose(out);
+		job->connection->session.out = NULL;
+
+		pthread_mutex_lock(&server->lock);
+		job_push(&server->done_head, &server->done_tail, job);
+		pthread_mutex_unlock(&server->lock);
+		uint64_t one = 1;
+		if (write(server->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+			printf("Error waking server loop: %d\n", errno);
+		}
+	}
+}
+
+//Hands every line queued on a connection to the workers as one job, if it isn't already waiting on one
+static void server_dispatch(Server* server, Connection* connection) {
+	if (connection->busy || connection->closing || connection->queued_head == NULL) {
+		return;
+	}
+	Job* job = malloc(sizeof(Job));
+	job->connection = connection;
+	job->lines = connection->queued_head;
+	job->output = NULL;
+	job->output_length = 0;
+	connection->queued_head = NULL;
+	connection->queued_tail = NULL;
+	connection->busy = true;
+	pthread_mutex_lock(&server->lock);
+	job_push(&server->jobs_head, &server->jobs_tail, job);
+	pthread_cond_signal(&server->work_ready);
+	pthread_mutex_unlock(&server->lock);
+}
+
+static void server_watch(Server* server, Connection* connection, bool want_write) {
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+	event.data.ptr = connection;
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+	connection->want_write = want_write;
+}
+
+//Writes as much pending output as the socket will take, and waits for EPOLLOUT if there's more
+static void server_flush(Server* server, Connection* connection) {
+	while (connection->out_sent < connection->out_length) {
+		ssize_t sent = send(connection->fd, connection->out + connection->out_sent,
+			connection->out_length - connection->out_sent, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (!connection->want_write) {
+					server_watch(server, connection, true);
+				}
+				return;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			connection->closing = true;
+			return;
+		}
+		connection->out_sent += (size_t)sent;
+	}
+	free(connection->out);
+	connection->out = NULL;
+	connection->out_length = 0;
+	connection->out_sent = 0;
+	if (connection->want_write) {
+		server_watch(server, connection, false);
+	}
+}
+
+static void server_accept(Server* server) {
+	while (true) {
+		int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) {
+			//EAGAIN means we've taken everyone who was waiting
+			return;
+		}
+		Connection* connection = calloc(1, sizeof(Connection));
+		connection->fd = fd;
+		connection->session.database = server->database;
+		connection->session.out = NULL;
+		connection->session.in_transaction = false;
+		connection->session.emit_row = NULL;
+		connection->mode = CONNECTION_UNDECIDED;
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLRDHUP;
+		event.data.ptr = connection;
+		epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+	}
+}
+
+static void server_queue_line(Connection* connection, const char* text, size_t length) {
+	Line* line = malloc(sizeof(Line));
+	line->text = malloc(length + 1);
+	memcpy(line->text, text, length);
+	line->text[length] = '\0';
+	line->length = length;
+	line->next = NULL;
+	if (connection->queued_tail) {
+		connection->queued_tail->next = line;
+	}
+	else {
+		connection->queued_head = line;
+	}
+	connection->queued_tail = line;
+}
+
+//Pulls complete frames out of the read buffer and queues them, returns how many bytes they used up
+static size_t server_split_frames(Connection* connection) {
+	size_t start = 0;
+	while (connection->in_length - start >= WIRE_HEADER_SIZE) {
+		uint32_t length = wire_get_u32((uint8_t*)connection->in + start);
+		if (length == 0 || length > SERVER_MAX_LINE) {
+			connection->closing = true;
+			break;
+		}
+		if (connection->in_length - start - sizeof(uint32_t) < length) {
+			break;
+		}
+		server_queue_line(connection, connection->in + start + sizeof(uint32_t), length);
+		start += sizeof(uint32_t) + length;
+	}
+	return start;
+}
+
+//Pulls complete lines out of the read buffer and queues them
+static void server_split_lines(Connection* connection) {
+	if (connection->mode == CONNECTION_UNDECIDED && connection->in_length > 0) {
+		//text never starts with a NUL, so that's a binary client saying hello
+		if (connection->in[0] != '\0') {
+			connection->mode = CONNECTION_TEXT;
+		}
+		else if (connection->in_length >= WIRE_MAGIC_SIZE) {
+			if (memcmp(connection->in, WIRE_MAGIC, WIRE_MAGIC_SIZE) != 0) {
+				connection->closing = true;
+				return;
+			}
+			connection->mode = CONNECTION_BINARY;
+			connection->session.emit_row = server_emit_row;
+			memmove(connection->in, connection->in + WIRE_MAGIC_SIZE, connection->in_length - WIRE_MAGIC_SIZE);
+			connection->in_length -= WIRE_MAGIC_SIZE;
+		}
+	}
+	if (connection->mode == CONNECTION_BINARY) {
+		size_t used = server_split_frames(connection);
+		memmove(connection->in, connection->in + used, connection->in_length - used);
+		connection->in_length -= used;
+		return;
+	}
+	if (connection->mode != CONNECTION_TEXT) {
+		return;
+	}
+	size_t start = 0;
+	for (size_t i = 0; i < connection->in_length; i++) {
+		if (connection->in[i] != '\n') {
+			continue;
+		}
+		size_t end = i;
+		//be forgiving of clients that send \r\n
+		if (end > start && connection->in[end - 1] == '\r') {
+			end--;
+		}
+		server_queue_line(connection, connection->in + start, end - start);
+		start = i + 1;
+	}
+	memmove(connection->in, connection->in + start, connection->in_length - start);
+	connection->in_length -= start;
+	if (connection->in_length > SERVER_MAX_LINE) {
+		//that's not a statement, that's a firehose
+		connection->closing = true;
+	}
+}
+
+static void server_read(Connection* connection) {
+	while (true) {
+		if (connection->in_capacity - connection->in_length < 4096) {
+			connection->in_capacity = connection->in_capacity ? connection->in_capacity * 2 : 8192;
+			connection->in = realloc(connection->in, connection->in_capacity);
+		}
+		ssize_t bytes_read = recv(connection->fd, connection->in + connection->in_length,
+			connection->in_capacity - connection->in_length, 0);
+		if (bytes_read > 0) {
+			connection->in_length += (size_t)bytes_read;
+			continue;
+		}
+		if (bytes_read == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			//client hung up, still run whatever full lines they sent before going
+			connection->closing = true;
+		}
+		break;
+	}
+	server_split_lines(connection);
+}
+
+static void server_destroy_connection(Server* server, Connection* connection) {
+	//A client that disappears mid transaction gets rolled back, same as .close in the REPL
+	pthread_mutex_lock(&server->write_lock);
+	if (server->transaction_owner == connection) {
+		change_log_rollback(server->database->changes);
+		shard_set_rollback(server->database->shards);
+		pager_rollback(server->database->pager);
+		server->transaction_owner = NULL;
+	}
+	pthread_mutex_unlock(&server->write_lock);
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+	close(connection->fd);
+	free_lines(connection->queued_head);
+	free(connection->in);
+	free(connection->out);
+	for (uint32_t i = 0; i < connection->num_prepared; i++) {
+		free(connection->prepared[i].text);
+	}
+	free(connection->prepared);
+	free(connection);
+}
+
+//Decides what happens next for a connection once it isn't waiting on a worker: run its next batch, or free it
+static void server_settle(Server* server, Connection* connection) {
+	if (connection->busy) {
+		return;
+	}
+	if (!connection->closing) {
+		server_dispatch(server, connection);
+		return;
+	}
+	if (connection->queued_head == NULL) {
+		server_destroy_connection(server, connection);
+		return;
+	}
+	//run what they sent before hanging up (a commit, say), the answers just go nowhere
+	connection->closing = false;
+	server_dispatch(server, connection);
+	connection->closing = true;
+}
+
+//Takes finished jobs back from the workers and queues their output on the right connection
+static void server_collect(Server* server) {
+	uint64_t count;
+	if (read(server->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		printf("Error reading wake event: %d\n", errno);
+	}
+	while (true) {
+		pthread_mutex_lock(&server->lock);
+		Job* job = job_pop(&server->done_head, &server->done_tail);
+		pthread_mutex_unlock(&server->lock);
+		if (job == NULL) {
+			return;
+		}
+		Connection* connection = job->connection;
+		connection->busy = false;
+		free_lines(job->lines);
+		if (connection->out == NULL) {
+			connection->out = job->output;
+			connection->out_length = job->output_length;
+			connection->out_sent = 0;
+		}
+		else {
+			connection->out = realloc(connection->out, connection->out_length + job->output_length);
+			memcpy(connection->out + connection->out_length, job->output, job->output_length);
+			connection->out_length += job->output_length;
+			free(job->output);
+		}
+		free(job);
+		server_flush(server, connection);
+		server_settle(server, connection);
+	}
+}
+
+//--follow: applies the followed database's changes as they come, until the server stops or following fails
+//(clients can still read what we've got then)
+static void* server_follow(void* arg) {
+	Server* server = arg;
+	pthread_mutex_lock(&server->lock);
+	while (!server->stopping) {
+		pthread_mutex_unlock(&server->lock);
+		int64_t count = follower_poll(server->follower, &server->write_lock);
+		fflush(stdout);
+		pthread_mutex_lock(&server->lock);
+		if (count < 0) {
+			break;
+		}
+		if (count == 0 && !server->stopping) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += FOLLOWER_POLL_MS / 1000;
+			deadline.tv_nsec += (FOLLOWER_POLL_MS % 1000) * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&server->follow_wake, &server->lock, &deadline);
+		}
+	}
+	pthread_mutex_unlock(&server->lock);
+	return NULL;
+}
+
+static int server_listen(const char* socket_path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(address.sun_path)) {
+		printf("Socket path too long: %s\n", socket_path);
+		return -1;
+	}
+	strcpy(address.sun_path, socket_path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		printf("Unable to create socket: %d\n", errno);
+		return -1;
+	}
+	//a socket file left over from a previous run would make bind fail
+	unlink(socket_path);
+	if (bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1 || listen(fd, SOMAXCONN) == -1) {
+		printf("Unable to listen on %s: %d\n", socket_path, errno);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int server_run(Database* database, const char* socket_path, uint32_t num_workers, const char* follow_source) {
+	if (num_workers == 0) {
+		num_workers = SERVER_DEFAULT_WORKERS;
+	}
+	Server server;
+	memset(&server, 0, sizeof(server));
+	server.database = database;
+	server.num_workers = num_workers;
+	if (follow_source != NULL) {
+		server.follower = follower_open(database, follow_source);
+		if (server.follower == NULL) {
+			return EXIT_FAILURE;
+		}
+	}
+	server.listen_fd = server_listen(socket_path);
+	if (server.listen_fd == -1) {
+		if (server.follower != NULL) {
+			follower_close(server.follower);
+		}
+		return EXIT_FAILURE;
+	}
+
+	//Ctrl-C/kill come in through a signalfd so the loop can shut down cleanly and flush the database.
+	//Block them before starting workers so the workers inherit the mask.
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	server.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	server.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	//the three server fds are told apart from connections by pointing at their own fields
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = &server.listen_fd;
+	epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event);
+	event.data.ptr = &server.wake_fd;
+	epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.wake_fd, &event);
+	event.data.ptr = &server.signal_fd;
+	epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.signal_fd, &event);
+
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.work_ready, NULL);
+	pthread_mutex_init(&server.write_lock, NULL);
+	pthread_cond_init(&server.shard_writers_done, NULL);
+	server.workers = malloc(sizeof(pthread_t) * num_workers);
+	for (uint32_t i = 0; i < num_workers; i++) {
+		pthread_create(&server.workers[i], NULL, server_worker, &server);
+	}
+	pthread_cond_init(&server.follow_wake, NULL);
+	if (server.follower != NULL) {
+		pthread_create(&server.follow_thread, NULL, server_follow, &server);
+	}
+	printf("Serving on %s with %u workers\n", socket_path, num_workers);
+	fflush(stdout);
+
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	bool running = true;
+	while (running) {
+		int count = epoll_wait(server.epoll_fd, events, SERVER_MAX_EVENTS, -1);
+		if (count == -1) {
+			if (errno == EINTR) continue;
+			printf("Error waiting on events: %d\n", errno);
+			break;
+		}
+		for (int i = 0; i < count; i++) {
+			void* source = events[i].data.ptr;
+			if (source == &server.listen_fd) {
+				server_accept(&server);
+				continue;
+			}
+			if (source == &server.wake_fd) {
+				server_collect(&server);
+				continue;
+			}
+			if (source == &server.signal_fd) {
+				running = false;
+				continue;
+			}
+			Connection* connection = source;
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				server_read(connection);
+			}
+			if (events[i].events & EPOLLOUT) {
+				server_flush(&server, connection);
+			}
+			server_settle(&server, connection);
+		}
+	}
+
+	//Let the workers finish what they've got, then shut them down
+	pthread_mutex_lock(&server.lock);
+	server.stopping = true;
+	pthread_cond_broadcast(&server.work_ready);
+	pthread_cond_broadcast(&server.follow_wake);
+	pthread_mutex_unlock(&server.lock);
+	for (uint32_t i = 0; i < num_workers; i++) {
+		pthread_join(server.workers[i], NULL);
+	}
+	if (server.follower != NULL) {
+		pthread_join(server.follow_thread, NULL);
+		follower_close(server.follower);
+	}
+	//Whoever had a transaction open doesn't get to keep it
+	if (server.transaction_owner != NULL) {
+		change_log_rollback(database->changes);
+		shard_set_rollback(database->shards);
+		pager_rollback(database->pager);
+	}
+	Job* job;
+	while ((job = job_pop(&server.done_head, &server.done_tail)) != NULL) {
+		free_lines(job->lines);
+		free(job->output);
+		free(job);
+	}
+	free(server.workers);
+	pthread_mutex_destroy(&server.write_lock);
+	pthread_cond_destroy(&server.shard_writers_done);
+	pthread_cond_destroy(&server.follow_wake);
+	pthread_cond_destroy(&server.work_ready);
+	pthread_mutex_destroy(&server.lock);
+	close(server.epoll_fd);
+	close(server.wake_fd);
+	close(server.signal_fd);
+	close(server.listen_fd);
+	unlink(socket_path);
+	printf("Server stopped.\n");
+	return EXIT_SUCCESS;
+}
+#endif
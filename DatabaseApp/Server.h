@@ -0,0 +1,23 @@
+#ifndef SERVER_H
+#define SERVER_H
+#include <stdint.h>
+#include "table.h"
+
+//Server mode: one process owns the database file (and its page cache), and local clients talk to it over a unix socket.
+//The protocol is the REPL's, minus the prompt: send statements one per line, get back exactly what the REPL
+//would have printed. Every response ends with its status line ("Executed.", "Error: ...", etc.), so a client
+//can fire off a whole batch of lines without waiting and match the answers up in order.
+//Meta commands aren't available over the socket.
+//Followers ask for the change log over the binary protocol (WIRE_CHANGES).
+//Clients that care about speed can open with WIRE_MAGIC and speak the binary protocol instead (WireProtocol.h, Client.h).
+
+#define SERVER_DEFAULT_WORKERS 4
+//Longest line we'll accept from a client before hanging up on them
+#define SERVER_MAX_LINE 16384
+
+//Listens on socket_path and serves the database until SIGINT/SIGTERM. Returns the process exit code.
+//Linux only, the event loop is epoll.
+//With a follow_source the database follows that one (see Follower.h) and clients only get to read it.
+int server_run(Database* database, const char* socket_path, uint32_t num_workers, const char* follow_source);
+
+#endif
@@ -0,0 +1,116 @@
+#include "Shard.h"
+#include "Journal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+char* shard_path_for(const char* db_filename, uint32_t shard) {
+	const char* suffix = "-shard";
+	//room for the biggest uint32_t
+	size_t length = strlen(db_filename) + strlen(suffix) + 10 + 1;
+	char* path = malloc(length);
+	snprintf(path, length, "%s%s%u", db_filename, suffix, shard);
+	return path;
+}
+
+ShardSet* shard_set_open(Database* database, const char* db_filename, uint32_t num_shards, uint32_t page_size) {
+	ShardSet* shards = malloc(sizeof(ShardSet));
+	shards->num_shards = num_shards;
+	shards->clean = true;
+	for (uint32_t i = 0; i < num_shards; i++) {
+		char* path = shard_path_for(db_filename, i);
+		//Just the file: the database's change log covers its shards, and a shard never has shards of its own
+		Database* shard = db_open_file(path, page_size);
+		if (shard == NULL) {
+			printf("Unable to open shard %s\n", path);
+			exit(EXIT_FAILURE);
+		}
+		free(path);
+		//read before create table below gets a chance to write anything
+		shards->clean = shards->clean && shard->pager->clean_on_disk;
+		for (uint32_t t = 0; t < database->num_tables; t++) {
+			const Schema* schema = &database->tables[t]->schema;
+			if (database_find_table(shard, schema->table_name) == NULL && database_create_table(shard, schema) == NULL) {
+				printf("Shard %u can't take table %s.\n", i, schema->table_name);
+				exit(EXIT_FAILURE);
+			}
+		}
+		shards->shards[i] = shard;
+		pthread_mutex_init(&shards->locks[i], NULL);
+	}
+	return shards;
+}
+
+void shard_set_close(ShardSet* shards) {
+	if (shards == NULL) {
+		return;
+	}
+	for (uint32_t i = 0; i < shards->num_shards; i++) {
+		db_close(shards->shards[i]);
+		pthread_mutex_destroy(&shards->locks[i]);
+	}
+	free(shards);
+}
+
+uint32_t shard_for_key(const ShardSet* shards, const Value* key) {
+	uint64_t hash;
+	if (key->type == VALUE_TEXT) {
+		//FNV-1a, the journal's checksum does the job
+		hash = journal_checksum((const uint8_t*)key->text, key->length);
+	}
+	else {
+		//Ids mostly come in order, the finalizer from splitmix64 scatters neighbours over every shard
+		hash = (uint64_t)key->integer;
+		hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+		hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+		hash ^= hash >> 31;
+	}
+	return (uint32_t)(hash % shards->num_shards);
+}
+
+Table* shard_find_table(ShardSet* shards, uint32_t shard, const Table* table) {
+	return database_find_table(shards->shards[shard], table->schema.table_name);
+}
+
+void shard_set_create_table(ShardSet* shards, const Schema* schema) {
+	if (shards == NULL) {
+		return;
+	}
+	for (uint32_t i = 0; i < shards->num_shards; i++) {
+		//The database checked the name and the room for it, a shard missing it gets it at the next open
+		database_create_table(shards->shards[i], schema);
+	}
+}
+
+bool shard_set_begin(ShardSet* shards) {
+	if (shards == NULL) {
+		return true;
+	}
+	for (uint32_t i = 0; i < shards->num_shards; i++) {
+		if (!pager_begin(shards->shards[i]->pager)) {
+			while (i-- > 0) {
+				pager_rollback(shards->shards[i]->pager);
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+void shard_set_commit(ShardSet* shards) {
+	if (shards == NULL) {
+		return;
+	}
+	for (uint32_t i = 0; i < shards->num_shards; i++) {
+		pager_commit(shards->shards[i]->pager);
+	}
+}
+
+void shard_set_rollback(ShardSet* shards) {
+	if (shards == NULL) {
+		return;
+	}
+	for (uint32_t i = 0; i < shards->num_shards; i++) {
+		pager_rollback(shards->shards[i]->pager);
+	}
+}
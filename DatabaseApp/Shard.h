@@ -0,0 +1,57 @@
+#ifndef SHARD_H
+#define SHARD_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "table.h"
+
+//Sharding: a database created with DB_SHARDS=N (2 or more) set spreads the rows of every table over N more files,
+//<db>-shard0 up to <db>-shardN-1, by a hash of each row's key. Every shard is a database of its own, with its own
+//pager: its own cache, its own file, its own TABLE_MAX_PAGES, and its own transactions, so writers on different
+//shards never wait on each other. The database's own file keeps the catalog and every shard has the same tables,
+//but the rows only ever go in the shards. The count is kept in the header (HEADER_SHARD_COUNT_OFFSET), so DB_SHARDS
+//only matters when the file gets created.
+//
+//An insert goes to the shard its key hashes to, and so does a select of one key. Ranges and whole table selects ask
+//every shard at once, a thread each, and merge what comes back (see execute_select). A server runs inserts outside of
+//a transaction side by side, only ones that land on the same shard wait for each other.
+//
+//begin/commit/rollback cover every shard, but a commit reaches the shard files one after the other, so a crash partway
+//through leaves it in some of them. With DB_CHANGE_LOG set (see ChangeLog.h) the next open puts the rest back in.
+
+//Most shards a database can have
+#ifndef SHARD_MAX
+#define SHARD_MAX 16
+#endif
+
+struct ShardSet {
+	uint32_t num_shards;
+	Database* shards[SHARD_MAX];
+	//Held while a statement writes to the shard. Inserts from different connections only wait on each other when
+	//they land on the same one.
+	pthread_mutex_t locks[SHARD_MAX];
+	//Every shard file had been closed cleanly when we opened it
+	bool clean;
+};
+
+//Builds the path of a database file's shard, caller frees it
+char* shard_path_for(const char* db_filename, uint32_t shard);
+//Opens (or creates) database's num_shards shard files, new ones get page_size byte pages. A shard that's missing one
+//of database's tables (a crash in the middle of create table) gets it.
+ShardSet* shard_set_open(Database* database, const char* db_filename, uint32_t num_shards, uint32_t page_size);
+//Closes every shard, rolling back anything uncommitted. Does nothing with NULL.
+void shard_set_close(ShardSet* shards);
+//Which shard the row with this key lives in
+uint32_t shard_for_key(const ShardSet* shards, const Value* key);
+//The shard's copy of table, NULL if the shard hasn't got one
+Table* shard_find_table(ShardSet* shards, uint32_t shard, const Table* table);
+
+//These all do nothing with a NULL set, so callers don't have to check whether the database is sharded.
+//Adds the table to every shard
+void shard_set_create_table(ShardSet* shards, const Schema* schema);
+//Starts a transaction on every shard. Returns false (with none started) if one of them has one open already.
+bool shard_set_begin(ShardSet* shards);
+//Commits every shard's transaction to disk, one after the other
+void shard_set_commit(ShardSet* shards);
+void shard_set_rollback(ShardSet* shards);
+
+#endif
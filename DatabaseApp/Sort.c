@@ -0,0 +1,328 @@
+#include "Sort.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct Sorter {
+	ColumnType key_type;
+	uint32_t key_size;
+	bool descending;
+	uint32_t row_size;
+	//key_size bytes of order by value, then the row
+	uint32_t record_size;
+	uint64_t limit;
+	//Keeping the best limit records in a heap instead of sorting everything
+	bool top_k;
+	//Records in memory. For top-k these are the heap's slots, and heap lists the slots with the worst record first.
+	uint8_t* records;
+	uint32_t num_records;
+	uint32_t capacity;
+	uint32_t* heap;
+	//When each top-k slot's record arrived, ties go to whichever came first. A buffer's records are already in
+	//arrival order so it doesn't need one.
+	uint64_t* sequence;
+	uint64_t next_sequence;
+	//Sorted runs spilled to temp files, oldest first
+	FILE** runs;
+	uint32_t num_runs;
+	uint32_t runs_capacity;
+};
+
+Sorter* sorter_new(const Column* key, bool descending, uint32_t row_size, uint64_t limit) {
+	Sorter* sorter = calloc(1, sizeof(Sorter));
+	sorter->key_type = key->type;
+	sorter->key_size = key->size;
+	sorter->descending = descending;
+	sorter->row_size = row_size;
+	sorter->record_size = key->size + row_size;
+	sorter->limit = limit;
+	//top-k when the best limit records fit in the budget, otherwise the limit only trims what comes out
+	if (limit != SORT_NO_LIMIT && limit * sorter->record_size <= SORT_MEMORY_BUDGET) {
+		sorter->top_k = true;
+		sorter->capacity = (uint32_t)limit;
+		sorter->records = malloc((size_t)sorter->capacity * sorter->record_size);
+		sorter->heap = malloc(sorter->capacity * sizeof(uint32_t));
+		sorter->sequence = malloc(sorter->capacity * sizeof(uint64_t));
+	}
+	return sorter;
+}
+
+static uint8_t* sort_record(const Sorter* sorter, uint32_t slot) {
+	return sorter->records + (size_t)slot * sorter->record_size;
+}
+
+//Orders two records by their order by values, like the B-tree orders keys (varchars byte by byte)
+static int sort_compare(const Sorter* sorter, const uint8_t* a, const uint8_t* b) {
+	int compared = schema_compare_values(sorter->key_type, sorter->key_size, a, b);
+	return sorter->descending ? -compared : compared;
+}
+
+//Whether the record in slot a comes out before the one in slot b
+static bool sort_before(const Sorter* sorter, uint32_t a, uint32_t b) {
+	int compared = sort_compare(sorter, sort_record(sorter, a), sort_record(sorter, b));
+	if (compared != 0) {
+		return compared < 0;
+	}
+	return sorter->top_k ? sorter->sequence[a] < sorter->sequence[b] : a < b;
+}
+
+//Merge sort of slot numbers, scratch is as big as slots
+static void sort_slots(const Sorter* sorter, uint32_t* slots, uint32_t* scratch, uint32_t count) {
+	if (count < 2) {
+		return;
+	}
+	uint32_t half = count / 2;
+	sort_slots(sorter, slots, scratch, half);
+	sort_slots(sorter, slots + half, scratch, count - half);
+	uint32_t i = 0;
+	uint32_t j = half;
+	uint32_t out = 0;
+	while (i < half && j < count) {
+		scratch[out++] = sort_before(sorter, slots[j], slots[i]) ? slots[j++] : slots[i++];
+	}
+	while (i < half) {
+		scratch[out++] = slots[i++];
+	}
+	while (j < count) {
+		scratch[out++] = slots[j++];
+	}
+	memcpy(slots, scratch, count * sizeof(uint32_t));
+}
+
+//The records in memory, in order
+static uint32_t* sort_in_memory(Sorter* sorter) {
+	uint32_t* slots = malloc(((size_t)sorter->num_records + 1) * sizeof(uint32_t));
+	uint32_t* scratch = malloc(((size_t)sorter->num_records + 1) * sizeof(uint32_t));
+	for (uint32_t i = 0; i < sorter->num_records; i++) {
+		slots[i] = i;
+	}
+	sort_slots(sorter, slots, scratch, sorter->num_records);
+	free(scratch);
+	return slots;
+}
+
+static FILE* sort_temp_file(void) {
+	FILE* file = tmpfile();
+	if (file == NULL) {
+		printf("Unable to create a temp file for sorting\n");
+		exit(EXIT_FAILURE);
+	}
+	return file;
+}
+
+static void sort_write(FILE* file, const void* record, uint32_t size) {
+	if (fwrite(record, size, 1, file) != 1) {
+		printf("Error writing a sort run\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void sort_add_run(Sorter* sorter, FILE* run) {
+	if (sorter->num_runs == sorter->runs_capacity) {
+		sorter->runs_capacity = sorter->runs_capacity == 0 ? 8 : sorter->runs_capacity * 2;
+		sorter->runs = realloc(sorter->runs, sorter->runs_capacity * sizeof(FILE*));
+	}
+	sorter->runs[sorter->num_runs++] = run;
+}
+
+//Sorts the buffer and writes it out as the newest run. Nothing past the limit can ever come out, so no run holds more.
+static void sort_spill(Sorter* sorter) {
+	uint32_t* slots = sort_in_memory(sorter);
+	uint32_t count = sorter->limit < sorter->num_records ? (uint32_t)sorter->limit : sorter->num_records;
+	FILE* run = sort_temp_file();
+	for (uint32_t i = 0; i < count; i++) {
+		sort_write(run, sort_record(sorter, slots[i]), sorter->record_size);
+	}
+	free(slots);
+	sort_add_run(sorter, run);
+	sorter->num_records = 0;
+}
+
+//Top-k heap: the worst record sits on top so it's the one a better one replaces
+static bool sort_heap_worse(const Sorter* sorter, uint32_t a, uint32_t b) {
+	return sort_before(sorter, b, a);
+}
+
+static void sort_heap_down(Sorter* sorter, uint32_t at) {
+	uint32_t* heap = sorter->heap;
+	for (;;) {
+		uint32_t worst = at;
+		uint32_t left = at * 2 + 1;
+		uint32_t right = left + 1;
+		if (left < sorter->num_records && sort_heap_worse(sorter, heap[left], heap[worst])) {
+			worst = left;
+		}
+		if (right < sorter->num_records && sort_heap_worse(sorter, heap[right], heap[worst])) {
+			worst = right;
+		}
+		if (worst == at) {
+			return;
+		}
+		uint32_t swap = heap[at];
+		heap[at] = heap[worst];
+		heap[worst] = swap;
+		at = worst;
+	}
+}
+
+static void sort_heap_up(Sorter* sorter, uint32_t at) {
+	uint32_t* heap = sorter->heap;
+	while (at > 0) {
+		uint32_t parent = (at - 1) / 2;
+		if (!sort_heap_worse(sorter, heap[at], heap[parent])) {
+			return;
+		}
+		uint32_t swap = heap[at];
+		heap[at] = heap[parent];
+		heap[parent] = swap;
+		at = parent;
+	}
+}
+
+void sorter_add(Sorter* sorter, const void* key, const void* row) {
+	if (sorter->limit == 0) {
+		return;
+	}
+	if (sorter->top_k) {
+		bool full = sorter->num_records == sorter->capacity;
+		//full: it only gets in by beating the worst record we have (a tie loses, it came later)
+		if (full && sort_compare(sorter, key, sort_record(sorter, sorter->heap[0])) >= 0) {
+			return;
+		}
+		uint32_t slot = full ? sorter->heap[0] : sorter->num_records;
+		uint8_t* record = sort_record(sorter, slot);
+		memcpy(record, key, sorter->key_size);
+		memcpy(record + sorter->key_size, row, sorter->row_size);
+		sorter->sequence[slot] = sorter->next_sequence++;
+		if (full) {
+			sort_heap_down(sorter, 0);
+		}
+		else {
+			sorter->heap[sorter->num_records++] = slot;
+			sort_heap_up(sorter, slot);
+		}
+		return;
+	}
+	if (sorter->num_records == sorter->capacity) {
+		//grow until the buffer hits the budget, then start spilling
+		uint64_t budget = SORT_MEMORY_BUDGET / sorter->record_size;
+		if (sorter->capacity < budget) {
+			uint64_t capacity = sorter->capacity == 0 ? 64 : (uint64_t)sorter->capacity * 2;
+			sorter->capacity = (uint32_t)(capacity < budget ? capacity : budget);
+			sorter->records = realloc(sorter->records, (size_t)sorter->capacity * sorter->record_size);
+		}
+		else {
+			sort_spill(sorter);
+		}
+	}
+	uint8_t* record = sort_record(sorter, sorter->num_records++);
+	memcpy(record, key, sorter->key_size);
+	memcpy(record + sorter->key_size, row, sorter->row_size);
+}
+
+//One run being merged: its file and the record at its front
+typedef struct {
+	FILE* file;
+	uint8_t* record;
+	uint32_t index;
+} SortRunHead;
+
+//Front records come out smallest first, ties go to the older run
+static bool sort_head_before(const Sorter* sorter, const SortRunHead* a, const SortRunHead* b) {
+	int compared = sort_compare(sorter, a->record, b->record);
+	return compared != 0 ? compared < 0 : a->index < b->index;
+}
+
+static void sort_heads_down(const Sorter* sorter, SortRunHead* heads, uint32_t count, uint32_t at) {
+	for (;;) {
+		uint32_t first = at;
+		uint32_t left = at * 2 + 1;
+		uint32_t right = left + 1;
+		if (left < count && sort_head_before(sorter, &heads[left], &heads[first])) {
+			first = left;
+		}
+		if (right < count && sort_head_before(sorter, &heads[right], &heads[first])) {
+			first = right;
+		}
+		if (first == at) {
+			return;
+		}
+		SortRunHead swap = heads[at];
+		heads[at] = heads[first];
+		heads[first] = swap;
+		at = first;
+	}
+}
+
+//k-way merge of runs, oldest first. Each record goes to out if there is one, otherwise its row gets emitted,
+//and it stops after limit records. Closes the runs.
+static void sort_merge(Sorter* sorter, FILE** runs, uint32_t count, FILE* out, SortEmit emit, void* context) {
+	SortRunHead* heads = malloc(count * sizeof(SortRunHead));
+	uint8_t* records = malloc((size_t)count * sorter->record_size);
+	uint32_t live = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		rewind(runs[i]);
+		SortRunHead head = { runs[i], records + (size_t)i * sorter->record_size, i };
+		if (fread(head.record, sorter->record_size, 1, head.file) == 1) {
+			heads[live++] = head;
+		}
+		else {
+			fclose(head.file);
+		}
+	}
+	for (uint32_t i = live; i-- > 0;) {
+		sort_heads_down(sorter, heads, live, i);
+	}
+	uint64_t written = 0;
+	while (live > 0 && written < sorter->limit) {
+		SortRunHead* first = &heads[0];
+		if (out != NULL) {
+			sort_write(out, first->record, sorter->record_size);
+		}
+		else {
+			emit(context, first->record + sorter->key_size);
+		}
+		written++;
+		if (fread(first->record, sorter->record_size, 1, first->file) != 1) {
+			//that run's done, the last one takes its place
+			fclose(first->file);
+			heads[0] = heads[--live];
+		}
+		sort_heads_down(sorter, heads, live, 0);
+	}
+	for (uint32_t i = 0; i < live; i++) {
+		fclose(heads[i].file);
+	}
+	free(records);
+	free(heads);
+}
+
+void sorter_finish(Sorter* sorter, SortEmit emit, void* context) {
+	if (sorter->num_runs == 0) {
+		uint32_t* slots = sort_in_memory(sorter);
+		uint64_t count = sorter->limit < sorter->num_records ? sorter->limit : sorter->num_records;
+		for (uint64_t i = 0; i < count; i++) {
+			emit(context, sort_record(sorter, slots[i]) + sorter->key_size);
+		}
+		free(slots);
+	}
+	else {
+		if (sorter->num_records > 0) {
+			sort_spill(sorter);
+		}
+		//Too many runs to merge at once: the oldest ones get merged into one run that takes their place
+		while (sorter->num_runs > SORT_MERGE_WAYS) {
+			FILE* merged = sort_temp_file();
+			sort_merge(sorter, sorter->runs, SORT_MERGE_WAYS, merged, NULL, NULL);
+			sorter->runs[0] = merged;
+			memmove(sorter->runs + 1, sorter->runs + SORT_MERGE_WAYS, (sorter->num_runs - SORT_MERGE_WAYS) * sizeof(FILE*));
+			sorter->num_runs -= SORT_MERGE_WAYS - 1;
+		}
+		sort_merge(sorter, sorter->runs, sorter->num_runs, NULL, emit, context);
+	}
+	free(sorter->runs);
+	free(sorter->sequence);
+	free(sorter->heap);
+	free(sorter->records);
+	free(sorter);
+}
@@ -0,0 +1,39 @@
+#ifndef SORT_H
+#define SORT_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "Schema.h"
+
+//select ... order by col [desc] limit n. Rows get handed to a sorter as they're selected, and come back out in order
+//once the scan is done. Every row is kept as a record: the order by column's value, then the row as it'll be sent.
+//
+//With a limit small enough to fit in memory we only ever keep the best n records in a bounded heap (top-k), so
+//"latest 50 by name" costs 50 records no matter how big the table is. Anything else gets buffered up to
+//SORT_MEMORY_BUDGET, sorted, and spilled to a temp file as a run once the buffer fills. At the end the runs get
+//merged back together (SORT_MERGE_WAYS at a time), and a sort that never filled the buffer never touches a file.
+//Rows with the same value come out in the order they went in, which is key order for a scan.
+
+//Bytes of records a sort keeps in memory before spilling a run, -DSORT_MEMORY_BUDGET=4096 makes tiny sorts spill
+#ifndef SORT_MEMORY_BUDGET
+#define SORT_MEMORY_BUDGET (4 * 1024 * 1024)
+#endif
+//Most runs merged in one pass, more than that and the oldest ones get merged into a bigger run first
+#ifndef SORT_MERGE_WAYS
+#define SORT_MERGE_WAYS 64
+#endif
+//No limit
+#define SORT_NO_LIMIT UINT64_MAX
+
+typedef struct Sorter Sorter;
+//Gets each row (row_size bytes) in order from sorter_finish
+typedef void (*SortEmit)(void* context, const void* row);
+
+//Orders by a value of key's type (the column's size bytes, the same format as inside a row), smallest first unless
+//descending, and keeps the first limit rows
+Sorter* sorter_new(const Column* key, bool descending, uint32_t row_size, uint64_t limit);
+//Copies one row and its order by value in
+void sorter_add(Sorter* sorter, const void* key, const void* row);
+//Emits the rows in order (at most limit of them) and frees the sorter
+void sorter_finish(Sorter* sorter, SortEmit emit, void* context);
+
+#endif
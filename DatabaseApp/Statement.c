@@ -1,147 +1,1079 @@
 #include "Statement.h"
+#include "ColumnStore.h"
+#include "Stats.h"
+#include "ChangeLog.h"
+#include "Shard.h"
+#include "ResultCache.h"
 //strncmp, strcmp, etc.
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 //Parse statement for execution
 PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement) {
+	//only insert fills these in
+	statement->num_values = 0;
+	statement->table_name[0] = '\0';
+	//and only select these, but the server copies them out of any prepared statement
+	statement->num_projected = 0;
+	statement->where.num_terms = 0;
 	//We haven't seen this string function yet, what does it do?
 	//strncmp compares two strings and an n number of characters, it will return 0 if the characters exactly match
 	if (strncmp(input_buffer->buffer, "insert", 6) == 0) {
 		return prepare_insert(input_buffer, statement);
 	}
 	if (strncmp(input_buffer->buffer, "select", 6) == 0) {
-		statement->type = STATEMENT_SELECT;
+		return prepare_select(input_buffer, statement);
+	}
+	if (strncmp(input_buffer->buffer, "create table ", 13) == 0) {
+		return prepare_create(input_buffer, statement);
+	}
+	//Transaction control takes no arguments, so these have to match exactly
+	if (strcmp(input_buffer->buffer, "begin") == 0) {
+		statement->type = STATEMENT_BEGIN;
+		return PREPARE_SUCCESS;
+	}
+	if (strcmp(input_buffer->buffer, "commit") == 0) {
+		statement->type = STATEMENT_COMMIT;
+		return PREPARE_SUCCESS;
+	}
+	if (strcmp(input_buffer->buffer, "rollback") == 0) {
+		statement->type = STATEMENT_ROLLBACK;
 		return PREPARE_SUCCESS;
 	}
 	return PREPARE_UNRECOGNIZED_STATEMENT;
 }
 PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement) {
 	statement->type = STATEMENT_INSERT;
+	statement->num_values = 0;
 	//Converts our input buffer from a string into null terminated tokens (char arrays) based on a delimiter (space in this case).
-	char* keyword = strtok(input_buffer->buffer, " ");
-	char* id_string = strtok(NULL, " ");
-	char* username = strtok(NULL, " ");
-	char* email = strtok(NULL, " ");
+	//strtok_r rather than strtok since the server prepares statements on several threads at once
+	char* save = NULL;
+	char* keyword = strtok_r(input_buffer->buffer, " ", &save);
+	char* token = strtok_r(NULL, " ", &save);
+	//insert into name ... picks the table, a plain insert goes to the default one.
+	//The first value is always an int key, so it can't be mistaken for "into".
+	if (token != NULL && strcmp(token, "into") == 0) {
+		char* name = strtok_r(NULL, " ", &save);
+		if (name == NULL) {
+			return PREPARE_SYNTAX_ERROR;
+		}
+		if (strlen(name) > SCHEMA_NAME_SIZE) {
+			return PREPARE_STRING_TOO_LONG;
+		}
+		strcpy(statement->table_name, name);
+		token = strtok_r(NULL, " ", &save);
+	}
+	while (token != NULL) {
+		if (statement->num_values == SCHEMA_MAX_COLUMNS) {
+			return PREPARE_SYNTAX_ERROR;
+		}
+		//We don't know the table's column types yet, so each value just remembers what it looked like.
+		//The text sticks around in the input buffer until execute is done with it.
+		statement->values[statement->num_values++] = value_parse(token);
+		token = strtok_r(NULL, " ", &save);
+	}
+	if (statement->num_values == 0) {
+		return PREPARE_SYNTAX_ERROR;
+	}
+	return PREPARE_SUCCESS;
+}
 
-	if (id_string == NULL || username == NULL || email == NULL) {
+static PrepareResult prepare_result_for(SchemaResult result) {
+	switch (result) {
+	case(SCHEMA_OK):
+		return PREPARE_SUCCESS;
+	case(SCHEMA_TOO_MANY_COLUMNS):
+		return PREPARE_TOO_MANY_COLUMNS;
+	case(SCHEMA_DUPLICATE_COLUMN):
+		return PREPARE_DUPLICATE_COLUMN;
+	case(SCHEMA_BAD_KEY_COLUMN):
+		return PREPARE_BAD_KEY_COLUMN;
+	case(SCHEMA_ROW_TOO_BIG):
+		return PREPARE_ROW_TOO_BIG;
+	default:
 		return PREPARE_SYNTAX_ERROR;
 	}
-	//atoi = ascii to int, convert our null terminated char array to a int value for our id.
-	int id = atoi(id_string);
-	if (strlen(username) > COLUMN_USERNAME_SIZE) {
-		return PREPARE_STRING_TOO_LONG;
+}
+
+//Skips spaces, returns the first character that isn't one
+static char* skip_spaces(char* text) {
+	while (*text == ' ') {
+		text++;
 	}
-	if (strlen(email) > COLUMN_EMAIL_SIZE) {
+	return text;
+}
+
+PrepareResult prepare_create(InputBuffer* input_buffer, Statement* statement) {
+	statement->type = STATEMENT_CREATE;
+	//create table name (column type, column type, ...)
+	char* name = skip_spaces(input_buffer->buffer + 13);
+	char* open = strchr(name, '(');
+	char* close = strrchr(name, ')');
+	if (open == NULL || close == NULL || close < open || *skip_spaces(close + 1) != '\0') {
+		return PREPARE_SYNTAX_ERROR;
+	}
+	char* name_end = open;
+	while (name_end > name && name_end[-1] == ' ') {
+		name_end--;
+	}
+	*name_end = '\0';
+	*close = '\0';
+	if (*name == '\0' || strchr(name, ' ') != NULL) {
+		return PREPARE_SYNTAX_ERROR;
+	}
+	if (strlen(name) > SCHEMA_NAME_SIZE) {
 		return PREPARE_STRING_TOO_LONG;
 	}
-	statement->row_to_insert.id = id;
-	if (id < 0) {
-		return PREPARE_NEGATIVE_ID;
+	schema_init(&statement->schema, name);
+
+	char* save = NULL;
+	for (char* definition = strtok_r(open + 1, ",", &save); definition != NULL; definition = strtok_r(NULL, ",", &save)) {
+		char* column_save = NULL;
+		char* column_name = strtok_r(definition, " ", &column_save);
+		char* type_name = strtok_r(NULL, " ", &column_save);
+		if (column_name == NULL || type_name == NULL || strtok_r(NULL, " ", &column_save) != NULL) {
+			return PREPARE_SYNTAX_ERROR;
+		}
+		if (strlen(column_name) > SCHEMA_NAME_SIZE) {
+			return PREPARE_STRING_TOO_LONG;
+		}
+		ColumnType type;
+		uint32_t max_length;
+		if (!schema_parse_type(type_name, &type, &max_length)) {
+			return PREPARE_SYNTAX_ERROR;
+		}
+		SchemaResult result = schema_add_column(&statement->schema, column_name, type, max_length);
+		if (result != SCHEMA_OK) {
+			return prepare_result_for(result);
+		}
 	}
+	return prepare_result_for(schema_compile(&statement->schema));
+}
 
-	strcpy_s(statement->row_to_insert.username, COLUMN_USERNAME_SIZE, username);
-	strcpy_s(statement->row_to_insert.email, COLUMN_EMAIL_SIZE, email);
+//The words that start the optional parts of a select, so none of them can be a column list or an id
+static bool is_select_keyword(const char* token) {
+	return strcmp(token, "from") == 0 || strcmp(token, "where") == 0 || strcmp(token, "order") == 0 || strcmp(token, "limit") == 0;
+}
 
-	return PREPARE_SUCCESS;
+//Copies a column or table name out of a token, false if it doesn't fit
+static bool copy_name(char* destination, const char* name) {
+	if (strlen(name) > SCHEMA_NAME_SIZE) {
+		return false;
+	}
+	strcpy(destination, name);
+	return true;
 }
-ExecuteResult execute_insert(Statement* statement, Table* table) {
-	if (table == NULL) {
+
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement) {
+	statement->type = STATEMENT_SELECT;
+	statement->select_kind = SELECT_ALL;
+	statement->select_from = 0;
+	statement->select_to = 0;
+	statement->select_key[0] = '\0';
+	statement->num_projected = 0;
+	statement->where.num_terms = 0;
+	statement->order_column[0] = '\0';
+	statement->order_descending = false;
+	statement->limit = SORT_NO_LIMIT;
+	//select [a, b] [from name] [id | id-id] [where column op value [and|or column op value]...]
+	//       [order by column [asc|desc]] [limit n]
+	char* save = NULL;
+	strtok_r(input_buffer->buffer, " ", &save);
+	char* token = strtok_r(NULL, " ", &save);
+	//A column list is anything up front that isn't a keyword or an id. Ids are numbers, a varchar key only
+	//gets looked up after "from name", so there's no mixing the two up.
+	if (token != NULL && !is_select_keyword(token) && token[0] != '-' && (token[0] < '0' || token[0] > '9')) {
+		//names are split by commas, with or without spaces around them
+		bool more = true;
+		while (token != NULL && more) {
+			more = token[strlen(token) - 1] == ',';
+			char* name_save = NULL;
+			for (char* name = strtok_r(token, ",", &name_save); name != NULL; name = strtok_r(NULL, ",", &name_save)) {
+				if (statement->num_projected == SCHEMA_MAX_COLUMNS) {
+					return PREPARE_TOO_MANY_COLUMNS;
+				}
+				if (!copy_name(statement->projected[statement->num_projected++], name)) {
+					return PREPARE_STRING_TOO_LONG;
+				}
+			}
+			token = strtok_r(NULL, " ", &save);
+			if (token != NULL && token[0] == ',') {
+				more = true;
+			}
+		}
+		if (statement->num_projected == 0 || more) {
+			return PREPARE_SYNTAX_ERROR;
+		}
+	}
+	//select from name ... picks the table, the arguments after it work the same as always
+	if (token != NULL && strcmp(token, "from") == 0) {
+		char* name = strtok_r(NULL, " ", &save);
+		if (name == NULL) {
+			return PREPARE_SYNTAX_ERROR;
+		}
+		if (!copy_name(statement->table_name, name)) {
+			return PREPARE_STRING_TOO_LONG;
+		}
+		token = strtok_r(NULL, " ", &save);
+	}
+	//Case 2 and 3: we are either selecting 1 row or a range of rows.
+	//Bad ids are left for execute to complain about, same as they always were.
+	if (token != NULL && !is_select_keyword(token)) {
+		if (strlen(token) > SCHEMA_MAX_KEY_LENGTH) {
+			return PREPARE_STRING_TOO_LONG;
+		}
+		strcpy(statement->select_key, token);
+		statement->select_from = strtoll(token, NULL, 10);
+		char* dash = strchr(token, '-');
+		if (dash == NULL) {
+			statement->select_kind = SELECT_ONE;
+		}
+		else {
+			statement->select_kind = SELECT_RANGE;
+			statement->select_to = strtoll(dash + 1, NULL, 10);
+		}
+		token = strtok_r(NULL, " ", &save);
+	}
+	//Any of them can be filtered with a where clause, terms joined by and/or
+	if (token != NULL && strcmp(token, "where") == 0) {
+		Filter* where = &statement->where;
+		bool starts_group = true;
+		do {
+			char* column = strtok_r(NULL, " ", &save);
+			char* op = strtok_r(NULL, " ", &save);
+			char* value = strtok_r(NULL, " ", &save);
+			if (value == NULL || where->num_terms == FILTER_MAX_TERMS) {
+				return PREPARE_SYNTAX_ERROR;
+			}
+			Predicate* term = &where->terms[where->num_terms];
+			if (!filter_parse_op(op, &term->op)) {
+				return PREPARE_SYNTAX_ERROR;
+			}
+			if (!copy_name(term->column_name, column)) {
+				return PREPARE_STRING_TOO_LONG;
+			}
+			//like insert's values, the text stays in the input buffer until execute is done with it
+			term->value = value_parse(value);
+			where->starts_group[where->num_terms++] = starts_group;
+			token = strtok_r(NULL, " ", &save);
+			starts_group = token != NULL && strcmp(token, "or") == 0;
+		} while (token != NULL && (starts_group || strcmp(token, "and") == 0));
+	}
+	if (token != NULL && strcmp(token, "order") == 0) {
+		char* by = strtok_r(NULL, " ", &save);
+		char* column = strtok_r(NULL, " ", &save);
+		if (column == NULL || strcmp(by, "by") != 0) {
+			return PREPARE_SYNTAX_ERROR;
+		}
+		if (!copy_name(statement->order_column, column)) {
+			return PREPARE_STRING_TOO_LONG;
+		}
+		token = strtok_r(NULL, " ", &save);
+		if (token != NULL && (strcmp(token, "asc") == 0 || strcmp(token, "desc") == 0)) {
+			statement->order_descending = token[0] == 'd';
+			token = strtok_r(NULL, " ", &save);
+		}
+	}
+	if (token != NULL && strcmp(token, "limit") == 0) {
+		char* count = strtok_r(NULL, " ", &save);
+		char* end = NULL;
+		if (count == NULL || count[0] < '0' || count[0] > '9') {
+			return PREPARE_SYNTAX_ERROR;
+		}
+		statement->limit = strtoull(count, &end, 10);
+		if (*end != '\0') {
+			return PREPARE_SYNTAX_ERROR;
+		}
+		token = strtok_r(NULL, " ", &save);
+	}
+	return token == NULL ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+}
+static ExecuteResult execute_result_for(SchemaResult result) {
+	switch (result) {
+	case(SCHEMA_WRONG_VALUE_COUNT):
+		return EXECUTE_WRONG_VALUE_COUNT;
+	case(SCHEMA_STRING_TOO_LONG):
+		return EXECUTE_STRING_TOO_LONG;
+	case(SCHEMA_NEGATIVE_KEY):
+		return EXECUTE_NEGATIVE_KEY;
+	case(SCHEMA_NO_SUCH_COLUMN):
+		return EXECUTE_NO_SUCH_COLUMN;
+	default:
+		return EXECUTE_TYPE_MISMATCH;
+	}
+}
+
+//Works out which of the database's tables a statement is about
+static ExecuteResult find_table(Statement* statement, Session* session, Table** table) {
+	if (session->database == NULL) {
 		return EXECUTE_NO_TABLE;
 	}
-	Row* row_to_insert = &(statement->row_to_insert);
-	uint32_t key_to_insert = row_to_insert->id;
-	Cursor* cursor = table_find(table, key_to_insert);
+	*table = database_find_table(session->database, statement->table_name);
+	return *table != NULL ? EXECUTE_SUCCESS : EXECUTE_NO_SUCH_TABLE;
+}
+
+ExecuteResult execute_insert(Statement* statement, Session* session) {
+	Table* table;
+	ExecuteResult found = find_table(statement, session, &table);
+	if (found != EXECUTE_SUCCESS) {
+		return found;
+	}
+	//Pack the values into a row first, nothing gets touched if they don't fit the schema
+	uint8_t row[SCHEMA_MAX_ROW_SIZE];
+	SchemaResult bind_result = schema_serialize(&table->schema, statement->values, statement->num_values, row);
+	if (bind_result != SCHEMA_OK) {
+		return execute_result_for(bind_result);
+	}
+	return execute_insert_row(session, table, row);
+}
+
+//A sharded database's rows live in its shards, so the row goes to the one its key hashes to. The shard has no change
+//log of its own, the database's gets the insert once the shard has it.
+static ExecuteResult execute_insert_shard(Session* session, Table* table, const void* row) {
+	ShardSet* shards = session->database->shards;
+	Value key = table_row_key(table, row);
+	uint32_t shard = shard_for_key(shards, &key);
+	Table* shard_table = shard_find_table(shards, shard, table);
+	if (shard_table == NULL) {
+		return EXECUTE_NO_SUCH_TABLE;
+	}
+	Session shard_session = *session;
+	shard_session.database = shards->shards[shard];
+	pthread_mutex_lock(&shards->locks[shard]);
+	ExecuteResult result = execute_insert_row(&shard_session, shard_table, row);
+	pthread_mutex_unlock(&shards->locks[shard]);
+	if (result == EXECUTE_SUCCESS) {
+		ChangeLog* changes = session->database->changes;
+		change_log_insert(changes, table, row);
+		//autocommit pages only reach the shard's file at close, so the log still has it first
+		if (!session->in_transaction) {
+			change_log_commit(changes, false);
+			//the shard has no cache of its own, the database's is keyed by its tables
+			result_cache_invalidate(session->database->results, table, &key);
+		}
+	}
+	return result;
+}
+
+ExecuteResult execute_insert_row(Session* session, Table* table, const void* row) {
+	if (session->database->shards != NULL) {
+		return execute_insert_shard(session, table, row);
+	}
+	ChangeLog* changes = session->database->changes;
+	//Outside of begin/commit every insert is its own little transaction. Its page writes go to shadow copies,
+	//so a reader's snapshot never sees a half finished split, and they all become visible together at the end.
+	bool implicit_transaction = !session->in_transaction && pager_begin(table->pager);
+	//the first column is always the key
+	Value key_to_insert = table_row_key(table, row);
+	Cursor cursor;
+	table_seek(table, &key_to_insert, NULL, &cursor);
 
-	void* node = get_page(table->pager, cursor->page_num);
+	void* node = get_page(table->pager, cursor.page_num);
 	uint32_t num_cells = *leaf_node_num_cells(node);
 
-	if (cursor->cell_num < num_cells) {
-		uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-		if (key_at_index == key_to_insert) {
+	if (cursor.cell_num < num_cells) {
+		if (leaf_node_compare(table, node, cursor.cell_num, &key_to_insert) == 0) {
+			if (implicit_transaction) {
+				pager_rollback(table->pager);
+			}
 			return EXECUTE_DUPLICATE_KEY;
 		}
 	}
 
-	leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
+	leaf_node_insert(&cursor, row);
+	change_log_insert(changes, table, row);
 
-	free(cursor);
+	if (implicit_transaction) {
+		//Still only written out at the next commit/close, same as before transactions existed.
+		//The change log gets it first, that's what keeps it if we die before then.
+		change_log_commit(changes, false);
+		pager_commit_in_memory(table->pager);
+		//Only once it's committed, a select between the two would cache what it read from before the insert
+		result_cache_invalidate(session->database->results, table, &key_to_insert);
+	}
 
 	return EXECUTE_SUCCESS;
 }
-ExecuteResult execute_select(Statement* statement, InputBuffer* input_buffer, Table* table) {
 
-	if (table == NULL) {
+ExecuteResult execute_create(Statement* statement, Session* session) {
+	Database* database = session->database;
+	if (database == NULL) {
 		return EXECUTE_NO_TABLE;
 	}
-	char* args = strchr(input_buffer->buffer, ' ');
-	if (args != NULL) {
-		args++;
-		if (*args == '\0') {
-			args = NULL;
+	//Rolling back would have to take the table back out of the database's list too, so it isn't allowed mid transaction
+	if (session->in_transaction) {
+		return EXECUTE_TRANSACTION_OPEN;
+	}
+	if (database_find_table(database, statement->schema.table_name) != NULL) {
+		return EXECUTE_TABLE_EXISTS;
+	}
+	if (database->num_tables == DATABASE_MAX_TABLES) {
+		return EXECUTE_TOO_MANY_TABLES;
+	}
+	//The checks above cover everything but someone else's transaction being open
+	if (database_create_table(database, &statement->schema) == NULL) {
+		return EXECUTE_TRANSACTION_OPEN;
+	}
+	shard_set_create_table(database->shards, &statement->schema);
+	change_log_create(database->changes, &statement->schema);
+	change_log_commit(database->changes, true);
+	return EXECUTE_SUCCESS;
+}
+
+//table_find leaves the cursor one past the last cell when the key is bigger than everything in that leaf,
+//this moves it onto the first cell of the next leaf (or the end of the table)
+static void cursor_skip_past_leaf_end(Cursor* cursor) {
+	void* node = get_page_at(cursor->table->pager, cursor->page_num, cursor->snapshot);
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	if (num_cells == 0) {
+		cursor->end_of_table = true;
+	}
+	else if (cursor->cell_num >= num_cells) {
+		cursor->cell_num = num_cells - 1;
+		cursor_advance(cursor);
+	}
+}
+
+//Where a select's rows go, and what they look like on the way: whole rows, or just the columns it asked for
+typedef struct {
+	Session* session;
+	Table* table;
+	//the table's schema, or projection when there's a column list
+	const Schema* layout;
+	Schema projection;
+	//the table column each output column comes from (0, 1, 2... for whole rows)
+	uint8_t columns[SCHEMA_MAX_COLUMNS];
+	bool projected;
+	bool has_where;
+	BoundFilter where;
+	//order by: the column rows get sorted on, and the sorter they go through (NULL when they go out in key order)
+	uint32_t order_index;
+	Sorter* sorter;
+	//rows limit still lets out, and whether that's run out (scans stop as soon as it does)
+	uint64_t remaining;
+	bool done;
+} SelectOutput;
+
+//Looks up the column list and the where clause against the table's schema
+static ExecuteResult select_output_init(Statement* statement, Session* session, Table* table, SelectOutput* output) {
+	const Schema* schema = &table->schema;
+	output->session = session;
+	output->table = table;
+	output->layout = schema;
+	output->projected = statement->num_projected > 0;
+	output->has_where = statement->where.num_terms > 0;
+	for (uint32_t i = 0; i < schema->num_columns; i++) {
+		output->columns[i] = (uint8_t)i;
+	}
+	if (output->projected) {
+		for (uint32_t i = 0; i < statement->num_projected; i++) {
+			int32_t column = schema_find_column(schema, statement->projected[i]);
+			if (column < 0) {
+				return EXECUTE_NO_SUCH_COLUMN;
+			}
+			output->columns[i] = (uint8_t)column;
+		}
+		schema_project(schema, output->columns, statement->num_projected, &output->projection);
+		output->layout = &output->projection;
+	}
+	if (output->has_where) {
+		SchemaResult bound = filter_bind_all(schema, &statement->where, &output->where);
+		if (bound != SCHEMA_OK) {
+			return execute_result_for(bound);
+		}
+	}
+	output->order_index = 0;
+	output->sorter = NULL;
+	output->remaining = statement->limit;
+	output->done = statement->limit == 0;
+	if (statement->order_column[0] != '\0') {
+		int32_t column = schema_find_column(schema, statement->order_column);
+		if (column < 0) {
+			return EXECUTE_NO_SUCH_COLUMN;
+		}
+		output->order_index = (uint32_t)column;
+		//scans already come out in key order, anything else has to be sorted
+		if (column != 0 || statement->order_descending) {
+			output->sorter = sorter_new(&schema->columns[column], statement->order_descending, output->layout->row_size, statement->limit);
+		}
+	}
+	return EXECUTE_SUCCESS;
+}
+
+//Hands one row, already in the output's layout, to whoever asked for it
+static void select_deliver(SelectOutput* output, const void* row) {
+	Session* session = output->session;
+	if (session->emit_row != NULL) {
+		session->emit_row(session, output->layout, row);
+		return;
+	}
+	schema_print_row(session->out, output->layout, row);
+}
+
+//SortEmit for rows coming back out of the sorter
+static void select_deliver_sorted(void* context, const void* row) {
+	select_deliver(context, row);
+}
+
+//Every row a select picks comes through here. order_key is its order by value, if the rows are getting sorted they
+//go to the sorter, otherwise straight out until limit runs out.
+static void select_send(SelectOutput* output, const void* order_key, const void* row) {
+	if (output->sorter != NULL) {
+		sorter_add(output->sorter, order_key, row);
+		return;
+	}
+	if (output->done) {
+		return;
+	}
+	select_deliver(output, row);
+	output->done = --output->remaining == 0;
+}
+
+//Hands over one row straight out of a leaf. Whole rows go out still in their serialized leaf cell form.
+static void select_emit_row(SelectOutput* output, const void* row) {
+	const uint8_t* order_key = (const uint8_t*)row + output->table->schema.columns[output->order_index].offset;
+	uint8_t projected[SCHEMA_MAX_ROW_SIZE];
+	if (output->projected) {
+		schema_project_row(&output->table->schema, output->layout, output->columns, row, projected);
+		row = projected;
+	}
+	select_send(output, order_key, row);
+}
+
+//Runs the where clause over count rows laid out stride bytes apart starting at rows, a leaf's cells or just one row
+static uint32_t select_filter_rows(SelectOutput* output, const uint8_t* rows, uint32_t stride, uint32_t count, uint16_t* selection) {
+	const Schema* schema = &output->table->schema;
+	const uint8_t* columns[SCHEMA_MAX_COLUMNS];
+	uint32_t strides[SCHEMA_MAX_COLUMNS];
+	for (uint32_t i = 0; i < schema->num_columns; i++) {
+		columns[i] = rows + schema->columns[i].offset;
+		strides[i] = stride;
+	}
+	return filter_run(&output->where, columns, strides, count, selection);
+}
+
+//Emits one row found by its key, if it gets past the where clause
+static void select_emit_found(SelectOutput* output, const void* row) {
+	uint16_t selection[1];
+	if (!output->has_where || select_filter_rows(output, row, 0, 1, selection) == 1) {
+		select_emit_row(output, row);
+	}
+}
+
+//Walks the leaves from the cursor a leaf at a time, up to and including key last (or to the end of the table without
+//one). Each leaf's rows go through the where clause FILTER_MAX_BATCH at a time (a leaf in a 16KB or 64KB page holds
+//thousands), reading the columns straight out of the cells, and only the rows that pass get emitted.
+static void select_leaf_batches(SelectOutput* output, Cursor* cursor, bool has_last, uint64_t last) {
+	Table* table = output->table;
+	uint16_t selection[FILTER_MAX_BATCH];
+	while (!cursor->end_of_table && !output->done) {
+		void* node = get_page_at(table->pager, cursor->page_num, cursor->snapshot);
+		uint32_t num_cells = *leaf_node_num_cells(node);
+		uint32_t first = cursor->cell_num;
+		uint32_t end = num_cells;
+		//the range ends in this leaf if its last key is past it
+		while (has_last && end > first && leaf_node_key(table, node, end - 1) > last) {
+			end--;
+		}
+		uint32_t stride = is_node_packed(node) ? table->leaf_cell_size : table->leaf_cell_size + LEAF_NODE_KEY_SIZE;
+		for (uint32_t start = first; start < end && !output->done; start += FILTER_MAX_BATCH) {
+			uint32_t count = end - start < FILTER_MAX_BATCH ? end - start : FILTER_MAX_BATCH;
+			if (output->has_where) {
+				count = select_filter_rows(output, leaf_node_value(table, node, start), stride, count, selection);
+			}
+			//limit stops the scan as soon as it runs out, there's no reading the rest of the table for nothing
+			for (uint32_t i = 0; i < count && !output->done; i++) {
+				select_emit_row(output, leaf_node_value(table, node, start + (output->has_where ? selection[i] : i)));
+			}
+		}
+		if (end < num_cells) {
+			break;
+		}
+		//on to the next leaf
+		cursor->cell_num = num_cells - 1;
+		cursor_advance(cursor);
+	}
+}
+
+//select a, b ... [where ...] off the table's column store. Blocks whose zones rule the where clause out get skipped
+//without a look, the rest get filtered a column at a time, and only the asked for columns of the rows that pass get
+//put back together.
+static void select_columns(SelectOutput* output, Snapshot* snapshot) {
+	Table* table = output->table;
+	const Schema* layout = output->layout;
+	uint32_t strides[SCHEMA_MAX_COLUMNS];
+	for (uint32_t i = 0; i < table->schema.num_columns; i++) {
+		strides[i] = table->schema.columns[i].size;
+	}
+	uint16_t selection[COLUMN_BLOCK_ROWS];
+	uint8_t row[SCHEMA_MAX_ROW_SIZE];
+	ColumnStore* store = column_store_acquire(table, snapshot);
+	const Column* order_column = &table->schema.columns[output->order_index];
+	for (uint32_t b = 0; b < store->num_blocks && !output->done; b++) {
+		ColumnBlock* block = &store->blocks[b];
+		uint32_t selected = block->num_rows;
+		if (output->has_where) {
+			if (!filter_zones_may_match(&output->where, block->zones)) {
+				continue;
+			}
+			selected = filter_run(&output->where, (const uint8_t* const*)block->columns, strides, block->num_rows, selection);
+		}
+		for (uint32_t i = 0; i < selected && !output->done; i++) {
+			uint32_t r = output->has_where ? selection[i] : i;
+			for (uint32_t c = 0; c < layout->num_columns; c++) {
+				const Column* column = &layout->columns[c];
+				memcpy(row + column->offset, block->columns[output->columns[c]] + (size_t)r * column->size, column->size);
+			}
+			select_send(output, block->columns[output->order_index] + (size_t)r * order_column->size, row);
 		}
 	}
-	if (args == NULL) {
+	column_store_release(table, store);
+}
+
+//Finds the rows a select wants and sends them to output
+static ExecuteResult select_scan(Statement* statement, Table* table, Snapshot* snapshot, Session* session, SelectOutput* output) {
+	//The REPL gets told about missing rows and backwards ranges, a client reading raw rows just gets none
+	bool chatty = session->emit_row == NULL;
+	if (statement->select_kind == SELECT_ALL) {
+		//A column list or a where clause over a snapshot reads the column store. Inside a transaction we have to
+		//see our own writes, which only the pages have.
+		if (snapshot != NULL && (output->projected || output->has_where)) {
+			select_columns(output, snapshot);
+			return EXECUTE_SUCCESS;
+		}
 	//case 1: select everything in our database
-		Cursor* cursor = table_start(table);
-		Row row;
-		while (!(cursor->end_of_table)) {
-			deserialize_row(cursor_value(cursor), &row);
-			print_row(&row);
-			cursor_advance(cursor);
-		}
-		//remember, created cursor, we must free it.
-		free(cursor);
+		//The cursor lives on our stack now, so there's nothing to free afterwards
+		Cursor cursor;
+		table_seek_start(table, snapshot, &cursor);
+		select_leaf_batches(output, &cursor, false, 0);
+		return EXECUTE_SUCCESS;
+	}
+	//A varchar key is looked up as typed, ranges would be ambiguous with dashes being fair game in a string
+	if (table->text_keys) {
+		Value key = { VALUE_TEXT, 0, 0, statement->select_key, (uint32_t)strlen(statement->select_key) };
+		Cursor cursor;
+		table_seek(table, &key, snapshot, &cursor);
+		cursor_skip_past_leaf_end(&cursor);
+		bool found = false;
+		if (!cursor.end_of_table) {
+			void* node = get_page_at(table->pager, cursor.page_num, snapshot);
+			found = leaf_node_compare(table, node, cursor.cell_num, &key) == 0;
+		}
+		if (found) {
+			select_emit_found(output, cursor_value(&cursor));
+		}
+		else if (chatty) {
+			fprintf(session->out, "Row with id %s not found.\n", statement->select_key);
+		}
 		return EXECUTE_SUCCESS;
 	}
 	//Case 2 and 3: we are either printing 1 row or a range of rows
-	char* dash = strchr(args, '-');
-	if (dash == NULL) {
-		int id = atoi(args);
-		if (id < 0) {
+	int64_t id1 = statement->select_from;
+	if (statement->select_kind == SELECT_ONE) {
+		if (id1 < 0) {
 			return EXECUTE_NEGATIVE_ID;
 		}
-		Cursor* cursor = table_find(table, id);
-		Row row;
-		deserialize_row(cursor_value(cursor), &row);
-		if (row.id == id) {
-			print_row(&row);
+		Value key = { VALUE_INTEGER, id1, 0, NULL, 0 };
+		Cursor cursor;
+		table_seek(table, &key, snapshot, &cursor);
+		cursor_skip_past_leaf_end(&cursor);
+		bool found = false;
+		if (!cursor.end_of_table) {
+			void* node = get_page_at(table->pager, cursor.page_num, snapshot);
+			found = leaf_node_key(table, node, cursor.cell_num) == (uint64_t)id1;
 		}
-		else {
-			printf("Row with id %u not found.\n", id);
+		if (found) {
+			select_emit_found(output, cursor_value(&cursor));
+		}
+		else if (chatty) {
+			fprintf(session->out, "Row with id %lld not found.\n", (long long)id1);
 		}
-		free(cursor);
 		return(EXECUTE_SUCCESS);
 	}
-	//split the string into 2
-	*dash = '\0';
-	int id1 = atoi(args);
-	int id2 = atoi(dash + 1);
+	int64_t id2 = statement->select_to;
 	if (id1 < 0 || id2 < 0) {
 		return EXECUTE_NEGATIVE_ID;
 	}
 	if (id2 < id1) {
-		printf("Invalid range %d-%d.\n", id1, id2);
+		if (chatty) {
+			fprintf(session->out, "Invalid range %lld-%lld.\n", (long long)id1, (long long)id2);
+		}
 		return(EXECUTE_SUCCESS);
 	}
-	for (uint32_t i = id1; i <= id2; i++) {
-		Row row;
-		Cursor* cursor = table_find(table, i);
-		deserialize_row(cursor_value(cursor), &row);
-		if (row.id == i) {
-			print_row(&row);
+	//Find the first id once, then walk the leaves until we pass the end of the range
+	Value key = { VALUE_INTEGER, id1, 0, NULL, 0 };
+	Cursor cursor;
+	table_seek(table, &key, snapshot, &cursor);
+	cursor_skip_past_leaf_end(&cursor);
+	select_leaf_batches(output, &cursor, true, (uint64_t)id2);
+	return (EXECUTE_SUCCESS);
+}
+
+//Does the actual work for execute_select, every page read goes through the snapshot
+static ExecuteResult select_rows(Statement* statement, Table* table, Snapshot* snapshot, Session* session) {
+	SelectOutput output;
+	ExecuteResult result = select_output_init(statement, session, table, &output);
+	if (result != EXECUTE_SUCCESS) {
+		return result;
+	}
+	result = select_scan(statement, table, snapshot, session, &output);
+	//sorted rows only go out once the scan has seen all of them
+	if (output.sorter != NULL) {
+		sorter_finish(output.sorter, select_deliver_sorted, &output);
+	}
+	return result;
+}
+
+//One shard's part of a select that asks every shard. The session comes first, so select_collect can get back to the
+//rest from the Session* it's handed.
+typedef struct {
+	Session session;
+	const Statement* statement;
+	ExecuteResult result;
+	//whole rows, in the order the shard sent them
+	uint8_t* rows;
+	size_t num_rows;
+	size_t capacity;
+	//the next one the merge hasn't taken yet
+	size_t next;
+#ifndef _WIN32
+	pthread_t thread;
+#endif
+} ShardSelect;
+
+static void select_collect(Session* session, const Schema* layout, const void* row) {
+	ShardSelect* select = (ShardSelect*)session;
+	if (select->num_rows == select->capacity) {
+		select->capacity = select->capacity == 0 ? 256 : select->capacity * 2;
+		select->rows = realloc(select->rows, select->capacity * layout->row_size);
+	}
+	memcpy(select->rows + select->num_rows * layout->row_size, row, layout->row_size);
+	select->num_rows++;
+}
+
+static void* select_shard_run(void* arg) {
+	ShardSelect* select = arg;
+	select->result = execute_select((Statement*)select->statement, &select->session);
+	return NULL;
+}
+
+//Whether row a goes out before row b: by the order by column, then by key, the order one table would have sent them in
+static bool select_merge_before(const Schema* schema, uint32_t order_index, bool descending, const uint8_t* a, const uint8_t* b) {
+	const Column* order = &schema->columns[order_index];
+	int compared = schema_compare_values(order->type, order->size, a + order->offset, b + order->offset);
+	if (compared != 0) {
+		return descending ? compared > 0 : compared < 0;
+	}
+	const Column* key = &schema->columns[0];
+	return schema_compare_values(key->type, key->size, a + key->offset, b + key->offset) < 0;
+}
+
+//select on a sharded database (see Shard.h). One key is in one shard, which gets asked like any other database.
+//Anything else goes to every shard at once, a thread each. Each one runs the select with its where clause, order by
+//and limit, but sends back whole rows, so the merge has the keys and order by values to put them back in order by.
+//The merge then takes the best row off the front of every shard's until limit runs out, and the column list gets
+//applied on the way out.
+static ExecuteResult select_sharded(Statement* statement, Session* session, Table* table) {
+	ShardSet* shards = session->database->shards;
+	bool chatty = session->emit_row == NULL;
+	if (statement->select_kind != SELECT_ALL && (table->text_keys || statement->select_kind == SELECT_ONE)) {
+		Value key = { VALUE_TEXT, 0, 0, statement->select_key, (uint32_t)strlen(statement->select_key) };
+		if (!table->text_keys) {
+			if (statement->select_from < 0) {
+				return EXECUTE_NEGATIVE_ID;
+			}
+			Value id = { VALUE_INTEGER, statement->select_from, 0, NULL, 0 };
+			key = id;
 		}
-		free(cursor);
+		Session shard_session = *session;
+		shard_session.database = shards->shards[shard_for_key(shards, &key)];
+		return execute_select(statement, &shard_session);
+	}
+	//Checked here, so they get said once rather than once a shard
+	if (statement->select_kind == SELECT_RANGE) {
+		if (statement->select_from < 0 || statement->select_to < 0) {
+			return EXECUTE_NEGATIVE_ID;
+		}
+		if (statement->select_to < statement->select_from) {
+			if (chatty) {
+				fprintf(session->out, "Invalid range %lld-%lld.\n", (long long)statement->select_from, (long long)statement->select_to);
+			}
+			return EXECUTE_SUCCESS;
+		}
+	}
+	Statement whole_rows = *statement;
+	whole_rows.num_projected = 0;
+	ShardSelect selects[SHARD_MAX];
+	for (uint32_t i = 0; i < shards->num_shards; i++) {
+		ShardSelect* select = &selects[i];
+		memset(select, 0, sizeof(ShardSelect));
+		Session shard_session = { shards->shards[i], session->out, session->in_transaction, select_collect };
+		select->session = shard_session;
+		select->statement = &whole_rows;
+#ifndef _WIN32
+		if (pthread_create(&select->thread, NULL, select_shard_run, select) != 0) {
+			printf("Unable to start a shard's select\n");
+			exit(EXIT_FAILURE);
+		}
+#else
+		//no threads here, the shards take turns
+		select_shard_run(select);
+#endif
+	}
+	ExecuteResult result = EXECUTE_SUCCESS;
+	for (uint32_t i = 0; i < shards->num_shards; i++) {
+#ifndef _WIN32
+		pthread_join(selects[i].thread, NULL);
+#endif
+		if (result == EXECUTE_SUCCESS) {
+			result = selects[i].result;
+		}
+	}
+
+	//The rows are already in order, so the output doesn't sort them again
+	Statement merged = *statement;
+	merged.order_column[0] = '\0';
+	SelectOutput output;
+	if (result == EXECUTE_SUCCESS) {
+		result = select_output_init(&merged, session, table, &output);
+	}
+	if (result == EXECUTE_SUCCESS) {
+		const Schema* schema = &table->schema;
+		uint32_t order_index = statement->order_column[0] != '\0' ? (uint32_t)schema_find_column(schema, statement->order_column) : 0;
+		uint32_t row_size = schema->row_size;
+		while (!output.done) {
+			ShardSelect* best = NULL;
+			for (uint32_t i = 0; i < shards->num_shards; i++) {
+				ShardSelect* select = &selects[i];
+				if (select->next < select->num_rows && (best == NULL || select_merge_before(schema, order_index,
+					statement->order_descending, select->rows + select->next * row_size, best->rows + best->next * row_size))) {
+					best = select;
+				}
+			}
+			if (best == NULL) {
+				break;
+			}
+			select_emit_row(&output, best->rows + best->next * row_size);
+			best->next++;
+		}
+	}
+	for (uint32_t i = 0; i < shards->num_shards; i++) {
+		free(selects[i].rows);
+	}
+	return result;
+}
+
+//Runs the select for real, against the shards or a snapshot of the file
+static ExecuteResult select_table(Statement* statement, Session* session, Table* table) {
+	if (session->database->shards != NULL) {
+		return select_sharded(statement, session, table);
+	}
+	//Readers work off a snapshot, so a long scan neither sees nor waits on anything committed after it started.
+	//Inside our own transaction we read the latest pages instead, so we see what we've written so far.
+	Snapshot pinned;
+	Snapshot* snapshot = NULL;
+	if (!session->in_transaction) {
+		snapshot = &pinned;
+		pager_snapshot_begin(table->pager, snapshot);
+	}
+	//A table created after the snapshot was taken doesn't exist as far as this select is concerned
+	ExecuteResult result = snapshot != NULL && table->created_at > snapshot->commit_seq
+		? EXECUTE_NO_SUCH_TABLE : select_rows(statement, table, snapshot, session);
+	if (snapshot != NULL) {
+		pager_snapshot_end(table->pager, snapshot);
+	}
+	return result;
+}
+
+ExecuteResult execute_select(Statement* statement, Session* session) {
+	Table* table;
+	ExecuteResult found = find_table(statement, session, &table);
+	if (found != EXECUTE_SUCCESS) {
+		return found;
+	}
+	//Point and range selects printed as text go through the result cache (see ResultCache.h)
+	ResultCache* results = session->database->results;
+	char key[RESULT_CACHE_KEY_SIZE];
+	uint64_t first;
+	uint64_t last;
+	if (results == NULL || session->emit_row != NULL || session->in_transaction
+		|| !result_cache_key(statement, table, key, &first, &last)) {
+		return select_table(statement, session, table);
+	}
+	if (result_cache_lookup(results, key, session->out)) {
+		stats_count(STAT_RESULT_CACHE_HITS);
+		return EXECUTE_SUCCESS;
+	}
+	stats_count(STAT_RESULT_CACHE_MISSES);
+	uint64_t epoch = result_cache_epoch(results);
+	ResultCapture capture;
+	result_capture_begin(&capture);
+	if (capture.stream == NULL) {
+		return select_table(statement, session, table);
+	}
+	Session capturing = *session;
+	capturing.out = capture.stream;
+	ExecuteResult result = select_table(statement, &capturing, table);
+	result_capture_end(&capture, session->out);
+	if (result == EXECUTE_SUCCESS) {
+		result_cache_store(results, key, table, first, last, &capture, epoch);
+	}
+	result_capture_free(&capture);
+	return result;
+}
+
+ExecuteResult execute_transaction(Statement* statement, Session* session) {
+	if (session->database == NULL) {
+		return EXECUTE_NO_TABLE;
+	}
+	//Transactions cover the whole file, every table shares the one pager. And every shard file, if it has them.
+	Pager* pager = session->database->pager;
+	ShardSet* shards = session->database->shards;
+	switch (statement->type) {
+	case(STATEMENT_BEGIN):
+		if (session->in_transaction || !pager_begin(pager)) {
+			return EXECUTE_TRANSACTION_OPEN;
+		}
+		if (!shard_set_begin(shards)) {
+			pager_rollback(pager);
+			return EXECUTE_TRANSACTION_OPEN;
+		}
+		session->in_transaction = true;
+		return EXECUTE_SUCCESS;
+	case(STATEMENT_COMMIT):
+		if (!session->in_transaction) {
+			return EXECUTE_NO_TRANSACTION;
+		}
+		session->in_transaction = false;
+		//Log first: a crash before the pages are in leaves the commit for the next open to replay from the log
+		change_log_commit(session->database->changes, true);
+		shard_set_commit(shards);
+		pager_commit(pager);
+		result_cache_clear(session->database->results);
+		return EXECUTE_SUCCESS;
+	default:
+		if (!session->in_transaction) {
+			return EXECUTE_NO_TRANSACTION;
+		}
+		session->in_transaction = false;
+		change_log_rollback(session->database->changes);
+		shard_set_rollback(shards);
+		pager_rollback(pager);
+		return EXECUTE_SUCCESS;
 	}
-	return (EXECUTE_SUCCESS);
 }
 
-ExecuteResult execute_statement(Statement* statement, InputBuffer* input_buffer, Table* table) {
+//Every statement gets timed into its type's latency histogram for .stats
+ExecuteResult execute_statement(Statement* statement, Session* session) {
+	uint64_t started = stats_clock();
+	ExecuteResult result = EXECUTE_SUCCESS;
+	StatHistogram latency = STAT_INSERT_LATENCY;
 	switch (statement->type) {
 	case(STATEMENT_INSERT):
-		return execute_insert(statement, table);
+		result = execute_insert(statement, session);
+		break;
 	case(STATEMENT_SELECT):
-		return execute_select(statement, input_buffer, table);
+		result = execute_select(statement, session);
+		latency = STAT_SELECT_LATENCY;
+		break;
+	case(STATEMENT_BEGIN):
+	case(STATEMENT_COMMIT):
+	case(STATEMENT_ROLLBACK):
+		result = execute_transaction(statement, session);
+		latency = STAT_TRANSACTION_LATENCY;
+		break;
+	case(STATEMENT_CREATE):
+		result = execute_create(statement, session);
+		latency = STAT_CREATE_LATENCY;
+		break;
+	}
+	stats_record(latency, stats_clock() - started);
+	return result;
+}
+
+void print_prepare_result(FILE* out, PrepareResult result, InputBuffer* input_buffer) {
+	switch (result) {
+	case(PREPARE_SUCCESS):
+		break;
+	case(PREPARE_SYNTAX_ERROR):
+		fprintf(out, "Syntax error. Could not parse statement.\n");
+		break;
+	case(PREPARE_UNRECOGNIZED_STATEMENT):
+		fprintf(out, "Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
+		break;
+	case(PREPARE_STRING_TOO_LONG):
+		fprintf(out, "String input is too long.\n");
+		break;
+	case(PREPARE_NEGATIVE_ID):
+		fprintf(out, "ID must be positive.\n");
+		break;
+	case(PREPARE_TOO_MANY_COLUMNS):
+		fprintf(out, "Tables can have at most %d columns.\n", SCHEMA_MAX_COLUMNS);
+		break;
+	case(PREPARE_DUPLICATE_COLUMN):
+		fprintf(out, "Column names must be unique.\n");
+		break;
+	case(PREPARE_BAD_KEY_COLUMN):
+		fprintf(out, "The first column must be an int32, int64 or varchar(%d or less), it's the table's key.\n", SCHEMA_MAX_KEY_LENGTH);
+		break;
+	case(PREPARE_ROW_TOO_BIG):
+		fprintf(out, "Rows can be at most %d bytes.\n", SCHEMA_MAX_ROW_SIZE);
+		break;
 	}
+}
 
+void print_execute_result(FILE* out, ExecuteResult result) {
+	switch (result) {
+	case(EXECUTE_SUCCESS):
+		fprintf(out, "Executed.\n");
+		break;
+	case(EXECUTE_TABLE_FULL):
+		fprintf(out, "Error: Table full.\n");
+		break;
+	case(EXECUTE_DUPLICATE_KEY):
+		fprintf(out, "Error: Duplicate key.\n");
+		break;
+	case(EXECUTE_NO_TABLE):
+		fprintf(out, "No table to perform statement!\n");
+		break;
+	case(EXECUTE_NEGATIVE_ID):
+		fprintf(out, "Negative id was given for selection\n");
+		break;
+	case(EXECUTE_TRANSACTION_OPEN):
+		fprintf(out, "Error: A transaction is already in progress.\n");
+		break;
+	case(EXECUTE_NO_TRANSACTION):
+		fprintf(out, "Error: No transaction in progress.\n");
+		break;
+	case(EXECUTE_BUSY):
+		fprintf(out, "Error: Database is busy.\n");
+		break;
+	case(EXECUTE_WRONG_VALUE_COUNT):
+		fprintf(out, "Syntax error. Wrong number of values for this table.\n");
+		break;
+	case(EXECUTE_TYPE_MISMATCH):
+		fprintf(out, "Error: Value doesn't match its column's type.\n");
+		break;
+	case(EXECUTE_STRING_TOO_LONG):
+		fprintf(out, "String input is too long.\n");
+		break;
+	case(EXECUTE_NEGATIVE_KEY):
+		fprintf(out, "ID must be positive.\n");
+		break;
+	case(EXECUTE_TABLE_EXISTS):
+		fprintf(out, "Error: Table already exists.\n");
+		break;
+	case(EXECUTE_NO_SUCH_TABLE):
+		fprintf(out, "Error: No such table.\n");
+		break;
+	case(EXECUTE_NO_SUCH_COLUMN):
+		fprintf(out, "Error: No such column.\n");
+		break;
+	case(EXECUTE_TOO_MANY_TABLES):
+		fprintf(out, "Error: A database can have at most %d tables.\n", DATABASE_MAX_TABLES);
+		break;
+	case(EXECUTE_READ_ONLY):
+		fprintf(out, "Error: This database follows another one, writes go to that one.\n");
+		break;
+	}
 }
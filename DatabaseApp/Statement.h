@@ -1,31 +1,96 @@
 #ifndef STATEMENT_H
 #define STATEMENT_H
+#include <stdio.h>
 #include "InputBuffer.h"
-#include "Table.h"
+#include "table.h"
+#include "Filter.h"
+#include "Sort.h"
 //We will also include prepare returns here as well, since they're handled in the same block
 //after meta commands have already been handled
 //PrepareResult is effectively our SQL compiler
 /*prepare_success = parsed with no trouble
 prepare_unrecognized_statement = command of the statement (insert, select, etc.) wasn't recognized
 prepare_syntax_error = there was an issue with how the statement was parsed (missing an arg, invalid entry, etc.)
-PREPARE_STRING_TOO_LONG = either the name or email field are too long
-prepare_negative_id = a negative id was passed into insert statement*/
+PREPARE_STRING_TOO_LONG = a table or column name in create table is too long
+prepare_negative_id = a negative id was passed into insert statement
+the rest are create table complaining about the schema it was given*/
 typedef enum {PREPARE_SUCCESS, PREPARE_UNRECOGNIZED_STATEMENT, 
 PREPARE_SYNTAX_ERROR, PREPARE_STRING_TOO_LONG,
-PREPARE_NEGATIVE_ID} PrepareResult;
+PREPARE_NEGATIVE_ID, PREPARE_TOO_MANY_COLUMNS, PREPARE_DUPLICATE_COLUMN,
+PREPARE_BAD_KEY_COLUMN, PREPARE_ROW_TOO_BIG} PrepareResult;
 
-typedef enum {STATEMENT_INSERT, STATEMENT_SELECT} StatementType;
+typedef enum {STATEMENT_INSERT, STATEMENT_SELECT, STATEMENT_BEGIN, STATEMENT_COMMIT, STATEMENT_ROLLBACK,
+STATEMENT_CREATE} StatementType;
 
-typedef struct { StatementType type; Row row_to_insert; } Statement;
+//select with no arguments, select id, or select id-id
+typedef enum { SELECT_ALL, SELECT_ONE, SELECT_RANGE } SelectKind;
 
-typedef enum { EXECUTE_SUCCESS, EXECUTE_TABLE_FULL, EXECUTE_DUPLICATE_KEY, EXECUTE_NO_TABLE, EXECUTE_NEGATIVE_ID } ExecuteResult;
+typedef struct {
+	StatementType type;
+	//insert into name / select from name. Empty means the default table (the first one in the file).
+	char table_name[SCHEMA_NAME_SIZE + 1];
+	//insert: one value per column, in column order. Types get checked against the table's schema at execute.
+	uint32_t num_values;
+	Value values[SCHEMA_MAX_COLUMNS];
+	//create table
+	Schema schema;
+	//Only used by select. Kept signed so execute can still complain about negative ids.
+	SelectKind select_kind;
+	int64_t select_from;
+	int64_t select_to;
+	//The argument as it was typed, for tables keyed by a varchar (where select takes one key, dashes and all)
+	char select_key[SCHEMA_MAX_KEY_LENGTH + 1];
+	//select a, b ...: the columns to return, by name. None means whole rows.
+	uint32_t num_projected;
+	char projected[SCHEMA_MAX_COLUMNS][SCHEMA_NAME_SIZE + 1];
+	//select ... where a op x and b op y or ..., no terms when there's no where clause
+	Filter where;
+	//select ... order by column [desc] limit n. An empty order_column keeps key order, limit is SORT_NO_LIMIT without one.
+	char order_column[SCHEMA_NAME_SIZE + 1];
+	bool order_descending;
+	uint64_t limit;
+} Statement;
+
+//EXECUTE_BUSY = server mode only, another connection has a transaction open so this write can't run
+//EXECUTE_WRONG_VALUE_COUNT through EXECUTE_NEGATIVE_KEY = the insert's values don't fit the table's schema
+//EXECUTE_NO_TABLE = no database open, EXECUTE_NO_SUCH_TABLE = the database doesn't have the table the statement named
+//EXECUTE_NO_SUCH_COLUMN = a select's column list or where clause named a column the table doesn't have
+//EXECUTE_READ_ONLY = server mode only, the server is a follower (see Follower.h) and only takes reads
+typedef enum { EXECUTE_SUCCESS, EXECUTE_TABLE_FULL, EXECUTE_DUPLICATE_KEY, EXECUTE_NO_TABLE, EXECUTE_NEGATIVE_ID,
+EXECUTE_TRANSACTION_OPEN, EXECUTE_NO_TRANSACTION, EXECUTE_BUSY, EXECUTE_WRONG_VALUE_COUNT, EXECUTE_TYPE_MISMATCH,
+EXECUTE_STRING_TOO_LONG, EXECUTE_NEGATIVE_KEY, EXECUTE_TABLE_EXISTS, EXECUTE_NO_SUCH_TABLE,
+EXECUTE_TOO_MANY_TABLES, EXECUTE_NO_SUCH_COLUMN, EXECUTE_READ_ONLY } ExecuteResult;
+
+//Everything a statement runs against: the open database, where its output goes, and whether this client has a
+//transaction open. The REPL has exactly one of these, the server has one per connection.
+//emit_row = NULL prints selected rows to out. Otherwise select hands it each row still serialized,
+//straight out of the leaf cell, which is how the binary protocol ships rows without formatting them.
+//layout is the table's schema, or for select a, b a schema of just those columns (see schema_project).
+typedef struct Session {
+	Database* database;
+	FILE* out;
+	bool in_transaction;
+	void (*emit_row)(struct Session* session, const Schema* layout, const void* row);
+} Session;
 
 PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement);
 PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement);
+PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement);
+//create table name (column type, ...)
+PrepareResult prepare_create(InputBuffer* input_buffer, Statement* statement);
+
 
+ExecuteResult execute_statement(Statement* statement, Session* session);
+ExecuteResult execute_insert(Statement* statement, Session* session);
+//The insert itself, for a row that's already serialized the way table lays rows out (execute_insert does that part)
+ExecuteResult execute_insert_row(Session* session, Table* table, const void* row);
+ExecuteResult execute_select(Statement* statement, Session* session);
+//begin, commit and rollback
+ExecuteResult execute_transaction(Statement* statement, Session* session);
+ExecuteResult execute_create(Statement* statement, Session* session);
 
-ExecuteResult execute_statement(Statement* statement, InputBuffer* input_buffer, Table* table);
-ExecuteResult execute_insert(Statement* statement, Table* table);
-ExecuteResult execute_select(Statement* statement, InputBuffer* input_buffer, Table* table);
+//Print the message that goes with a prepare/execute result, shared by the REPL and the server
+void print_prepare_result(FILE* out, PrepareResult result, InputBuffer* input_buffer);
+void print_execute_result(FILE* out, ExecuteResult result);
 
 #endif
\ No newline at end of file
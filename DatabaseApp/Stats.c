@@ -0,0 +1,311 @@
+#include "Stats.h"
+#include "posix_comp.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//One thread's counts. Only the thread that owns a block writes to it, stats_collect just reads.
+typedef struct StatsBlock {
+	EngineStats stats;
+	struct StatsBlock* next;
+	//1 while a thread owns it. A thread that exits gives its block up (see stats_block_release) and the next new
+	//thread takes it over, counts and all, so short lived threads (a sharded select starts one per shard) don't each
+	//leave a block behind. The totals only ever add blocks up, so it doesn't matter whose counts are whose.
+	int in_use;
+} StatsBlock;
+
+//The owner's updates are relaxed stores and collect's reads relaxed loads: nothing gets ordered or locked, it just
+//keeps a 64 bit count from being read half written. On x86 and arm64 both are plain movs.
+#ifdef _MSC_VER
+#define STATS_THREAD_LOCAL __declspec(thread)
+#define STATS_LOAD(x) (*(volatile uint64_t*)&(x))
+#define STATS_STORE(x, v) (*(volatile uint64_t*)&(x) = (v))
+#else
+#define STATS_THREAD_LOCAL _Thread_local
+#define STATS_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STATS_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#endif
+
+static STATS_THREAD_LOCAL StatsBlock* thread_block = NULL;
+//Every block any thread has ever made, newest first. Blocks only ever get pushed on, never taken off, so there are
+//only ever as many as there have been threads counting at the same time.
+static StatsBlock* all_blocks = NULL;
+#ifndef _WIN32
+//Holds each thread's block too, only so its destructor runs when the thread exits
+static pthread_key_t block_key;
+static pthread_once_t block_key_once = PTHREAD_ONCE_INIT;
+
+static void stats_block_release(void* block) {
+	//everything the thread counted goes before the block does
+	__atomic_store_n(&((StatsBlock*)block)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void stats_block_key_create(void) {
+	pthread_key_create(&block_key, stats_block_release);
+}
+
+//Takes over a block an exited thread gave up, NULL if every block has an owner
+static StatsBlock* stats_block_reuse(void) {
+	for (StatsBlock* block = __atomic_load_n(&all_blocks, __ATOMIC_ACQUIRE); block != NULL; block = block->next) {
+		int expected = 0;
+		if (__atomic_load_n(&block->in_use, __ATOMIC_RELAXED) == 0
+			&& __atomic_compare_exchange_n(&block->in_use, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return block;
+		}
+	}
+	return NULL;
+}
+#endif
+
+static const char* counter_names[STAT_NUM_COUNTERS] = {
+	"page_hits", "page_misses", "page_reads", "page_writes", "leaf_splits", "internal_splits", "root_splits",
+	"finds", "append_finds", "result_cache_hits", "result_cache_misses"
+};
+static const char* histogram_names[STAT_NUM_HISTOGRAMS] = {
+	"find_depth", "insert_ns", "select_ns", "transaction_ns", "create_ns"
+};
+
+//A thread's first count takes over a block some exited thread gave up, or makes one and pushes it onto all_blocks
+//with a compare and swap, so there's no lock to set up before the first thread gets here
+static StatsBlock* stats_block(void) {
+	StatsBlock* block = thread_block;
+	if (block != NULL) {
+		return block;
+	}
+#ifndef _WIN32
+	pthread_once(&block_key_once, stats_block_key_create);
+	block = stats_block_reuse();
+	if (block != NULL) {
+		thread_block = block;
+		pthread_setspecific(block_key, block);
+		return block;
+	}
+#endif
+	block = calloc(1, sizeof(StatsBlock));
+	block->in_use = 1;
+#ifdef _MSC_VER
+	StatsBlock* head;
+	do {
+		head = all_blocks;
+		block->next = head;
+	} while (InterlockedCompareExchangePointer((void* volatile*)&all_blocks, block, head) != head);
+#else
+	block->next = __atomic_load_n(&all_blocks, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(&all_blocks, &block->next, block, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+	}
+#endif
+	thread_block = block;
+#ifndef _WIN32
+	pthread_setspecific(block_key, block);
+#endif
+	return block;
+}
+
+void stats_count(StatCounter counter) {
+	StatsBlock* block = stats_block();
+	STATS_STORE(block->stats.counters[counter], block->stats.counters[counter] + 1);
+}
+
+//Index of the highest set bit, 0 for 0 and 1
+static uint32_t stats_log2(uint64_t value) {
+	if (value == 0) {
+		return 0;
+	}
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return (uint32_t)index;
+#else
+	return 63 - (uint32_t)__builtin_clzll(value);
+#endif
+}
+
+void stats_record(StatHistogram histogram, uint64_t value) {
+	StatsBlock* block = stats_block();
+	StatsHistogram* counts = &block->stats.histograms[histogram];
+	uint64_t bucket = histogram == STAT_FIND_DEPTH ? value : stats_log2(value);
+	if (bucket >= STATS_HISTOGRAM_BUCKETS) {
+		bucket = STATS_HISTOGRAM_BUCKETS - 1;
+	}
+	STATS_STORE(counts->count, counts->count + 1);
+	STATS_STORE(counts->sum, counts->sum + value);
+	STATS_STORE(counts->buckets[bucket], counts->buckets[bucket] + 1);
+}
+
+uint64_t stats_clock(void) {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER now;
+	if (frequency.QuadPart == 0) {
+		QueryPerformanceFrequency(&frequency);
+	}
+	QueryPerformanceCounter(&now);
+	return (uint64_t)((double)now.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+void stats_collect(EngineStats* stats) {
+	memset(stats, 0, sizeof(EngineStats));
+#ifdef _MSC_VER
+	StatsBlock* block = (StatsBlock*)all_blocks;
+	MemoryBarrier();
+#else
+	StatsBlock* block = __atomic_load_n(&all_blocks, __ATOMIC_ACQUIRE);
+#endif
+	for (; block != NULL; block = block->next) {
+		for (uint32_t i = 0; i < STAT_NUM_COUNTERS; i++) {
+			stats->counters[i] += STATS_LOAD(block->stats.counters[i]);
+		}
+		for (uint32_t i = 0; i < STAT_NUM_HISTOGRAMS; i++) {
+			StatsHistogram* from = &block->stats.histograms[i];
+			StatsHistogram* to = &stats->histograms[i];
+			to->count += STATS_LOAD(from->count);
+			to->sum += STATS_LOAD(from->sum);
+			for (uint32_t j = 0; j < STATS_HISTOGRAM_BUCKETS; j++) {
+				to->buckets[j] += STATS_LOAD(from->buckets[j]);
+			}
+		}
+	}
+}
+
+//The bucket the fraction-th value falls in. The counts were read one by one while threads kept adding to them, so
+//they might not quite add up to count, in which case it's the last bucket anything's in.
+static uint32_t stats_percentile(const StatsHistogram* histogram, double fraction) {
+	uint64_t target = (uint64_t)(fraction * (double)histogram->count);
+	uint64_t so_far = 0;
+	uint32_t last = 0;
+	for (uint32_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+		if (histogram->buckets[i] == 0) {
+			continue;
+		}
+		last = i;
+		so_far += histogram->buckets[i];
+		if (so_far > target) {
+			break;
+		}
+	}
+	return last;
+}
+
+static void print_duration(FILE* out, double nanoseconds) {
+	if (nanoseconds < 1000) {
+		fprintf(out, "%8.0fns", nanoseconds);
+	}
+	else if (nanoseconds < 1000000) {
+		fprintf(out, "%8.1fus", nanoseconds / 1000);
+	}
+	else if (nanoseconds < 1000000000) {
+		fprintf(out, "%8.1fms", nanoseconds / 1000000);
+	}
+	else {
+		fprintf(out, "%8.2fs ", nanoseconds / 1000000000);
+	}
+}
+
+//Height of the tree the snapshot sees: the root, then down the leftmost child until we hit a leaf
+static void stats_print_heights(FILE* out, Database* database, bool json) {
+	if (database == NULL) {
+		return;
+	}
+	Snapshot snapshot;
+	pager_snapshot_begin(database->pager, &snapshot);
+	pthread_mutex_lock(&database->pager->latch);
+	uint32_t num_tables = database->num_tables;
+	pthread_mutex_unlock(&database->pager->latch);
+	for (uint32_t i = 0; i < num_tables; i++) {
+		Table* table = database->tables[i];
+		uint32_t height = table_height(table, &snapshot);
+		if (json) {
+			fprintf(out, "%s{\"name\":\"%s\",\"height\":%u}", i > 0 ? "," : "", table->schema.table_name, height);
+		}
+		else {
+			fprintf(out, "%s%s %u", i > 0 ? ", " : "Tree height: ", table->schema.table_name, height);
+		}
+	}
+	if (!json && num_tables > 0) {
+		fprintf(out, "\n");
+	}
+	pager_snapshot_end(database->pager, &snapshot);
+}
+
+static void stats_print_json(FILE* out, Database* database, const EngineStats* stats) {
+	fprintf(out, "{\"counters\":{");
+	for (uint32_t i = 0; i < STAT_NUM_COUNTERS; i++) {
+		fprintf(out, "%s\"%s\":%llu", i > 0 ? "," : "", counter_names[i], (unsigned long long)stats->counters[i]);
+	}
+	fprintf(out, "},\"tables\":[");
+	stats_print_heights(out, database, true);
+	fprintf(out, "],\"histograms\":{");
+	for (uint32_t i = 0; i < STAT_NUM_HISTOGRAMS; i++) {
+		const StatsHistogram* histogram = &stats->histograms[i];
+		fprintf(out, "%s\"%s\":{\"count\":%llu,\"sum\":%llu,\"buckets\":[", i > 0 ? "," : "", histogram_names[i],
+			(unsigned long long)histogram->count, (unsigned long long)histogram->sum);
+		//trailing empty buckets are left off
+		uint32_t num_buckets = STATS_HISTOGRAM_BUCKETS;
+		while (num_buckets > 0 && histogram->buckets[num_buckets - 1] == 0) {
+			num_buckets--;
+		}
+		for (uint32_t j = 0; j < num_buckets; j++) {
+			fprintf(out, "%s%llu", j > 0 ? "," : "", (unsigned long long)histogram->buckets[j]);
+		}
+		fprintf(out, "]}");
+	}
+	fprintf(out, "}}\n");
+}
+
+void stats_print(FILE* out, Database* database, bool json) {
+	EngineStats stats;
+	stats_collect(&stats);
+	if (json) {
+		stats_print_json(out, database, &stats);
+		return;
+	}
+	const uint64_t* counters = stats.counters;
+	uint64_t lookups = counters[STAT_PAGE_HITS] + counters[STAT_PAGE_MISSES];
+	fprintf(out, "Pages: %llu hits, %llu misses (%.1f%% hit), %llu read, %llu written\n",
+		(unsigned long long)counters[STAT_PAGE_HITS], (unsigned long long)counters[STAT_PAGE_MISSES],
+		lookups > 0 ? 100.0 * (double)counters[STAT_PAGE_HITS] / (double)lookups : 0.0,
+		(unsigned long long)counters[STAT_PAGE_READS], (unsigned long long)counters[STAT_PAGE_WRITES]);
+	fprintf(out, "Splits: %llu leaf, %llu internal, %llu root\n", (unsigned long long)counters[STAT_LEAF_SPLITS],
+		(unsigned long long)counters[STAT_INTERNAL_SPLITS], (unsigned long long)counters[STAT_ROOT_SPLITS]);
+	stats_print_heights(out, database, false);
+
+	const StatsHistogram* depth = &stats.histograms[STAT_FIND_DEPTH];
+	fprintf(out, "Finds: %llu (%llu appends), depth avg %.2f", (unsigned long long)counters[STAT_FINDS],
+		(unsigned long long)counters[STAT_APPEND_FINDS], depth->count > 0 ? (double)depth->sum / (double)depth->count : 0.0);
+	for (uint32_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+		if (depth->buckets[i] > 0) {
+			fprintf(out, ", %u: %llu", i, (unsigned long long)depth->buckets[i]);
+		}
+	}
+	fprintf(out, "\n");
+	uint64_t cached = counters[STAT_RESULT_CACHE_HITS] + counters[STAT_RESULT_CACHE_MISSES];
+	fprintf(out, "Result cache: %llu hits, %llu misses (%.1f%% hit)\n", (unsigned long long)counters[STAT_RESULT_CACHE_HITS],
+		(unsigned long long)counters[STAT_RESULT_CACHE_MISSES],
+		cached > 0 ? 100.0 * (double)counters[STAT_RESULT_CACHE_HITS] / (double)cached : 0.0);
+
+	//p50 and p99 are the top of the power of two bucket they landed in
+	fprintf(out, "Latency          count         avg        p50        p99\n");
+	for (uint32_t i = STAT_INSERT_LATENCY; i < STAT_NUM_HISTOGRAMS; i++) {
+		const StatsHistogram* histogram = &stats.histograms[i];
+		if (histogram->count == 0) {
+			continue;
+		}
+		//"insert_ns" -> "insert"
+		const char* name = histogram_names[i];
+		fprintf(out, "%-12.*s %9llu  ", (int)(strchr(name, '_') - name), name, (unsigned long long)histogram->count);
+		print_duration(out, (double)histogram->sum / (double)histogram->count);
+		fprintf(out, " ");
+		print_duration(out, (double)(2ull << stats_percentile(histogram, 0.5)));
+		fprintf(out, " ");
+		print_duration(out, (double)(2ull << stats_percentile(histogram, 0.99)));
+		fprintf(out, "\n");
+	}
+}
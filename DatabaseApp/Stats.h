@@ -0,0 +1,75 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "table.h"
+
+//Counters and histograms for what the engine's doing under the hood: how often get_page finds a page already cached,
+//how many pages actually get read and written, how often nodes split, how deep lookups go and how long statements take.
+//
+//Every thread counts into its own block, so bumping a counter is a plain add on memory nobody else writes to, no
+//lock and no shared cache line. .stats adds every thread's block up when it's asked for. A thread's block sticks
+//around after the thread is gone, so its counts still show up in the totals.
+
+typedef enum {
+	//get_page and friends found the page in memory (cached, a shadow, or an old version for a snapshot)
+	STAT_PAGE_HITS,
+	//had to go to the file for it, or wait on a prefetch that was still on its way
+	STAT_PAGE_MISSES,
+	//pages read from the file, read-ahead included
+	STAT_PAGE_READS,
+	//pages written to the file by a checkpoint
+	STAT_PAGE_WRITES,
+	STAT_LEAF_SPLITS,
+	STAT_INTERNAL_SPLITS,
+	//a split that went all the way up and made the tree one level taller
+	STAT_ROOT_SPLITS,
+	//key lookups, and how many of them took the append fast path straight to the rightmost leaf
+	STAT_FINDS,
+	STAT_APPEND_FINDS,
+	//point and range selects the result cache answered, and ones it had to run (see ResultCache.h)
+	STAT_RESULT_CACHE_HITS,
+	STAT_RESULT_CACHE_MISSES,
+	STAT_NUM_COUNTERS
+} StatCounter;
+
+typedef enum {
+	//pages a key lookup read on its way down, the leaf included
+	STAT_FIND_DEPTH,
+	//nanoseconds spent executing each kind of statement
+	STAT_INSERT_LATENCY,
+	STAT_SELECT_LATENCY,
+	//begin, commit and rollback
+	STAT_TRANSACTION_LATENCY,
+	STAT_CREATE_LATENCY,
+	STAT_NUM_HISTOGRAMS
+} StatHistogram;
+
+//Depths go one bucket per level, latencies one per power of two (bucket i is 2^i up to 2^(i+1) - 1 ns, about 17
+//minutes by the last one, which also catches anything slower)
+#define STATS_HISTOGRAM_BUCKETS 40
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+} StatsHistogram;
+
+//Every thread's counts added together
+typedef struct {
+	uint64_t counters[STAT_NUM_COUNTERS];
+	StatsHistogram histograms[STAT_NUM_HISTOGRAMS];
+} EngineStats;
+
+void stats_count(StatCounter counter);
+void stats_record(StatHistogram histogram, uint64_t value);
+//A monotonic clock in nanoseconds, for timing things into a latency histogram
+uint64_t stats_clock(void);
+//Adds up every thread's counts. Threads still counting might be an increment or two ahead of what this sees.
+void stats_collect(EngineStats* stats);
+//.stats: the counters, every table's height and the histograms, as a table for people or as one line of JSON.
+//database can be NULL, the counts are for the whole process either way.
+void stats_print(FILE* out, Database* database, bool json);
+
+#endif
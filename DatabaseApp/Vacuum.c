@@ -0,0 +1,292 @@
+#include "Vacuum.h"
+#include "Journal.h"
+#include "Shard.h"
+#include "posix_comp.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+//One node on the level being built: its page, and the key that goes between it and the next node in their parent
+//(the node's biggest key, or for text keys the shortest key between its last one and the next node's first)
+typedef struct {
+	uint32_t page_num;
+	Value separator;
+} VacuumNode;
+
+typedef struct {
+	VacuumNode* nodes;
+	uint32_t count;
+	uint32_t capacity;
+} VacuumLevel;
+
+static void vacuum_level_add(VacuumLevel* level, uint32_t page_num, const Value* separator) {
+	if (level->count == level->capacity) {
+		level->capacity = level->capacity == 0 ? 16 : level->capacity * 2;
+		level->nodes = realloc(level->nodes, level->capacity * sizeof(VacuumNode));
+	}
+	level->nodes[level->count].page_num = page_num;
+	level->nodes[level->count].separator = *separator;
+	level->count++;
+}
+
+//Same separator a leaf split hands up: integer keys use the left leaf's last key, text keys the shortest start of
+//the right leaf's first key that's still bigger than the left leaf's last. Text gets its own copy, the pages move.
+static Value vacuum_separator(Table* table, const void* left_last, const void* right_first) {
+	Value separator = table_row_key(table, left_last);
+	if (table->text_keys) {
+		Value right_min = table_row_key(table, right_first);
+		uint32_t shared = 0;
+		while (shared < separator.length && right_min.text[shared] == separator.text[shared]) {
+			shared++;
+		}
+		separator.length = shared + 1;
+		char* text = malloc(separator.length);
+		memcpy(text, right_min.text, separator.length);
+		separator.text = text;
+	}
+	return separator;
+}
+
+//Parents for nodes[first] up to nodes[first + count - 1], the last one is the right child
+static void vacuum_contents(Table* table, const VacuumLevel* level, uint32_t first, uint32_t count, InternalNodeContents* contents) {
+	contents->num_keys = count - 1;
+	contents->right_child = level->nodes[first + count - 1].page_num;
+	contents->text = table->text_keys;
+	contents->text_storage = NULL;
+	for (uint32_t i = 0; i < count - 1; i++) {
+		const VacuumNode* node = &level->nodes[first + i];
+		contents->children[i] = node->page_num;
+		if (table->text_keys) {
+			contents->text_keys[i] = node->separator.text;
+			contents->text_key_lengths[i] = (uint16_t)node->separator.length;
+		}
+		else {
+			contents->keys[i] = (uint64_t)node->separator.integer;
+		}
+	}
+}
+
+//Builds the level above children: each parent takes as many children as it can encode, except that the last parent
+//never gets left with just one
+static VacuumLevel vacuum_build_parents(Table* table, const VacuumLevel* children) {
+	Pager* pager = table->pager;
+	VacuumLevel parents = { NULL, 0, 0 };
+	InternalNodeContents* contents = malloc(sizeof(InternalNodeContents));
+	uint32_t first = 0;
+	while (first < children->count) {
+		uint32_t page_num = get_unused_page_num(pager);
+		void* node = get_page_for_write(pager, page_num);
+		initialize_internal_node(node);
+		uint32_t remaining = children->count - first;
+		uint32_t count = remaining < 2 ? remaining : 2;
+		while (count < remaining && count <= INTERNAL_NODE_MAX_CELLS) {
+			vacuum_contents(table, children, first, count + 1, contents);
+			if (!internal_node_encode(table, node, contents)) {
+				break;
+			}
+			count++;
+		}
+		if (remaining - count == 1 && count > 2) {
+			count--;
+		}
+		vacuum_contents(table, children, first, count, contents);
+		internal_node_encode(table, node, contents);
+		for (uint32_t i = 0; i < count; i++) {
+			*node_parent(get_page_for_write(pager, children->nodes[first + i].page_num)) = page_num;
+		}
+		//the parent sits between the same two neighbours its last child does
+		vacuum_level_add(&parents, page_num, &children->nodes[first + count - 1].separator);
+		first += count;
+	}
+	free(contents);
+	return parents;
+}
+
+//Copies a table into the rebuilt file and returns its new root. The leaves come first, filled to leaf_max_cells and
+//numbered in key order, then each level of internal nodes above them.
+static uint32_t vacuum_table(Table* source, Snapshot* snapshot, Pager* rebuilt) {
+	//Same layout, just living in the other file
+	Table table = *source;
+	table.pager = rebuilt;
+	table.column_store = NULL;
+
+	VacuumLevel leaves = { NULL, 0, 0 };
+	Value no_separator = { VALUE_INTEGER, 0, 0, NULL, 0 };
+	uint32_t page_num = 0;
+	void* leaf = NULL;
+	Cursor cursor;
+	table_seek_start(source, snapshot, &cursor);
+	while (!cursor.end_of_table) {
+		const void* row = cursor_value(&cursor);
+		if (leaf == NULL || *leaf_node_num_cells(leaf) == table.leaf_max_cells) {
+			uint32_t next_page_num = get_unused_page_num(rebuilt);
+			void* next = get_page_for_write(rebuilt, next_page_num);
+			initialize_leaf_node(next);
+			*leaf_node_next_leaf(next) = 0;
+			if (leaf != NULL) {
+				*leaf_node_next_leaf(leaf) = next_page_num;
+				Value separator = vacuum_separator(&table, leaf_node_value(&table, leaf, table.leaf_max_cells - 1), row);
+				vacuum_level_add(&leaves, page_num, &separator);
+			}
+			page_num = next_page_num;
+			leaf = next;
+		}
+		memcpy(leaf_node_value(&table, leaf, *leaf_node_num_cells(leaf)), row, table.schema.row_size);
+		*leaf_node_num_cells(leaf) += 1;
+		cursor_advance(&cursor);
+	}
+	if (leaf == NULL) {
+		//empty table, still needs its root
+		page_num = get_unused_page_num(rebuilt);
+		leaf = get_page_for_write(rebuilt, page_num);
+		initialize_leaf_node(leaf);
+		*leaf_node_next_leaf(leaf) = 0;
+	}
+	vacuum_level_add(&leaves, page_num, &no_separator);
+
+	VacuumLevel level = leaves;
+	while (level.count > 1) {
+		VacuumLevel parents = vacuum_build_parents(&table, &level);
+		if (level.nodes != leaves.nodes) {
+			free(level.nodes);
+		}
+		level = parents;
+	}
+	uint32_t root_page_num = level.nodes[0].page_num;
+	set_node_root(get_page_for_write(rebuilt, root_page_num), true);
+	if (level.nodes != leaves.nodes) {
+		free(level.nodes);
+	}
+	//the separators further up were copies of these
+	if (table.text_keys) {
+		for (uint32_t i = 0; i + 1 < leaves.count; i++) {
+			free((char*)leaves.nodes[i].separator.text);
+		}
+	}
+	free(leaves.nodes);
+	return root_page_num;
+}
+
+//The rename only survives a crash once the directory it happened in is on disk too
+static void vacuum_sync_directory(const char* path) {
+#ifndef _WIN32
+	const char* slash = strrchr(path, '/');
+	char* directory = NULL;
+	if (slash == NULL) {
+		directory = malloc(2);
+		strcpy(directory, ".");
+	}
+	else {
+		size_t length = slash == path ? 1 : (size_t)(slash - path);
+		directory = malloc(length + 1);
+		memcpy(directory, path, length);
+		directory[length] = '\0';
+	}
+	int fd = open(directory, O_RDONLY);
+	if (fd != -1) {
+		fsync(fd);
+		close(fd);
+	}
+	free(directory);
+#else
+	(void)path;
+#endif
+}
+
+//Vacuums one file, the database's own or one of its shards
+static VacuumResult vacuum_file(Database* database, VacuumStats* stats) {
+	Pager* pager = database->pager;
+	pthread_mutex_lock(&pager->latch);
+	bool in_transaction = pager->in_transaction;
+	//A table only remembers the root it had before the last vacuum, so a reader from before that has to be done first
+	bool busy = false;
+	for (Snapshot* snapshot = pager->snapshots; snapshot != NULL; snapshot = snapshot->next) {
+		for (uint32_t i = 0; i < database->num_tables; i++) {
+			busy = busy || snapshot->commit_seq < database->tables[i]->root_moved_at;
+		}
+	}
+	stats->pages_before = pager->num_pages;
+	pthread_mutex_unlock(&pager->latch);
+	if (in_transaction) {
+		return VACUUM_IN_TRANSACTION;
+	}
+	if (busy) {
+		return VACUUM_BUSY;
+	}
+
+	//Whatever an earlier vacuum that died left lying around goes first
+	size_t path_length = strlen(pager->path) + strlen("-vacuum") + 1;
+	char* path = malloc(path_length);
+	snprintf(path, path_length, "%s-vacuum", pager->path);
+	char* journal_path = journal_path_for(path);
+	unlink(path);
+	unlink(journal_path);
+	free(journal_path);
+	//The copy keeps the file's page size
+	Pager* rebuilt = pager_open(path, pager->page_size);
+
+	//Page 0 is the header, every table goes after it, then the catalog pointing at their new roots
+	get_page_for_write(rebuilt, 0);
+	Snapshot snapshot;
+	pager_snapshot_begin(pager, &snapshot);
+	uint32_t root_page_nums[DATABASE_MAX_TABLES];
+	for (uint32_t i = 0; i < database->num_tables; i++) {
+		root_page_nums[i] = vacuum_table(database->tables[i], &snapshot, rebuilt);
+	}
+	pager_snapshot_end(pager, &snapshot);
+	uint32_t catalog_root = database_write_catalog(database, rebuilt, root_page_nums);
+	pager_checkpoint(rebuilt);
+
+	//rename swaps the whole file in one go: a crash before it leaves the old file, after it the new one
+	bool renamed;
+#ifdef _WIN32
+	renamed = MoveFileExA(path, pager->path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	renamed = rename(path, pager->path) == 0;
+#endif
+	if (!renamed) {
+		printf("Error swapping in vacuumed file: %d\n", errno);
+		//Throw the copy away, it never got swapped in
+		pager_discard(rebuilt);
+		unlink(path);
+		free(path);
+		return VACUUM_FAILED;
+	}
+	vacuum_sync_directory(pager->path);
+	free(path);
+	stats->pages_after = rebuilt->num_pages;
+	database_install_file(database, rebuilt, root_page_nums, catalog_root);
+	return VACUUM_SUCCESS;
+}
+
+VacuumResult database_vacuum(Database* database, VacuumStats* stats) {
+	VacuumResult result = vacuum_file(database, stats);
+	ShardSet* shards = database->shards;
+	//Each shard is a file of its own and gets swapped in on its own, the stats add them all up
+	for (uint32_t i = 0; shards != NULL && i < shards->num_shards && result == VACUUM_SUCCESS; i++) {
+		VacuumStats shard_stats;
+		result = vacuum_file(shards->shards[i], &shard_stats);
+		if (result == VACUUM_SUCCESS) {
+			stats->pages_before += shard_stats.pages_before;
+			stats->pages_after += shard_stats.pages_after;
+		}
+	}
+	return result;
+}
+
+void print_vacuum_result(FILE* out, VacuumResult result, const VacuumStats* stats) {
+	switch (result) {
+	case(VACUUM_SUCCESS):
+		fprintf(out, "Vacuumed: %u pages -> %u pages.\n", stats->pages_before, stats->pages_after);
+		break;
+	case(VACUUM_IN_TRANSACTION):
+		fprintf(out, "Error: Can't vacuum inside a transaction.\n");
+		break;
+	case(VACUUM_BUSY):
+		fprintf(out, "Error: Database is busy.\n");
+		break;
+	case(VACUUM_FAILED):
+		fprintf(out, "Error: Vacuum failed, the database is unchanged.\n");
+		break;
+	}
+}
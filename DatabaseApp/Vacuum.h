@@ -0,0 +1,35 @@
+#ifndef VACUUM_H
+#define VACUUM_H
+#include <stdio.h>
+#include "table.h"
+
+//.vacuum: rewrites the whole file densely. Splitting leaves them half full, and pages land in the file in whatever
+//order they were allocated, so after a while a scan hops all over the file reading pages that are half empty.
+//A vacuum copies every table out of a snapshot into a new file (<db>-vacuum) bottom up: every leaf as full as it'll go,
+//the leaves back to back in key order, then the internal nodes above them. That copy is synced, renamed over the
+//database file (the atomic part), and swapped in as one commit.
+//
+//It's online for readers: the copy is made from a snapshot, so reads carry on while it's built, and reads that are
+//still going when it gets swapped in finish on the old pages. Writes have to wait, the server holds its write lock
+//for the whole thing.
+//A sharded database's shard files get vacuumed one after the other after its own, and the stats count all of them.
+
+typedef enum {
+	VACUUM_SUCCESS,
+	//inside begin/commit, commit or roll back first
+	VACUUM_IN_TRANSACTION,
+	//a reader from before the last vacuum is still going
+	VACUUM_BUSY,
+	//couldn't swap the new file in, the database is left as it was
+	VACUUM_FAILED
+} VacuumResult;
+
+typedef struct {
+	uint32_t pages_before;
+	uint32_t pages_after;
+} VacuumStats;
+
+VacuumResult database_vacuum(Database* database, VacuumStats* stats);
+void print_vacuum_result(FILE* out, VacuumResult result, const VacuumStats* stats);
+
+#endif
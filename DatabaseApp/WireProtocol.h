@@ -0,0 +1,86 @@
+#ifndef WIRE_PROTOCOL_H
+#define WIRE_PROTOCOL_H
+#include <stdint.h>
+#include <string.h>
+
+//The binary protocol server mode speaks alongside the text one. Shared by Server.c and the client library.
+//
+//A client picks it by sending WIRE_MAGIC as the very first bytes on the connection (text clients can't,
+//their first byte is never NUL). After that everything is a frame:
+//
+//  uint32 length | uint8 type | payload
+//
+//length counts the type byte plus the payload. Every integer is little endian.
+//
+//Client -> server
+//  WIRE_PREPARE   statement text, '?' where a parameter goes ("insert ? ? ?", "select from t ?", "select ?-?",
+//                 "select a, b from t where c > ?"), not for table or column names
+//  WIRE_EXECUTE   uint32 statement id, uint8 param count, then each param:
+//                   WIRE_PARAM_INT    int32
+//                   WIRE_PARAM_TEXT   uint16 length, bytes (no terminator)
+//                   WIRE_PARAM_INT64  int64
+//                   WIRE_PARAM_DOUBLE the double's 64 bits
+//  WIRE_FINALIZE  uint32 statement id, forget a prepared statement (no reply)
+//  WIRE_CHANGES   uint64 sequence number, a follower asking for the change log's records after it (see ChangeLog.h)
+//
+//Server -> client
+//  WIRE_PREPARED       uint32 statement id, uint8 param count
+//  WIRE_PREPARE_ERROR  uint8 PrepareResult
+//  WIRE_ROW            one row exactly as it sits in the leaf cell (the table's row_size bytes, laid out by its Schema).
+//                      A select with a column list sends just those columns' slots, back to back in the order asked for.
+//                      Client and server share a machine, so this one is in host byte order.
+//  WIRE_DONE           uint8 ExecuteResult, uint32 rows sent. Ends every execute that ran.
+//  WIRE_CHANGE_BATCH   uint8 1 if the database keeps a change log (0 and nothing else if not), uint64 the log's last
+//                      sequence number, then as many whole records as fit in CHANGE_LOG_BATCH_SIZE, exactly as they
+//                      are in the log (none if there's nothing new). Answers every WIRE_CHANGES.
+//An execute that never ran (unknown statement id, parameters that don't fit) gets WIRE_PREPARE_ERROR instead.
+//
+//Frames are answered in the order they were sent, so a client can pipeline as many as it likes.
+
+#define WIRE_MAGIC "\0DBW"
+#define WIRE_MAGIC_SIZE 4
+#define WIRE_HEADER_SIZE (sizeof(uint32_t) + sizeof(uint8_t))
+
+typedef enum {
+	WIRE_PREPARE = 1,
+	WIRE_EXECUTE = 2,
+	WIRE_FINALIZE = 3,
+	WIRE_CHANGES = 4,
+	WIRE_PREPARED = 0x81,
+	WIRE_PREPARE_ERROR = 0x82,
+	WIRE_ROW = 0x83,
+	WIRE_DONE = 0x84,
+	WIRE_CHANGE_BATCH = 0x85
+} WireMessage;
+
+typedef enum { WIRE_PARAM_INT = 1, WIRE_PARAM_TEXT = 2, WIRE_PARAM_INT64 = 3, WIRE_PARAM_DOUBLE = 4 } WireParamType;
+
+//Most parameters a statement can have, one per column (SCHEMA_MAX_COLUMNS)
+#define WIRE_MAX_PARAMS 32
+
+//Byte order helpers, spelled out so the format doesn't depend on the machine
+static inline void wire_put_u32(uint8_t* destination, uint32_t value) {
+	destination[0] = (uint8_t)value;
+	destination[1] = (uint8_t)(value >> 8);
+	destination[2] = (uint8_t)(value >> 16);
+	destination[3] = (uint8_t)(value >> 24);
+}
+static inline uint32_t wire_get_u32(const uint8_t* source) {
+	return (uint32_t)source[0] | ((uint32_t)source[1] << 8) | ((uint32_t)source[2] << 16) | ((uint32_t)source[3] << 24);
+}
+static inline void wire_put_u64(uint8_t* destination, uint64_t value) {
+	wire_put_u32(destination, (uint32_t)value);
+	wire_put_u32(destination + 4, (uint32_t)(value >> 32));
+}
+static inline uint64_t wire_get_u64(const uint8_t* source) {
+	return (uint64_t)wire_get_u32(source) | ((uint64_t)wire_get_u32(source + 4) << 32);
+}
+static inline void wire_put_u16(uint8_t* destination, uint16_t value) {
+	destination[0] = (uint8_t)value;
+	destination[1] = (uint8_t)(value >> 8);
+}
+static inline uint16_t wire_get_u16(const uint8_t* source) {
+	return (uint16_t)(source[0] | (source[1] << 8));
+}
+
+#endif
@@ -1,9 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include "InputBuffer.h"
 #include "MetaCommand.h"
 #include "Statement.h"
+#ifdef __linux__
+#include "Server.h"
+#include "Follower.h"
+#endif
 //Quick function for handling our input prompt.
 void print_prompt() { printf("db > "); }
 
@@ -11,6 +16,8 @@ void print_prompt() { printf("db > "); }
 #define INITIAL_BUFFER_SIZE 256
 #define MAX_BUFFER_SIZE 16384
 //getline() equivalent for windows, we need an input reader which is resizable, hence the definitions above.
+//POSIX already ships getline() in stdio.h, so only define ours on windows.
+#ifdef _WIN32
 ssize_t getline(char** lineptr, size_t* n, FILE* stream) {
 	if (!lineptr || !n || !stream) return -1;
 
@@ -52,6 +59,7 @@ ssize_t getline(char** lineptr, size_t* n, FILE* stream) {
 	(*lineptr)[pos] = '\0';
 	return (ssize_t)pos;
 }
+#endif
 
 //Finally, with that monstrosity declared above, we can handle the read input function
 //Reads input into an InputBuffer
@@ -79,10 +87,36 @@ int main(int argc, char* argv[]) {
 	//main.c will serve as our entry point into the application.
 	//Similar to my MTG Deck builder project, this is my first real C project (first C project ever in fact)
 	//So expect a significant amount of comments (I'd argue too many for anyone familiar with the langauge)
-	Table* table = NULL;
+	//The REPL is a single client, so it gets a single session
+	Session session = { NULL, stdout, false, NULL };
+#ifdef __linux__
+	//DatabaseApp --serve socket_path filename.db [workers] runs the server instead of the prompt
+	if (argc >= 4 && strcmp(argv[1], "--serve") == 0) {
+		Database* database = db_open(argv[3]);
+		uint32_t num_workers = argc >= 5 ? (uint32_t)atoi(argv[4]) : SERVER_DEFAULT_WORKERS;
+		int result = server_run(database, argv[2], num_workers, NULL);
+		db_close(database);
+		return result;
+	}
+	//DatabaseApp --follow source follower.db [socket_path [workers]] keeps follower.db in step with source,
+	//serving reads on socket_path if there is one (see Follower.h)
+	if (argc >= 4 && strcmp(argv[1], "--follow") == 0) {
+		Database* database = db_open(argv[3]);
+		int result;
+		if (argc >= 5) {
+			uint32_t num_workers = argc >= 6 ? (uint32_t)atoi(argv[5]) : SERVER_DEFAULT_WORKERS;
+			result = server_run(database, argv[4], num_workers, argv[2]);
+		}
+		else {
+			result = follower_run(database, argv[2]);
+		}
+		db_close(database);
+		return result;
+	}
+#endif
 	if (argc >= 2) {
 		char* filename = argv[1];
-		table = db_open(filename);
+		session.database = db_open(filename);
 	}
 	//Putting the input buffer into it's own header and c file is overkill, this is just to get me comfy with the conventions
 	InputBuffer* input_buffer = new_input_buffer();
@@ -92,59 +126,36 @@ int main(int argc, char* argv[]) {
 		read_input(input_buffer);
 		//Seperate out meta commands (.help, .tables, etc.) by checking if the first element in the buffer is a dot
 		if (input_buffer->buffer[0] == '.') {
-			switch (do_meta_command(input_buffer, table)) {
+			switch (do_meta_command(input_buffer, session.database)) {
 			case (META_COMMAND_SUCCESS):
 				continue;
 			case (META_COMMAND_UNRECOGNIZED_COMMAND):
 				printf("Unrecognized command '%s' .\n", input_buffer->buffer);
 				continue;
 			case (META_COMMAND_CLOSE_SUCCESS):
-				table = NULL;
+				//closing rolls back anything uncommitted
+				session.database = NULL;
+				session.in_transaction = false;
 				continue;
-			case (META_COMMAND_OPEN_SUCCESS):
+			case (META_COMMAND_OPEN_SUCCESS): {
 				char* filename = input_buffer->buffer + 6;
 				filename[strcspn(filename, "\n")] = 0;
-				table = db_open(filename);
+				session.database = db_open(filename);
+				session.in_transaction = false;
 				printf("Opened database file %s\n", filename);
 				continue;
 			}
+			}
 		}
 		//Check if input is a non-meta valid statement, if not restart the loop and print the error.
 		Statement statement;
-		switch (prepare_statement(input_buffer, &statement)) {
-		case(PREPARE_SUCCESS):
-			break;
-		case(PREPARE_SYNTAX_ERROR):
-			printf("Syntax error. Could not parse statement.");
-			continue;
-		case(PREPARE_UNRECOGNIZED_STATEMENT):
-			printf("Unrecognized keyword at start of '%s'.\n", input_buffer->buffer);
-			continue;
-		case(PREPARE_STRING_TOO_LONG):
-			printf("String input is too long.\n");
-			continue;
-		case(PREPARE_NEGATIVE_ID):
-			printf("ID must be positive.\n");
+		PrepareResult prepare_result = prepare_statement(input_buffer, &statement);
+		if (prepare_result != PREPARE_SUCCESS) {
+			print_prepare_result(stdout, prepare_result, input_buffer);
 			continue;
 		}
 		//If we reached here we have a valid non-meta statement, so execute!
-		switch (execute_statement(&statement, input_buffer, table)) {
-		case(EXECUTE_SUCCESS):
-			printf("Executed.\n");
-			break;
-		case(EXECUTE_TABLE_FULL):
-			printf("Error: Table full.\n");
-			break;
-		case(EXECUTE_DUPLICATE_KEY):
-			printf("Error: Duplicate key.\n");
-			break;
-		case(EXECUTE_NO_TABLE):
-			printf("No table to perform statement!\n");
-			break;
-		case(EXECUTE_NEGATIVE_ID):
-			printf("Negative id was given for selection\n");
-			break;
-		}
+		print_execute_result(stdout, execute_statement(&statement, &session));
 	}
 	return 0;
 }
\ No newline at end of file
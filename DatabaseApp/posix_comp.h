@@ -9,8 +9,52 @@
 //Oh why oh why POSIX?
 #ifdef _WIN32
 	#include <basetsd.h>
+	#include <io.h>
+	#include <fcntl.h>
+	#include <sys/stat.h>
 	typedef SSIZE_T ssize_t;
+	//Windows spells the POSIX file calls with an underscore, map them so table.c can use the normal names.
+	#define open _open
+	#define close _close
+	#define O_RDWR _O_RDWR
+	#define O_CREAT _O_CREAT
+	//Without this windows opens the file in text mode and mangles any 0x0A byte in a page
+	#define O_BINARY _O_BINARY
+	#define S_IRUSR _S_IREAD
+	#define S_IWUSR _S_IWRITE
+	//Just enough of pthreads for the pager's latch, backed by a critical section
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+	typedef CRITICAL_SECTION pthread_mutex_t;
+	#define pthread_mutex_init(m, attr) (InitializeCriticalSection(m), 0)
+	#define pthread_mutex_lock(m) (EnterCriticalSection(m), 0)
+	#define pthread_mutex_unlock(m) (LeaveCriticalSection(m), 0)
+	#define pthread_mutex_destroy(m) (DeleteCriticalSection(m), 0)
+	#define unlink _unlink
+	#define dup _dup
+	//_commit is windows' fsync, and _chsize_s does what ftruncate does
+	#define fsync _commit
+	#define ftruncate _chsize_s
+	//same thing as strtok_r, different name
+	#define strtok_r strtok_s
+	//There's no pread/pwrite on windows, so we fake them with a seek + read/write.
+	//Not atomic like the real ones, but we only ever have one thread touching the file.
+	static __inline ssize_t pread(int fd, void* buf, size_t count, long long offset) {
+		if (_lseeki64(fd, offset, SEEK_SET) == -1) return -1;
+		return _read(fd, buf, (unsigned int)count);
+	}
+	static __inline ssize_t pwrite(int fd, const void* buf, size_t count, long long offset) {
+		if (_lseeki64(fd, offset, SEEK_SET) == -1) return -1;
+		return _write(fd, buf, (unsigned int)count);
+	}
 #else
-	//Do nothing because we have ssize_t already
+	//ssize_t, pread/pwrite and friends all come with the platform
+	#include <sys/types.h>
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sys/stat.h>
+	#include <pthread.h>
+	//POSIX has no text mode, so there's nothing to turn off
+	#define O_BINARY 0
+#endif
 #endif
-#endif
\ No newline at end of file
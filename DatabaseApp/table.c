@@ -1,4 +1,11 @@
-#include "Table.h"
+#include "table.h"
+#include "Journal.h"
+#include "ColumnStore.h"
+#include "Stats.h"
+#include "Analyze.h"
+#include "ChangeLog.h"
+#include "Shard.h"
+#include "ResultCache.h"
 //needed for ssize_t
 #include "posix_comp.h"
 //remember, needed for malloc and free
@@ -7,77 +14,611 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
-#include <fcntl.h>
-#include <sys/stat.h>
-
-//Opens database file, initializing table and pager.
-Table* db_open(const char* filename) {
-	Pager* pager = pager_open(filename);
+#ifdef __linux__
+//madvise, to ask for huge pages under the frame slab
+#include <sys/mman.h>
+#endif
+//Internal node searches compare a vector of packed keys at a time when the compiler gives us SSE2
+//(every x86-64 build does), anything else takes the scalar loop
+#if defined(__SSE2__) || defined(_M_X64)
+#define KEY_SEARCH_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define count_bits(x) __popcnt(x)
+#else
+#define count_bits(x) __builtin_popcount(x)
+#endif
+#endif
+
+//The catalog's columns. The schema column just needs a slot big enough for schema_encode's bytes.
+#define CATALOG_COLUMN_ID 0
+#define CATALOG_COLUMN_NAME 1
+#define CATALOG_COLUMN_ROOT 2
+#define CATALOG_COLUMN_SCHEMA 3
+
+static void catalog_schema(Schema* schema) {
+	schema_init(schema, "catalog");
+	schema_add_column(schema, "id", COLUMN_INT32, 0);
+	schema_add_column(schema, "name", COLUMN_VARCHAR, SCHEMA_NAME_SIZE);
+	schema_add_column(schema, "root_page", COLUMN_INT32, 0);
+	schema_add_column(schema, "schema", COLUMN_VARCHAR, SCHEMA_ENCODED_SIZE - 1);
+	schema_compile(schema);
+}
 
+static Table* table_new(Pager* pager, uint32_t root_page_num, uint32_t table_id, const Schema* schema) {
 	Table* table = malloc(sizeof(Table));
 	table->pager = pager;
-	table->root_page_num = 0;
+	table->root_page_num = root_page_num;
+	table->old_root_page_num = root_page_num;
+	table->root_moved_at = 0;
+	table->table_id = table_id;
+	table->created_at = 0;
+	table->modified_at = 0;
+	table->column_store = NULL;
+	table->analysis = NULL;
+	table->append_leaf = INVALID_PAGE_NUM;
+	table->append_epoch = 0;
+	table_set_schema(table, schema);
+	return table;
+}
+
+//Starts a new, empty B-tree, returns its root page
+static uint32_t table_new_root(Pager* pager) {
+	uint32_t page_num = get_unused_page_num(pager);
+	void* root = get_page_for_write(pager, page_num);
+	initialize_leaf_node(root);
+	set_node_root(root, true);
+	return page_num;
+}
+
+static void write_header(Pager* pager, uint32_t catalog_root) {
+	void* header = get_page_for_write(pager, 0);
+	uint32_t version = HEADER_FORMAT_VERSION;
+	uint32_t page_size = pager->page_size;
+	memset(header, 0, page_size);
+	memcpy(header, HEADER_MAGIC, HEADER_MAGIC_SIZE);
+	memcpy((char*)header + HEADER_ROOT_PAGE_OFFSET, &catalog_root, sizeof(uint32_t));
+	memcpy((char*)header + HEADER_VERSION_OFFSET, &version, sizeof(uint32_t));
+	memcpy((char*)header + HEADER_PAGE_SIZE_OFFSET, &page_size, sizeof(uint32_t));
+	//page count, free list and clean flag stay 0 until close
+	pager->has_header = true;
+}
+
+//Adds a table's row to the catalog
+static void catalog_insert(Database* database, uint32_t table_id, uint32_t root_page_num, const Schema* schema) {
+	Table* catalog = database->catalog;
+	const Column* columns = catalog->schema.columns;
+	uint8_t row[SCHEMA_MAX_ROW_SIZE];
+	memset(row, 0, catalog->schema.row_size);
+	int32_t id = (int32_t)table_id;
+	int32_t root = (int32_t)root_page_num;
+	memcpy(row + columns[CATALOG_COLUMN_ID].offset, &id, sizeof(id));
+	//the row's zeroed, so the name ends up terminated (create table already held it to SCHEMA_NAME_SIZE)
+	memcpy(row + columns[CATALOG_COLUMN_NAME].offset, schema->table_name, strlen(schema->table_name));
+	memcpy(row + columns[CATALOG_COLUMN_ROOT].offset, &root, sizeof(root));
+	schema_encode(schema, row + columns[CATALOG_COLUMN_SCHEMA].offset);
+	Cursor* cursor = table_find(catalog, table_id);
+	leaf_node_insert(cursor, row);
+	free(cursor);
+}
+
+//Builds a Table for every row in the catalog
+static void catalog_load(Database* database) {
+	Table* catalog = database->catalog;
+	const Column* columns = catalog->schema.columns;
+	Cursor* cursor = table_start(catalog);
+	while (!cursor->end_of_table) {
+		const char* row = cursor_value(cursor);
+		int32_t id;
+		int32_t root;
+		Schema schema;
+		memcpy(&id, row + columns[CATALOG_COLUMN_ID].offset, sizeof(id));
+		memcpy(&root, row + columns[CATALOG_COLUMN_ROOT].offset, sizeof(root));
+		if (database->num_tables == DATABASE_MAX_TABLES || !schema_decode(&schema, row + columns[CATALOG_COLUMN_SCHEMA].offset)) {
+			printf("Database catalog is corrupt.\n");
+			exit(EXIT_FAILURE);
+		}
+		database->tables[database->num_tables++] = table_new(database->pager, (uint32_t)root, (uint32_t)id, &schema);
+		cursor_advance(cursor);
+	}
+	free(cursor);
+}
 
+//One of PAGE_SIZE_VARIANTS
+#define CASE_PAGE_SIZE(size) case(size):
+static bool page_size_supported(uint32_t page_size) {
+	switch (page_size) {
+	PAGE_SIZE_VARIANTS(CASE_PAGE_SIZE)
+		return true;
+	default:
+		return false;
+	}
+}
+
+//Opens database file, initializing the pager and every table in it.
+Database* db_open(const char* filename) {
+	uint32_t page_size = PAGE_SIZE;
+	const char* setting = getenv("DB_PAGE_SIZE");
+	if (setting != NULL && setting[0] != '\0') {
+		page_size = (uint32_t)strtoul(setting, NULL, 10);
+	}
+	Database* database = db_open_page_size(filename, page_size);
+	if (database == NULL) {
+		printf("DB_PAGE_SIZE must be 4096, 16384 or 65536, not %s.\n", setting);
+		exit(EXIT_FAILURE);
+	}
+	return database;
+}
+
+//Builds the Database for a freshly opened pager: the header and catalog of a new file, or whatever tables an
+//existing one has
+static Database* database_load(Pager* pager) {
+	Database* database = malloc(sizeof(Database));
+	database->pager = pager;
+	database->catalog = NULL;
+	database->num_tables = 0;
+	database->changes = NULL;
+	database->shards = NULL;
+	database->results = NULL;
+
+	Schema schema;
 	if (pager->num_pages == 0) {
-		//This means our database file is new. Initialize page 0 as leaf node.
-		void* root_node = get_page(pager, 0);
-		initialize_leaf_node(root_node);
-		set_node_root(root_node, true);
+		//This means our database file is new. Page 0 is the header, then come the catalog's root
+		//and the default users table's root, so inserting straight away works like it always has.
+		get_page_for_write(pager, 0);
+		catalog_schema(&schema);
+		uint32_t catalog_root = table_new_root(pager);
+		write_header(pager, catalog_root);
+		database->catalog = table_new(pager, catalog_root, 0, &schema);
+		schema_default(&schema);
+		Table* users = table_new(pager, table_new_root(pager), 1, &schema);
+		catalog_insert(database, users->table_id, users->root_page_num, &users->schema);
+		database->tables[database->num_tables++] = users;
+		return database;
+	}
+
+	void* first_page = get_page(pager, 0);
+	if (memcmp(first_page, HEADER_MAGIC, HEADER_MAGIC_SIZE) == 0) {
+		uint32_t catalog_root;
+		memcpy(&catalog_root, (char*)first_page + HEADER_ROOT_PAGE_OFFSET, sizeof(uint32_t));
+		catalog_schema(&schema);
+		database->catalog = table_new(pager, catalog_root, 0, &schema);
+		catalog_load(database);
+		return database;
+	}
+	//Files from before the catalog have exactly one table
+	uint32_t root_page_num = 0;
+	if (memcmp(first_page, HEADER_SINGLE_TABLE_MAGIC, HEADER_MAGIC_SIZE) == 0) {
+		if (!schema_decode(&schema, (char*)first_page + HEADER_SCHEMA_OFFSET)) {
+			printf("Database header is corrupt.\n");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(&root_page_num, (char*)first_page + HEADER_ROOT_PAGE_OFFSET, sizeof(uint32_t));
+	}
+	else {
+		schema_default(&schema);
+	}
+	database->tables[database->num_tables++] = table_new(pager, root_page_num, 0, &schema);
+	return database;
+}
+
+//Opens <db>-changes. Anything the log has that a crash kept out of the file goes back in first, while the log isn't
+//attached yet (those changes are in it already).
+static void database_open_change_log(Database* database, const char* filename, bool clean) {
+	char* path = change_log_path_for(filename);
+	ChangeLog* log = change_log_open(path, true);
+	if (log == NULL) {
+		printf("Unable to open change log %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	free(path);
+	change_log_attach(log, database->pager);
+	if (!clean) {
+		uint64_t replayed = change_log_replay(log, database);
+		if (replayed > 0) {
+			printf("Replayed %llu changes from the change log.\n", (unsigned long long)replayed);
+		}
+	}
+	database->changes = log;
+}
+
+Database* db_open_file(const char* filename, uint32_t page_size) {
+	if (!page_size_supported(page_size)) {
+		return NULL;
+	}
+	return database_load(pager_open(filename, page_size));
+}
+
+//HEADER_SHARD_COUNT_OFFSET for an existing file, DB_SHARDS for a new one (which gets it written into its header)
+static uint32_t database_shard_count(Database* database, bool created) {
+	Pager* pager = database->pager;
+	uint32_t num_shards = 0;
+	if (!pager->has_header) {
+		return 0;
+	}
+	if (!created) {
+		memcpy(&num_shards, (char*)get_page(pager, 0) + HEADER_SHARD_COUNT_OFFSET, sizeof(uint32_t));
+		return num_shards;
+	}
+	const char* setting = getenv("DB_SHARDS");
+	if (setting != NULL && setting[0] != '\0') {
+		num_shards = (uint32_t)strtoul(setting, NULL, 10);
+	}
+	if (num_shards > SHARD_MAX) {
+		printf("DB_SHARDS can be at most %d, not %s.\n", SHARD_MAX, setting);
+		exit(EXIT_FAILURE);
+	}
+	//one shard is just the file itself
+	num_shards = num_shards >= 2 ? num_shards : 0;
+	memcpy((char*)get_page_for_write(pager, 0) + HEADER_SHARD_COUNT_OFFSET, &num_shards, sizeof(uint32_t));
+	return num_shards;
+}
+
+Database* db_open_page_size(const char* filename, uint32_t page_size) {
+	if (!page_size_supported(page_size)) {
+		return NULL;
+	}
+	Pager* pager = pager_open(filename, page_size);
+	//the first checkpoint clears this, so it's read before anything can be written
+	bool clean = pager->clean_on_disk;
+	bool created = pager->num_pages == 0;
+	Database* database = database_load(pager);
+	uint32_t num_shards = database_shard_count(database, created);
+	if (num_shards > 0) {
+		database->shards = shard_set_open(database, filename, num_shards, pager->page_size);
+		//the rows are in the shards, so they're what a crash would have left behind
+		clean = clean && database->shards->clean;
+	}
+	const char* change_log = getenv("DB_CHANGE_LOG");
+	if (change_log != NULL && change_log[0] != '\0' && strcmp(change_log, "0") != 0) {
+		database_open_change_log(database, filename, clean);
+	}
+	size_t result_cache_bytes = RESULT_CACHE_BYTES;
+	const char* result_cache = getenv("DB_RESULT_CACHE");
+	if (result_cache != NULL && result_cache[0] != '\0') {
+		result_cache_bytes = (size_t)strtoull(result_cache, NULL, 10);
+	}
+	database->results = result_cache_new(result_cache_bytes);
+	return database;
+}
+
+void table_set_schema(Table* table, const Schema* schema) {
+	table->schema = *schema;
+	table->text_keys = schema->columns[0].type == COLUMN_VARCHAR;
+	table->key_size = table->text_keys ? schema->columns[0].size
+		: schema->columns[0].type == COLUMN_INT64 ? sizeof(uint64_t) : sizeof(uint32_t);
+	table->leaf_cell_size = schema->row_size;
+	table->leaf_max_cells = LEAF_NODE_SPACE_FOR_CELLS(table->pager->page_size) / table->leaf_cell_size;
+	table->leaf_right_split_count = (table->leaf_max_cells + 1) / 2;
+	table->leaf_left_split_count = (table->leaf_max_cells + 1) - table->leaf_right_split_count;
+}
+
+Table* database_find_table(Database* database, const char* name) {
+	Table* found = NULL;
+	//create table can be adding to the list on another thread
+	pthread_mutex_lock(&database->pager->latch);
+	if (name == NULL || name[0] == '\0') {
+		found = database->num_tables > 0 ? database->tables[0] : NULL;
+	}
+	else {
+		for (uint32_t i = 0; i < database->num_tables; i++) {
+			if (strcmp(database->tables[i]->schema.table_name, name) == 0) {
+				found = database->tables[i];
+				break;
+			}
+		}
 	}
+	pthread_mutex_unlock(&database->pager->latch);
+	return found;
+}
+
+//Gives a file from before the catalog one, its lone table becomes table 1. Runs inside create table's transaction.
+//Page 0 has to turn into the header, so if the table's root is sitting there it gets copied to a new page first.
+static void database_add_catalog(Database* database) {
+	Pager* pager = database->pager;
+	Table* table = database->tables[0];
+	uint32_t root_page_num = table->root_page_num;
+	if (root_page_num == 0) {
+		root_page_num = get_unused_page_num(pager);
+		void* root = get_page_for_write(pager, root_page_num);
+		memcpy(root, get_page(pager, 0), pager->page_size);
+		if (get_node_type(root) == NODE_INTERNAL) {
+			//internal_node_child hands back the right child for the last index
+			for (uint32_t i = 0; i <= *internal_node_num_keys(root); i++) {
+				void* child = get_page_for_write(pager, *internal_node_child(table, root, i));
+				*node_parent(child) = root_page_num;
+			}
+		}
+		//Fine to switch over before commit: the copy has the same rows the old root had
+		pthread_mutex_lock(&pager->latch);
+		table->root_page_num = root_page_num;
+		pager->tree_epoch++;
+		pthread_mutex_unlock(&pager->latch);
+	}
+	Schema schema;
+	catalog_schema(&schema);
+	uint32_t catalog_root = table_new_root(pager);
+	write_header(pager, catalog_root);
+	database->catalog = table_new(pager, catalog_root, 0, &schema);
+	catalog_insert(database, 1, root_page_num, &table->schema);
+}
+
+Table* database_create_table(Database* database, const Schema* schema) {
+	Pager* pager = database->pager;
+	if (database_find_table(database, schema->table_name) != NULL || database->num_tables == DATABASE_MAX_TABLES) {
+		return NULL;
+	}
+	//Rolling back would have to take the table back out of the list too, so the catalog only changes on its own
+	if (!pager_begin(pager)) {
+		return NULL;
+	}
+	bool upgrading = database->catalog == NULL;
+	if (upgrading) {
+		database_add_catalog(database);
+	}
+	//Ids only go up, the catalog is loaded in id order so the last table has the biggest one
+	uint32_t last_id = upgrading ? 1 : (database->num_tables > 0 ? database->tables[database->num_tables - 1]->table_id : 0);
+	uint32_t root_page_num = table_new_root(pager);
+	catalog_insert(database, last_id + 1, root_page_num, schema);
+	pager_commit_in_memory(pager);
+
+	Table* table = table_new(pager, root_page_num, last_id + 1, schema);
+	pthread_mutex_lock(&pager->latch);
+	table->created_at = pager->commit_seq;
+	if (upgrading) {
+		database->tables[0]->table_id = 1;
+	}
+	database->tables[database->num_tables++] = table;
+	pthread_mutex_unlock(&pager->latch);
 	return table;
 }
 
+//The size of a huge page on x86-64. The frame slab starts on one so the kernel is able to back it with huge pages,
+//which keeps a scan over the whole cache from burning through the TLB.
+#define FRAME_SLAB_ALIGNMENT (2 * 1024 * 1024)
+
+static char* frame_slab_alloc(size_t size) {
+#ifdef _WIN32
+	char* slab = _aligned_malloc(size, PAGE_SIZE);
+#else
+	void* slab = NULL;
+	if (posix_memalign(&slab, FRAME_SLAB_ALIGNMENT, size) != 0) {
+		slab = NULL;
+	}
+#endif
+	if (slab == NULL) {
+		printf("Unable to allocate page frames\n");
+		exit(EXIT_FAILURE);
+	}
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	//Only a hint, plenty of kernels have transparent huge pages switched off
+	madvise(slab, size, MADV_HUGEPAGE);
+#endif
+	return slab;
+}
+
+static void frame_slab_free(char* slab) {
+#ifdef _WIN32
+	_aligned_free(slab);
+#else
+	free(slab);
+#endif
+}
+
+//A frame for a page, off the slab's free list while it lasts. Caller holds the latch (or is the only thread).
+static void* pager_frame_alloc(Pager* pager) {
+	void* frame = pager->free_frames;
+	if (frame == NULL) {
+		//More old versions around than the slab has room for
+		return malloc(pager->page_size);
+	}
+	memcpy(&pager->free_frames, frame, sizeof(void*));
+	return frame;
+}
+
+static void pager_frame_free(Pager* pager, void* frame) {
+	if (frame == NULL) {
+		return;
+	}
+	char* at = frame;
+	if (at < pager->frames || at >= pager->frames + (size_t)PAGER_SLAB_FRAMES * pager->page_size) {
+		free(frame);
+		return;
+	}
+	memcpy(frame, &pager->free_frames, sizeof(void*));
+	pager->free_frames = frame;
+}
+
+//Requests come out of the pager's own array, NULL means the I/O queue is already as deep as it goes
+static IORequest* pager_request_alloc(Pager* pager) {
+	IORequest* request = pager->free_requests;
+	if (request != NULL) {
+		pager->free_requests = request->next;
+	}
+	return request;
+}
+
+static void pager_request_free(Pager* pager, IORequest* request) {
+	request->next = pager->free_requests;
+	pager->free_requests = request;
+}
+
 //Initializes pager
-Pager* pager_open(const char* filename) {
+Pager* pager_open(const char* filename, uint32_t new_page_size) {
 	/*O_RDWR = read/write
 	O_CREAT = create if file doesn't exist
-	S_IWRITE = User write permission
-	S_IREAD = user read permission*/
-	int fd = _open(filename, _O_RDWR | _O_CREAT, _S_IWRITE | _S_IREAD);
+	S_IWUSR = User write permission
+	S_IRUSR = user read permission
+	O_BINARY = don't let windows translate newlines (does nothing on POSIX)*/
+	int fd = open(filename, O_RDWR | O_CREAT | O_BINARY, S_IWUSR | S_IRUSR);
 
 	if (fd == -1) {
 		printf("Unable to open file\n");
 		exit(EXIT_FAILURE);
 	}
 
-	off_t file_length = _lseek(fd, 0, SEEK_END);
-	Pager* pager = malloc(sizeof(Pager));
-	pager->file_descriptor = fd;
-	pager->file_length = file_length;
-	pager->num_pages = ((file_length + PAGE_SIZE - 1) / PAGE_SIZE);
+	//The header's format fields, before anything else gets read with our page size
+	uint8_t header[HEADER_SIZE];
+	bool has_header = pread(fd, header, HEADER_SIZE, 0) == HEADER_SIZE && memcmp(header, HEADER_MAGIC, HEADER_MAGIC_SIZE) == 0;
+	bool clean = false;
+	uint32_t page_count = 0;
+	//Files from before the header said how big their pages are all have PAGE_SIZE ones
+	uint32_t page_size = PAGE_SIZE;
+	if (has_header) {
+		uint32_t version;
+		uint32_t header_page_size;
+		memcpy(&version, header + HEADER_VERSION_OFFSET, sizeof(uint32_t));
+		memcpy(&header_page_size, header + HEADER_PAGE_SIZE_OFFSET, sizeof(uint32_t));
+		memcpy(&page_count, header + HEADER_PAGE_COUNT_OFFSET, sizeof(uint32_t));
+		if (version > HEADER_FORMAT_VERSION) {
+			printf("Database file is format %u, this build only reads up to %d.\n", version, HEADER_FORMAT_VERSION);
+			exit(EXIT_FAILURE);
+		}
+		if (version >= 1) {
+			//Reading it with any other page size would mangle every page we wrote back
+			if (!page_size_supported(header_page_size)) {
+				printf("Database file has %u byte pages, which this build can't read.\n", header_page_size);
+				exit(EXIT_FAILURE);
+			}
+			page_size = header_page_size;
+		}
+		clean = version >= 1 && header[HEADER_CLEAN_OFFSET] == 1;
+	}
+
+	//If we crashed in the middle of writing a batch of pages, put the old pages back before reading anything.
+	//A file that was closed cleanly can't have a journal, so there's nothing to look for.
+	char* journal_path = journal_path_for(filename);
+	if (!clean && journal_recover(journal_path, fd, page_size)) {
+		printf("Recovered database from interrupted write.\n");
+	}
 
+	//fstat gives us the size without moving the file offset around
+	struct stat file_stat;
+	off_t file_length = -1;
+	if (fstat(fd, &file_stat) == 0) {
+		file_length = file_stat.st_size;
+	}
 	if (file_length < 0) {
 		printf("db file length invalid. corrupt file.\n");
 		exit(EXIT_FAILURE);
 	}
+	//Nothing in it yet (or a crash undid the only batch ever written), so it's a new file
+	if (file_length == 0) {
+		page_size = new_page_size;
+	}
+	//A clean close wrote down how many pages there are, so a file shorter than that lost some
+	if (clean && (off_t)page_count * page_size > file_length) {
+		printf("Database file is truncated, its header says %u pages.\n", page_count);
+		exit(EXIT_FAILURE);
+	}
+	Pager* pager = malloc(sizeof(Pager));
+	pager->file_descriptor = fd;
+	pager->file_length = file_length;
+	pager->page_size = page_size;
+	pager->num_pages = clean ? page_count : (uint32_t)((file_length + page_size - 1) / page_size);
+	pager->has_header = has_header;
+	pager->clean_on_disk = clean;
 
 	for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
 		pager->pages[i] = NULL;
+		pager->dirty[i] = false;
+		pager->in_flight[i] = NULL;
+		pager->shadow[i] = NULL;
+		pager->installed_at[i] = 0;
+		pager->old_versions[i] = NULL;
 	}
+	pager->commit_seq = 0;
+	pager->snapshots = NULL;
+	pager->tree_epoch = 0;
+	//Chain the frames together back to front so they get handed out in address order
+	pager->frames = frame_slab_alloc((size_t)PAGER_SLAB_FRAMES * page_size);
+	pager->free_frames = NULL;
+	for (uint32_t i = PAGER_SLAB_FRAMES; i > 0; i--) {
+		pager_frame_free(pager, pager->frames + (size_t)(i - 1) * page_size);
+	}
+	pager->free_requests = NULL;
+	for (uint32_t i = ASYNC_IO_QUEUE_DEPTH; i > 0; i--) {
+		pager_request_free(pager, &pager->requests[i - 1]);
+	}
+	pthread_mutex_init(&pager->latch, NULL);
+	pager->io = async_io_open(fd);
+	pager->path = malloc(strlen(filename) + 1);
+	strcpy(pager->path, filename);
+	pager->journal_path = journal_path;
+	pager->in_transaction = false;
+	pager->transaction_num_pages = 0;
 	return pager;
 }
-//Fetches page
-void* get_page(Pager* pager, uint32_t page_num) {
-	if (page_num > TABLE_MAX_PAGES) {
+
+//Number of pages that actually exist in the file (counting a partial page at the end)
+static uint32_t pager_file_pages(Pager* pager) {
+	uint32_t num_pages = pager->file_length / pager->page_size;
+	if (pager->file_length % pager->page_size) {
+		num_pages += 1;
+	}
+	return num_pages;
+}
+
+//Waits for the next finished I/O and deals with it, reads get installed into the page cache
+static void pager_reap(Pager* pager) {
+	IORequest* request = async_io_wait(pager->io);
+	if (request == NULL) {
+		return;
+	}
+	if (request->result < 0) {
+		printf("Error %s page %d: %d\n", request->kind == IO_READ ? "reading" : "writing", request->page_num, (int)-request->result);
+		exit(EXIT_FAILURE);
+	}
+	//A partly written page must never be marked clean, the checkpoint would drop the journal that can fix it
+	if (request->kind == IO_WRITE && (size_t)request->result != request->length) {
+		printf("Error writing page %d: only %zd of %zu bytes written\n", request->page_num, request->result, request->length);
+		exit(EXIT_FAILURE);
+	}
+	stats_count(request->kind == IO_READ ? STAT_PAGE_READS : STAT_PAGE_WRITES);
+	if (request->kind == IO_READ) {
+		//a page hanging off the end of the file reads short, the rest of it is blank like in pager_load_page
+		if ((size_t)request->result < request->length) {
+			memset((char*)request->buffer + request->result, 0, request->length - (size_t)request->result);
+		}
+		pager->pages[request->page_num] = request->buffer;
+		pager->in_flight[request->page_num] = NULL;
+	}
+	pager_request_free(pager, request);
+}
+//Loads the committed copy of a page into the cache if it isn't there yet. Caller holds the latch.
+static void* pager_load_page(Pager* pager, uint32_t page_num) {
+	if (page_num >= TABLE_MAX_PAGES) {
 		printf("Tried to fetch page number out of bounds. %d > %d", page_num, TABLE_MAX_PAGES);
 		exit(EXIT_FAILURE);
 	}
-	if (pager->pages[page_num] == NULL) {
-		//Cache miss. allocate memory and load from file.
-		void* page = malloc(PAGE_SIZE);
-		uint32_t num_pages = pager->file_length / PAGE_SIZE;
-		//In case we want to save a partial page at the end of the file
-		if (pager->file_length % PAGE_SIZE) {
-			num_pages += 1;
+	stats_count(pager->pages[page_num] != NULL ? STAT_PAGE_HITS : STAT_PAGE_MISSES);
+	if (pager->pages[page_num] == NULL && pager->in_flight[page_num] != NULL) {
+		//Someone already asked for this page in the background, just wait for it to show up
+		async_io_submit(pager->io);
+		while (pager->in_flight[page_num] != NULL) {
+			pager_reap(pager);
 		}
+	}
+	if (pager->pages[page_num] == NULL) {
+		//Cache miss. grab a frame and load from file.
+		void* page = pager_frame_alloc(pager);
+		uint32_t num_pages = pager_file_pages(pager);
 
 		if (page_num <= num_pages) {
-			_lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-			ssize_t bytes_read = _read(pager->file_descriptor, page, PAGE_SIZE);
+			//pread reads at an offset in one call, no seek needed first
+			ssize_t bytes_read = pread(pager->file_descriptor, page, pager->page_size, (off_t)page_num * pager->page_size);
 			if (bytes_read == -1) {
 				printf("Error reading file: %d\n", errno);
 				exit(EXIT_FAILURE);
 			}
+			if (bytes_read > 0) {
+				stats_count(STAT_PAGE_READS);
+			}
+			//past the end of the file there's nothing to read, start that part off blank
+			if (bytes_read < (ssize_t)pager->page_size) {
+				memset((char*)page + bytes_read, 0, pager->page_size - (size_t)bytes_read);
+			}
 		}
 		pager->pages[page_num] = page;
 		if (page_num >= pager->num_pages) {
@@ -87,38 +628,549 @@ void* get_page(Pager* pager, uint32_t page_num) {
 	return pager->pages[page_num];
 }
 
+//Fetches page
+void* get_page(Pager* pager, uint32_t page_num) {
+	pthread_mutex_lock(&pager->latch);
+	//Inside a transaction, a page we've already written to lives in its shadow copy
+	void* page = NULL;
+	if (page_num < TABLE_MAX_PAGES && pager->shadow[page_num] != NULL) {
+		page = pager->shadow[page_num];
+		stats_count(STAT_PAGE_HITS);
+	}
+	else {
+		page = pager_load_page(pager, page_num);
+	}
+	pthread_mutex_unlock(&pager->latch);
+	return page;
+}
+
+void* get_page_at(Pager* pager, uint32_t page_num, Snapshot* snapshot) {
+	if (snapshot == NULL) {
+		return get_page(pager, page_num);
+	}
+	pthread_mutex_lock(&pager->latch);
+	//Shadows are never visible to a snapshot, only committed versions are
+	void* page = NULL;
+	if (page_num < TABLE_MAX_PAGES && pager->installed_at[page_num] > snapshot->commit_seq) {
+		//Committed after the snapshot was taken, walk back to the copy that was current back then.
+		//After a vacuum that copy might be of a page the new file doesn't even have, so don't load it first.
+		for (PageVersion* version = pager->old_versions[page_num]; version != NULL; version = version->older) {
+			if (version->installed_at <= snapshot->commit_seq) {
+				page = version->data;
+				stats_count(STAT_PAGE_HITS);
+				break;
+			}
+		}
+	}
+	if (page == NULL) {
+		page = pager_load_page(pager, page_num);
+	}
+	pthread_mutex_unlock(&pager->latch);
+	return page;
+}
+
+void* get_page_for_write(Pager* pager, uint32_t page_num) {
+	pthread_mutex_lock(&pager->latch);
+	void* page = pager_load_page(pager, page_num);
+	//First write to a page that existed before the transaction: copy it and write the copy instead.
+	//Pages the transaction created itself don't need one, rollback just throws them away.
+	if (pager->in_transaction && page_num < pager->transaction_num_pages) {
+		if (pager->shadow[page_num] == NULL) {
+			void* copy = pager_frame_alloc(pager);
+			memcpy(copy, page, pager->page_size);
+			pager->shadow[page_num] = copy;
+		}
+		page = pager->shadow[page_num];
+	}
+	else {
+		pager->dirty[page_num] = true;
+	}
+	pthread_mutex_unlock(&pager->latch);
+	return page;
+}
+
+//Queues a background read for a page without submitting it, returns false if the queue had no room
+static bool pager_queue_read(Pager* pager, uint32_t page_num) {
+	//Nothing to do if it's out of range, already cached, already on its way, or not in the file yet
+	if (page_num >= TABLE_MAX_PAGES || pager->pages[page_num] != NULL || pager->in_flight[page_num] != NULL) {
+		return true;
+	}
+	if (page_num >= pager_file_pages(pager)) {
+		return true;
+	}
+	IORequest* request = pager_request_alloc(pager);
+	if (request == NULL) {
+		//Queue's full, a prefetch is only a hint so just drop it
+		return false;
+	}
+	request->kind = IO_READ;
+	request->buffer = pager_frame_alloc(pager);
+	request->length = pager->page_size;
+	request->offset = (off_t)page_num * pager->page_size;
+	request->page_num = page_num;
+	if (!async_io_queue(pager->io, request)) {
+		pager_frame_free(pager, request->buffer);
+		pager_request_free(pager, request);
+		return false;
+	}
+	pager->in_flight[page_num] = request;
+	return true;
+}
+
+void pager_prefetch(Pager* pager, uint32_t page_num) {
+	pthread_mutex_lock(&pager->latch);
+	pager_queue_read(pager, page_num);
+	async_io_submit(pager->io);
+	pthread_mutex_unlock(&pager->latch);
+}
+
+void pager_prefetch_range(Pager* pager, uint32_t first_page, uint32_t count) {
+	pthread_mutex_lock(&pager->latch);
+	for (uint32_t i = 0; i < count; i++) {
+		if (!pager_queue_read(pager, first_page + i)) {
+			break;
+		}
+	}
+	async_io_submit(pager->io);
+	pthread_mutex_unlock(&pager->latch);
+}
+
+//Clears the clean shutdown flag on disk, once per open. Caller holds the latch.
+static void pager_mark_dirty_locked(Pager* pager) {
+	if (!pager->clean_on_disk) {
+		return;
+	}
+	uint8_t clean = 0;
+	if (pwrite(pager->file_descriptor, &clean, 1, HEADER_CLEAN_OFFSET) != 1 || fsync(pager->file_descriptor) == -1) {
+		printf("Error writing db header: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	pager->clean_on_disk = false;
+}
+
+void pager_mark_dirty(Pager* pager) {
+	pthread_mutex_lock(&pager->latch);
+	pager_mark_dirty_locked(pager);
+	pthread_mutex_unlock(&pager->latch);
+}
+
+//Caller holds the latch. Readers block on a checkpoint, but a checkpoint only happens on commit and close.
+static void pager_checkpoint_locked(Pager* pager) {
+	//Let any prefetches land first so nothing is reading while we write
+	while (async_io_in_flight(pager->io) > 0) {
+		pager_reap(pager);
+	}
+	uint32_t* dirty_pages = malloc(sizeof(uint32_t) * TABLE_MAX_PAGES);
+	uint32_t num_dirty = 0;
+	for (uint32_t i = 0; i < pager->num_pages; i++) {
+		if (pager->pages[i] != NULL && pager->dirty[i]) {
+			dirty_pages[num_dirty++] = i;
+		}
+	}
+	if (num_dirty == 0) {
+		free(dirty_pages);
+		return;
+	}
+	//A crash from here on leaves a journal, so the header can't claim a clean close any more
+	pager_mark_dirty_locked(pager);
+	//Save the old copies first, so a crash partway through the writes below can be undone on the next open
+	journal_write(pager->journal_path, pager->file_descriptor, pager->file_length, dirty_pages, num_dirty, pager->page_size);
+
+	//Queue a write for every dirty page, only stopping to collect completions when the queue fills up.
+	//This keeps up to ASYNC_IO_QUEUE_DEPTH writes outstanding instead of one at a time.
+	for (uint32_t j = 0; j < num_dirty; j++) {
+		uint32_t i = dirty_pages[j];
+		IORequest* request = pager_request_alloc(pager);
+		while (request == NULL) {
+			//every request is out, wait for one to come back
+			async_io_submit(pager->io);
+			pager_reap(pager);
+			request = pager_request_alloc(pager);
+		}
+		if (i == 0 && pager->has_header) {
+			//page 0 as it was read in says clean, only close gets to write that
+			((uint8_t*)pager->pages[0])[HEADER_CLEAN_OFFSET] = 0;
+		}
+		request->kind = IO_WRITE;
+		request->buffer = pager->pages[i];
+		request->length = pager->page_size;
+		request->offset = (off_t)i * pager->page_size;
+		request->page_num = i;
+		while (!async_io_queue(pager->io, request)) {
+			async_io_submit(pager->io);
+			pager_reap(pager);
+		}
+		pager->dirty[i] = false;
+	}
+	async_io_submit(pager->io);
+	while (async_io_in_flight(pager->io) > 0) {
+		pager_reap(pager);
+	}
+	free(dirty_pages);
+	if (fsync(pager->file_descriptor) == -1) {
+		printf("Error syncing db file: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	//The pages are safely on disk, dropping the journal is what commits them
+	journal_delete(pager->journal_path);
+	if ((off_t)pager->num_pages * pager->page_size > (off_t)pager->file_length) {
+		pager->file_length = pager->num_pages * pager->page_size;
+	}
+}
+
+void pager_checkpoint(Pager* pager) {
+	pthread_mutex_lock(&pager->latch);
+	pager_checkpoint_locked(pager);
+	pthread_mutex_unlock(&pager->latch);
+}
+
+//Frees every old page version that no open snapshot can see anymore. Caller holds the latch.
+static void pager_reclaim_versions(Pager* pager) {
+	//A version is needed by a snapshot taken at seq s if installed_at <= s < replaced_at.
+	//Once replaced_at <= the oldest open snapshot, nobody can reach it.
+	uint64_t oldest = UINT64_MAX;
+	for (Snapshot* snapshot = pager->snapshots; snapshot != NULL; snapshot = snapshot->next) {
+		if (snapshot->commit_seq < oldest) {
+			oldest = snapshot->commit_seq;
+		}
+	}
+	for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+		PageVersion** link = &pager->old_versions[i];
+		while (*link != NULL) {
+			PageVersion* version = *link;
+			if (version->replaced_at <= oldest) {
+				*link = version->older;
+				pager_frame_free(pager, version->data);
+				free(version);
+			}
+			else {
+				link = &version->older;
+			}
+		}
+	}
+}
+
+//Swaps the transaction's shadows in as the new committed pages. Caller holds the latch.
+static void pager_install_transaction(Pager* pager) {
+	uint64_t seq = pager->commit_seq + 1;
+	for (uint32_t i = 0; i < pager->transaction_num_pages; i++) {
+		if (pager->shadow[i] == NULL) {
+			continue;
+		}
+		if (pager->snapshots != NULL) {
+			//an open snapshot could still be reading the page we're replacing, keep it for them
+			PageVersion* version = malloc(sizeof(PageVersion));
+			version->data = pager->pages[i];
+			version->installed_at = pager->installed_at[i];
+			version->replaced_at = seq;
+			version->older = pager->old_versions[i];
+			pager->old_versions[i] = version;
+		}
+		else {
+			pager_frame_free(pager, pager->pages[i]);
+		}
+		pager->pages[i] = pager->shadow[i];
+		pager->shadow[i] = NULL;
+		pager->installed_at[i] = seq;
+		pager->dirty[i] = true;
+	}
+	//Brand new pages only become reachable through pages this commit installed
+	for (uint32_t i = pager->transaction_num_pages; i < pager->num_pages; i++) {
+		pager->installed_at[i] = seq;
+	}
+	pager->commit_seq = seq;
+	pager->in_transaction = false;
+}
+
+bool pager_begin(Pager* pager) {
+	pthread_mutex_lock(&pager->latch);
+	bool started = !pager->in_transaction;
+	if (started) {
+		pager->in_transaction = true;
+		pager->transaction_num_pages = pager->num_pages;
+	}
+	pthread_mutex_unlock(&pager->latch);
+	return started;
+}
+
+bool pager_commit(Pager* pager) {
+	pthread_mutex_lock(&pager->latch);
+	bool committed = pager->in_transaction;
+	if (committed) {
+		//Swap each shadow in for the page it copied, then the whole lot goes to disk as one journaled batch.
+		//Doing the durable write once per transaction instead of once per statement is what makes big imports cheap.
+		pager_install_transaction(pager);
+		pager_checkpoint_locked(pager);
+	}
+	pthread_mutex_unlock(&pager->latch);
+	return committed;
+}
+
+bool pager_commit_in_memory(Pager* pager) {
+	pthread_mutex_lock(&pager->latch);
+	bool committed = pager->in_transaction;
+	if (committed) {
+		pager_install_transaction(pager);
+	}
+	pthread_mutex_unlock(&pager->latch);
+	return committed;
+}
+
+bool pager_rollback(Pager* pager) {
+	pthread_mutex_lock(&pager->latch);
+	bool rolled_back = pager->in_transaction;
+	if (rolled_back) {
+		for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
+			if (pager->shadow[i] != NULL) {
+				pager_frame_free(pager, pager->shadow[i]);
+				pager->shadow[i] = NULL;
+			}
+		}
+		//Pages the transaction created never existed as far as anyone else is concerned
+		for (uint32_t i = pager->transaction_num_pages; i < pager->num_pages; i++) {
+			if (pager->pages[i] != NULL) {
+				pager_frame_free(pager, pager->pages[i]);
+				pager->pages[i] = NULL;
+			}
+			pager->dirty[i] = false;
+		}
+		pager->num_pages = pager->transaction_num_pages;
+		pager->in_transaction = false;
+		pager->tree_epoch++;
+	}
+	pthread_mutex_unlock(&pager->latch);
+	return rolled_back;
+}
+
+void pager_snapshot_begin(Pager* pager, Snapshot* snapshot) {
+	pthread_mutex_lock(&pager->latch);
+	snapshot->commit_seq = pager->commit_seq;
+	//Pages a transaction that's still going added aren't committed yet
+	snapshot->num_pages = pager->in_transaction ? pager->transaction_num_pages : pager->num_pages;
+	snapshot->next = pager->snapshots;
+	pager->snapshots = snapshot;
+	pthread_mutex_unlock(&pager->latch);
+}
+
+bool pager_page_on_disk(Pager* pager, uint32_t page_num, Snapshot* snapshot) {
+	pthread_mutex_lock(&pager->latch);
+	//Committed at or before the snapshot, and not waiting on a checkpoint. Whatever's committed later gets its
+	//installed_at bumped before any checkpoint writes it, so the file still has the snapshot's copy until then.
+	bool on_disk = page_num < TABLE_MAX_PAGES && page_num < pager_file_pages(pager)
+		&& pager->installed_at[page_num] <= snapshot->commit_seq && !pager->dirty[page_num];
+	pthread_mutex_unlock(&pager->latch);
+	return on_disk;
+}
+
+void pager_snapshot_end(Pager* pager, Snapshot* snapshot) {
+	pthread_mutex_lock(&pager->latch);
+	Snapshot** link = &pager->snapshots;
+	while (*link != NULL && *link != snapshot) {
+		link = &(*link)->next;
+	}
+	if (*link == snapshot) {
+		*link = snapshot->next;
+	}
+	pager_reclaim_versions(pager);
+	pthread_mutex_unlock(&pager->latch);
+}
+
 uint32_t get_unused_page_num(Pager* pager) {
 	//We haven't implemented recycling free'd pages, so new pages will always go at the end
 	return pager->num_pages;
 }
 
-// Flushes page cache to disk, closes db file, frees memory for pager and table
-void db_close(Table* table) {
-	Pager* pager = table->pager;
+uint32_t database_write_catalog(Database* database, Pager* rebuilt, const uint32_t* root_page_nums) {
+	Schema schema;
+	catalog_schema(&schema);
+	uint32_t catalog_root = table_new_root(rebuilt);
+	write_header(rebuilt, catalog_root);
+	//catalog_insert only needs the catalog, so a stand in Database over the rebuilt pager does the job
+	//whatever change a follower had got up to stays in the header
+	uint64_t change_seq = database_change_seq(database);
+	memcpy((char*)get_page_for_write(rebuilt, 0) + HEADER_CHANGE_SEQ_OFFSET, &change_seq, sizeof(uint64_t));
+	//and so do the shards
+	uint32_t num_shards = database->shards != NULL ? database->shards->num_shards : 0;
+	memcpy((char*)get_page_for_write(rebuilt, 0) + HEADER_SHARD_COUNT_OFFSET, &num_shards, sizeof(uint32_t));
+	Database copy;
+	copy.pager = rebuilt;
+	copy.changes = NULL;
+	copy.shards = NULL;
+	copy.results = NULL;
+	copy.catalog = table_new(rebuilt, catalog_root, 0, &schema);
+	copy.num_tables = 0;
+	for (uint32_t i = 0; i < database->num_tables; i++) {
+		Table* table = database->tables[i];
+		//A file from before the catalog gets one on the way, and its lone table becomes table 1 like create table does it
+		catalog_insert(&copy, table->table_id == 0 ? 1 : table->table_id, root_page_nums[i], &table->schema);
+	}
+	free(copy.catalog);
+	return catalog_root;
+}
 
-	for (uint32_t i = 0; i < pager->num_pages; i++) {
-		if (pager->pages[i] == NULL) {
-			continue;
+void database_install_file(Database* database, Pager* rebuilt, const uint32_t* root_page_nums, uint32_t catalog_root) {
+	Pager* pager = database->pager;
+	pthread_mutex_lock(&pager->latch);
+	//Nothing can be reading the old file once it's gone
+	while (async_io_in_flight(pager->io) > 0) {
+		pager_reap(pager);
+	}
+	//Like a commit that replaced every page at once. Readers on older snapshots get the old pages as versions,
+	//which means reading every old page into memory first, the old file is about to be closed.
+	uint64_t seq = pager->commit_seq + 1;
+	uint32_t old_num_pages = pager->num_pages;
+	uint32_t num_pages = old_num_pages > rebuilt->num_pages ? old_num_pages : rebuilt->num_pages;
+	for (uint32_t i = 0; i < num_pages; i++) {
+		if (i < old_num_pages) {
+			void* old_page = pager_load_page(pager, i);
+			if (pager->snapshots != NULL) {
+				PageVersion* version = malloc(sizeof(PageVersion));
+				version->data = old_page;
+				version->installed_at = pager->installed_at[i];
+				version->replaced_at = seq;
+				version->older = pager->old_versions[i];
+				pager->old_versions[i] = version;
+			}
+			else {
+				pager_frame_free(pager, old_page);
+			}
 		}
-		pager_flush(pager, i);
-		free(pager->pages[i]);
+		//Every page of the rebuilt copy is still in its cache, and already on disk. Its frames belong to its own slab,
+		//so the pages get copied over into ours.
 		pager->pages[i] = NULL;
+		if (i < rebuilt->num_pages) {
+			pager->pages[i] = pager_frame_alloc(pager);
+			memcpy(pager->pages[i], rebuilt->pages[i], pager->page_size);
+		}
+		pager->dirty[i] = false;
+		pager->installed_at[i] = seq;
 	}
+	//The rebuilt file stays open as ours, with its I/O queue
+	AsyncIO* old_io = pager->io;
+	int old_file_descriptor = pager->file_descriptor;
+	pager->file_descriptor = rebuilt->file_descriptor;
+	pager->io = rebuilt->io;
+	rebuilt->file_descriptor = old_file_descriptor;
+	rebuilt->io = old_io;
+	pager->file_length = rebuilt->file_length;
+	pager->num_pages = rebuilt->num_pages;
+	pager->commit_seq = seq;
+	pager->tree_epoch++;
+	//the rebuilt file's header got written by database_write_catalog, and it's still flagged as open
+	pager->has_header = true;
+	pager->clean_on_disk = false;
+
+	for (uint32_t i = 0; i < database->num_tables; i++) {
+		Table* table = database->tables[i];
+		table->old_root_page_num = table->root_page_num;
+		table->root_moved_at = seq;
+		table->root_page_num = root_page_nums[i];
+		//it was about the old file's pages
+		free(table->analysis);
+		table->analysis = NULL;
+		if (table->table_id == 0) {
+			table->table_id = 1;
+		}
+	}
+	if (database->catalog == NULL) {
+		Schema schema;
+		catalog_schema(&schema);
+		database->catalog = table_new(pager, catalog_root, 0, &schema);
+	}
+	else {
+		database->catalog->root_page_num = catalog_root;
+	}
+	pthread_mutex_unlock(&pager->latch);
+	//which leaves the old file for the rebuilt pager to close
+	pager_discard(rebuilt);
+}
 
-	int result = _close(pager->file_descriptor);
+void pager_discard(Pager* pager) {
+	async_io_close(pager->io);
+	int result = close(pager->file_descriptor);
 	if (result == -1) {
 		printf("Error closing db file.\n");
 		exit(EXIT_FAILURE);
 	}
 	for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-		void* page = pager->pages[i];
-		if (page) {
-			free(page);
-			pager->pages[i] = NULL;
-		}
+		pager_frame_free(pager, pager->pages[i]);
+		pager_frame_free(pager, pager->shadow[i]);
+		pager->pages[i] = NULL;
+		pager->shadow[i] = NULL;
 	}
+	//Anyone still holding a snapshot at close is out of luck, drop every old version
+	pager->snapshots = NULL;
+	pager_reclaim_versions(pager);
+	pthread_mutex_destroy(&pager->latch);
+	frame_slab_free(pager->frames);
+	free(pager->journal_path);
+	free(pager->path);
 	free(pager);
-	free(table);
+}
+
+void header_mark_clean(void* header, uint32_t page_size, uint32_t num_pages) {
+	uint32_t values[] = { HEADER_FORMAT_VERSION, page_size, num_pages, 0 };
+	memcpy((char*)header + HEADER_VERSION_OFFSET, values, sizeof(values));
+	((uint8_t*)header)[HEADER_CLEAN_OFFSET] = 1;
+}
+
+uint64_t database_change_seq(Database* database) {
+	uint64_t seq = 0;
+	if (database->pager->has_header) {
+		memcpy(&seq, (char*)get_page(database->pager, 0) + HEADER_CHANGE_SEQ_OFFSET, sizeof(uint64_t));
+	}
+	return seq;
+}
+
+bool database_set_change_seq(Database* database, uint64_t seq) {
+	if (!database->pager->has_header) {
+		return false;
+	}
+	memcpy((char*)get_page_for_write(database->pager, 0) + HEADER_CHANGE_SEQ_OFFSET, &seq, sizeof(uint64_t));
+	return true;
+}
+
+//Once the last checkpoint is on disk: the page count and the clean shutdown flag go in the header, so the next open
+//can trust the count and skip looking for a journal. Written straight to the file, the cached page 0 is on its way out.
+static void pager_mark_clean(Pager* pager) {
+	if (!pager->has_header || pager->clean_on_disk) {
+		return;
+	}
+	uint8_t header[HEADER_SIZE];
+	header_mark_clean(header, pager->page_size, pager->num_pages);
+	size_t length = HEADER_SIZE - HEADER_VERSION_OFFSET;
+	if (pwrite(pager->file_descriptor, header + HEADER_VERSION_OFFSET, length, HEADER_VERSION_OFFSET) != (ssize_t)length
+		|| fsync(pager->file_descriptor) == -1) {
+		printf("Error writing db header: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	pager->clean_on_disk = true;
+}
+
+// Flushes page cache to disk, closes db file, frees memory for pager and tables
+void db_close(Database* database) {
+	Pager* pager = database->pager;
+
+	//Uncommitted work doesn't survive a close
+	pager_rollback(pager);
+	//Shards first, the database's own file only says it closed cleanly once they have
+	shard_set_close(database->shards);
+	//All the dirty pages go out in one batch rather than a write per page
+	pager_checkpoint(pager);
+	pager_mark_clean(pager);
+	change_log_close(database->changes);
+	result_cache_free(database->results);
+
+	for (uint32_t i = 0; i < database->num_tables; i++) {
+		column_store_drop(database->tables[i]);
+	}
+	pager_discard(pager);
+	for (uint32_t i = 0; i < database->num_tables; i++) {
+		free(database->tables[i]->analysis);
+		free(database->tables[i]);
+	}
+	free(database->catalog);
+	free(database);
 }
 
 void pager_flush(Pager* pager, uint32_t page_num) {
@@ -126,50 +1178,172 @@ void pager_flush(Pager* pager, uint32_t page_num) {
 		printf("Tried to flush null page\n");
 		exit(EXIT_FAILURE);
 	}
-	off_t offset = _lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-	if (offset == -1) {
-		printf("Error seeking: %d\n", errno);
-		exit(EXIT_FAILURE);
-	}
 	//Now that we've introduced cells, a cell takes up one page, so we don't need to worry about partial pages
-	ssize_t bytes_written = _write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+	ssize_t bytes_written = pwrite(pager->file_descriptor, pager->pages[page_num], pager->page_size,
+		(off_t)page_num * pager->page_size);
 	if (bytes_written == -1) {
 		printf("Error writing:%d\n", errno);
 		exit(EXIT_FAILURE);
 	}
+	if (bytes_written != (ssize_t)pager->page_size) {
+		printf("Error writing page %d: only %zd of %u bytes written\n", page_num, bytes_written, pager->page_size);
+		exit(EXIT_FAILURE);
+	}
+	stats_count(STAT_PAGE_WRITES);
 }
 
 //Returns the number of cells in the node
 //take the pointer to node in memory, and skip most of the header info, leaving you at the start of num_cells.
 uint32_t* leaf_node_num_cells(void* node) {
-	return (char*)node + LEAF_NODE_NUM_CELLS_OFFSET;
+	return (uint32_t*)((char*)node + LEAF_NODE_NUM_CELLS_OFFSET);
 }
 //Returns a cell in the node
-//take the pointer to node in memory, skip the header entirely, then to access the cell of a number, multiply that number by cell size
-void* leaf_node_cell(void* node, uint32_t cell_num) {
-	return (char*)node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+//take the pointer to node in memory, skip the header entirely, then to access the cell of a number, multiply that number by cell size.
+//Old leaves have the key in front of every row, so their cells are a little bigger.
+void* leaf_node_cell(Table* table, void* node, uint32_t cell_num) {
+	uint32_t cell_size = is_node_packed(node) ? table->leaf_cell_size : table->leaf_cell_size + LEAF_NODE_KEY_SIZE;
+	return (char*)node + LEAF_NODE_HEADER_SIZE + cell_num * cell_size;
 }
 //Returns the key for the relevant cell
-//Same as the above function, since it returns the starting point of the cell (i.e the key)
-uint32_t* leaf_node_key(void* node, uint32_t cell_num) {
-	return leaf_node_cell(node, cell_num);
+//The key is the row's first column, an int32 or int64 depending on the table
+uint64_t leaf_node_key(Table* table, void* node, uint32_t cell_num) {
+	const char* row = leaf_node_value(table, node, cell_num);
+	if (table->key_size == sizeof(uint32_t)) {
+		uint32_t key;
+		memcpy(&key, row, sizeof(key));
+		return key;
+	}
+	uint64_t key;
+	memcpy(&key, row, sizeof(key));
+	return key;
+}
+//Text keys sort byte by byte, and a string sorts before anything longer that starts with it
+static int key_compare_text(const char* a, uint32_t a_length, const char* b, uint32_t b_length) {
+	uint32_t shorter = a_length < b_length ? a_length : b_length;
+	//an empty key can come with a NULL pointer, which memcmp isn't allowed even for 0 bytes
+	if (shorter > 0) {
+		int compared = memcmp(a, b, shorter);
+		if (compared != 0) {
+			return compared;
+		}
+	}
+	return a_length < b_length ? -1 : (a_length > b_length ? 1 : 0);
+}
+
+static Value integer_key(uint64_t integer) {
+	Value key = { VALUE_INTEGER, (int64_t)integer, 0, NULL, 0 };
+	return key;
+}
+
+Value table_row_key(Table* table, const void* row) {
+	if (table->text_keys) {
+		//varchar slots are null terminated unless the string fills them
+		Value key = { VALUE_TEXT, 0, 0, row, (uint32_t)strnlen(row, table->key_size) };
+		return key;
+	}
+	if (table->key_size == sizeof(uint32_t)) {
+		uint32_t key;
+		memcpy(&key, row, sizeof(key));
+		return integer_key(key);
+	}
+	uint64_t key;
+	memcpy(&key, row, sizeof(key));
+	return integer_key(key);
+}
+
+int leaf_node_compare(Table* table, void* node, uint32_t cell_num, const Value* key) {
+	if (table->text_keys) {
+		const char* row = leaf_node_value(table, node, cell_num);
+		return key_compare_text(row, (uint32_t)strnlen(row, table->key_size), key->text, key->length);
+	}
+	uint64_t cell_key = leaf_node_key(table, node, cell_num);
+	uint64_t other = (uint64_t)key->integer;
+	return cell_key < other ? -1 : (cell_key > other ? 1 : 0);
 }
+
 //Accesses the relevant cell's value
-//Access the cell, skip the key, you have the value
-void* leaf_node_value(void* node, uint32_t cell_num) {
-	return (char*)leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+//In a packed leaf the cell is the row, in an old one skip the key and you have the row
+void* leaf_node_value(Table* table, void* node, uint32_t cell_num) {
+	char* cell = leaf_node_cell(table, node, cell_num);
+	return is_node_packed(node) ? cell : cell + LEAF_NODE_KEY_SIZE;
+}
+
+//Rewrites an old leaf in the packed layout, dropping the key in front of each row. Rows only move left, so in place is fine.
+static void leaf_node_pack(Table* table, void* node) {
+	if (is_node_packed(node)) {
+		return;
+	}
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	char* cells = (char*)node + LEAF_NODE_HEADER_SIZE;
+	for (uint32_t i = 0; i < num_cells; i++) {
+		memmove(cells + i * table->leaf_cell_size, cells + i * (table->leaf_cell_size + LEAF_NODE_KEY_SIZE) + LEAF_NODE_KEY_SIZE,
+			table->leaf_cell_size);
+	}
+	*((uint8_t*)node + NODE_TYPE_OFFSET) |= NODE_PACKED;
 }
 
 uint32_t* internal_node_num_keys(void* node) {
-	return (char*)node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+	return (uint32_t*)((char*)node + INTERNAL_NODE_NUM_KEYS_OFFSET);
 }
 uint32_t* internal_node_right_child(void* node) {
-	return (char*)node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+	return (uint32_t*)((char*)node + INTERNAL_NODE_RIGHT_CHILD_OFFSET);
 }
-uint32_t* internal_node_cell(void* node, uint32_t cell_num) {
-	return (char*)node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+
+//How many bytes each key offset in a packed internal node takes
+static uint32_t internal_node_key_width(void* node) {
+	return *((uint8_t*)node + INTERNAL_NODE_KEY_WIDTH_OFFSET);
+}
+//Key slots a packed node has when its keys are width bytes each in page_size byte pages. This is the on disk layout,
+//so it only ever depends on the page and the width, never on INTERNAL_NODE_MAX_CELLS.
+static inline uint32_t internal_node_key_slots(uint32_t width, uint32_t page_size) {
+	return INTERNAL_NODE_SPACE_FOR_CELLS(page_size) / (INTERNAL_NODE_CHILD_SIZE + width);
+}
+//Most keys this build puts in one before splitting it: every slot, or fewer in a build with a small
+//INTERNAL_NODE_MAX_CELLS (whose files the normal build still reads, the slots are where they always are)
+static inline uint32_t internal_node_max_keys(uint32_t width, uint32_t page_size) {
+	uint32_t max_keys = internal_node_key_slots(width, page_size);
+	return max_keys < INTERNAL_NODE_MAX_CELLS ? max_keys : INTERNAL_NODE_MAX_CELLS;
+}
+static char* internal_node_keys(void* node) {
+	return (char*)node + INTERNAL_NODE_KEYS_OFFSET;
+}
+static bool is_node_text(void* node) {
+	return (*((uint8_t*)node + NODE_TYPE_OFFSET) & NODE_TEXT_KEYS) != 0;
+}
+//Text nodes: the key ends come right after the child pointers, then the prefix, then the suffixes
+static uint16_t* internal_node_key_ends(void* node) {
+	return (uint16_t*)(internal_node_keys(node) + *internal_node_num_keys(node) * INTERNAL_NODE_CHILD_SIZE);
+}
+static uint32_t internal_node_prefix_length(void* node) {
+	return *(uint16_t*)((char*)node + INTERNAL_NODE_PREFIX_LENGTH_OFFSET);
+}
+static const char* internal_node_prefix(void* node) {
+	return (const char*)(internal_node_key_ends(node) + *internal_node_num_keys(node));
 }
-uint32_t* internal_node_child(void* node, uint32_t child_num) {
+//Finds text key i's suffix, returns its length
+static uint32_t internal_node_suffix(void* node, uint32_t key_num, const char** suffix) {
+	const uint16_t* key_ends = internal_node_key_ends(node);
+	uint32_t start = key_num == 0 ? 0 : key_ends[key_num - 1];
+	*suffix = internal_node_prefix(node) + internal_node_prefix_length(node) + start;
+	return key_ends[key_num] - start;
+}
+//The child pointers sit right after the last key slot (or first thing in a text node), so in an integer node
+//where they start depends on how many key slots the page has room for
+static inline uint32_t* internal_node_children(void* node, uint32_t page_size) {
+	if (is_node_text(node)) {
+		return (uint32_t*)internal_node_keys(node);
+	}
+	uint32_t width = internal_node_key_width(node);
+	//rounded up so the pointers stay 4 byte aligned
+	uint32_t keys_size = (internal_node_key_slots(width, page_size) * width + 3) & ~3u;
+	return (uint32_t*)(internal_node_keys(node) + keys_size);
+}
+//Old internal nodes keep child and key side by side in cells
+static uint32_t* internal_node_legacy_cell(void* node, uint32_t cell_num) {
+	return (uint32_t*)((char*)node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_LEGACY_CELL_SIZE);
+}
+
+static inline uint32_t* internal_node_child_sized(void* node, uint32_t child_num, uint32_t page_size) {
 	uint32_t num_keys = *internal_node_num_keys(node);
 	if (child_num > num_keys) {
 		printf("tried to access child_num %d > num_keys %d\n", child_num, num_keys);
@@ -184,7 +1358,8 @@ uint32_t* internal_node_child(void* node, uint32_t child_num) {
 		return right_child;
 	}
 	else {
-		uint32_t* child = internal_node_cell(node, child_num);
+		uint32_t* child = is_node_packed(node) ? internal_node_children(node, page_size) + child_num
+			: internal_node_legacy_cell(node, child_num);
 		if (*child == INVALID_PAGE_NUM) {
 			printf("Tried to access child %d of node, but was invalid page", child_num);
 			exit(EXIT_FAILURE);
@@ -192,41 +1367,202 @@ uint32_t* internal_node_child(void* node, uint32_t child_num) {
 		return child;
 	}
 }
-//Remember the child pointer comes before the key pointer, so we want to skip that.
-uint32_t* internal_node_key(void* node, uint32_t key_num) {
-	return (char*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+uint32_t* internal_node_child(Table* table, void* node, uint32_t child_num) {
+	return internal_node_child_sized(node, child_num, table->pager->page_size);
+}
+//Packed nodes add the key's offset back onto the base.
+//Old ones: remember the child pointer comes before the key pointer, so we want to skip that.
+uint64_t internal_node_key(void* node, uint32_t key_num) {
+	if (!is_node_packed(node)) {
+		return *(uint32_t*)((char*)internal_node_legacy_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE);
+	}
+	uint64_t base;
+	memcpy(&base, (char*)node + INTERNAL_NODE_KEY_BASE_OFFSET, sizeof(base));
+	const char* keys = internal_node_keys(node);
+	switch (internal_node_key_width(node)) {
+	case(sizeof(uint16_t)):
+		return base + ((const uint16_t*)keys)[key_num];
+	case(sizeof(uint32_t)):
+		return base + ((const uint32_t*)keys)[key_num];
+	default:
+		return base + ((const uint64_t*)keys)[key_num];
+	}
 }
 
-initialize_internal_node(void* node) {
+void initialize_internal_node(void* node) {
 	set_node_type(node, NODE_INTERNAL);
+	*((uint8_t*)node + NODE_TYPE_OFFSET) |= NODE_PACKED;
 	set_node_root(node, false);
 	*internal_node_num_keys(node) = 0;
 	//Signifies the node is currently empty
 	*internal_node_right_child(node) = INVALID_PAGE_NUM;
+	uint64_t base = 0;
+	memcpy((char*)node + INTERNAL_NODE_KEY_BASE_OFFSET, &base, sizeof(base));
+	*((uint8_t*)node + INTERNAL_NODE_KEY_WIDTH_OFFSET) = sizeof(uint16_t);
+}
+
+void internal_node_decode(Table* table, void* node, InternalNodeContents* contents) {
+	uint32_t num_keys = *internal_node_num_keys(node);
+	//A file from a normal build opened by one compiled with a small INTERNAL_NODE_MAX_CELLS
+	if (num_keys > INTERNAL_NODE_MAX_CELLS) {
+		printf("Internal node with %u keys, this build holds at most %d. Rebuild without INTERNAL_NODE_MAX_CELLS set.\n",
+			num_keys, (int)INTERNAL_NODE_MAX_CELLS);
+		exit(EXIT_FAILURE);
+	}
+	contents->num_keys = num_keys;
+	contents->right_child = *internal_node_right_child(node);
+	contents->text = is_node_text(node);
+	contents->text_storage = NULL;
+	if (contents->text) {
+		//Put the prefix back on the front of every key, it gets worked out again when the node is encoded
+		uint32_t prefix_length = internal_node_prefix_length(node);
+		uint32_t suffixes_size = num_keys > 0 ? internal_node_key_ends(node)[num_keys - 1] : 0;
+		contents->text_storage = malloc(num_keys * prefix_length + suffixes_size + 1);
+		char* at = contents->text_storage;
+		for (uint32_t i = 0; i < num_keys; i++) {
+			const char* suffix;
+			uint32_t suffix_length = internal_node_suffix(node, i, &suffix);
+			memcpy(at, internal_node_prefix(node), prefix_length);
+			memcpy(at + prefix_length, suffix, suffix_length);
+			contents->text_keys[i] = at;
+			contents->text_key_lengths[i] = (uint16_t)(prefix_length + suffix_length);
+			contents->children[i] = *internal_node_child(table, node, i);
+			at += prefix_length + suffix_length;
+		}
+		return;
+	}
+	for (uint32_t i = 0; i < num_keys; i++) {
+		contents->keys[i] = internal_node_key(node, i);
+		contents->children[i] = *internal_node_child(table, node, i);
+	}
+}
+
+static bool internal_node_encode_text(Table* table, void* node, const InternalNodeContents* contents) {
+	uint32_t num_keys = contents->num_keys;
+	//Keys are sorted, so whatever the first and last share every key in between shares too
+	uint32_t prefix_length = 0;
+	if (num_keys > 0) {
+		const char* first = contents->text_keys[0];
+		const char* last = contents->text_keys[num_keys - 1];
+		uint32_t shortest = contents->text_key_lengths[0] < contents->text_key_lengths[num_keys - 1]
+			? contents->text_key_lengths[0] : contents->text_key_lengths[num_keys - 1];
+		while (prefix_length < shortest && first[prefix_length] == last[prefix_length]) {
+			prefix_length++;
+		}
+	}
+	uint32_t size = INTERNAL_NODE_KEYS_OFFSET + num_keys * (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_END_SIZE) + prefix_length;
+	for (uint32_t i = 0; i < num_keys; i++) {
+		size += contents->text_key_lengths[i] - prefix_length;
+	}
+	if (num_keys > INTERNAL_NODE_MAX_CELLS || size > table->pager->page_size) {
+		return false;
+	}
+	*((uint8_t*)node + NODE_TYPE_OFFSET) = NODE_INTERNAL | NODE_PACKED | NODE_TEXT_KEYS;
+	*internal_node_num_keys(node) = num_keys;
+	*internal_node_right_child(node) = contents->right_child;
+	*(uint16_t*)((char*)node + INTERNAL_NODE_PREFIX_LENGTH_OFFSET) = (uint16_t)prefix_length;
+	memcpy(internal_node_children(node, table->pager->page_size), contents->children, num_keys * sizeof(uint32_t));
+	uint16_t* key_ends = internal_node_key_ends(node);
+	char* prefix = (char*)(key_ends + num_keys);
+	if (num_keys > 0) {
+		memcpy(prefix, contents->text_keys[0], prefix_length);
+	}
+	char* suffixes = prefix + prefix_length;
+	uint32_t end = 0;
+	for (uint32_t i = 0; i < num_keys; i++) {
+		uint32_t suffix_length = contents->text_key_lengths[i] - prefix_length;
+		memcpy(suffixes + end, contents->text_keys[i] + prefix_length, suffix_length);
+		end += suffix_length;
+		key_ends[i] = (uint16_t)end;
+	}
+	return true;
+}
+
+bool internal_node_encode(Table* table, void* node, const InternalNodeContents* contents) {
+	if (contents->text) {
+		return internal_node_encode_text(table, node, contents);
+	}
+	uint32_t num_keys = contents->num_keys;
+	//Keys are sorted, so the first is the base and the last decides how wide the offsets need to be
+	uint64_t base = num_keys > 0 ? contents->keys[0] : 0;
+	uint64_t spread = num_keys > 0 ? contents->keys[num_keys - 1] - base : 0;
+	uint32_t width = spread <= UINT16_MAX ? sizeof(uint16_t) : spread <= UINT32_MAX ? sizeof(uint32_t) : sizeof(uint64_t);
+	if (num_keys > internal_node_max_keys(width, table->pager->page_size)) {
+		return false;
+	}
+	*((uint8_t*)node + NODE_TYPE_OFFSET) = NODE_INTERNAL | NODE_PACKED;
+	*internal_node_num_keys(node) = num_keys;
+	*internal_node_right_child(node) = contents->right_child;
+	memcpy((char*)node + INTERNAL_NODE_KEY_BASE_OFFSET, &base, sizeof(base));
+	*((uint8_t*)node + INTERNAL_NODE_KEY_WIDTH_OFFSET) = (uint8_t)width;
+	char* keys = internal_node_keys(node);
+	for (uint32_t i = 0; i < num_keys; i++) {
+		uint64_t offset = contents->keys[i] - base;
+		switch (width) {
+		case(sizeof(uint16_t)):
+			((uint16_t*)keys)[i] = (uint16_t)offset;
+			break;
+		case(sizeof(uint32_t)):
+			((uint32_t*)keys)[i] = (uint32_t)offset;
+			break;
+		default:
+			((uint64_t*)keys)[i] = offset;
+			break;
+		}
+	}
+	memcpy(internal_node_children(node, table->pager->page_size), contents->children, num_keys * sizeof(uint32_t));
+	return true;
+}
+
+void internal_node_contents_free(InternalNodeContents* contents) {
+	free(contents->text_storage);
+	contents->text_storage = NULL;
+}
+
+//Key i of decoded contents as a Value, and the other way round
+static Value internal_node_contents_key(const InternalNodeContents* contents, uint32_t key_num) {
+	if (contents->text) {
+		Value key = { VALUE_TEXT, 0, 0, contents->text_keys[key_num], contents->text_key_lengths[key_num] };
+		return key;
+	}
+	return integer_key(contents->keys[key_num]);
+}
+static void internal_node_contents_set_key(InternalNodeContents* contents, uint32_t key_num, const Value* key) {
+	if (contents->text) {
+		contents->text_keys[key_num] = key->text;
+		contents->text_key_lengths[key_num] = (uint16_t)key->length;
+	}
+	else {
+		contents->keys[key_num] = (uint64_t)key->integer;
+	}
 }
 
-uint32_t get_node_max_key(Pager* pager, void* node) {
+uint64_t get_node_max_key(Table* table, void* node) {
 	if (get_node_type(node) == NODE_LEAF) {
-		return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+		return leaf_node_key(table, node, *leaf_node_num_cells(node) - 1);
 	}
-	void* right_child = get_page(pager, *internal_node_right_child(node));
-	return get_node_max_key(pager, right_child);
+	void* right_child = get_page(table->pager, *internal_node_right_child(node));
+	return get_node_max_key(table, right_child);
 }
 
 NodeType get_node_type(void* node) {
-	//Get the address of node type, cast to uint8_t* and dereference it for our value
+	//Get the address of node type, cast to uint8_t* and dereference it for our value (minus the layout flags)
 	uint8_t value = *((uint8_t*)((char*)node + NODE_TYPE_OFFSET));
-	return (NodeType)value;
+	return (NodeType)(value & ~(NODE_PACKED | NODE_TEXT_KEYS));
 }
 void set_node_type(void* node, NodeType type) {
 	uint8_t value = type;
 	//Go to the node type in memory, store the value there as a uint8_t type.
 	*((uint8_t*)((char*)node + NODE_TYPE_OFFSET)) = value;
 }
+bool is_node_packed(void* node) {
+	return (*((uint8_t*)node + NODE_TYPE_OFFSET) & NODE_PACKED) != 0;
+}
 
 //initialize by setting the number of cells of the node to 0
 void initialize_leaf_node(void* node) { 
 	set_node_type(node, NODE_LEAF);
+	*((uint8_t*)node + NODE_TYPE_OFFSET) |= NODE_PACKED;
 	set_node_root(node, false);
 	*leaf_node_num_cells(node) = 0; 
 	*leaf_node_next_leaf(node) = 0; //0 meaning no sibling leaves.
@@ -243,140 +1579,184 @@ void set_node_root(void* node, bool is_root) {
 	*((uint8_t*)((char*)node + IS_ROOT_OFFSET)) = value;
 }
 
+//Points every child of an internal node back at it
+static void internal_node_adopt_children(Table* table, uint32_t page_num) {
+	void* node = get_page(table->pager, page_num);
+	uint32_t num_keys = *internal_node_num_keys(node);
+	for (uint32_t i = 0; i <= num_keys; i++) {
+		void* child = get_page_for_write(table->pager, *internal_node_child(table, node, i));
+		*node_parent(child) = page_num;
+	}
+}
+
 /*let N be the root node, allocate L and R as children, move the lower half of N to L and the upper half into R
 NOW N is empty, add (L, K, R) in N where K is the max key in L, N remains the root*/
-void create_new_root(Table* table, uint32_t right_child_page_num) {
-	void* root = get_page(table->pager, table->root_page_num);
-	void* right_child = get_page(table->pager, right_child_page_num);
+void create_new_root(Table* table, uint32_t right_child_page_num, const Value* separator) {
+	stats_count(STAT_ROOT_SPLITS);
+	void* root = get_page_for_write(table->pager, table->root_page_num);
+	void* right_child = get_page_for_write(table->pager, right_child_page_num);
 	uint32_t left_child_page_num = get_unused_page_num(table->pager);
-	void* left_child = get_page(table->pager, left_child_page_num);
+	void* left_child = get_page_for_write(table->pager, left_child_page_num);
 
-	if (get_node_type(root) == NODE_INTERNAL) {
-		initialize_internal_node(right_child);
-		initialize_internal_node(left_child);
-	}
-
-	memcpy(left_child, root, PAGE_SIZE);
+	memcpy(left_child, root, table->pager->page_size);
 	set_node_root(left_child, false);
 
 	if (get_node_type(left_child) == NODE_INTERNAL) {
-		void* child;
-		for (int i = 0; i < *internal_node_num_keys(left_child); i++) {
-			child = get_page(table->pager, *internal_node_child(left_child, i));
-			*node_parent(child) = left_child_page_num;
-		}
-		child = get_page(table->pager, *internal_node_right_child(left_child));
-		*node_parent(child) = left_child_page_num;
+		internal_node_adopt_children(table, left_child_page_num);
 	}
 
 	//Root node is new internal node w one key and 2 children
+	InternalNodeContents* contents = malloc(sizeof(InternalNodeContents));
+	contents->num_keys = 1;
+	contents->text = table->text_keys;
+	contents->text_storage = NULL;
+	internal_node_contents_set_key(contents, 0, separator);
+	contents->children[0] = left_child_page_num;
+	contents->right_child = right_child_page_num;
 	initialize_internal_node(root);
 	set_node_root(root, true);
-	*internal_node_num_keys(root) = 1;
-	*internal_node_child(root, 0) = left_child_page_num;
-	uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
-	*internal_node_key(root, 0) = left_child_max_key;
-	*internal_node_right_child(root) = right_child_page_num;
+	internal_node_encode(table, root, contents);
+	free(contents);
 	*node_parent(left_child) = table->root_page_num;
 	*node_parent(right_child) = table->root_page_num;
 }
 
 
 
-void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
-	void* node = get_page(cursor->table->pager, cursor->page_num);
+void leaf_node_insert(Cursor* cursor, const void* row) {
+	Table* table = cursor->table;
+	//Transactions don't overlap, so the commit this insert goes out with is the next one. A rollback leaves it
+	//pointing at whatever commits next instead, which only costs a column store that didn't need rebuilding.
+	pthread_mutex_lock(&table->pager->latch);
+	table->modified_at = table->pager->commit_seq + 1;
+	pthread_mutex_unlock(&table->pager->latch);
+	void* node = get_page_for_write(table->pager, cursor->page_num);
+	//Anything we write gets the packed layout, old leaves are converted on their first write
+	leaf_node_pack(table, node);
 
 	uint32_t num_cells = *leaf_node_num_cells(node);
-	if (num_cells >= LEAF_NODE_MAX_CELLS) {
+	if (num_cells >= table->leaf_max_cells) {
 		//this means the node is full and needs to be split
-		leaf_node_split_and_insert(cursor, key, value);
+		leaf_node_split_and_insert(cursor, row);
 		return;
 	}
 	if (cursor->cell_num < num_cells) {
-		//space needs to be made for the new cell, shift all nodes to the right of the cursor over 1.
-		for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-			memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1), LEAF_NODE_CELL_SIZE);
-		}
+		//space needs to be made for the new cell, shift all cells to the right of the cursor over 1 in one go.
+		memmove(leaf_node_cell(table, node, cursor->cell_num + 1), leaf_node_cell(table, node, cursor->cell_num),
+			(num_cells - cursor->cell_num) * table->leaf_cell_size);
 	}
 	*(leaf_node_num_cells(node)) += 1;
-	*(leaf_node_key(node, cursor->cell_num)) = key;
-	serialize_row(value, leaf_node_value(node, cursor->cell_num));
+	memcpy(leaf_node_value(table, node, cursor->cell_num), row, table->schema.row_size);
 }
 
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
-	void* old_node = get_page(cursor->table->pager, cursor->page_num);
-	uint32_t old_max = get_node_max_key(cursor->table->pager, old_node);
+static void internal_node_insert_at(Table* table, uint32_t parent_page_num, uint32_t split_child_page_num, const Value* separator,
+	uint32_t new_child_page_num, bool appending);
+
+void leaf_node_split_and_insert(Cursor* cursor, const void* row) {
+	Table* table = cursor->table;
+	stats_count(STAT_LEAF_SPLITS);
+	void* old_node = get_page_for_write(cursor->table->pager, cursor->page_num);
+	leaf_node_pack(table, old_node);
 	uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-	void* new_node = get_page(cursor->table->pager, new_page_num);
+	void* new_node = get_page_for_write(cursor->table->pager, new_page_num);
 	initialize_leaf_node(new_node);
 	*node_parent(new_node) = *node_parent(old_node);
 	*leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
 	*leaf_node_next_leaf(old_node) = new_page_num;
+	//Going on the end of the rightmost leaf means keys are coming in increasing order. Halving the leaf would leave
+	//its left half empty for good, so the full leaf stays full and the new one starts with just this row.
+	bool appending = cursor->cell_num == table->leaf_max_cells && *leaf_node_next_leaf(new_node) == 0;
+	if (appending) {
+		memcpy(leaf_node_value(table, new_node, 0), row, table->schema.row_size);
+		*(leaf_node_num_cells(new_node)) = 1;
+	}
 	//next we need to make sure all existing and  the new key are divided evenly going from right to left
-	for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
+	for (int32_t i = appending ? -1 : (int32_t)table->leaf_max_cells; i >= 0; i--) {
 		void* destination_node;
-		if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
+		if (i >= (int32_t)table->leaf_left_split_count) {
 			destination_node = new_node;
 		}
 		else {
 			destination_node = old_node;
 		}
-		uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-		void* destination = leaf_node_cell(destination_node, index_within_node);
+		uint32_t index_within_node = i % table->leaf_left_split_count;
+		void* destination = leaf_node_cell(table, destination_node, index_within_node);
 
-		if (i == cursor->cell_num) {
-			serialize_row(value, leaf_node_value(destination_node, index_within_node));
-			*leaf_node_key(destination_node, index_within_node) = key;
+		if (i == (int32_t)cursor->cell_num) {
+			memcpy(destination, row, table->schema.row_size);
 		}
-		else if (i > cursor->cell_num) {
-			memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
+		else if (i > (int32_t)cursor->cell_num) {
+			memcpy(destination, leaf_node_cell(table, old_node, i - 1), table->leaf_cell_size);
 		}
 		else {
-			memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+			memcpy(destination, leaf_node_cell(table, old_node, i), table->leaf_cell_size);
 		}
 	}
 	//Now we need to make sure the cell count on both leafs are correct
-	*(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-	*(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+	if (!appending) {
+		*(leaf_node_num_cells(old_node)) = table->leaf_left_split_count;
+		*(leaf_node_num_cells(new_node)) = table->leaf_right_split_count;
+	}
 	//Finally we need to update the parent and make sure it points to both nodes, if it was the root we need to create a parent for it
+	Value separator = table_row_key(table, leaf_node_value(table, old_node, *leaf_node_num_cells(old_node) - 1));
+	char separator_text[SCHEMA_MAX_KEY_LENGTH + 1];
+	if (table->text_keys) {
+		//The parent only needs something between the two leaves: the shortest start of the right leaf's
+		//first key that's still bigger than the left leaf's last
+		Value right_min = table_row_key(table, leaf_node_value(table, new_node, 0));
+		uint32_t shared = 0;
+		while (shared < separator.length && right_min.text[shared] == separator.text[shared]) {
+			shared++;
+		}
+		separator.length = shared + 1;
+		memcpy(separator_text, right_min.text, separator.length);
+		separator.text = separator_text;
+	}
 	if (is_node_root(old_node)) {
-		return create_new_root(cursor->table, new_page_num);
+		create_new_root(cursor->table, new_page_num, &separator);
 	}
 	else {
-		uint32_t parent_page_num = *node_parent(old_node);
-		uint32_t new_max = get_node_max_key(cursor->table->pager, old_node);
-		void* parent = get_page(cursor->table->pager, parent_page_num);
-
-		update_internal_node_key(parent, old_max, new_max);
-
-		internal_node_insert(cursor->table, parent_page_num, new_page_num);
-		return;
+		internal_node_insert_at(cursor->table, *node_parent(old_node), cursor->page_num, &separator, new_page_num, appending);
+	}
+	if (*leaf_node_next_leaf(new_node) == 0) {
+		table->append_leaf = new_page_num;
+		table->append_epoch = table->pager->tree_epoch;
 	}
 }
 
-void serialize_row(Row* source, void* destination) {
-	memcpy((char*)destination + ID_OFFSET, &(source->id), ID_SIZE);
-	memcpy((char*)destination + USERNAME_OFFSET, &(source->username), USERNAME_SIZE);
-	memcpy((char*)destination + EMAIL_OFFSET, &(source->email), EMAIL_SIZE);
+void print_row(FILE* out, Table* table, const void* row) {
+	schema_print_row(out, &table->schema, row);
 }
-void deserialize_row(void* source, Row* destination) {
-	memcpy(&(destination->id), (char*)source + ID_OFFSET, ID_SIZE);
-	memcpy(&(destination->username), (char*)source + USERNAME_OFFSET, USERNAME_SIZE);
-	memcpy(&(destination->email), (char*)source + EMAIL_OFFSET, EMAIL_SIZE);
+
+Cursor* table_start(Table* table) {
+	return table_start_at(table, NULL);
 }
 
-void print_row(Row* row) {
-	printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+Cursor* table_start_at(Table* table, Snapshot* snapshot) {
+	Cursor* cursor = malloc(sizeof(Cursor));
+	table_seek_start(table, snapshot, cursor);
+	return cursor;
 }
 
-Cursor* table_start(Table* table) {
+void table_seek_start(Table* table, Snapshot* snapshot, Cursor* cursor) {
 	//New implementation returns the lowest key/id in the table (the left most leaf node)
-	Cursor* cursor = table_find(table, 0);
+	Value first = integer_key(0);
+	table_seek(table, &first, snapshot, cursor);
 
-	void* node = get_page(table->pager, cursor->page_num);
+	void* node = get_page_at(table->pager, cursor->page_num, snapshot);
 	uint32_t num_cells = *leaf_node_num_cells(node);
 	cursor->end_of_table = (num_cells == 0);
-	return cursor;
+	//If .analyze found the leaf chain running through the file in order, the first hop to the next page is enough
+	//to start reading a window ahead (any hop that isn't still resets it)
+	pthread_mutex_lock(&table->pager->latch);
+	if (table->analysis != NULL && table->analysis->fragmentation <= ANALYZE_IN_ORDER_FRAGMENTATION) {
+		cursor->sequential_hops = LEAF_READAHEAD_TRIGGER - 1;
+	}
+	pthread_mutex_unlock(&table->pager->latch);
+	//a cursor from table_start is almost always a scan, so start pulling in the next leaf now
+	if (*leaf_node_next_leaf(node) != 0) {
+		pager_prefetch(table->pager, *leaf_node_next_leaf(node));
+	}
 }
 
 /*
@@ -396,25 +1776,28 @@ Cursor* table_end(Table* table) {
 
 
 //Returns the position of the key, the position of the key we'll need to move, or one position past the last key
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
-	void* node = get_page(table->pager, page_num);
+static void leaf_node_find_at(Table* table, uint32_t page_num, const Value* key, Snapshot* snapshot, Cursor* cursor) {
+	void* node = get_page_at(table->pager, page_num, snapshot);
 	uint32_t num_cells = *leaf_node_num_cells(node);
-	Cursor* cursor = malloc(sizeof(Cursor));
 	cursor->table = table;
 	cursor->page_num = page_num;
+	cursor->end_of_table = false;
+	cursor->snapshot = snapshot;
+	cursor->sequential_hops = 0;
+	cursor->readahead_end = 0;
 
 	//binary search
 	uint32_t min_index = 0;
 	uint32_t one_past_max_index = num_cells;
 	while (one_past_max_index != min_index) {
 		uint32_t index = (min_index + one_past_max_index) / 2;
-		uint32_t key_at_index = *leaf_node_key(node, index);
+		int compared = leaf_node_compare(table, node, index, key);
 
-		if (key == key_at_index) {
+		if (compared == 0) {
 			cursor->cell_num = index;
-			return cursor;
+			return;
 		}
-		if (key < key_at_index) {
+		if (compared > 0) {
 			one_past_max_index = index;
 		}
 		else {
@@ -422,61 +1805,334 @@ Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key) {
 		}
 	}
 	cursor->cell_num = min_index;
+	//A writer that ended up on the rightmost leaf remembers it for the next append
+	if (snapshot == NULL && *leaf_node_next_leaf(node) == 0) {
+		table->append_leaf = page_num;
+		table->append_epoch = table->pager->tree_epoch;
+	}
+}
+
+Cursor* leaf_node_find(Table* table, uint32_t page_num, uint64_t key) {
+	Value find = integer_key(key);
+	Cursor* cursor = malloc(sizeof(Cursor));
+	leaf_node_find_at(table, page_num, &find, NULL, cursor);
 	return cursor;
 }
+
 uint32_t* leaf_node_next_leaf(void* node) {
-	return (char*)node + LEAF_NODE_NEXT_LEAF_OFFSET;
+	return (uint32_t*)((char*)node + LEAF_NODE_NEXT_LEAF_OFFSET);
+}
+
+//Binary search only narrows things down to this many keys, the rest is done a vector at a time
+#define KEY_SEARCH_WINDOW 32
+
+//Index of the first of count sorted offsets that's >= target
+static uint32_t key_search_u16(const uint16_t* keys, uint32_t count, uint16_t target) {
+	uint32_t low = 0;
+	uint32_t high = count;
+	while (high - low > KEY_SEARCH_WINDOW) {
+		uint32_t middle = (low + high) / 2;
+		if (keys[middle] < target) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+#ifdef KEY_SEARCH_SSE2
+	//SSE2 only compares signed, flipping the top bit of both sides makes the unsigned order come out right
+	__m128i flip = _mm_set1_epi16((short)0x8000);
+	__m128i probe = _mm_xor_si128(_mm_set1_epi16((short)target), flip);
+	while (low + 8 <= high) {
+		__m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(keys + low)), flip);
+		//one bit per byte, so two per key that's smaller than the target
+		uint32_t smaller = count_bits((uint32_t)_mm_movemask_epi8(_mm_cmpgt_epi16(probe, block))) / 2;
+		if (smaller < 8) {
+			return low + smaller;
+		}
+		low += 8;
+	}
+#endif
+	while (low < high && keys[low] < target) {
+		low++;
+	}
+	return low;
+}
+
+static uint32_t key_search_u32(const uint32_t* keys, uint32_t count, uint32_t target) {
+	uint32_t low = 0;
+	uint32_t high = count;
+	while (high - low > KEY_SEARCH_WINDOW) {
+		uint32_t middle = (low + high) / 2;
+		if (keys[middle] < target) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+#ifdef KEY_SEARCH_SSE2
+	__m128i flip = _mm_set1_epi32((int)0x80000000u);
+	__m128i probe = _mm_xor_si128(_mm_set1_epi32((int)target), flip);
+	while (low + 4 <= high) {
+		__m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(keys + low)), flip);
+		uint32_t smaller = count_bits((uint32_t)_mm_movemask_epi8(_mm_cmpgt_epi32(probe, block))) / 4;
+		if (smaller < 4) {
+			return low + smaller;
+		}
+		low += 4;
+	}
+#endif
+	while (low < high && keys[low] < target) {
+		low++;
+	}
+	return low;
+}
+
+//Whole 64 bit keys, only for nodes whose keys are too spread out to pack. SSE2 has no 64 bit compare, so plain binary search.
+static uint32_t key_search_u64(const uint64_t* keys, uint32_t count, uint64_t target) {
+	uint32_t low = 0;
+	uint32_t high = count;
+	while (low != high) {
+		uint32_t middle = (low + high) / 2;
+		if (keys[middle] < target) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+	return low;
 }
 
-uint32_t internal_node_find_child(void* node, uint32_t key) {
+uint32_t internal_node_find_child(void* node, uint64_t key) {
 	uint32_t num_keys = *internal_node_num_keys(node);
 
+	if (!is_node_packed(node)) {
+		uint32_t min_index = 0;
+		uint32_t max_index = num_keys;
+
+		while (min_index != max_index) {
+			uint32_t index = (min_index + max_index) / 2;
+			uint64_t key_to_right = internal_node_key(node, index);
+			if (key_to_right >= key) {
+				//our key must be to the left of this one (or is this one)
+				max_index = index;
+			}
+			else {
+				//our key must be to the right of this one
+				min_index = index + 1;
+			}
+		}
+		return min_index;
+	}
+	//Work in the node's offsets instead of decoding every key: subtract the base from our key once,
+	//anything at or below the base goes in the first child and anything past the widest offset in the last
+	uint64_t base;
+	memcpy(&base, (char*)node + INTERNAL_NODE_KEY_BASE_OFFSET, sizeof(base));
+	if (num_keys == 0 || key <= base) {
+		return 0;
+	}
+	uint64_t target = key - base;
+	const char* keys = internal_node_keys(node);
+	switch (internal_node_key_width(node)) {
+	case(sizeof(uint16_t)):
+		return target > UINT16_MAX ? num_keys : key_search_u16((const uint16_t*)keys, num_keys, (uint16_t)target);
+	case(sizeof(uint32_t)):
+		return target > UINT32_MAX ? num_keys : key_search_u32((const uint32_t*)keys, num_keys, (uint32_t)target);
+	default:
+		return key_search_u64((const uint64_t*)keys, num_keys, target);
+	}
+}
+
+uint32_t internal_node_find_child_text(void* node, const char* key, uint32_t length) {
+	uint32_t num_keys = *internal_node_num_keys(node);
+	//Every key here starts with the prefix, so a key that doesn't goes before or after all of them
+	uint32_t prefix_length = internal_node_prefix_length(node);
+	int compared = memcmp(key, internal_node_prefix(node), length < prefix_length ? length : prefix_length);
+	if (compared < 0 || (compared == 0 && length < prefix_length)) {
+		return 0;
+	}
+	if (compared > 0) {
+		return num_keys;
+	}
+	key += prefix_length;
+	length -= prefix_length;
+	//Text keys are the smallest key of the child after them, so find the first one bigger than ours
 	uint32_t min_index = 0;
 	uint32_t max_index = num_keys;
-
-	while(min_index != max_index) {
+	while (min_index != max_index) {
 		uint32_t index = (min_index + max_index) / 2;
-		uint32_t key_to_right = *internal_node_key(node, index);
-		if (key_to_right >= key) {
-			//our key must be to the left of this one (or is this one)
+		const char* suffix;
+		uint32_t suffix_length = internal_node_suffix(node, index, &suffix);
+		if (key_compare_text(suffix, suffix_length, key, length) > 0) {
 			max_index = index;
 		}
 		else {
-			//our key must be to the right of this one
 			min_index = index + 1;
 		}
 	}
 	return min_index;
 }
 
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key) {
-	void* node = get_page(table->pager, page_num);
-	uint32_t child_index = internal_node_find_child(node, key);
-	uint32_t child_num = *internal_node_child(node, child_index);
-	void* child = get_page(table->pager, child_num);
-	switch (get_node_type(child)) {
-	case NODE_LEAF:
-		return leaf_node_find(table, child_num, key);
-	case NODE_INTERNAL:
-		return internal_node_find(table, child_num, key);
+//Walks down from an internal node to the leaf the key belongs in, one level at a time, and leaves page_num on
+//that leaf. Returns how many pages it went through, the leaf included.
+static inline uint32_t internal_node_descend(Table* table, uint32_t* page_num, const Value* key, Snapshot* snapshot,
+	uint32_t page_size) {
+	void* node = get_page_at(table->pager, *page_num, snapshot);
+	uint32_t depth = 1;
+	while (get_node_type(node) == NODE_INTERNAL) {
+		uint32_t child_index = table->text_keys ? internal_node_find_child_text(node, key->text, key->length)
+			: internal_node_find_child(node, (uint64_t)key->integer);
+		*page_num = *internal_node_child_sized(node, child_index, page_size);
+		node = get_page_at(table->pager, *page_num, snapshot);
+		depth++;
 	}
+	return depth;
 }
 
-Cursor* table_find(Table* table, uint32_t key) {
-	uint32_t root_page_num = table->root_page_num;
-	void* root_node = get_page(table->pager, root_page_num);
+//A copy of the descent for every page size a file can have. With the size a constant, the compiler works out where
+//an integer node's children start at compile time instead of dividing by the key width on every level.
+#define DEFINE_INTERNAL_NODE_DESCEND(size) \
+	static uint32_t internal_node_descend_##size(Table* table, uint32_t* page_num, const Value* key, Snapshot* snapshot) { \
+		return internal_node_descend(table, page_num, key, snapshot, size); \
+	}
+PAGE_SIZE_VARIANTS(DEFINE_INTERNAL_NODE_DESCEND)
+#define CASE_INTERNAL_NODE_DESCEND(size) \
+	case(size): \
+		depth = internal_node_descend_##size(table, &page_num, key, snapshot); \
+		break;
+
+static uint32_t internal_node_find_at(Table* table, uint32_t page_num, const Value* key, Snapshot* snapshot, Cursor* cursor) {
+	uint32_t depth;
+	switch (table->pager->page_size) {
+	PAGE_SIZE_VARIANTS(CASE_INTERNAL_NODE_DESCEND)
+	default:
+		//pager_open never lets any other size through
+		depth = internal_node_descend(table, &page_num, key, snapshot, table->pager->page_size);
+		break;
+	}
+	leaf_node_find_at(table, page_num, key, snapshot, cursor);
+	return depth;
+}
+
+Cursor* internal_node_find(Table* table, uint32_t page_num, uint64_t key) {
+	Value find = integer_key(key);
+	Cursor* cursor = malloc(sizeof(Cursor));
+	internal_node_find_at(table, page_num, &find, NULL, cursor);
+	return cursor;
+}
+
+Cursor* table_find(Table* table, uint64_t key) {
+	return table_find_at(table, key, NULL);
+}
+
+Cursor* table_find_at(Table* table, uint64_t key, Snapshot* snapshot) {
+	Value find = integer_key(key);
+	return table_find_key(table, &find, snapshot);
+}
+
+//Keys bigger than everything in the table all go on the end of the rightmost leaf, which is where the descent would
+//end up anyway. Returns false if the key doesn't go there or we don't know which leaf that is right now.
+static bool table_find_append(Table* table, const Value* key, Cursor* cursor) {
+	if (table->append_leaf == INVALID_PAGE_NUM || table->append_epoch != table->pager->tree_epoch) {
+		return false;
+	}
+	void* node = get_page(table->pager, table->append_leaf);
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	if (num_cells == 0 || leaf_node_compare(table, node, num_cells - 1, key) >= 0) {
+		return false;
+	}
+	cursor->table = table;
+	cursor->page_num = table->append_leaf;
+	cursor->cell_num = num_cells;
+	cursor->end_of_table = false;
+	cursor->snapshot = NULL;
+	cursor->sequential_hops = 0;
+	cursor->readahead_end = 0;
+	return true;
+}
+
+Cursor* table_find_key(Table* table, const Value* key, Snapshot* snapshot) {
+	Cursor* cursor = malloc(sizeof(Cursor));
+	table_seek(table, key, snapshot, cursor);
+	return cursor;
+}
+
+void table_seek(Table* table, const Value* key, Snapshot* snapshot, Cursor* cursor) {
+	stats_count(STAT_FINDS);
+	if (snapshot == NULL && table_find_append(table, key, cursor)) {
+		stats_count(STAT_APPEND_FINDS);
+		stats_record(STAT_FIND_DEPTH, 1);
+		return;
+	}
+	uint32_t root_page_num = table_root_at(table, snapshot);
+	void* root_node = get_page_at(table->pager, root_page_num, snapshot);
 
 	if (get_node_type(root_node) == NODE_LEAF) {
-		return leaf_node_find(table, root_page_num, key);
+		leaf_node_find_at(table, root_page_num, key, snapshot, cursor);
+		stats_record(STAT_FIND_DEPTH, 1);
 	}
 	else {
-		return internal_node_find(table, root_page_num, key);
+		stats_record(STAT_FIND_DEPTH, internal_node_find_at(table, root_page_num, key, snapshot, cursor));
+	}
+}
+
+uint32_t table_root_at(Table* table, Snapshot* snapshot) {
+	pthread_mutex_lock(&table->pager->latch);
+	//A snapshot from before a vacuum walks the tree the way it was before it
+	uint32_t root_page_num = snapshot != NULL && snapshot->commit_seq < table->root_moved_at
+		? table->old_root_page_num : table->root_page_num;
+	pthread_mutex_unlock(&table->pager->latch);
+	return root_page_num;
+}
+
+uint32_t table_height(Table* table, Snapshot* snapshot) {
+	uint32_t page_num = table_root_at(table, snapshot);
+	void* node = get_page_at(table->pager, page_num, snapshot);
+	uint32_t height = 1;
+	while (get_node_type(node) == NODE_INTERNAL) {
+		node = get_page_at(table->pager, *internal_node_child(table, node, 0), snapshot);
+		height++;
+	}
+	return height;
+}
+
+//Called every time a cursor hops from one leaf to the next.
+//After a bulk load the leaf chain runs through the file in page order, so once we see a few hops
+//to page_num + 1 in a row we stop chasing pointers and read a whole window of pages ahead.
+//Otherwise we just prefetch the one leaf the chain says is next.
+static void cursor_read_ahead(Cursor* cursor, uint32_t old_page_num, uint32_t new_page_num) {
+	Pager* pager = cursor->table->pager;
+	if (new_page_num == old_page_num + 1) {
+		cursor->sequential_hops++;
+	}
+	else {
+		cursor->sequential_hops = 0;
+		cursor->readahead_end = 0;
+	}
+
+	if (cursor->sequential_hops >= LEAF_READAHEAD_TRIGGER) {
+		//Top the window back up once half of it has been used, so requests go out in decent sized batches
+		uint32_t window_end = new_page_num + 1 + LEAF_READAHEAD_PAGES;
+		if (cursor->readahead_end <= new_page_num + LEAF_READAHEAD_PAGES / 2) {
+			uint32_t first = cursor->readahead_end > new_page_num ? cursor->readahead_end : new_page_num + 1;
+			pager_prefetch_range(pager, first, window_end - first);
+			cursor->readahead_end = window_end;
+		}
+		return;
+	}
+	//while we chew through this leaf, get the one after it coming off disk
+	void* node = get_page_at(pager, new_page_num, cursor->snapshot);
+	uint32_t after_next = *leaf_node_next_leaf(node);
+	if (after_next != 0) {
+		pager_prefetch(pager, after_next);
 	}
 }
 
 void cursor_advance(Cursor* cursor) {
 	uint32_t page_num = cursor->page_num;
-	void* node = get_page(cursor->table->pager, page_num);
+	void* node = get_page_at(cursor->table->pager, page_num, cursor->snapshot);
 	cursor->cell_num += 1;
 	if (cursor->cell_num >= (*leaf_node_num_cells(node))) {
 		//we head the end of the leaf node so try to iterate to the next leaf over
@@ -489,22 +2145,26 @@ void cursor_advance(Cursor* cursor) {
 		else {
 			cursor->page_num = next_page_num;
 			cursor->cell_num = 0;
+			cursor_read_ahead(cursor, page_num, next_page_num);
 		}
 	}
 }
 
 void* cursor_value(Cursor* cursor) {
 	uint32_t page_num = cursor->page_num;
-	void* page = get_page(cursor->table->pager, page_num);
-	return leaf_node_value(page, cursor->cell_num);
+	void* page = get_page_at(cursor->table->pager, page_num, cursor->snapshot);
+	return leaf_node_value(cursor->table, page, cursor->cell_num);
 }
-void print_constants() {
-	printf("ROW_SIZE: %d\n", ROW_SIZE);
-	printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-	printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-	printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-	printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-	printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+void print_constants(Table* table) {
+	printf("ROW_SIZE: %d\n", table->schema.row_size);
+	printf("COMMON_NODE_HEADER_SIZE: %d\n", (int)COMMON_NODE_HEADER_SIZE);
+	printf("LEAF_NODE_HEADER_SIZE: %d\n", (int)LEAF_NODE_HEADER_SIZE);
+	printf("LEAF_NODE_CELL_SIZE: %d\n", table->leaf_cell_size);
+	printf("PAGE_SIZE: %u\n", table->pager->page_size);
+	printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", (int)LEAF_NODE_SPACE_FOR_CELLS(table->pager->page_size));
+	printf("LEAF_NODE_MAX_CELLS: %d\n", table->leaf_max_cells);
+	printf("INTERNAL_NODE_MAX_CELLS: %d\n", (int)INTERNAL_NODE_MAX_CELLS);
+	printf("KEY_SIZE: %d\n", table->key_size);
 }
 /*
 * depreciated, replaced by print_tree
@@ -524,8 +2184,8 @@ void indent(uint32_t level) {
 }
 
 //Prints out our BTree
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
-	void* node = get_page(pager, page_num);
+void print_tree(Table* table, uint32_t page_num, uint32_t indentation_level) {
+	void* node = get_page(table->pager, page_num);
 	uint32_t num_keys, child;
 
 	switch (get_node_type(node)) {
@@ -535,7 +2195,13 @@ void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
 		printf("- leaf (size %d)\n", num_keys);
 		for (uint32_t i = 0; i < num_keys; i++) {
 			indent(indentation_level + 1);
-			printf("- %d\n", *leaf_node_key(node, i));
+			Value key = table_row_key(table, leaf_node_value(table, node, i));
+			if (table->text_keys) {
+				printf("- %.*s\n", (int)key.length, key.text);
+			}
+			else {
+				printf("- %llu\n", (unsigned long long)key.integer);
+			}
 		}
 		break;
 	case (NODE_INTERNAL):
@@ -545,138 +2211,131 @@ void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level) {
 		//adds a safe guard to make sure we don't try to access an invalid page
 		if (num_keys > 0) {
 			for (uint32_t i = 0; i < num_keys; i++) {
-				child = *internal_node_child(node, i);
-				print_tree(pager, child, indentation_level + 1);
+				child = *internal_node_child(table, node, i);
+				print_tree(table, child, indentation_level + 1);
 				indent(indentation_level + 1);
-				printf("- key %d\n", *internal_node_key(node, i));
+				if (is_node_text(node)) {
+					//the shared prefix, then what's left of the key
+					const char* suffix;
+					uint32_t suffix_length = internal_node_suffix(node, i, &suffix);
+					printf("- key %.*s|%.*s\n", (int)internal_node_prefix_length(node), internal_node_prefix(node),
+						(int)suffix_length, suffix);
+				}
+				else {
+					printf("- key %llu\n", (unsigned long long)internal_node_key(node, i));
+				}
 
 			}
 			child = *internal_node_right_child(node);
-			print_tree(pager, child, indentation_level + 1);
+			print_tree(table, child, indentation_level + 1);
 
 			break;
 		}
 	}
 }
-uint32_t* node_parent(void* node) { return (char*)node + PARENT_POINTER_OFFSET; }
-
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key) {
-	uint32_t old_child_index = internal_node_find_child(node, old_key);
-	*internal_node_key(node, old_child_index) = new_key;
-}
-
-
-void internal_node_split_and_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
-	uint32_t old_page_num = parent_page_num;
-	void* old_node = get_page(table->pager, parent_page_num);
-	uint32_t old_max = get_node_max_key(table->pager, old_node);
-
-	void* child = get_page(table->pager, child_page_num);
-	uint32_t child_max = get_node_max_key(table->pager, child);
-
-	uint32_t new_page_num = get_unused_page_num(table->pager);
-	
-	//declaring a flag for if we are splitting the root
-	uint32_t splitting_root = is_node_root(old_node);
-
-	void* parent;
-	//will throw potentially uninitialized error hissyfit
-	void* new_node = NULL;
-	if (splitting_root) {
-		create_new_root(table, new_page_num);
-		parent = get_page(table->pager, table->root_page_num);
-		//if we're splitting the root, update old node to point to new root's left child,
-		//new_page_num will already point to the new root's right child
+uint32_t* node_parent(void* node) { return (uint32_t*)((char*)node + PARENT_POINTER_OFFSET); }
 
-		old_page_num = *internal_node_child(parent, 0);
-		old_node = get_page(table->pager, old_page_num);
+//Where to split a node that's overflowed: halfway through its keys, or for text keys (which aren't all the same size)
+//halfway through the bytes they take, so both halves are sure to fit
+static uint32_t internal_node_split_point(const InternalNodeContents* contents) {
+	if (!contents->text) {
+		return contents->num_keys / 2;
 	}
-	else {
-		parent = get_page(table->pager, *node_parent(old_node));
-		new_node = get_page(table->pager, new_page_num);
-		initialize_internal_node(new_node);
+	uint32_t total = 0;
+	for (uint32_t i = 0; i < contents->num_keys; i++) {
+		total += contents->text_key_lengths[i];
 	}
-	uint32_t* old_num_keys = internal_node_num_keys(old_node);
-
-	uint32_t cur_page_num = internal_node_right_child(old_node);
-	void* cur = get_page(table->pager, cur_page_num);
-
-	//first put right child into new node and set right child of old node to INVALID_PAGE_NUM
-	internal_node_insert(table, new_page_num, cur_page_num);
-	*node_parent(cur) = new_page_num;
-	*internal_node_right_child(old_node) = INVALID_PAGE_NUM;
-
-	//For each key until we hit the middle key, move the key and the child to the new node
-	for (int i = INTERNAL_NODE_MAX_CELLS - 1; i > INTERNAL_NODE_MAX_CELLS / 2; i--) {
-		cur_page_num = *internal_node_child(old_node, i);
-		cur = get_page(table->pager, cur_page_num);
-		
-		internal_node_insert(table, new_page_num, cur_page_num);
-		*node_parent(cur) = new_page_num;
-
-		(*old_num_keys)--;
-	}
-	//Set child before middle key which is now the highest key, to be the node's right child
-	//then decrement number of keeys
-	*internal_node_right_child(old_node) = *internal_node_child(old_node, *old_num_keys);
-	(*old_num_keys)--;
-
-	//Determine which of the two nodes after the split should insert
-	uint32_t max_after_split = get_node_max_key(table->pager, old_node);
-
-	uint32_t destination_page_num = child_max < max_after_split ? old_page_num : new_page_num;
-
-	internal_node_insert(table, destination_page_num, child_page_num);
-	*node_parent(child) = destination_page_num;
-
-	update_internal_node_key(parent, old_max, get_node_max_key(table->pager, old_node));
-	if (!splitting_root) {
-		internal_node_insert(table, *node_parent(old_node), new_page_num);
-		*node_parent(new_node) = *node_parent(old_node);
+	uint32_t so_far = 0;
+	uint32_t middle = 0;
+	while (middle < contents->num_keys - 2 && so_far + contents->text_key_lengths[middle] <= total / 2) {
+		so_far += contents->text_key_lengths[middle];
+		middle++;
 	}
+	//both sides keep at least one key
+	return middle == 0 ? 1 : middle;
 }
 
-void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num) {
-	void* parent = get_page(table->pager, parent_page_num);
-	void* child = get_page(table->pager, child_page_num);
-	uint32_t child_max_key = get_node_max_key(table->pager, child);
-	uint32_t index = internal_node_find_child(parent, child_max_key);
-
-	uint32_t original_num_keys = *internal_node_num_keys(parent);
+/*split_child_page_num just split: it keeps the keys up to split_child_max and new_child_page_num took the rest,
+so new_child takes over the slot (and key) split_child had in the parent and split_child gets a new one in front of it.
+If the parent can't fit one more key it splits too: the left half stays where it is, the right half moves to a new node,
+and the key between them goes up a level the same way.*/
+void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t split_child_page_num, const Value* separator,
+	uint32_t new_child_page_num) {
+	internal_node_insert_at(table, parent_page_num, split_child_page_num, separator, new_child_page_num, false);
+}
 
-	if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-		internal_node_split_and_insert(table, parent_page_num, child_page_num);
-		return;
+//appending: the split below was an append to the rightmost leaf. Up the right edge of the tree a full node then
+//keeps all but its last key and the new node starts out with one, the same idea as the leaf split.
+static void internal_node_insert_at(Table* table, uint32_t parent_page_num, uint32_t split_child_page_num, const Value* separator,
+	uint32_t new_child_page_num, bool appending) {
+	void* parent = get_page_for_write(table->pager, parent_page_num);
+	InternalNodeContents* contents = malloc(sizeof(InternalNodeContents));
+	internal_node_decode(table, parent, contents);
+
+	appending = appending && contents->right_child == split_child_page_num;
+	if (contents->right_child == split_child_page_num) {
+		internal_node_contents_set_key(contents, contents->num_keys, separator);
+		contents->children[contents->num_keys] = split_child_page_num;
+		contents->right_child = new_child_page_num;
 	}
+	else {
+		uint32_t index = 0;
+		while (contents->children[index] != split_child_page_num) {
+			index++;
+		}
+		for (uint32_t i = contents->num_keys; i > index; i--) {
+			contents->keys[i] = contents->keys[i - 1];
+			contents->text_keys[i] = contents->text_keys[i - 1];
+			contents->text_key_lengths[i] = contents->text_key_lengths[i - 1];
+			contents->children[i] = contents->children[i - 1];
+		}
+		//index + 1 is new_child now, and still has split_child's old key
+		contents->children[index + 1] = new_child_page_num;
+		internal_node_contents_set_key(contents, index, separator);
+	}
+	contents->num_keys++;
+	void* new_child = get_page_for_write(table->pager, new_child_page_num);
+	*node_parent(new_child) = parent_page_num;
 
-	uint32_t right_child_page_num = *internal_node_right_child(parent);
-
-	//an internal node with a right child of INVALID_PAGE_NUM is empty
-	if (right_child_page_num == INVALID_PAGE_NUM) {
-		*internal_node_right_child(parent) = child_page_num;
+	if (internal_node_encode(table, parent, contents)) {
+		internal_node_contents_free(contents);
+		free(contents);
 		return;
 	}
 
-	void* right_child = get_page(table->pager, right_child_page_num);
-
-	//If we are at the max number of cells for a node, we cant increment before splitting
-	//incrementing without inserting a key/child pair and immediately calling internal_node_split_and_insert
-	//will create a new key at max_cells + 1 with an uninitialized value.
-
-	if (child_max_key > get_node_max_key(table->pager, right_child)) {
-		//replace the right child
-		*internal_node_child(parent, original_num_keys) = right_child_page_num;
-		*internal_node_key(parent, original_num_keys) = get_node_max_key(table->pager, right_child);
-		*internal_node_right_child(parent) = child_page_num;
+	//Doesn't fit, keys[middle] goes up to the grandparent and everything right of it goes to a new node
+	stats_count(STAT_INTERNAL_SPLITS);
+	uint32_t middle = appending && contents->num_keys > 2 ? contents->num_keys - 2 : internal_node_split_point(contents);
+	Value up = internal_node_contents_key(contents, middle);
+	//right borrows contents' text_storage, which lives until we're done here
+	InternalNodeContents* right = malloc(sizeof(InternalNodeContents));
+	right->num_keys = contents->num_keys - middle - 1;
+	right->right_child = contents->right_child;
+	right->text = contents->text;
+	right->text_storage = NULL;
+	memcpy(right->keys, contents->keys + middle + 1, right->num_keys * sizeof(uint64_t));
+	memcpy(right->text_keys, contents->text_keys + middle + 1, right->num_keys * sizeof(const char*));
+	memcpy(right->text_key_lengths, contents->text_key_lengths + middle + 1, right->num_keys * sizeof(uint16_t));
+	memcpy(right->children, contents->children + middle + 1, right->num_keys * sizeof(uint32_t));
+	contents->num_keys = middle;
+	contents->right_child = contents->children[middle];
+
+	uint32_t right_page_num = get_unused_page_num(table->pager);
+	void* right_node = get_page_for_write(table->pager, right_page_num);
+	initialize_internal_node(right_node);
+	internal_node_encode(table, right_node, right);
+	free(right);
+	internal_node_adopt_children(table, right_page_num);
+	internal_node_encode(table, parent, contents);
+
+	if (is_node_root(parent)) {
+		create_new_root(table, right_page_num, &up);
 	}
 	else {
-		// make room for new cell
-		for (uint32_t i = original_num_keys; i > index; i--) {
-			void* destination = internal_node_cell(parent, i);
-			void* source = internal_node_cell(parent, i - 1);
-			memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
-		}
-		*internal_node_child(parent, index) = child_page_num;
-		*internal_node_key(parent, index) = child_max_key;
+		uint32_t grandparent_page_num = *node_parent(parent);
+		*node_parent(right_node) = grandparent_page_num;
+		internal_node_insert_at(table, grandparent_page_num, parent_page_num, &up, right_page_num, appending);
 	}
-}
\ No newline at end of file
+	internal_node_contents_free(contents);
+	free(contents);
+}
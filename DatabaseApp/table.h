@@ -3,6 +3,12 @@
 //Include for uint32_t
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include "AsyncIO.h"
+#include "posix_comp.h"
+#include "Schema.h"
+//The row of the default users table (see schema_default). Tables get their layout from a Schema now,
+//this is only kept for code that deals with that one table, like the client's db_client_decode_row.
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
 //A row in the table
@@ -37,36 +43,151 @@ it just returns the size of the attribute type in the struct */
 #define EMAIL_OFFSET  (USERNAME_OFFSET + USERNAME_SIZE)
 #define ROW_SIZE  (ID_SIZE + USERNAME_SIZE + EMAIL_SIZE)
 
-
-void serialize_row(Row* source, void* destination);
-void deserialize_row(void* source, Row* destination);
-
+//Every file picks its page size when it's created (DB_PAGE_SIZE, see db_open) and keeps it in its header.
+//PAGE_SIZE is the default, and what every file written before the header recorded it uses. Bigger pages mean fatter
+//leaves and fewer levels for scans, 4096 tends to be best for point lookups on small rows.
 #define PAGE_SIZE 4096
+#define PAGE_SIZE_MAX 65536
+//Every size a file can use. The lookup path gets one copy of itself per size, with that size's node layout folded in
+//(X gets called once per size, see internal_node_find_at).
+#define PAGE_SIZE_VARIANTS(X) X(4096) X(16384) X(65536)
 #define TABLE_MAX_PAGES  100
+//Page frames the pager carves out of one slab at open: a cached copy plus a transaction's shadow of every page.
+//Old versions kept for snapshots past that come off the heap.
+#ifndef PAGER_SLAB_FRAMES
+#define PAGER_SLAB_FRAMES (TABLE_MAX_PAGES * 2)
+#endif
 /*
 * Constants no longer needed since we don't store partial pages anymore
 #define ROWS_PER_PAGE  (PAGE_SIZE / ROW_SIZE)
 #define TABLE_MAX_ROWS  (ROWS_PER_PAGE * TABLE_MAX_PAGES)
 */
+//An older committed copy of a page, kept around while some snapshot might still read it.
+//It was the current version for snapshots taken from installed_at up to (not including) replaced_at.
+typedef struct PageVersion {
+	void* data;
+	uint64_t installed_at;
+	uint64_t replaced_at;
+	struct PageVersion* older;
+} PageVersion;
+
+//A reader's view of the database as of one commit. Pages read through a snapshot never change underneath it,
+//no matter what gets committed while the reader is still walking the tree.
+typedef struct Snapshot {
+	uint64_t commit_seq;
+	//pages the database had as of that commit
+	uint32_t num_pages;
+	struct Snapshot* next;
+} Snapshot;
+
 //Create a struct Pager which the table can call to make requests
 typedef struct {
 	int file_descriptor;
 	uint32_t file_length;
 	uint32_t num_pages;
 	void* pages[TABLE_MAX_PAGES];
+	//Pages modified since the last checkpoint, only these get written back
+	bool dirty[TABLE_MAX_PAGES];
+	//Reads started by pager_prefetch that haven't landed in pages[] yet
+	IORequest* in_flight[TABLE_MAX_PAGES];
+	AsyncIO* io;
+	//Every page the pager holds lives in a frame from this page aligned slab (hugepage backed where the OS will do it),
+	//so a cache miss or a shadow copy takes a frame off the free list instead of going to malloc.
+	//Free frames are chained through their first bytes.
+	char* frames;
+	void* free_frames;
+	//Same idea for I/O requests, there can never be more than the queue depth of them out at once
+	IORequest requests[ASYNC_IO_QUEUE_DEPTH];
+	IORequest* free_requests;
+	//The database file's name, .vacuum writes its new copy next to it
+	char* path;
+	//Where the rollback journal lives while a batch of pages is being written
+	char* journal_path;
+	//Bytes in every page of this file, one of PAGE_SIZE_VARIANTS
+	uint32_t page_size;
+	//Page 0 is a DBHEADR2 header, so close records the page count and a clean shutdown in it
+	bool has_header;
+	//The header on disk says the file was closed cleanly. The first checkpoint clears that before writing anything.
+	bool clean_on_disk;
+	//Transaction state. Inside a transaction the first write to an existing page makes a private copy (shadow)
+	//and every later get_page sees the copy. Rollback throws the copies away, commit swaps them in.
+	bool in_transaction;
+	//num_pages when the transaction began, anything at or past this was created by the transaction
+	uint32_t transaction_num_pages;
+	void* shadow[TABLE_MAX_PAGES];
+	//MVCC: every commit bumps commit_seq, and installed_at says which commit put pages[i] there.
+	//When a commit replaces a page that an open snapshot might still need, the old copy moves to old_versions.
+	uint64_t commit_seq;
+	uint64_t installed_at[TABLE_MAX_PAGES];
+	PageVersion* old_versions[TABLE_MAX_PAGES];
+	Snapshot* snapshots;
+	//Bumped whenever pages get put back or moved (rollback, vacuum), which makes every table forget its append_leaf
+	uint64_t tree_epoch;
+	//Short term latch over the page table, version chains and I/O queue (and the Database's table list). Nobody holds it across a tree walk.
+	pthread_mutex_t latch;
 } Pager;
-//Initializes pager and opens file.
-Pager* pager_open(const char* filename);
+//Initializes pager and opens file. A new (empty) file gets new_page_size pages, an existing one keeps its own.
+Pager* pager_open(const char* filename, uint32_t new_page_size);
 //Retrieves a page from itself/file (file if cache miss)
 void* get_page(Pager* pager, uint32_t page_num);
+//Same as get_page, but marks the page dirty so it gets written back. Use this for any page you're about to modify.
+void* get_page_for_write(Pager* pager, uint32_t page_num);
+//Retrieves the version of a page a snapshot should see. A NULL snapshot is the same as get_page.
+void* get_page_at(Pager* pager, uint32_t page_num, Snapshot* snapshot);
+//Pins the current committed state of the database for a reader. The caller owns the Snapshot (usually on its stack)
+//and has to end it before it goes away.
+void pager_snapshot_begin(Pager* pager, Snapshot* snapshot);
+//Releases a snapshot, any page versions only it was using get freed
+void pager_snapshot_end(Pager* pager, Snapshot* snapshot);
+//True if the database file holds exactly the snapshot's copy of the page right now, so it can be copied straight
+//out of the file without going through the cache. Stays true until a commit after the snapshot replaces the page.
+bool pager_page_on_disk(Pager* pager, uint32_t page_num, Snapshot* snapshot);
+//Starts reading a page in the background so a later get_page doesn't have to wait on the disk
+void pager_prefetch(Pager* pager, uint32_t page_num);
+//Same as pager_prefetch for count pages starting at first_page, submitted to the disk as one batch
+void pager_prefetch_range(Pager* pager, uint32_t first_page, uint32_t count);
 //Get an unused page for node splitting
 uint32_t get_unused_page_num(Pager* pager);
 //Flushes page to disk
 void pager_flush(Pager* pager, uint32_t page_num);
+//Writes every dirty page back to disk as one atomic batch (journal, write, fsync)
+void pager_checkpoint(Pager* pager);
+//Clears the clean shutdown flag in the file's header (synced) if it's still set, so the next open knows there may be
+//something to recover. The first checkpoint does it, and so does the change log before its first record.
+void pager_mark_dirty(Pager* pager);
+//Starts a transaction, returns false if one is already running
+bool pager_begin(Pager* pager);
+//Makes the transaction's pages visible and durable, returns false if there's no transaction
+bool pager_commit(Pager* pager);
+//Makes the transaction's pages visible to new snapshots without writing them out yet (statements outside begin/commit)
+bool pager_commit_in_memory(Pager* pager);
+//Throws away everything the transaction changed, returns false if there's no transaction
+bool pager_rollback(Pager* pager);
+//Closes a pager without writing anything back and frees it
+void pager_discard(Pager* pager);
+
+//The leaf layout depends on the table's row size, so the node functions need to know which table they're in
+typedef struct Table Table;
+//Column at a time copy of a table for analytic scans, see ColumnStore.h
+typedef struct ColumnStore ColumnStore;
+//What the last .analyze found out about a table's tree, see Analyze.h
+typedef struct TableAnalysis TableAnalysis;
+//Inserts and create tables in commit order, for followers, see ChangeLog.h
+typedef struct ChangeLog ChangeLog;
+//The files a sharded database's rows live in, see Shard.h
+typedef struct ShardSet ShardSet;
+//Output of recent selects, see ResultCache.h
+typedef struct ResultCache ResultCache;
 
 //I would really like nodes to be in a seperate file, but the way they interact with table and pager force me to place them here
 typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
-//We will have to come back and rework this for non int types of data, what if we want to set this up with strings?
+//Keys are 64 bit now (the table's first column, int32 or int64). Nodes written since then are "packed":
+//leaves don't keep a copy of the key in front of every row, and internal nodes store their keys as offsets from
+//the node's smallest key. Nodes from older files are still read as they are and get packed the first time
+//they're written to. The packed flag rides along in the node type byte.
+#define NODE_PACKED 0x80
+//Internal nodes of a table keyed by a varchar, see the text node layout below
+#define NODE_TEXT_KEYS 0x40
 //The below are constants for internal nodes and some for leaf nodes
 #define NODE_TYPE_SIZE sizeof(uint8_t)
 #define NODE_TYPE_OFFSET 0
@@ -84,48 +205,43 @@ typedef enum { NODE_INTERNAL, NODE_LEAF } NodeType;
 #define LEAF_NODE_NEXT_LEAF_SIZE sizeof(uint32_t)
 #define LEAF_NODE_NEXT_LEAF_OFFSET (LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE)
 #define LEAF_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + (LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE))
+//Unpacked (old) leaves only: every cell starts with a 32 bit copy of the row's key
 #define LEAF_NODE_KEY_SIZE sizeof(uint32_t)
-#define LEAF_NODE_KEY_OFFSET 0
-#define LEAF_NODE_VALUE_SIZE ROW_SIZE
-#define LEAF_NODE_VALUE_OFFSET (LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE)
-#define LEAF_NODE_CELL_SIZE (LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE)
-#define LEAF_NODE_SPACE_FOR_CELLS (PAGE_SIZE - LEAF_NODE_HEADER_SIZE)
-#define LEAF_NODE_MAX_CELLS (LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE)
-
-/*From the above constants here's what our leaf node layout will look like
+#define LEAF_NODE_SPACE_FOR_CELLS(page_size) ((page_size) - LEAF_NODE_HEADER_SIZE)
+//A packed leaf cell is just the serialized row, the key is read straight out of its first column.
+//So the cell size, cells per leaf and split counts come from the table's schema.
+//They live in the Table (leaf_cell_size and friends), see table_set_schema.
+
+/*From the above constants here's what a packed leaf looks like for the default users table (293 byte rows)
 byte 0: node_type
 1: is_root
 2-6: parent_pointer
 6-9: num_cells
-10-13: key 0
-14-306: value 0
-307-310 key 1
-311-603: value 1
-604-607: key 2
+10-13: next_leaf
+14-306: row 0 (its first 4 bytes are the id)
+307-599: row 1
 .....
-3578-3871: value 12
-3871-4095: wasted space
-We leave the space empty to avoid splitting cells between nodes.*/
-
-//Constants for splitting and inserting leaf nodes
-#define LEAF_NODE_RIGHT_SPLIT_COUNT ((LEAF_NODE_MAX_CELLS + 1) / 2)
-//If right gets an even number of cells, this will get that number + 1
-#define LEAF_NODE_LEFT_SPLIT_COUNT ((LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT)
+3530-3822: row 12
+3823-4095: wasted space
+We leave the space empty to avoid splitting cells between nodes.
+Old leaves put a 4 byte key in front of each row, which is how they only fit 13 cells too.*/
 
 //Most of the below functions use pointer arithmatic to access the node's keys, values, and metadata.
 
 //Returns the number of cells in the node
 uint32_t* leaf_node_num_cells(void* node);
 //Returns a cell in the node
-void* leaf_node_cell(void* node, uint32_t cell_num);
+void* leaf_node_cell(Table* table, void* node, uint32_t cell_num);
 //Returns the key for the relevant cell
-uint32_t* leaf_node_key(void* node, uint32_t cell_num);
-//Accesses the relevant cell's value
-void* leaf_node_value(void* node, uint32_t cell_num);
+uint64_t leaf_node_key(Table* table, void* node, uint32_t cell_num);
+//Accesses the relevant cell's value (the row)
+void* leaf_node_value(Table* table, void* node, uint32_t cell_num);
 //Returns if the node is a leaf or internal
 NodeType get_node_type(void* node);
 //Sets whether the node is a leaf or internal
 void set_node_type(void* node, NodeType type);
+//Whether the node uses the packed layout
+bool is_node_packed(void* node);
 //Creates the leaf node
 void initialize_leaf_node(void* node);
 
@@ -135,32 +251,83 @@ void initialize_leaf_node(void* node);
 #define INTERNAL_NODE_RIGHT_CHILD_SIZE sizeof(uint32_t)
 #define INTERNAL_NODE_RIGHT_CHILD_OFFSET (INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE)
 #define INTERNAL_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE)
-//Internal node body layout
-#define INTERNAL_NODE_KEY_SIZE sizeof(uint32_t)
+//Packed internal nodes: frame of reference encoding. Every key is stored as key - key_base (the node's smallest key)
+//in the narrowest width the node's spread of keys fits in, so a node full of nearby 64 bit ids costs 2 or 4 bytes a key.
+#define INTERNAL_NODE_KEY_BASE_OFFSET INTERNAL_NODE_HEADER_SIZE
+#define INTERNAL_NODE_KEY_WIDTH_OFFSET (INTERNAL_NODE_KEY_BASE_OFFSET + sizeof(uint64_t))
+//Keys start 8 byte aligned, the child pointers come right after the last key slot
+#define INTERNAL_NODE_KEYS_OFFSET 24
 #define INTERNAL_NODE_CHILD_SIZE sizeof(uint32_t)
-#define INTERNAL_NODE_CELL_SIZE (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE)
-#define INTERNAL_NODE_MAX_CELLS 3
-
-/*So from the above constants this is what our internal layout looks like
+#define INTERNAL_NODE_SPACE_FOR_CELLS(page_size) ((page_size) - INTERNAL_NODE_KEYS_OFFSET)
+//Most keys a node could ever hold (with 2 byte keys in the biggest pages). Compile with a small INTERNAL_NODE_MAX_CELLS
+//(the original was 3) to get internal nodes splitting after a handful of rows.
+#ifndef INTERNAL_NODE_MAX_CELLS
+#define INTERNAL_NODE_MAX_CELLS (INTERNAL_NODE_SPACE_FOR_CELLS(PAGE_SIZE_MAX) / (INTERNAL_NODE_CHILD_SIZE + sizeof(uint16_t)))
+#endif
+//Unpacked (old) internal nodes: cells of 32 bit child pointer + 32 bit key, and never more than 3 of them
+#define INTERNAL_NODE_LEGACY_KEY_SIZE sizeof(uint32_t)
+#define INTERNAL_NODE_LEGACY_CELL_SIZE (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_LEGACY_KEY_SIZE)
+
+/*So from the above constants this is what a packed internal node looks like when its keys fit in 2 bytes
 byte 0: node_type
 byte 1: is_root
 2-6 parent_pointer
 6-9 num_keys
 10-13 right child pointer
-14-17 child pointer 0
-18-21 key 0
-22-25 child pointer 1
-26-29 key 1
+14-21 key_base
+22 key_width (2, 4 or 8)
+24-25 key 0 - key_base
+26-27 key 1 - key_base
+....
+1378-1379 key 677 - key_base
+1380-1383 child pointer 0
 ....
-4086-4089 child pointer 509
-4090-4093 key 509
-4094-4095 wasted space
+4088-4091 child pointer 677
+4092-4095 wasted space
 
+With 4 byte offsets that's 509 keys a node, and 339 when the keys are too far apart and get stored whole.
 this is a *ridiculous* growth rate, 3 layers deep is about 550 gb of data total,
 but since we only need to access 4 disk pages total (root + 2 internals + 1 leaf) we only have to load
 16kb of memory to find our key (4 kb per node).
 */
 
+/*Tables keyed by a varchar get text internal nodes instead (packed, plus NODE_TEXT_KEYS). Sorted strings in one node
+tend to start the same way (think emails at one domain, or a node far down the tree where every key starts "jo"),
+so the prefix every key in the node shares is stored once and each key only keeps the rest of itself.
+On top of that the keys themselves are cut short when the node gets them: a key only has to separate
+two children, so a leaf split hands up the shortest start of the right leaf's first key that's still bigger than the
+left leaf's last one ("jon" rather than "jonathan@example.com" if the left leaf ends at "joe@example.com").
+So a text node's key i is the smallest key in child i + 1 (or less, never below what child i holds), the other way round
+from integer nodes where it's the biggest key in child i.
+byte 0: node_type
+byte 1: is_root
+2-6 parent_pointer
+6-9 num_keys
+10-13 right child pointer
+14-15 prefix_length
+24- child pointers, num_keys of them
+then each key's end, 2 bytes a key, counted from where the suffixes start
+then the shared prefix, then every key's suffix back to back
+*/
+#define INTERNAL_NODE_PREFIX_LENGTH_OFFSET INTERNAL_NODE_HEADER_SIZE
+#define INTERNAL_NODE_KEY_END_SIZE sizeof(uint16_t)
+
+//Every key and child of an internal node, unpacked. Nodes get decoded into one of these to be changed
+//and encoded back, since inserting one key can change the base or width of all of them.
+//Room for one more than a node holds, so a full node can take the insert before it gets split.
+//Sized for the biggest pages that makes it a couple hundred KB, so these live on the heap, not the stack.
+typedef struct {
+	uint32_t num_keys;
+	uint32_t right_child;
+	uint64_t keys[INTERNAL_NODE_MAX_CELLS + 1];
+	uint32_t children[INTERNAL_NODE_MAX_CELLS + 1];
+	//Text nodes use these instead of keys: key i is text_keys[i], text_key_lengths[i] bytes long (no terminator).
+	//Decoding copies them out of the node into text_storage, internal_node_contents_free gives that back.
+	bool text;
+	const char* text_keys[INTERNAL_NODE_MAX_CELLS + 1];
+	uint16_t text_key_lengths[INTERNAL_NODE_MAX_CELLS + 1];
+	char* text_storage;
+} InternalNodeContents;
 
 //Constant which represents an invalid page number that is the child of every empty node
 #define INVALID_PAGE_NUM UINT32_MAX
@@ -169,38 +336,157 @@ but since we only need to access 4 disk pages total (root + 2 internals + 1 leaf
 uint32_t* internal_node_num_keys(void* node);
 //Gets the right child of the internal node
 uint32_t* internal_node_right_child(void* node);
-//Gets a cell within the internal node
-uint32_t* internal_node_cell(void* node, uint32_t cell_num);
-//Gets a numbered child within the internal node
-uint32_t* internal_node_child(void* node, uint32_t child_num);
+//Gets a numbered child within the internal node. Where an integer node's children start depends on the page size.
+uint32_t* internal_node_child(Table* table, void* node, uint32_t child_num);
 //Gets a key within the internal node.
-uint32_t* internal_node_key(void* node, uint32_t key_num);
+uint64_t internal_node_key(void* node, uint32_t key_num);
 //Initializes internal node
-initialize_internal_node(void* node);
+void initialize_internal_node(void* node);
+//Unpacks any internal node (packed or old) into contents
+void internal_node_decode(Table* table, void* node, InternalNodeContents* contents);
+//Writes contents into the node in the packed layout. Returns false (and leaves the node alone) if they don't fit.
+bool internal_node_encode(Table* table, void* node, const InternalNodeContents* contents);
+void internal_node_contents_free(InternalNodeContents* contents);
 
 
-//Returns the maximum key within a node
-uint32_t get_node_max_key(Pager* pager, void* node);
+//Returns the maximum key within a node (integer keyed tables only)
+uint64_t get_node_max_key(Table* table, void* node);
 
 //determines if a node is the root
 bool is_node_root(void* node);
 //sets the node as the root or not
 void set_node_root(void* node, bool is_root);
 
-typedef struct {
+struct Table {
 	Pager* pager;
+	//The root never moves once a table exists (create_new_root splits it in place), so the catalog
+	//only has to be written when a table is created
 	uint32_t root_page_num;
-} Table;
-
-//Function for creating a new root in our btree
-void create_new_root(Table* table, uint32_t right_child_page_num);
-
-//Prints a row to console
-void print_row(Row* row);
-//Initializes table and pager, opens/creates database file
-Table* db_open(const char* filename);
-//Flushes memory to disk, closes db file, and frees table and pager on ".exit".
-void db_close(Table* table);
+	//Except for a vacuum, which rebuilds every tree somewhere else in a new file. Snapshots from before root_moved_at
+	//still start from old_root_page_num (the old pages stay around for them as page versions). Guarded by the pager latch.
+	uint32_t old_root_page_num;
+	uint64_t root_moved_at;
+	//Key of the table's row in the catalog, 0 for the lone table of a file that has no catalog
+	uint32_t table_id;
+	//Size of the key column (the first one), 4 for int32, 8 for int64, or the whole slot for a varchar
+	uint32_t key_size;
+	//Keyed by a varchar rather than an integer
+	bool text_keys;
+	//The commit that created the table, snapshots older than that don't get to see it
+	uint64_t created_at;
+	Schema schema;
+	//Packed leaf layout for this table's rows, worked out from the schema by table_set_schema
+	uint32_t leaf_cell_size;
+	uint32_t leaf_max_cells;
+	uint32_t leaf_right_split_count;
+	//If right gets an even number of cells, this will get that number + 1
+	uint32_t leaf_left_split_count;
+	//The commit that last changed the table's rows (or will, while a transaction that inserted into it is open), so a
+	//commit to some other table doesn't throw this one's column store out. Guarded by the pager latch.
+	uint64_t modified_at;
+	//The last column store a scan built, NULL until one does
+	ColumnStore* column_store;
+	//The last .analyze, NULL until one runs (or since a vacuum moved every page). Guarded by the pager latch.
+	TableAnalysis* analysis;
+	//The rightmost leaf, so inserts with a key bigger than everything in the table (increasing ids) go straight there
+	//instead of down from the root. INVALID_PAGE_NUM until a lookup lands on it, and stale once append_epoch falls
+	//behind the pager's tree_epoch. Only writers use it, so the write side guards it.
+	uint32_t append_leaf;
+	uint64_t append_epoch;
+};
+
+//Most tables one file can hold (each needs at least a root page, so TABLE_MAX_PAGES is the real limit for now)
+#define DATABASE_MAX_TABLES 64
+
+//One open database file. Every table in it shares the one pager, so they share its page cache, its
+//transactions and its file descriptor.
+typedef struct {
+	Pager* pager;
+	//The system catalog: a B-tree like any other table, keyed by table id, one row per table
+	//(id, name, root page, encoded schema). NULL for files from before it existed, which hold one table.
+	Table* catalog;
+	//Every table in catalog order, loaded at open. Tables only get appended (and only outside of a
+	//transaction) and aren't freed until db_close, so a Table* stays good for as long as the database is open.
+	Table* tables[DATABASE_MAX_TABLES];
+	uint32_t num_tables;
+	//<db>-changes, NULL unless DB_CHANGE_LOG is set
+	ChangeLog* changes;
+	//NULL unless the database was created with DB_SHARDS set, then its rows are all in these
+	ShardSet* shards;
+	//What repeated selects printed, NULL when DB_RESULT_CACHE=0 (and in shard files, the database caches for them)
+	ResultCache* results;
+} Database;
+
+//Page 0 of a file with a catalog starts with this, a node page never does (its first byte is the node type, 0 or 1).
+//The catalog's root page number comes right after it.
+#define HEADER_MAGIC "DBHEADR2"
+#define HEADER_MAGIC_SIZE 8
+#define HEADER_ROOT_PAGE_OFFSET HEADER_MAGIC_SIZE
+/*Then the format fields, all uint32_t except the last:
+format version (files from before these fields have zeros here, which reads as version 0: no page size to check
+and never closed cleanly), page size, pages in the file, head of the free page list (0, nothing frees pages yet,
+a vacuum gives them back instead), and one byte that's 1 while the file is closed cleanly.
+The page count and clean flag are only written at close, while the database is open the flag on disk is 0.*/
+#define HEADER_FORMAT_VERSION 1
+#define HEADER_VERSION_OFFSET (HEADER_ROOT_PAGE_OFFSET + sizeof(uint32_t))
+#define HEADER_PAGE_SIZE_OFFSET (HEADER_VERSION_OFFSET + sizeof(uint32_t))
+#define HEADER_PAGE_COUNT_OFFSET (HEADER_PAGE_SIZE_OFFSET + sizeof(uint32_t))
+#define HEADER_FREELIST_OFFSET (HEADER_PAGE_COUNT_OFFSET + sizeof(uint32_t))
+#define HEADER_CLEAN_OFFSET (HEADER_FREELIST_OFFSET + sizeof(uint32_t))
+#define HEADER_SIZE (HEADER_CLEAN_OFFSET + 1)
+//Past the format fields (8 byte aligned), a uint64_t: the last change from a leader's change log that's in this file.
+//Followers keep it up to date in the same transaction as the changes themselves, and a backup of a database with a
+//change log sets it, so a follower can start from the backup. 0 in any other file.
+#define HEADER_CHANGE_SEQ_OFFSET 40
+//Then a uint32_t: how many shard files the database's rows are spread over (see Shard.h), 0 when they're in this one
+#define HEADER_SHARD_COUNT_OFFSET (HEADER_CHANGE_SEQ_OFFSET + sizeof(uint64_t))
+//Files written before the catalog existed have this instead, followed by their one table's root page and schema
+#define HEADER_SINGLE_TABLE_MAGIC "DBHEADR1"
+#define HEADER_SCHEMA_OFFSET (HEADER_ROOT_PAGE_OFFSET + sizeof(uint32_t))
+//Files older than that don't have a header at all, their root is page 0 and their schema is schema_default
+//Fills in a header's format fields the way a clean close leaves them: this build's version, page_size, num_pages
+//and the clean flag set
+void header_mark_clean(void* header, uint32_t page_size, uint32_t num_pages);
+//HEADER_CHANGE_SEQ_OFFSET out of the database's header, 0 for a file without one
+uint64_t database_change_seq(Database* database);
+//Sets it, as part of the transaction that has to be open. Returns false if the file has no header to keep it in.
+bool database_set_change_seq(Database* database, uint64_t seq);
+
+//Function for creating a new root in our btree. The root's current contents move to a new left child
+//and right_child_page_num becomes the right child, with separator as the key between them
+//(the left child's biggest key, or for text keys the shortened first key of the right child).
+void create_new_root(Table* table, uint32_t right_child_page_num, const Value* separator);
+
+//Prints a row (as stored in a leaf cell) to the given stream (stdout for the REPL)
+void print_row(FILE* out, Table* table, const void* row);
+//Switches the table to a schema and works out its leaf layout
+void table_set_schema(Table* table, const Schema* schema);
+//Initializes the pager and loads the catalog, opens/creates database file.
+//A new file starts out with the default users table in it, and DB_PAGE_SIZE bytes a page (PAGE_SIZE if unset).
+//With DB_CHANGE_LOG set it opens the change log too, and plays it back into a file that wasn't closed cleanly.
+//A new file gets DB_SHARDS shard files if that's set, an existing one opens the ones its header says it has.
+//Selects get a result cache of DB_RESULT_CACHE bytes (RESULT_CACHE_BYTES if unset).
+Database* db_open(const char* filename);
+//Same, but a new file gets page_size byte pages. Returns NULL if page_size isn't one of PAGE_SIZE_VARIANTS.
+Database* db_open_page_size(const char* filename, uint32_t page_size);
+//Just the file and its tables: no change log, no shards and no result cache, whatever the environment or the header says.
+//How shard files get opened. Returns NULL if page_size isn't one of PAGE_SIZE_VARIANTS.
+Database* db_open_file(const char* filename, uint32_t page_size);
+//Flushes memory to disk, closes db file, and frees every table and the pager on ".exit".
+//A transaction that's still open gets rolled back.
+void db_close(Database* database);
+//Looks a table up by name. NULL or "" means the default table (the first one), so statements that don't
+//name a table keep working on single table files. Returns NULL if there's no such table.
+Table* database_find_table(Database* database, const char* name);
+//Adds a table with its own empty B-tree and writes it to the catalog. Files without a catalog get one first.
+//Can't run inside a transaction. Returns NULL if the name is taken or the database is out of room for tables.
+Table* database_create_table(Database* database, const Schema* schema);
+//For .vacuum (see Vacuum.h): writes the header and a catalog listing every table, with root_page_nums[i] as
+//tables[i]'s new root, into a rebuilt copy of the file. Returns the catalog's root.
+uint32_t database_write_catalog(Database* database, Pager* rebuilt, const uint32_t* root_page_nums);
+//Swaps the rebuilt copy in as the database's file, as one commit. Snapshots from before it keep reading the old pages
+//from memory. The rebuilt pager is freed, and it has to already be on disk under the database's name.
+void database_install_file(Database* database, Pager* rebuilt, const uint32_t* root_page_nums, uint32_t catalog_root);
 
 
 //Represnts a location on the table
@@ -209,11 +495,30 @@ typedef struct {
 	uint32_t page_num;
 	uint32_t cell_num;
 	bool end_of_table;
+	//Which version of the pages this cursor reads, NULL means the latest (including our own uncommitted writes)
+	Snapshot* snapshot;
+	//Read-ahead bookkeeping for scans: how many leaf hops in a row went to page_num + 1,
+	//and the first page past what we've already asked the pager to prefetch
+	uint32_t sequential_hops;
+	uint32_t readahead_end;
 } Cursor;
+
+//Once a scan has hopped to the very next page this many times in a row we treat the leaves as laid out in order
+#define LEAF_READAHEAD_TRIGGER 2
+//How many pages past the current leaf a sequential scan keeps in flight
+#define LEAF_READAHEAD_PAGES 16
 //Once we split our implementation into a BTree, this will make inserts, modifications, and deletes much easier.
 
 //Return a cursor pointing at the start of a table
 Cursor* table_start(Table* table);
+//table_start_at and table_find_key for a cursor the caller owns, usually on the stack. Lookups and scans use these,
+//so neither has to touch the heap. The ones that hand back a Cursor* are the same thing in a malloc'd cursor.
+void table_seek_start(Table* table, Snapshot* snapshot, Cursor* cursor);
+void table_seek(Table* table, const Value* key, Snapshot* snapshot, Cursor* cursor);
+//The root the snapshot sees, which is the one from before the last vacuum for a snapshot older than that
+uint32_t table_root_at(Table* table, Snapshot* snapshot);
+//Levels in the table's tree as the snapshot sees it, 1 while the root is still a leaf
+uint32_t table_height(Table* table, Snapshot* snapshot);
 
 /*
 * Depreciated, functionality replaced with table_find
@@ -222,26 +527,40 @@ Cursor* table_end(Table* table);
 */
 
 //Returns position of a given key or where the key should be inserted.
-Cursor* table_find(Table* table, uint32_t key);
+Cursor* table_find(Table* table, uint64_t key);
+//table_find for any table: key is read as text if the table is keyed by a varchar and as an integer otherwise
+Cursor* table_find_key(Table* table, const Value* key, Snapshot* snapshot);
+//A row's key (its first column) as a Value, text keys point into the row
+Value table_row_key(Table* table, const void* row);
+//Compares the key in a leaf cell with key, <0, 0 or >0 like strcmp
+int leaf_node_compare(Table* table, void* node, uint32_t cell_num, const Value* key);
+//table_start and table_find for readers, the cursor sees the table as of the snapshot
+Cursor* table_start_at(Table* table, Snapshot* snapshot);
+Cursor* table_find_at(Table* table, uint64_t key, Snapshot* snapshot);
 //returns pointer to position in table described by the cursor
 void* cursor_value(Cursor* cursor);
 //Advances cursor to the next row
 void cursor_advance(Cursor* cursor);
-//Inserts a leaf node into the tree
-void leaf_node_insert(Cursor * cursor, uint32_t key, Row* value);
-//Splits a full node into two and inserts a key
-void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value);
+//Inserts a row (its key is its first column) into the leaf at the cursor
+void leaf_node_insert(Cursor * cursor, const void* row);
+//Splits a full node into two and inserts the row. A row going on the end of the rightmost leaf gets a new leaf
+//to itself instead, so the full one stays full.
+void leaf_node_split_and_insert(Cursor* cursor, const void* row);
 //Finds leaf node with key using binary search.
-Cursor* leaf_node_find(Table* table, uint32_t page_num, uint32_t key);
+Cursor* leaf_node_find(Table* table, uint32_t page_num, uint64_t key);
 //Gets a leaf to the right of our current leaf node
 uint32_t* leaf_node_next_leaf(void* node);
 //Finds internal node with a given key using binary search.
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key);
-//Return index of child which should contain key
-uint32_t internal_node_find_child(void* node, uint32_t key);
+Cursor* internal_node_find(Table* table, uint32_t page_num, uint64_t key);
+//Return index of child which should contain key. Packed nodes are searched without decoding them:
+//the key gets turned into an offset from the node's base once, then compared against the stored offsets
+//a whole SIMD register at a time.
+uint32_t internal_node_find_child(void* node, uint64_t key);
+//internal_node_find_child for text nodes. Only the part of the key past the node's shared prefix gets compared.
+uint32_t internal_node_find_child_text(void* node, const char* key, uint32_t length);
 
 //Prints constant values relevant to leaf nodes
-void print_constants();
+void print_constants(Table* table);
 
 /*
 * depreciated, replaced by print_tree
@@ -252,16 +571,12 @@ void print_leaf_node(void* node);
 //adds an number of indents equal to level
 void indent(uint32_t level);
 
-void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level);
+void print_tree(Table* table, uint32_t page_num, uint32_t indentation_level);
 //returns a reference to a nodes parents
 uint32_t* node_parent(void* node);
 
-//Updates internal node's key
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key);
-//Forward declared to reduce code duping with internal_node_insert
-
-//Creates a sibling node to store half the internal node's keys.
-void internal_node_split_and_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
-//Inserts into an internal node.
-void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
+//split_child (in the parent) has just been split in two, and new_child holds the upper half of its keys.
+//Adds new_child to the parent right after it with separator between them, splitting the parent too if it's full.
+void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t split_child_page_num, const Value* separator,
+	uint32_t new_child_page_num);
 #endif
\ No newline at end of file
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Kills the app after a clean reopen and checks the change log brings back every insert made since.
+# Usage: change_log_crash.sh path/to/DatabaseApp
+app="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+export DB_CHANGE_LOG=1
+
+size() { wc -c < "$dir/test.db-changes"; }
+
+# An empty file, then 10 rows, closed cleanly. Every insert's record is the same size, which says how big the log
+# gets once the 30 below are in it (stdout is buffered, so it's the log we watch rather than the output).
+echo ".exit" | "$app" "$dir/test.db" > /dev/null
+empty=$(size)
+i=1
+while [ $i -le 10 ]; do echo "insert $i user$i person$i@example.com"; i=$((i + 1)); done > "$dir/first"
+echo ".exit" >> "$dir/first"
+"$app" "$dir/test.db" < "$dir/first" > /dev/null
+ten=$(size)
+expected=$((ten + 3 * (ten - empty)))
+
+# Reopen, 30 more autocommit inserts, then kill -9 before it can close
+mkfifo "$dir/input"
+"$app" "$dir/test.db" < "$dir/input" > /dev/null &
+pid=$!
+exec 3> "$dir/input"
+while [ $i -le 40 ]; do echo "insert $i user$i person$i@example.com" >&3; i=$((i + 1)); done
+tries=0
+while [ "$(size)" -lt $expected ]; do
+	tries=$((tries + 1))
+	if [ $tries -gt 100 ]; then echo "inserts never finished"; kill -9 $pid; exit 1; fi
+	sleep 0.1
+done
+kill -9 $pid
+wait $pid 2> /dev/null
+exec 3>&-
+
+rows=$(printf 'select\n.exit\n' | "$app" "$dir/test.db" | grep -o '([0-9]*, ' | wc -l)
+if [ "$rows" -ne 40 ]; then
+	echo "expected 40 rows after the crash, found $rows"
+	exit 1
+fi
+echo "all 40 rows back"
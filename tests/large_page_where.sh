@@ -0,0 +1,33 @@
+#!/bin/sh
+# A where clause over leaves that hold more rows than one filter batch (FILTER_MAX_BATCH), on 16KB and 64KB pages.
+# Usage: large_page_where.sh path/to/DatabaseApp
+app="$1"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for page_size in 16384 65536; do
+	{
+		echo "create table t (id int32, a int32)"
+		i=1
+		while [ $i -le 3000 ]; do echo "insert into t $i $((i % 7))"; i=$((i + 1)); done
+		# every row, inside a transaction too, then one row in seven
+		echo "select from t 1-3000 where id > 0"
+		echo "begin"
+		echo "select from t where id > 0"
+		echo "rollback"
+		echo "select from t 1-3000 where a = 3"
+		echo ".exit"
+	} > "$dir/input"
+	DB_PAGE_SIZE=$page_size "$app" "$dir/test$page_size.db" < "$dir/input" > "$dir/output" || {
+		echo "$page_size byte pages: the app died"
+		exit 1
+	}
+	rows=$(grep -o '([0-9]*, [0-9]*)' "$dir/output" | wc -l)
+	threes=$(grep -o '([0-9]*, 3)' "$dir/output" | wc -l)
+	# 3000 + 3000 + 429 rows, 429 of each batch have a = 3
+	if [ "$rows" -ne 6429 ] || [ "$threes" -ne 1287 ]; then
+		echo "$page_size byte pages: expected 6429 rows (1287 with a = 3), found $rows ($threes)"
+		exit 1
+	fi
+done
+echo "where clauses on 16KB and 64KB pages"